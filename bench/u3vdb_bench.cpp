@@ -0,0 +1,504 @@
+// Microbenchmarks of the host-side protocol core (uvcp.h), no device needed.
+// Each case runs until --min-time has passed and reports ns per operation,
+// heap allocations per operation and, for data paths, MB/s. --baseline
+// compares against a saved run and fails when a case allocates more, so a
+// regression is caught before it reaches a camera. Timings are compared
+// relative to a reference case of the same run and only reported, since
+// absolute ns/op depend on the host.
+#include "uvcp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::atomic<uint64_t> g_allocations{0};
+
+}  // namespace
+
+// Every heap allocation of the process is counted, so allocations per
+// operation come out exact.
+void* operator new(std::size_t size) {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+namespace {
+
+using namespace u3vdb;
+using Clock = std::chrono::steady_clock;
+
+// Results feed this so the compiler cannot drop the measured work.
+volatile uint64_t g_sink = 0;
+
+struct BenchCase {
+	std::string name;
+	size_t bytesPerOp = 0; // payload moved per operation, 0 if not a data path
+	std::function<void(size_t iterations)> run;
+};
+
+struct BenchResult {
+	std::string name;
+	double nsPerOp = 0;
+	double allocsPerOp = 0;
+	double mbps = 0;
+};
+
+// In-memory device end of the loopback: answers READ_MEMORY and
+// WRITE_MEMORY commands from a register space the way a camera would, so
+// the host side runs its full command and ACK path per transaction.
+class LoopbackDevice {
+  public:
+	LoopbackDevice() : memory_(1u << 20) {}
+
+	// Answer the command in `cmd` into `ack`; returns the ACK length.
+	size_t answer(const uint8_t* cmd, uint8_t* ack) {
+		const auto* hdr = reinterpret_cast<const UVCPHeader*>(cmd);
+		auto* reply = reinterpret_cast<UVCPHeader*>(ack);
+		reply->magic = UVCPConstants::MAGIC;
+		reply->flags = 0;
+		reply->id = hdr->id;
+		if (hdr->command == UVCPConstants::COMMAND_READ_MEMORY_CMD) {
+			const auto* read = reinterpret_cast<const UVCPReadMemoryCmd*>(cmd);
+			reply->command = UVCPConstants::COMMAND_READ_MEMORY_ACK;
+			reply->size = read->size;
+			std::memcpy(ack + sizeof(UVCPHeader), &memory_[read->address % (memory_.size() - read->size)],
+						read->size);
+			return sizeof(UVCPHeader) + read->size;
+		}
+		const auto* write = reinterpret_cast<const UVCPWriteMemoryCmd*>(cmd);
+		const uint16_t bytes = static_cast<uint16_t>(hdr->size - sizeof(uint64_t));
+		std::memcpy(&memory_[write->address % (memory_.size() - bytes)], cmd + kWriteMemoryCmdHeaderSize, bytes);
+		auto* writeAck = reinterpret_cast<UVCPWriteMemoryAck*>(ack);
+		reply->command = UVCPConstants::COMMAND_WRITE_MEMORY_ACK;
+		reply->size = sizeof(writeAck->unknown) + sizeof(writeAck->bytes_written);
+		writeAck->unknown = 0;
+		writeAck->bytes_written = bytes;
+		return sizeof(UVCPWriteMemoryAck);
+	}
+
+	// Change a register the way the device's own firmware would.
+	void poke(uint32_t address, uint32_t value) { std::memcpy(&memory_[address], &value, sizeof(value)); }
+
+  private:
+	std::vector<uint8_t> memory_;
+};
+
+// One host transaction as U3VDevice runs it: build the command into the OUT
+// buffer, let the device answer, then frame-check, match and validate the
+// ACK and copy its payload out. Returns false on any rejected ACK.
+class LoopbackHost {
+  public:
+	LoopbackHost() : out_(TY_UVCP_MAX_MSG_LEN), in_(TY_UVCP_MAX_MSG_LEN) {}
+
+	bool read(uint32_t address, uint8_t* dest, uint16_t bytes) {
+		const uint16_t id = ++id_;
+		const UVCPReadMemoryCmd cmd = makeReadMemoryCmd(address, bytes, id);
+		std::memcpy(out_.data(), &cmd, sizeof(cmd));
+		const size_t length = device_.answer(out_.data(), in_.data());
+		if (!accept(id, length, UVCPConstants::COMMAND_READ_MEMORY_ACK, bytes)) {
+			return false;
+		}
+		const UVCPAck ack = parseAck(in_.data());
+		std::memcpy(dest, ack.payload, ack.payloadSize);
+		return true;
+	}
+
+	bool write(uint32_t address, const uint8_t* data, uint16_t bytes) {
+		const uint16_t id = ++id_;
+		const UVCPWriteMemoryCmd cmd = makeWriteMemoryCmd(address, bytes, id);
+		std::memcpy(out_.data(), &cmd, kWriteMemoryCmdHeaderSize);
+		std::memcpy(out_.data() + kWriteMemoryCmdHeaderSize, data, bytes);
+		const size_t length = device_.answer(out_.data(), in_.data());
+		return accept(id, length, UVCPConstants::COMMAND_WRITE_MEMORY_ACK, bytes) &&
+			   parseAck(in_.data()).bytesWritten == bytes;
+	}
+
+	LoopbackDevice& device() { return device_; }
+
+  private:
+	bool accept(uint16_t id, size_t length, uint16_t expectedAck, uint16_t expectedBytes) {
+		return checkPacket(in_.data(), length) == UVCPCheck::Ok &&
+			   reinterpret_cast<const UVCPHeader*>(in_.data())->id == id &&
+			   checkAck(in_.data(), length, expectedAck, expectedBytes) == UVCPCheck::Ok;
+	}
+
+	LoopbackDevice device_;
+	std::vector<uint8_t> out_;
+	std::vector<uint8_t> in_;
+	uint16_t id_ = 0;
+};
+
+// Largest READ_MEMORY payload of one 64 KiB ACK, cut to 1024-byte packets.
+constexpr uint16_t kBlockBytes = (TY_UVCP_MAX_MSG_LEN - sizeof(UVCPHeader)) / 1024 * 1024;
+
+std::vector<BenchCase> makeCases() {
+	std::vector<BenchCase> cases;
+
+	cases.push_back({"uvcp_build_read", 0, [](size_t n) {
+		uint8_t buffer[sizeof(UVCPReadMemoryCmd)];
+		for (size_t i = 0; i < n; ++i) {
+			const UVCPReadMemoryCmd cmd = makeReadMemoryCmd(0x30000 + 4 * (i & 0xFF), 4, static_cast<uint16_t>(i));
+			std::memcpy(buffer, &cmd, sizeof(cmd));
+			g_sink = g_sink + buffer[i % sizeof(buffer)];
+		}
+	}});
+
+	cases.push_back({"uvcp_check_ack", 0, [](size_t n) {
+		uint8_t ack[sizeof(UVCPHeader) + 4] = {};
+		auto* hdr = reinterpret_cast<UVCPHeader*>(ack);
+		hdr->magic = UVCPConstants::MAGIC;
+		hdr->command = UVCPConstants::COMMAND_READ_MEMORY_ACK;
+		hdr->size = 4;
+		for (size_t i = 0; i < n; ++i) {
+			hdr->id = static_cast<uint16_t>(i);
+			if (checkPacket(ack, sizeof(ack)) == UVCPCheck::Ok &&
+				checkAck(ack, sizeof(ack), UVCPConstants::COMMAND_READ_MEMORY_ACK, 4) == UVCPCheck::Ok) {
+				g_sink = g_sink + parseAck(ack).payloadSize;
+			}
+		}
+	}});
+
+	cases.push_back({"read_register", 4, [](size_t n) {
+		LoopbackHost host;
+		uint32_t value = 0;
+		for (size_t i = 0; i < n; ++i) {
+			if (host.read(0x30000 + 4 * (i & 0xFF), reinterpret_cast<uint8_t*>(&value), sizeof(value))) {
+				g_sink = g_sink + value;
+			}
+		}
+	}});
+
+	cases.push_back({"read_block", kBlockBytes, [](size_t n) {
+		LoopbackHost host;
+		std::vector<uint8_t> dest(kBlockBytes);
+		for (size_t i = 0; i < n; ++i) {
+			if (host.read(static_cast<uint32_t>(i * kBlockBytes), dest.data(), kBlockBytes)) {
+				g_sink = g_sink + dest[i % kBlockBytes];
+			}
+		}
+	}});
+
+	cases.push_back({"write_block", kBlockBytes, [](size_t n) {
+		LoopbackHost host;
+		std::vector<uint8_t> data(kBlockBytes, 0x5A);
+		for (size_t i = 0; i < n; ++i) {
+			g_sink = g_sink + host.write(static_cast<uint32_t>(i * kBlockBytes), data.data(), kBlockBytes);
+		}
+	}});
+
+	cases.push_back({"wildcard_match", 0, [](size_t n) {
+		static const char* const names[] = {
+			"messages", "messages.1.log", "kern.log", "syslog", "capture_0001.raw", "capture_0002.raw",
+			"u3vdb-bench.tmp", "very_long_file_name_without_the_extension_we_want_here.txt",
+		};
+		constexpr size_t count = sizeof(names) / sizeof(names[0]);
+		for (size_t i = 0; i < n; ++i) {
+			g_sink = g_sink + wildcardMatch("*.log", names[i % count]) + wildcardMatch("capture_*.r?w", names[i % count]);
+		}
+	}});
+
+	cases.push_back({"split_tokens", 0, [](size_t n) {
+		const std::string line = "u3vget --resume /var/log/messages logs/messages.log";
+		for (size_t i = 0; i < n; ++i) {
+			g_sink = g_sink + splitTokens(line).size();
+		}
+	}});
+
+	// A wait loop as TerminalClient runs it: a few idle polls, then progress.
+	cases.push_back({"poll_backoff", 0, [](size_t n) {
+		const PollPolicy policy;
+		PollBackoff backoff(policy);
+		for (size_t i = 0; i < n; ++i) {
+			if ((i & 7) == 7) {
+				backoff.reset();
+			} else {
+				g_sink = g_sink + static_cast<uint64_t>(backoff.nextDelay().count());
+			}
+		}
+	}});
+
+	// TerminalClient's status wait over the loopback: read the status
+	// register, back off while it is not ready, start over once it is. The
+	// device turns ready every eighth poll. Delays are summed, not slept.
+	cases.push_back({"terminal_poll", 0, [](size_t n) {
+		constexpr uint32_t kStatusAddr = 0x40000;
+		constexpr uint32_t kReady = 1;
+		LoopbackHost host;
+		const PollPolicy policy;
+		PollBackoff backoff(policy);
+		host.device().poke(kStatusAddr, 0);
+		for (size_t i = 0; i < n; ++i) {
+			if ((i & 7) == 7) {
+				host.device().poke(kStatusAddr, kReady);
+			}
+			uint32_t status = 0;
+			if (!host.read(kStatusAddr, reinterpret_cast<uint8_t*>(&status), sizeof(status))) {
+				continue;
+			}
+			if (status & kReady) {
+				backoff.reset();
+				host.device().poke(kStatusAddr, 0);
+			} else {
+				g_sink = g_sink + static_cast<uint64_t>(backoff.nextDelay().count());
+			}
+		}
+	}});
+
+	return cases;
+}
+
+// Timings are compared as a ratio to this case, measured in the same run,
+// so a faster or slower host does not shift every case at once.
+const char* const kReferenceCase = "read_register";
+
+// Rounds per case once the iteration count is known; the fastest counts, as
+// slower rounds only add scheduler and cache noise.
+constexpr int kRounds = 3;
+
+BenchResult measure(const BenchCase& c, std::chrono::milliseconds minTime) {
+	c.run(16); // warm up caches and lazily initialised state
+	auto timed = [&c](size_t iterations, uint64_t& allocs) {
+		const uint64_t allocsBefore = g_allocations.load(std::memory_order_relaxed);
+		const auto start = Clock::now();
+		c.run(iterations);
+		const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+		allocs = g_allocations.load(std::memory_order_relaxed) - allocsBefore;
+		return static_cast<double>(elapsed.count());
+	};
+	const double target = static_cast<double>(std::chrono::nanoseconds(minTime).count());
+	size_t iterations = 1;
+	uint64_t allocs = 0;
+	double ns = timed(iterations, allocs);
+	while (ns < target && iterations < (size_t(1) << 40)) {
+		// Aim past the minimum time in one more round.
+		const double ratio = ns > 0 ? target / ns * 1.2 : 100.0;
+		iterations = static_cast<size_t>(static_cast<double>(iterations) * std::min(std::max(ratio, 2.0), 100.0));
+		ns = timed(iterations, allocs);
+	}
+	for (int round = 1; round < kRounds; ++round) {
+		uint64_t roundAllocs = 0;
+		ns = std::min(ns, timed(iterations, roundAllocs));
+	}
+
+	BenchResult r;
+	r.name = c.name;
+	r.nsPerOp = ns / static_cast<double>(iterations);
+	r.allocsPerOp = static_cast<double>(allocs) / static_cast<double>(iterations);
+	if (c.bytesPerOp != 0 && ns > 0) {
+		r.mbps = static_cast<double>(c.bytesPerOp) * static_cast<double>(iterations) * 1e3 / ns;
+	}
+	return r;
+}
+
+struct BaselineEntry {
+	double nsPerOp = 0;
+	double allocsPerOp = 0;
+};
+
+bool loadBaseline(const std::string& path, std::map<std::string, BaselineEntry>& out) {
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "Cannot read baseline '" << path << "'" << std::endl;
+		return false;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields(line);
+		std::string name;
+		BaselineEntry entry;
+		if (!(fields >> name >> entry.nsPerOp >> entry.allocsPerOp)) {
+			std::cerr << "Malformed baseline line: " << line << std::endl;
+			return false;
+		}
+		out[name] = entry;
+	}
+	return true;
+}
+
+bool writeBaseline(const std::string& path, const std::vector<BenchResult>& results) {
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "Cannot write baseline '" << path << "'" << std::endl;
+		return false;
+	}
+	out << "# u3vdb_bench baseline: name ns/op allocs/op\n" << std::fixed;
+	for (const BenchResult& r : results) {
+		out << r.name << ' ' << std::setprecision(2) << r.nsPerOp << ' ' << std::setprecision(0) << r.allocsPerOp
+			<< '\n';
+	}
+	return static_cast<bool>(out);
+}
+
+void printUsage(const char* exe) {
+	std::cout << "Usage: " << exe << " [options]\n"
+			  << "  --filter <text>         Run only cases whose name contains text\n"
+			  << "  --min-time <ms>         Run each case at least this long (default 200)\n"
+			  << "  --csv                   Print name,ns_per_op,allocs_per_op,mb_per_s\n"
+			  << "  --baseline <file>       Fail if a case allocates more than recorded; flag slower ones\n"
+			  << "  --tolerance <percent>   Relative slowdown flagged against the baseline (default 25)\n"
+			  << "  --write-baseline <file> Record this run as the new baseline\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+	std::string filter;
+	std::string baselinePath;
+	std::string writePath;
+	std::chrono::milliseconds minTime(200);
+	double tolerance = 25;
+	bool csv = false;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--filter" && hasValue) {
+			filter = argv[++i];
+		} else if (arg == "--min-time" && hasValue) {
+			minTime = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 0));
+		} else if (arg == "--csv") {
+			csv = true;
+		} else if (arg == "--baseline" && hasValue) {
+			baselinePath = argv[++i];
+		} else if (arg == "--tolerance" && hasValue) {
+			tolerance = std::strtod(argv[++i], nullptr);
+		} else if (arg == "--write-baseline" && hasValue) {
+			writePath = argv[++i];
+		} else if (arg == "-h" || arg == "--help") {
+			printUsage(argv[0]);
+			return 0;
+		} else {
+			std::cerr << "Unknown option '" << arg << "'" << std::endl;
+			printUsage(argv[0]);
+			return 2;
+		}
+	}
+
+	std::map<std::string, BaselineEntry> baseline;
+	if (!baselinePath.empty() && !loadBaseline(baselinePath, baseline)) {
+		return 2;
+	}
+	const std::vector<BenchCase> cases = makeCases();
+	// Host speed relative to the baseline's, from the reference case.
+	double hostScale = 1;
+	BenchResult reference;
+	if (!baseline.empty()) {
+		const auto base = baseline.find(kReferenceCase);
+		const auto c = std::find_if(cases.begin(), cases.end(),
+									[](const BenchCase& bc) { return bc.name == kReferenceCase; });
+		if (base == baseline.end() || base->second.nsPerOp <= 0 || c == cases.end()) {
+			std::cerr << "Baseline '" << baselinePath << "' has no " << kReferenceCase << " entry" << std::endl;
+			return 2;
+		}
+		reference = measure(*c, minTime);
+		hostScale = reference.nsPerOp / base->second.nsPerOp;
+	}
+
+	if (csv) {
+		std::cout << "name,ns_per_op,allocs_per_op,mb_per_s\n";
+	} else {
+		std::cout << std::left << std::setw(18) << "case" << std::right << std::setw(12) << "ns/op" << std::setw(12)
+				  << "allocs/op" << std::setw(12) << "MB/s"
+				  << (baseline.empty() ? "" : std::string("  vs baseline, relative to ") + kReferenceCase) << '\n';
+	}
+	std::vector<BenchResult> results;
+	int regressions = 0;
+	for (const BenchCase& c : cases) {
+		if (!filter.empty() && c.name.find(filter) == std::string::npos) {
+			continue;
+		}
+		BenchResult r = c.name == kReferenceCase && !baseline.empty() ? reference : measure(c, minTime);
+		std::string verdict;
+		const auto base = baseline.find(r.name);
+		if (base != baseline.end()) {
+			const double limit = base->second.nsPerOp * hostScale * (1 + tolerance / 100);
+			if (r.nsPerOp > limit) {
+				// A burst of other load should not flag a case: it only
+				// counts as slower if a second measurement agrees.
+				const BenchResult again = measure(c, minTime);
+				if (again.nsPerOp < r.nsPerOp) {
+					r = again;
+				}
+			}
+			// Allocation counts are exact and host independent, so any
+			// increase is a regression. Timing drift is only reported.
+			const bool slower = r.nsPerOp > limit;
+			const bool allocates = r.allocsPerOp > base->second.allocsPerOp + 0.01;
+			std::ostringstream v;
+			v << std::fixed << std::setprecision(0) << (r.nsPerOp / (base->second.nsPerOp * hostScale) - 1) * 100
+			  << "%";
+			if (allocates) {
+				verdict = "REGRESSED (" + v.str() + ", allocates more)";
+				++regressions;
+			} else {
+				verdict = slower ? "slower (" + v.str() + ")" : v.str();
+			}
+		} else if (!baseline.empty()) {
+			verdict = "not in baseline";
+		}
+		results.push_back(r);
+		if (csv) {
+			std::cout << r.name << ',' << std::fixed << std::setprecision(2) << r.nsPerOp << ',' << r.allocsPerOp
+					  << ',' << r.mbps << '\n';
+		} else {
+			std::cout << std::left << std::setw(18) << r.name << std::right << std::fixed << std::setprecision(1)
+					  << std::setw(12) << r.nsPerOp << std::setprecision(2) << std::setw(12) << r.allocsPerOp
+					  << std::setprecision(0) << std::setw(12);
+			if (r.mbps > 0) {
+				std::cout << r.mbps;
+			} else {
+				std::cout << "-";
+			}
+			std::cout << (verdict.empty() ? "" : "  ") << verdict << '\n';
+		}
+		std::cout.flush();
+	}
+
+	if (!writePath.empty() && !writeBaseline(writePath, results)) {
+		return 2;
+	}
+	if (regressions != 0) {
+		std::cerr << regressions << " case(s) regressed against " << baselinePath << std::endl;
+		return 1;
+	}
+	return 0;
+}
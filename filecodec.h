@@ -0,0 +1,185 @@
+// LZ4 block codec and the file channel frames built on it. Nothing here
+// touches a device, so u3vdb_check can feed it malformed input directly.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace u3vdb {
+
+// File channel compression (kCapFileCodec). The data port carries frames: a
+// little-endian word with the payload length, kFileFrameStored set when the
+// payload is the block itself rather than an LZ4 block, then the payload.
+// Each frame decodes on its own to at most kFileCodecBlock bytes.
+constexpr size_t kFileCodecBlock = 64 * 1024;
+constexpr uint32_t kFileFrameStored = 1u << 31;
+// Longest payload a frame may announce: an LZ4 block of incompressible input.
+constexpr size_t kFileFrameMaxPayload = kFileCodecBlock + kFileCodecBlock / 255 + 16;
+
+// Append the LZ4 block encoding of `src` to `dst`: greedy matching through a
+// 4K-entry hash of 4-byte sequences, within the format's end-of-block rules.
+inline void lz4CompressBlock(const uint8_t* src, size_t size, std::string& dst) {
+	constexpr size_t kMinMatch = 4;
+	constexpr size_t kLastLiterals = 5;  // the block ends with at least 5 literals
+	constexpr size_t kMatchStartLimit = 12; // and no match starts in its last 12 bytes
+	constexpr unsigned kHashBits = 12;
+	auto read32 = [src](size_t at) {
+		uint32_t value;
+		std::memcpy(&value, src + at, sizeof(value));
+		return value;
+	};
+	auto putLength = [&dst](size_t length) {
+		for (; length >= 255; length -= 255) {
+			dst.push_back(static_cast<char>(255));
+		}
+		dst.push_back(static_cast<char>(length));
+	};
+	auto putSequence = [&](size_t literalStart, size_t literals, size_t offset, size_t matchLength) {
+		const size_t extra = matchLength ? matchLength - kMinMatch : 0;
+		dst.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) |
+										(matchLength ? std::min<size_t>(extra, 15) : 0)));
+		if (literals >= 15) {
+			putLength(literals - 15);
+		}
+		dst.append(reinterpret_cast<const char*>(src + literalStart), literals);
+		if (matchLength) {
+			dst.push_back(static_cast<char>(offset & 0xFF));
+			dst.push_back(static_cast<char>(offset >> 8));
+			if (extra >= 15) {
+				putLength(extra - 15);
+			}
+		}
+	};
+
+	std::vector<uint32_t> table(size_t{1} << kHashBits, 0); // position + 1, 0 = empty
+	size_t anchor = 0;
+	if (size > kMatchStartLimit) {
+		const size_t startLimit = size - kMatchStartLimit;
+		const size_t matchLimit = size - kLastLiterals;
+		size_t pos = 0;
+		while (pos < startLimit) {
+			const uint32_t sequence = read32(pos);
+			uint32_t& slot = table[(sequence * 2654435761u) >> (32 - kHashBits)];
+			const size_t candidate = slot;
+			slot = static_cast<uint32_t>(pos + 1);
+			if (candidate == 0 || pos - (candidate - 1) > 0xFFFF || read32(candidate - 1) != sequence) {
+				++pos;
+				continue;
+			}
+			size_t ref = candidate - 1;
+			while (pos > anchor && ref > 0 && src[pos - 1] == src[ref - 1]) {
+				--pos;
+				--ref;
+			}
+			size_t length = kMinMatch;
+			while (pos + length < matchLimit && src[pos + length] == src[ref + length]) {
+				++length;
+			}
+			putSequence(anchor, pos - anchor, pos - ref, length);
+			pos += length;
+			anchor = pos;
+		}
+	}
+	putSequence(anchor, size - anchor, 0, 0);
+}
+
+// Decode one LZ4 block into `dst`; false if it is malformed or needs more
+// than `capacity` bytes.
+inline bool lz4DecompressBlock(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, size_t& produced) {
+	size_t in = 0;
+	size_t out = 0;
+	auto getLength = [&](size_t& length) {
+		uint8_t byte = 255;
+		while (byte == 255) {
+			if (in >= size) {
+				return false;
+			}
+			byte = src[in++];
+			length += byte;
+		}
+		return true;
+	};
+	while (in < size) {
+		const uint8_t token = src[in++];
+		size_t literals = token >> 4;
+		if ((literals == 15 && !getLength(literals)) || literals > size - in || literals > capacity - out) {
+			return false;
+		}
+		std::memcpy(dst + out, src + in, literals);
+		in += literals;
+		out += literals;
+		if (in == size) {
+			break; // the last sequence has no match
+		}
+		if (size - in < 2) {
+			return false;
+		}
+		const size_t offset = src[in] | (static_cast<size_t>(src[in + 1]) << 8);
+		in += 2;
+		size_t length = token & 15;
+		if (offset == 0 || offset > out || (length == 15 && !getLength(length))) {
+			return false;
+		}
+		length += 4;
+		if (length > capacity - out) {
+			return false;
+		}
+		for (size_t i = 0; i < length; ++i, ++out) { // byte by byte: matches may overlap
+			dst[out] = dst[out - offset];
+		}
+	}
+	produced = out;
+	return true;
+}
+
+// Append the frame for a block of at most kFileCodecBlock bytes.
+inline void encodeFileFrame(const char* data, size_t size, std::string& frame) {
+	const size_t start = frame.size();
+	frame.append(4, '\0');
+	lz4CompressBlock(reinterpret_cast<const uint8_t*>(data), size, frame);
+	uint32_t header = static_cast<uint32_t>(frame.size() - start - 4);
+	if (header >= size) {
+		frame.resize(start + 4);
+		frame.append(data, size);
+		header = static_cast<uint32_t>(size) | kFileFrameStored;
+	}
+	std::memcpy(&frame[start], &header, sizeof(header));
+}
+
+// Length of the frame at the front of `data`: 0 while it is incomplete,
+// npos if its header is invalid.
+inline size_t fileFrameLength(const std::string& data) {
+	if (data.size() < 4) {
+		return 0;
+	}
+	uint32_t header;
+	std::memcpy(&header, data.data(), sizeof(header));
+	const size_t payload = header & ~kFileFrameStored;
+	if ((header & kFileFrameStored) ? payload > kFileCodecBlock : payload > kFileFrameMaxPayload) {
+		return std::string::npos;
+	}
+	return data.size() >= 4 + payload ? 4 + payload : 0;
+}
+
+// Append the block held by a complete frame; false if it does not decode.
+inline bool decodeFileFrame(const char* frame, size_t length, std::string& block) {
+	uint32_t header;
+	std::memcpy(&header, frame, sizeof(header));
+	if (header & kFileFrameStored) {
+		block.append(frame + 4, length - 4);
+		return true;
+	}
+	const size_t start = block.size();
+	block.resize(start + kFileCodecBlock);
+	size_t produced = 0;
+	const bool ok = lz4DecompressBlock(reinterpret_cast<const uint8_t*>(frame + 4), length - 4,
+									   reinterpret_cast<uint8_t*>(&block[start]), kFileCodecBlock, produced);
+	block.resize(start + produced);
+	return ok;
+}
+
+}  // namespace u3vdb
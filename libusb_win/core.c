@@ -2320,6 +2320,16 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			break;
 		}
 
+		if (LIBUSB_OPTION_WINUSB_RAW_IO == option) {
+			/* Per-handle option: applies to an open device, never a default */
+			ctx = usbi_get_context(ctx);
+			if (ctx != NULL && usbi_backend.set_option)
+				r = usbi_backend.set_option(ctx, option, ap);
+			else
+				r = LIBUSB_ERROR_NOT_SUPPORTED;
+			break;
+		}
+
 		if (NULL == ctx) {
 			usbi_mutex_static_lock(&default_context_lock);
 			default_context_options[option].is_set = 1;
@@ -2362,6 +2372,7 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			libusb_set_log_cb_internal(ctx, log_cb, LIBUSB_LOG_CB_CONTEXT);
 			break;
 
+		case LIBUSB_OPTION_WINUSB_RAW_IO: /* handled above */
 		case LIBUSB_OPTION_MAX: /* unreachable */
 		default:
 			r = LIBUSB_ERROR_INVALID_PARAM;
@@ -2484,6 +2495,11 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 			r = libusb_set_option(_ctx, options[i].option, options[i].value.log_cbval);
 			break;
 
+		case LIBUSB_OPTION_WINUSB_RAW_IO:
+			/* needs an open device handle, which cannot exist yet */
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			break;
+
 		case LIBUSB_OPTION_LOG_LEVEL:
 		case LIBUSB_OPTION_USE_USBDK:
 		case LIBUSB_OPTION_NO_DEVICE_DISCOVERY:
@@ -1646,7 +1646,30 @@ enum libusb_option {
 	 */
 	LIBUSB_OPTION_LOG_CB = 3,
 
-	LIBUSB_OPTION_MAX = 4
+	/** Enable or disable WinUSB RAW_IO on a bulk or interrupt IN endpoint.
+	 *
+	 * With RAW_IO, WinUSB hands read requests straight to the host controller
+	 * instead of splitting and buffering them, so an application that keeps
+	 * several transfers posted on the endpoint avoids per-request gaps on the
+	 * bus. Every transfer submitted on the endpoint must then have a length
+	 * that is a multiple of its wMaxPacketSize and no larger than the pipe's
+	 * MAXIMUM_TRANSFER_SIZE.
+	 *
+	 * This option must be provided the arguments
+	 * (libusb_device_handle *dev_handle, unsigned int endpoint, int enable,
+	 * unsigned int *max_transfer_size). The interface owning the endpoint
+	 * must be claimed. When max_transfer_size is not NULL, it receives the
+	 * pipe's MAXIMUM_TRANSFER_SIZE. The option is never recorded as a
+	 * context default.
+	 *
+	 * Only valid on Windows with the WinUSB or libusbK drivers. Returns
+	 * LIBUSB_ERROR_NOT_SUPPORTED everywhere else.
+	 */
+	LIBUSB_OPTION_WINUSB_RAW_IO = 4,
+
+#define LIBUSB_OPTION_WINUSB_RAW_IO LIBUSB_OPTION_WINUSB_RAW_IO
+
+	LIBUSB_OPTION_MAX = 5
 };
 
 /** \ingroup libusb_lib
@@ -412,6 +412,11 @@ static inline struct winusb_transfer_priv *get_winusb_transfer_priv(struct usbi_
 extern const struct windows_backend usbdk_backend;
 extern const struct windows_backend winusb_backend;
 
+#ifdef U3VDB_WINUSB_RAW_IO
+int winusb_set_raw_io(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int enable, unsigned int *max_transfer_size);
+#endif
+
 HMODULE load_system_library(struct libusb_context *ctx, const char *name);
 unsigned long htab_hash(const char *str);
 enum libusb_transfer_status usbd_status_to_libusb_transfer_status(USBD_STATUS status);
@@ -609,7 +609,24 @@ static int windows_set_option(struct libusb_context *ctx, enum libusb_option opt
 {
 	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
 
+#ifdef U3VDB_WINUSB_RAW_IO
+	if (option == LIBUSB_OPTION_WINUSB_RAW_IO) {
+		struct libusb_device_handle *dev_handle = va_arg(ap, struct libusb_device_handle *);
+		unsigned char endpoint = (unsigned char)va_arg(ap, unsigned int);
+		int enable = va_arg(ap, int);
+		unsigned int *max_transfer_size = va_arg(ap, unsigned int *);
+
+		if (dev_handle == NULL)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (priv->backend != &winusb_backend) {
+			usbi_dbg(ctx, "RAW_IO is only available with the WinUSB backend");
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+		return winusb_set_raw_io(dev_handle, endpoint, enable, max_transfer_size);
+	}
+#else
 	UNUSED(ap);
+#endif
 
 	if (option == LIBUSB_OPTION_USE_USBDK) {
 		if (!usbdk_available) {
@@ -3364,6 +3364,67 @@ static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_hand
 	return LIBUSB_SUCCESS;
 }
 
+#ifdef U3VDB_WINUSB_RAW_IO
+/*
+ * Enable or disable RAW_IO on an IN pipe (LIBUSB_OPTION_WINUSB_RAW_IO) and
+ * report its MAXIMUM_TRANSFER_SIZE, which bounds every read once RAW_IO is on.
+ */
+int winusb_set_raw_io(struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int enable, unsigned int *max_transfer_size)
+{
+	struct winusb_device_handle_priv *handle_priv = get_winusb_device_handle_priv(dev_handle);
+	struct winusb_device_priv *priv = usbi_get_device_priv(dev_handle->dev);
+	const struct windows_usb_api_backend *apib = priv->apib;
+	int sub_api = priv->sub_api;
+	HANDLE winusb_handle;
+	int current_interface;
+	UCHAR policy = enable ? TRUE : FALSE;
+	ULONG max_size = 0;
+	ULONG length = sizeof(max_size);
+
+	if (!IS_EPIN(endpoint))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(HANDLE_CTX(dev_handle), "unable to match endpoint to an open interface - cannot set RAW_IO");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if (apib->id == USB_API_COMPOSITE) {
+		apib = priv->usb_interface[current_interface].apib;
+		sub_api = priv->usb_interface[current_interface].sub_api;
+	}
+	// libusb0 has no pipe policies beyond the timeout (see winusbx_configure_endpoints)
+	if ((apib->id != USB_API_WINUSBX) || (sub_api == SUB_API_LIBUSB0))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (WinUSBX[sub_api].hDll == NULL)
+		return LIBUSB_ERROR_ACCESS;
+
+	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+	if (!WinUSBX[sub_api].GetPipePolicy(winusb_handle, endpoint,
+		MAXIMUM_TRANSFER_SIZE, &length, &max_size)) {
+		usbi_err(HANDLE_CTX(dev_handle), "failed to read MAXIMUM_TRANSFER_SIZE for endpoint %02X: %s",
+			endpoint, windows_error_str(0));
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint,
+		RAW_IO, sizeof(UCHAR), &policy)) {
+		usbi_err(HANDLE_CTX(dev_handle), "failed to %s RAW_IO for endpoint %02X: %s",
+			enable ? "enable" : "disable", endpoint, windows_error_str(0));
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	usbi_dbg(HANDLE_CTX(dev_handle), "RAW_IO %s for endpoint %02X, maximum transfer size %lu",
+		enable ? "enabled" : "disabled", endpoint, (unsigned long)max_size);
+	if (max_transfer_size != NULL)
+		*max_transfer_size = (unsigned int)max_size;
+
+	return LIBUSB_SUCCESS;
+}
+#endif
+
 static int winusbx_cancel_transfer(int sub_api, struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
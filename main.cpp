@@ -1,4 +1,8 @@
 #ifdef _WIN32
+// libusb.h pulls in <windows.h>; keep its min/max macros off std::min/std::max.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
 #include "libusb.h"
 #else
 #include <libusb-1.0/libusb.h>
@@ -6,16 +10,31 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cctype>
+#include <condition_variable>
+#include <csignal>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <fstream>
+#include <future>
+#include <initializer_list>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 #include <functional>
 
@@ -23,7 +42,6 @@
 
 #ifdef _WIN32
 	#include <windows.h>
-	#include <conio.h>
 	#include <io.h>
 	#ifndef STDIN_FILENO
 		#define STDIN_FILENO 0
@@ -32,14 +50,35 @@
 		#define STDOUT_FILENO 1
 	#endif
 #else
+	#include <fcntl.h>
+	#include <signal.h>
 	#include <termios.h>
 	#include <unistd.h>
+	#include <sys/file.h>
 	#include <sys/select.h>
+	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/un.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+	#include <nmmintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+	#define U3VDB_CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	#include <arm_acle.h>
+	#define U3VDB_CRC32C_ARM 1
 #endif
 
+#include "filecodec.h"
+#include "tar.h"
+#include "uvcp.h"
+
 namespace {
 
-#define TY_UVCP_MAX_MSG_LEN 65536
+using namespace u3vdb;
 
 // USB3 Vision Class
 #pragma pack(push, 1)
@@ -59,1757 +98,8438 @@ struct usb3v_device_info_descriptor {
 	uint8_t  iUserDefinedName;
 	uint8_t  bmSpeedSupport;
 };
-#pragma pack(pop)
-
-//UVCP (USB3 Vision Control Protocol)
-namespace UVCPConstants {
-    const uint32_t MAGIC = 0x43563355; // "U3VC"
-    const uint16_t FLAGS_REQUEST_ACK = 0x0001<<14;
-    
-    enum Command {
-        COMMAND_READ_MEMORY_CMD                 = 0x0800,
-        COMMAND_READ_MEMORY_ACK                 = 0x0801,
-        COMMAND_WRITE_MEMORY_CMD                = 0x0802,
-        COMMAND_WRITE_MEMORY_ACK                = 0x0803,
-        COMMAND_PENDING_ACK                     = 0x0805,
-        COMMAND_EVENT_CMD                       = 0x0c00,
-	    COMMAND_EVENT_ACK                       = 0x0c01
-    };
-}
 
-#pragma pack(push, 1)
 struct ManifestEntry {
     uint16_t file_version_subminor;
     uint8_t file_version_minor;
     uint8_t file_version_major;
-    uint32_t schema;
+    uint32_t schema;                // bits 10-15 file type, 16-23 schema minor, 24-31 major
     uint64_t address;
     uint64_t size;
-    uint64_t unknown3;
-    uint64_t unknown4;
-    uint64_t unknown5;
-    uint64_t unknown6;
-    uint64_t unknown7;
+    uint8_t sha1[20];               // all zero if the device does not provide it
+    uint8_t reserved[20];
 };
+#pragma pack(pop)
 
-struct UVCPHeader { //ArvUvcpHeader
-    uint32_t magic  = 0;
-    uint16_t flags  = 0;
-    uint16_t command= 0;
-    uint16_t size   = 0;
-    uint16_t id     = 0;
+constexpr uint16_t kVendorId = 0x04b4;
+constexpr uint16_t kProductId = 0x1004;
+// Control interface and endpoints are discovered dynamically.
+constexpr unsigned int kTransferTimeoutMs = 10000;
+// Register and memory reads have no side effects, so they get a shorter
+// deadline and are sent again when they time out or fail...
+constexpr unsigned int kReadTimeoutMs = 1000;
+// ...up to this many times. Reads of the terminal and file data windows
+// consume what they return and are never repeated.
+constexpr uint8_t kReadRetries = 2;
+// After a halted endpoint is cleared, requests sent before the halt wait at
+// most this long for ACKs that may have been lost with it.
+constexpr auto kRecoveryAckWait = std::chrono::milliseconds(250);
+// Ids of failed and retried requests remembered, so that their ACKs arriving
+// late are dropped without a warning.
+constexpr size_t kStaleIdHistory = 64;
+// --reconnect waits this long for a lost device to come back...
+constexpr auto kReconnectTimeout = std::chrono::seconds(120);
+// ...and retries this often while it is missing or not answering yet.
+constexpr auto kReconnectRetry = std::chrono::milliseconds(250);
+// Number of UVCP commands the async engine keeps outstanding by default.
+constexpr size_t kDefaultPipelineDepth = 8;
+// Size of the in-flight slot table; request ids map to slots modulo this.
+constexpr size_t kMaxPipelineDepth = 256;
+// Most UVCP commands concatenated into one bulk OUT transfer.
+constexpr size_t kMaxBatchCommands = 16;
+// Bulk IN transfers kept posted so ACKs never wait for the host to resubmit.
+constexpr size_t kInTransferCount = 4;
+// With WinUSB RAW_IO nothing queues reads below libusb, so post more.
+constexpr size_t kRawIoInTransferCount = 8;
+// A PENDING_ACK moves its request's deadline to timeout_ms from now plus this
+// allowance for the bus; other requests keep flowing meanwhile...
+constexpr auto kPendingAckGrace = std::chrono::milliseconds(1000);
+// ...until the request has been extended this long in total.
+constexpr auto kMaxPendingWait = std::chrono::seconds(60);
+// Upload chunks queued ahead of the oldest ACK.
+constexpr size_t kUploadChunksInFlight = kDefaultPipelineDepth;
+// A background upload keeps fewer, so shell traffic queues behind at most
+// this many file chunks.
+constexpr size_t kBackgroundChunksInFlight = 2;
+// Uploads read the file status after this many chunks by default...
+constexpr uint32_t kDefaultUploadStatusInterval = 16;
+// ...or once this many bytes went out since the last check, whichever is first.
+constexpr uint64_t kUploadStatusMaxBytes = 1u << 20;
+
+// The ABRM at address 0 points at the SBRM, which holds the largest UVCP
+// command and acknowledge the device accepts, and at the manifest table of
+// GenICam files: a 64-bit entry count followed by ManifestEntry records.
+constexpr uint32_t kAbrmModelNameAddr = 0x0044;
+constexpr uint32_t kAbrmStringLength = 64;
+constexpr uint32_t kAbrmManifestTableAddr = 0x01D0; // 64-bit
+constexpr uint32_t kAbrmSbrmAddressAddr = 0x01D8; // 64-bit
+constexpr uint32_t kSbrmMaxCommandLengthOffset = 0x14;
+constexpr uint32_t kSbrmMaxAckLengthOffset = 0x18;
+// Transfers this small fit any device, so they skip the SBRM lookup; also
+// the smallest SBRM limit taken at face value.
+constexpr uint32_t kMinTransferLength = 512;
+// memread/memwrite move this much between the link and the disk at a time.
+constexpr size_t kMemoryBlockBytes = 1u << 20;
+// Manifest file types, ManifestEntry::schema bits 10-15.
+constexpr uint32_t kManifestFileXml = 0;
+constexpr uint32_t kManifestFileZip = 1;
+// Longer manifest tables are taken as garbage.
+constexpr uint64_t kMaxManifestEntries = 64;
+
+// Outcome of one UVCP transaction as seen by completion callbacks.
+struct UVCPCompletion {
+	bool ok = false;
+	uint16_t id = 0;
+	uint16_t command = 0;            // ACK command code
+	uint16_t bytesWritten = 0;       // WRITE_MEMORY_ACK only
+	const uint8_t* payload = nullptr; // READ_MEMORY_ACK payload, valid during the callback only
+	uint16_t payloadSize = 0;
+	std::vector<uint8_t> data;       // payload copy, filled for the future-based API
 };
 
-struct UVCPReadMemoryCmd {  //ArvUvcpReadMemoryCmd
-    UVCPHeader header{};
-    uint64_t address = 0;
-    uint16_t unknown = 0;
-    uint16_t size    = 0;
-};
+// Completion callbacks run on the libusb event thread and must not block on
+// further transactions.
+using UVCPCallback = std::function<void(UVCPCompletion&)>;
 
-struct UVCPReadMemoryAck {      //ArvUvcpReadMemoryCmd
-    UVCPHeader header{};
-    uint8_t data[1];
+// Receives U3V events (EVENT_CMD) from the event endpoint or the control
+// channel. Runs on the libusb event thread.
+using UVCPEventHandler = std::function<void(uint16_t eventId, const uint8_t* data, size_t size)>;
+
+// Tracks a group of submitted requests so the caller can wait for all of them
+// without allocating a future per request.
+class UVCPWaitGroup {
+  public:
+	void add() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		++pending_;
+	}
+
+	void done(bool ok) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!ok) {
+			ok_ = false;
+		}
+		--pending_;
+		cv_.notify_all();
+	}
+
+	// Returns false if any request in the group failed, then resets the group.
+	bool wait() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return pending_ == 0; });
+		const bool ok = ok_;
+		ok_ = true;
+		return ok;
+	}
+
+	bool idle() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return pending_ == 0;
+	}
+
+  private:
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	int pending_ = 0;
+	bool ok_ = true;
 };
 
-struct UVCPWriteMemoryCmd {      //ArvUvcpWriteMemoryCmd
-    UVCPHeader header{};
-    uint64_t address = 0;
-    uint8_t data[1];
+// Stream buffer that writes whole lines to another stream as "[prefix] line",
+// so several devices can report concurrently without interleaving. Carriage
+// returns discard the pending line, which keeps only the final state of
+// progress counters.
+class PrefixedLineBuf : public std::streambuf {
+  public:
+	PrefixedLineBuf(std::ostream& target, std::string prefix)
+		: target_(target), prefix_("[" + std::move(prefix) + "] ") {}
+	~PrefixedLineBuf() override {
+		if (!line_.empty()) {
+			emit();
+		}
+	}
+
+  protected:
+	int_type overflow(int_type ch) override {
+		if (ch != traits_type::eof()) {
+			const char c = traits_type::to_char_type(ch);
+			xsputn(&c, 1);
+		}
+		return traits_type::not_eof(ch);
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (std::streamsize i = 0; i < n; ++i) {
+			if (s[i] == '\n') {
+				emit();
+			} else if (s[i] == '\r') {
+				line_.clear();
+			} else {
+				line_ += s[i];
+			}
+		}
+		return n;
+	}
+
+  private:
+	void emit() {
+		static std::mutex targetMutex;
+		std::lock_guard<std::mutex> lock(targetMutex);
+		target_ << prefix_ << line_ << '\n' << std::flush;
+		line_.clear();
+	}
+
+	std::ostream& target_;
+	const std::string prefix_;
+	std::mutex mutex_;
+	std::string line_;
 };
 
-struct UVCPWriteMemoryAck {     //ArvUvcpWriteMemoryAck
-    UVCPHeader header{};
-    uint16_t unknown       = 0;
-    uint16_t bytes_written = 0;
+inline bool stdoutIsTerminal() {
+#ifdef _WIN32
+	static const bool terminal = _isatty(_fileno(stdout)) != 0;
+#else
+	static const bool terminal = ::isatty(STDOUT_FILENO) != 0;
+#endif
+	return terminal;
+}
+
+// The "\r" progress line of one transfer. It is redrawn at most every
+// kInterval with the current and average rate and an ETA, and stays silent
+// when not `visible`, so transfers whose output nobody watches format nothing.
+class TransferProgress {
+  public:
+	using Clock = std::chrono::steady_clock;
+	static constexpr std::chrono::milliseconds kInterval{100};
+
+	// `label` ends in the padding that lines up the numbers; `total` is 0 if
+	// unknown and `start` is where a resumed transfer picks up.
+	TransferProgress(std::ostream& out, const char* label, uint64_t total, uint64_t start, bool visible)
+		: out_(out), label_(label), total_(total), start_(start), done_(start), lastBytes_(start),
+		  visible_(visible), begin_(Clock::now()), last_(begin_) {}
+
+	void update(uint64_t done) {
+		done_ = done;
+		if (!visible_) {
+			return;
+		}
+		const auto now = Clock::now();
+		if (now - last_ < kInterval) {
+			return;
+		}
+		rate_ = static_cast<double>(done_ - lastBytes_) / std::chrono::duration<double>(now - last_).count();
+		last_ = now;
+		lastBytes_ = done_;
+		draw(now);
+	}
+
+	// Draw the final state and end the line, if one was started.
+	void finish() {
+		if (!drawn_) {
+			return;
+		}
+		draw(Clock::now());
+		out_ << '\n' << std::flush;
+		drawn_ = false;
+	}
+
+  private:
+	void draw(Clock::time_point now) {
+		const double elapsed = std::chrono::duration<double>(now - begin_).count();
+		const double average = elapsed > 0 ? static_cast<double>(done_ - start_) / elapsed : 0.0;
+		std::ostringstream line;
+		line << label_ << done_;
+		if (total_ > 0) {
+			line << '/' << total_ << " (" << std::fixed << std::setprecision(1)
+				 << 100.0 * static_cast<double>(done_) / static_cast<double>(total_) << "%)";
+		} else {
+			line << " bytes";
+		}
+		line << std::fixed << std::setprecision(1) << "  " << rate_ / 1e6 << " MB/s, avg " << average / 1e6
+			 << " MB/s";
+		if (total_ > done_ && average > 0) {
+			const uint64_t eta = static_cast<uint64_t>(static_cast<double>(total_ - done_) / average + 0.5);
+			line << ", ETA ";
+			if (eta >= 3600) {
+				line << eta / 3600 << ':' << std::setw(2) << std::setfill('0') << eta / 60 % 60;
+			} else {
+				line << eta / 60;
+			}
+			line << ':' << std::setw(2) << std::setfill('0') << eta % 60;
+		}
+		std::string text = line.str();
+		// Blank what is left of a longer previous line.
+		const size_t width = text.size();
+		if (width < width_) {
+			text.append(width_ - width, ' ');
+		}
+		width_ = width;
+		out_ << '\r' << text << std::flush;
+		drawn_ = true;
+	}
+
+	std::ostream& out_;
+	const char* label_;
+	const uint64_t total_;
+	const uint64_t start_;
+	uint64_t done_;
+	uint64_t lastBytes_;
+	const bool visible_;
+	const Clock::time_point begin_;
+	Clock::time_point last_;
+	double rate_ = 0.0;
+	size_t width_ = 0;
+	bool drawn_ = false;
 };
 
-struct UVCPPendingAck {
-    UVCPHeader header{};
-    uint16_t unknown    = 0;
-    uint16_t timeout_ms = 0;
+// Byte queue between exactly one producer and one consumer thread. Each side
+// only advances its own index, so neither takes a lock.
+class SpscByteRing {
+  public:
+	explicit SpscByteRing(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		buffer_.resize(size);
+		mask_ = size - 1;
+	}
+
+	// Producer: queue up to `size` bytes, returns how many fit.
+	size_t write(const uint8_t* data, size_t size) {
+		const size_t tail = tail_.load(std::memory_order_relaxed);
+		const size_t head = head_.load(std::memory_order_acquire);
+		const size_t count = std::min(size, buffer_.size() - (tail - head));
+		const size_t offset = tail & mask_;
+		const size_t first = std::min(count, buffer_.size() - offset);
+		std::memcpy(buffer_.data() + offset, data, first);
+		std::memcpy(buffer_.data(), data + first, count - first);
+		tail_.store(tail + count, std::memory_order_release);
+		return count;
+	}
+
+	// Consumer: take up to `size` bytes, returns how many were queued.
+	size_t read(uint8_t* data, size_t size) {
+		const size_t head = head_.load(std::memory_order_relaxed);
+		const size_t tail = tail_.load(std::memory_order_acquire);
+		const size_t count = std::min(size, tail - head);
+		const size_t offset = head & mask_;
+		const size_t first = std::min(count, buffer_.size() - offset);
+		std::memcpy(data, buffer_.data() + offset, first);
+		std::memcpy(data + first, buffer_.data(), count - first);
+		head_.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+	// Producer: bytes that write() would accept right now.
+	size_t freeSpace() const {
+		return buffer_.size() - (tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire));
+	}
+
+  private:
+	std::vector<uint8_t> buffer_;
+	size_t mask_ = 0;
+	alignas(64) std::atomic<size_t> head_{0};
+	alignas(64) std::atomic<size_t> tail_{0};
 };
-#pragma pack(pop)
 
-constexpr uint16_t kVendorId = 0x04b4;
-constexpr uint16_t kProductId = 0x1004;
-// Control interface and endpoints are discovered dynamically.
-constexpr unsigned int kTransferTimeoutMs = 10000;
+// Lets a thread sleep until another one has queued work for it. A notify()
+// that comes before the wait is not lost.
+class Wakeup {
+  public:
+	void notify() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			signalled_ = true;
+		}
+		cv_.notify_one();
+	}
 
-constexpr uint32_t kTerminalMagic = 0x5445524Du; // 'TERM'
-constexpr uint32_t kTerminalBaseAddr       = 0x30000;
-constexpr uint32_t kTerminalVersionAddr    = kTerminalBaseAddr + 0x4;
-constexpr uint32_t kTerminalStatusAddr     = kTerminalBaseAddr + 0x8;
-constexpr uint32_t kTerminalAvailAddr      = kTerminalBaseAddr + 0xC;
-constexpr uint32_t kTerminalChunkHintAddr  = kTerminalBaseAddr + 0x10;
-constexpr uint32_t kTerminalAuthStatusAddr = kTerminalBaseAddr + 0x14;
-constexpr uint32_t kTerminalAuthCmdAddr    = kTerminalBaseAddr + 0x18;
-constexpr uint32_t kTerminalAuthBufAddr    = kTerminalBaseAddr + 0x1C;
-constexpr uint32_t kTerminalDataAddr       = kTerminalBaseAddr + 0x100;
+	void waitUntil(std::chrono::steady_clock::time_point deadline) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait_until(lock, deadline, [this] { return signalled_; });
+		signalled_ = false;
+	}
 
-constexpr uint32_t kTerminalFileCmdAddr         = kTerminalBaseAddr + 0x40;
-constexpr uint32_t kTerminalFileStatusAddr      = kTerminalBaseAddr + 0x44;
-constexpr uint32_t kTerminalFileResultAddr      = kTerminalBaseAddr + 0x48;
-constexpr uint32_t kTerminalFileSizeLowAddr     = kTerminalBaseAddr + 0x4C;
-constexpr uint32_t kTerminalFileSizeHighAddr    = kTerminalBaseAddr + 0x50;
-constexpr uint32_t kTerminalFileCursorLowAddr   = kTerminalBaseAddr + 0x54;
-constexpr uint32_t kTerminalFileCursorHighAddr  = kTerminalBaseAddr + 0x58;
-constexpr uint32_t kTerminalFileDataAvailAddr   = kTerminalBaseAddr + 0x5C;
-constexpr uint32_t kTerminalFilePathAddr        = kTerminalBaseAddr + 0x60;
-constexpr uint32_t kTerminalFilePathCapacity    = 0x60;
-constexpr uint32_t kTerminalFileDataAddr        = kTerminalBaseAddr + 0xC0;
-constexpr uint32_t kTerminalFileDataWindow      = 0x40;
+  private:
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	bool signalled_ = false;
+};
 
-constexpr uint32_t kStatusReady = 1u << 0;
-constexpr uint32_t kStatusChildAlive = 1u << 1;
-constexpr uint32_t kStatusOutputPending = 1u << 2;
-constexpr uint32_t kStatusOverflow = 1u << 3;
-constexpr uint32_t kStatusError = 1u << 4;
-constexpr uint32_t kStatusEchoEnabled = 1u << 5;
+// Keeps background transfers behind interactive traffic. The shell holds a
+// Scope around each of its transactions; a job calls yield() before queueing
+// more file data and waits, for at most kForegroundYieldMax, until no shell
+// transaction is in flight.
+class ForegroundGate {
+  public:
+	class Scope {
+	  public:
+		explicit Scope(ForegroundGate& gate) : gate_(gate) { gate_.active_.fetch_add(1); }
+		~Scope() {
+			if (gate_.active_.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> lock(gate_.mutex_);
+				gate_.cv_.notify_all();
+			}
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
 
-constexpr uint32_t kCtrlStart = 1u << 0;
-constexpr uint32_t kCtrlReset = 1u << 1;
-constexpr uint32_t kCtrlSigInt = 1u << 2;
-constexpr uint32_t kCtrlSigTerm = 1u << 3;
-constexpr uint32_t kCtrlClearFlags = 1u << 4;
-constexpr uint32_t kCtrlEchoEnable = 1u << 5;
-constexpr uint32_t kCtrlEchoDisable = 1u << 6;
+	  private:
+		ForegroundGate& gate_;
+	};
 
-enum FileCommandReg : uint32_t {
-	kFileCmdNone     = 0,
-	kFileCmdOpenRead = 1,
-	kFileCmdOpenWrite= 2,
-	kFileCmdClose    = 3,
-	kFileCmdReset    = 4,
+	void yield() {
+		if (active_.load() == 0) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait_for(lock, kForegroundYieldMax, [this] { return active_.load() == 0; });
+	}
+
+  private:
+	static constexpr auto kForegroundYieldMax = std::chrono::milliseconds(50);
+
+	std::atomic<int> active_{0};
+	std::mutex mutex_;
+	std::condition_variable cv_;
 };
 
-constexpr uint32_t kFileStatusBusy      = 1u << 0;
-constexpr uint32_t kFileStatusError     = 1u << 1;
-constexpr uint32_t kFileStatusEof       = 1u << 2;
-constexpr uint32_t kFileStatusReading   = 1u << 3;
-constexpr uint32_t kFileStatusWriting   = 1u << 4;
-constexpr uint32_t kFileStatusOpen      = 1u << 5;
-constexpr uint32_t kFileStatusPathReady = 1u << 6;
+// Messages of a background job: the lines written so far and the one being
+// written, which a carriage return starts over so progress counters keep only
+// their latest value. Progress lines are not kept once ended. May be read
+// while the job writes.
+class JobLogBuf : public std::streambuf {
+  public:
+	// The line being written, else the last complete one.
+	std::string current() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return !line_.empty() || lines_.empty() ? line_ : lines_.back();
+	}
+
+	std::vector<std::string> lines() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return lines_;
+	}
+
+  protected:
+	int_type overflow(int_type ch) override {
+		if (ch != traits_type::eof()) {
+			const char c = traits_type::to_char_type(ch);
+			xsputn(&c, 1);
+		}
+		return traits_type::not_eof(ch);
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (std::streamsize i = 0; i < n; ++i) {
+			if (s[i] == '\n') {
+				if (!progress_ && !line_.empty()) {
+					lines_.push_back(std::move(line_));
+				}
+				line_.clear();
+				progress_ = false;
+			} else if (s[i] == '\r') {
+				line_.clear();
+				progress_ = true;
+			} else {
+				line_ += s[i];
+			}
+		}
+		return n;
+	}
+
+  private:
+	mutable std::mutex mutex_;
+	std::vector<std::string> lines_;
+	std::string line_;
+	bool progress_ = false; // line_ was rewritten after a carriage return
+};
 
-class U3VDevice {
+// Bounded queue between a transfer loop and its codec thread. close() wakes
+// both sides: pushes fail from then on, pops drain what is left.
+template <typename T>
+class CodecQueue {
   public:
-	U3VDevice() = default;
-	~U3VDevice() { shutdown(); }
+	static constexpr size_t kDepth = 4;
 
-	bool open(uint16_t vendorId, uint16_t productId, const std::string& serialFilter = {}) {
-		if (ctx_) {
-			std::cerr << "Context already initialized" << std::endl;
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return closed_ || items_.size() < kDepth; });
+		if (closed_) {
 			return false;
 		}
+		items_.push_back(std::move(item));
+		cv_.notify_all();
+		return true;
+	}
 
-		if (int err = libusb_init(&ctx_); err != LIBUSB_SUCCESS) {
-			std::cerr << "libusb_init failed: " << libusb_error_name(err) << std::endl;
-			ctx_ = nullptr;
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return closed_ || !items_.empty(); });
+		if (items_.empty()) {
 			return false;
 		}
+		item = std::move(items_.front());
+		items_.pop_front();
+		cv_.notify_all();
+		return true;
+	}
 
-		libusb_device** list = nullptr;
-		ssize_t count = libusb_get_device_list(ctx_, &list);
-		if (count < 0 || !list) {
-			std::cerr << "libusb_get_device_list failed" << std::endl;
-			libusb_exit(ctx_);
-			ctx_ = nullptr;
-			return false;
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		cv_.notify_all();
+	}
+
+  private:
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<T> items_;
+	bool closed_ = false;
+};
+
+// Reads `source` as file channel frames, compressed on a helper thread a few
+// blocks ahead of the upload.
+class FileEncodeBuf : public std::streambuf {
+  public:
+	explicit FileEncodeBuf(std::istream& source) : source_(source) {
+		thread_ = std::thread([this] { run(); });
+	}
+	~FileEncodeBuf() override {
+		queue_.close();
+		thread_.join();
+	}
+
+	// Bytes of `source` in the frames handed out so far.
+	uint64_t rawBytes() const { return rawBytes_; }
+	// False if reading `source` failed; valid once the frames ran out.
+	bool ok() const { return ok_; }
+
+  protected:
+	int_type underflow() override {
+		if (gptr() == egptr()) {
+			Frame frame;
+			if (!queue_.pop(frame)) {
+				return traits_type::eof();
+			}
+			current_ = std::move(frame.data);
+			rawBytes_ += frame.rawBytes;
+			setg(&current_[0], &current_[0], &current_[0] + current_.size());
 		}
+		return traits_type::to_int_type(*gptr());
+	}
 
-		struct DeviceCandidate {
-			libusb_device_handle* handle = nullptr;
-			std::string serial;
-		};
-		bool found = false;
-		std::vector<DeviceCandidate> candidates;
-		for (ssize_t i = 0; i < count; ++i) {
-			libusb_device* dev = list[i];
-			libusb_device_descriptor desc{};
-			if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS) {
-				continue;
+  private:
+	struct Frame {
+		std::string data;
+		size_t rawBytes = 0;
+	};
+
+	void run() {
+		std::vector<char> block(kFileCodecBlock);
+		while (source_) {
+			source_.read(block.data(), static_cast<std::streamsize>(block.size()));
+			const size_t got = static_cast<size_t>(source_.gcount());
+			if (got == 0) {
+				break;
 			}
-			if (desc.idVendor != vendorId || desc.idProduct != productId) {
-				continue;
+			Frame frame;
+			frame.rawBytes = got;
+			encodeFileFrame(block.data(), got, frame.data);
+			if (!queue_.push(std::move(frame))) {
+				return;
 			}
+		}
+		ok_ = !source_.bad();
+		queue_.close();
+	}
 
-			libusb_device_handle* candidate = nullptr;
-			if (libusb_open(dev, &candidate) != LIBUSB_SUCCESS || !candidate) {
-				continue;
-			}
+	std::istream& source_;
+	CodecQueue<Frame> queue_;
+	std::string current_;
+	uint64_t rawBytes_ = 0;
+	std::atomic<bool> ok_{true};
+	std::thread thread_;
+};
 
-			std::string serial;
-			if (desc.iSerialNumber != 0) {
-				unsigned char buffer[256] = {0};
-				int len = libusb_get_string_descriptor_ascii(candidate, desc.iSerialNumber, buffer,
-													 sizeof(buffer));
-				if (len > 0) {
-					serial.assign(reinterpret_cast<char*>(buffer), len);
-				}
-			}
+// Takes file channel frames as a download writes them and decompresses them
+// into `sink` on a helper thread.
+class FileDecodeBuf : public std::streambuf {
+  public:
+	explicit FileDecodeBuf(std::ostream& sink) : sink_(sink) {
+		thread_ = std::thread([this] { run(); });
+	}
+	~FileDecodeBuf() override { finish(); }
 
-			if (!serialFilter.empty()) {
-				if (!serial.empty() && serial == serialFilter) {
-					handle_ = candidate;
-					found = true;
-					break;
-				}
-				libusb_close(candidate);
-				continue;
+	// Wait for the queued frames to reach the sink. False if a frame was
+	// corrupt, the stream stopped inside one, or the sink failed.
+	bool finish() {
+		queue_.close();
+		if (thread_.joinable()) {
+			thread_.join();
+		}
+		if (!pending_.empty() && !failed_) {
+			fail("compressed stream ended inside a frame");
+		}
+		return !failed_;
+	}
+	const std::string& error() const { return error_; }
+	// Bytes written to the sink so far.
+	uint64_t rawBytes() const { return rawBytes_; }
+
+  protected:
+	int_type overflow(int_type ch) override {
+		if (ch == traits_type::eof()) {
+			return traits_type::not_eof(ch);
+		}
+		const char c = traits_type::to_char_type(ch);
+		return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		if (failed_) {
+			return 0;
+		}
+		pending_.append(s, static_cast<size_t>(n));
+		for (size_t length; (length = fileFrameLength(pending_)) != 0;) {
+			if (length == std::string::npos) {
+				fail("bad compressed frame header");
+				return 0;
+			}
+			if (!queue_.push(pending_.substr(0, length))) {
+				return 0;
 			}
+			pending_.erase(0, length);
+		}
+		return n;
+	}
 
-			candidates.push_back(DeviceCandidate{candidate, serial});
+  private:
+	void fail(const std::string& message) {
+		if (!failed_.exchange(true)) {
+			error_ = message;
 		}
+		queue_.close();
+	}
 
-		libusb_free_device_list(list, 1);
-		if (!serialFilter.empty()) {
-			if (!found) {
-				std::cerr << "Unable to open device " << std::hex << vendorId << ':' << productId
-					  << " with serial '" << serialFilter << '\'' << std::dec << std::endl;
-				libusb_exit(ctx_);
-				ctx_ = nullptr;
-				return false;
+	void run() {
+		std::string frame;
+		std::string block;
+		while (queue_.pop(frame)) {
+			block.clear();
+			if (!decodeFileFrame(frame.data(), frame.size(), block)) {
+				fail("corrupt compressed frame");
+				return;
 			}
-		} else {
-			if (candidates.empty()) {
-				std::cerr << "Unable to open device " << std::hex << vendorId << ':' << productId
-					  << std::dec << std::endl;
-				libusb_exit(ctx_);
-				ctx_ = nullptr;
-				return false;
+			if (!sink_.write(block.data(), static_cast<std::streamsize>(block.size()))) {
+				fail("cannot write the decompressed data");
+				return;
 			}
-			if (candidates.size() == 1) {
-				handle_ = candidates[0].handle;
-				found = true;
-			} else {
-				std::cout << "Multiple USB3 Vision devices detected:" << std::endl;
-				for (size_t idx = 0; idx < candidates.size(); ++idx) {
-					libusb_device* dev = libusb_get_device(candidates[idx].handle);
-					uint8_t bus = libusb_get_bus_number(dev);
-					uint8_t addr = libusb_get_device_address(dev);
-					const std::string serial = candidates[idx].serial.empty()
-												? std::string("<no-serial>")
-												: candidates[idx].serial;
-					std::cout << "  [" << idx << "] bus " << static_cast<int>(bus)
+			rawBytes_ += block.size();
+		}
+	}
+
+	std::ostream& sink_;
+	CodecQueue<std::string> queue_;
+	std::string pending_;
+	std::atomic<bool> failed_{false};
+	std::string error_; // by whoever failed first; read after finish()
+	std::atomic<uint64_t> rawBytes_{0};
+	std::thread thread_;
+};
+
+// CRC-32C (Castagnoli), the file digest of kCapFileDigest. crc32c(0, ...)
+// starts a digest and passing the previous result continues it. The SSE4.2
+// or ARMv8 CRC instruction takes 8 bytes a step, several GB/s, so the digest
+// keeps up with any link; other CPUs use slicing-by-8 tables.
+struct Crc32cTables {
+	uint32_t table[8][256];
+
+	constexpr Crc32cTables() : table() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+			}
+			table[0][i] = crc;
+		}
+		for (uint32_t i = 0; i < 256; ++i) {
+			for (int slice = 1; slice < 8; ++slice) {
+				table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+			}
+		}
+	}
+};
+constexpr Crc32cTables kCrc32cTables;
+
+inline uint32_t crc32cPortable(uint32_t crc, const uint8_t* data, size_t size) {
+	const auto& t = kCrc32cTables.table;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint32_t low;
+		uint32_t high;
+		std::memcpy(&low, data, 4);
+		std::memcpy(&high, data + 4, 4);
+		low ^= crc;
+		crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+			  t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+	}
+	for (; size != 0; ++data, --size) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+	}
+	return crc;
+}
+
+#if defined(U3VDB_CRC32C_SSE42)
+#ifdef __GNUC__
+__attribute__((target("sse4.2")))
+#endif
+uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t size) {
+	uint64_t crc64 = crc;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = static_cast<uint32_t>(crc64);
+	for (; size != 0; ++data, --size) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+
+bool crc32cHardwareAvailable() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(U3VDB_CRC32C_ARM)
+uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t size) {
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+	for (; size != 0; ++data, --size) {
+		crc = __crc32cb(crc, *data);
+	}
+	return crc;
+}
+
+bool crc32cHardwareAvailable() { return true; }
+#endif
+
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+	const auto* bytes = static_cast<const uint8_t*>(data);
+#if defined(U3VDB_CRC32C_SSE42) || defined(U3VDB_CRC32C_ARM)
+	static const bool hardware = crc32cHardwareAvailable();
+	return ~(hardware ? crc32cHardware(~crc, bytes, size) : crc32cPortable(~crc, bytes, size));
+#else
+	return ~crc32cPortable(~crc, bytes, size);
+#endif
+}
+
+// Passes a stream through to `target` and keeps the CRC-32C of the bytes
+// that went by, so transfers digest their data without a second pass. Reads
+// are buffered (transfer loops peek); writes go straight through.
+class Crc32cStreamBuf : public std::streambuf {
+  public:
+	explicit Crc32cStreamBuf(std::streambuf* target) : target_(target) {}
+
+	uint32_t digest() const { return crc_; }
+
+  protected:
+	int_type underflow() override {
+		if (gptr() == egptr()) {
+			if (buffer_.empty()) {
+				buffer_.resize(kFileCodecBlock);
+			}
+			const std::streamsize got = target_->sgetn(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+			if (got <= 0) {
+				return traits_type::eof();
+			}
+			crc_ = crc32c(crc_, buffer_.data(), static_cast<size_t>(got));
+			setg(buffer_.data(), buffer_.data(), buffer_.data() + got);
+		}
+		return traits_type::to_int_type(*gptr());
+	}
+
+	int_type overflow(int_type ch) override {
+		if (ch == traits_type::eof()) {
+			return traits_type::not_eof(ch);
+		}
+		const char c = traits_type::to_char_type(ch);
+		return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		const std::streamsize written = target_->sputn(s, n);
+		if (written > 0) {
+			crc_ = crc32c(crc_, s, static_cast<size_t>(written));
+		}
+		return written;
+	}
+
+	int sync() override { return target_->pubsync(); }
+
+  private:
+	std::streambuf* target_;
+	std::vector<char> buffer_;
+	uint32_t crc_ = 0;
+};
+
+// Buffer size for local files read or written through iostreams; large
+// enough that the file system sees few, big requests.
+constexpr size_t kLocalFileBuffer = 1u << 20;
+
+// monitor: samples waiting for the writer thread are buffered this deep.
+constexpr size_t kMonitorRingBytes = 8u << 20;
+
+// A local regular file read as a stream in kLocalFileBuffer blocks, which a
+// prefetch thread reads ahead with positional reads. Raw uploads send their
+// chunks straight from the block buffers (take()). If the file shrinks while
+// it is read, the stream ends early with failed() set; a mapping of it would
+// fault instead.
+class PrefetchFileBuf : public std::streambuf {
+  public:
+	PrefetchFileBuf() = default;
+	PrefetchFileBuf(const PrefetchFileBuf&) = delete;
+	PrefetchFileBuf& operator=(const PrefetchFileBuf&) = delete;
+	~PrefetchFileBuf() { close(); }
+
+	// False for empty files and anything that is not a regular file (pipes,
+	// devices); those are read through an ifstream instead.
+	bool open(const std::string& path) {
+		close();
+#ifdef _WIN32
+		handle_ = CreateFileW(std::filesystem::path(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+							  nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (handle_ == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER size{};
+		if (GetFileType(handle_) == FILE_TYPE_DISK && GetFileSizeEx(handle_, &size) && size.QuadPart > 0) {
+			size_ = static_cast<uint64_t>(size.QuadPart);
+		}
+#else
+		fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd_ < 0) {
+			return false;
+		}
+		struct stat st {};
+		if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			size_ = static_cast<uint64_t>(st.st_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		}
+#endif
+		if (size_ == 0) {
+			close();
+			return false;
+		}
+		window(0, size_);
+		return true;
+	}
+
+	uint64_t size() const { return size_; }
+
+	// The file ended before its size at open: it was truncated while read.
+	bool failed() const { return failed_; }
+
+	// Read [offset, offset + length) into `dest` regardless of the stream
+	// position; safe to call from several threads at once.
+	bool readAt(uint64_t offset, char* dest, size_t length) const {
+		while (length > 0) {
+#ifdef _WIN32
+			OVERLAPPED at{};
+			at.Offset = static_cast<DWORD>(offset);
+			at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+			DWORD got = 0;
+			if (!ReadFile(handle_, dest, static_cast<DWORD>(std::min<size_t>(length, 1u << 30)), &got, &at) ||
+				got == 0) {
+				return false;
+			}
+#else
+			const ssize_t got = ::pread(fd_, dest, length, static_cast<off_t>(offset));
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			if (got <= 0) {
+				return false;
+			}
+#endif
+			dest += got;
+			offset += static_cast<uint64_t>(got);
+			length -= static_cast<size_t>(got);
+		}
+		return true;
+	}
+
+	// Read only [begin, end) of the file from now on, starting at begin.
+	void window(uint64_t begin, uint64_t end) {
+		stopPrefetch();
+		blockOffset_ = next_ = begin;
+		end_ = end;
+	}
+
+	size_t remaining() const { return static_cast<size_t>(end_ - position()); }
+
+	// Point `chunk` at up to `max` bytes at the read position and move past
+	// them, without copying. A chunk stays valid until the stream has moved
+	// a whole block past it, seeks or closes.
+	size_t take(const char*& chunk, size_t max) {
+		if (gptr() == egptr() && !nextBlock()) {
+			return 0;
+		}
+		const size_t n = std::min(max, static_cast<size_t>(egptr() - gptr()));
+		chunk = gptr();
+		setg(eback(), gptr() + n, egptr());
+		return n;
+	}
+
+  protected:
+	int_type underflow() override {
+		if (gptr() == egptr() && !nextBlock()) {
+			return traits_type::eof();
+		}
+		return traits_type::to_int_type(*gptr());
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+		const off_type base = dir == std::ios_base::beg ? 0
+							  : dir == std::ios_base::cur ? static_cast<off_type>(position())
+														  : static_cast<off_type>(end_);
+		return seekpos(pos_type(base + off), which);
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+		const off_type at = off_type(pos);
+		if (!(which & std::ios_base::in) || size_ == 0 || at < 0 || at > static_cast<off_type>(size_)) {
+			return pos_type(off_type(-1));
+		}
+		if (static_cast<uint64_t>(at) != position() || end_ != size_) {
+			window(static_cast<uint64_t>(at), size_);
+		}
+		return pos;
+	}
+
+  private:
+	// Blocks in use: the one being read, the one before it (chunks taken from
+	// it may still be in flight) and the one being prefetched.
+	static constexpr size_t kSlots = 3;
+	static_assert(kUploadChunksInFlight * TY_UVCP_MAX_MSG_LEN <= kLocalFileBuffer,
+				  "chunks in flight must fit within one block");
+
+	struct Slot {
+		std::vector<char> data;
+		uint64_t offset = 0;
+		size_t length = 0;
+		bool full = false;  // filled, or still held by the reader
+		bool error = false; // the file ended early here
+	};
+
+	uint64_t position() const { return blockOffset_ + static_cast<uint64_t>(gptr() - eback()); }
+
+	void startPrefetch() {
+		if (thread_.joinable()) {
+			return;
+		}
+		for (Slot& slot : slots_) {
+			slot.data.resize(kLocalFileBuffer);
+			slot.full = false;
+			slot.error = false;
+		}
+		stop_ = false;
+		thread_ = std::thread([this, at = next_, end = end_]() mutable {
+			for (size_t i = 0; at < end; i = (i + 1) % kSlots) {
+				Slot& slot = slots_[i];
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					cv_.wait(lock, [&] { return stop_ || !slot.full; });
+					if (stop_) {
+						return;
+					}
+				}
+				const size_t length = static_cast<size_t>(std::min<uint64_t>(kLocalFileBuffer, end - at));
+				const bool ok = readAt(at, slot.data.data(), length);
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					slot.offset = at;
+					slot.length = length;
+					slot.error = !ok;
+					slot.full = true;
+				}
+				cv_.notify_all();
+				if (!ok) {
+					return;
+				}
+				at += length;
+			}
+		});
+	}
+
+	void stopPrefetch() {
+		if (thread_.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			cv_.notify_all();
+			thread_.join();
+		}
+		current_ = previous_ = kSlots;
+		nextSlot_ = 0;
+		blockOffset_ = position();
+		next_ = blockOffset_;
+		setg(nullptr, nullptr, nullptr);
+	}
+
+	// Move to the next prefetched block; false at the end of the window or
+	// when the file ended early.
+	bool nextBlock() {
+		if (next_ >= end_ || failed_) {
+			return false;
+		}
+		startPrefetch();
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (previous_ != kSlots) {
+			slots_[previous_].full = false;
+			cv_.notify_all();
+		}
+		previous_ = current_;
+		Slot& slot = slots_[nextSlot_];
+		cv_.wait(lock, [&] { return slot.full; });
+		if (slot.error) {
+			failed_ = true;
+			return false;
+		}
+		current_ = nextSlot_;
+		nextSlot_ = (nextSlot_ + 1) % kSlots;
+		blockOffset_ = slot.offset;
+		next_ = slot.offset + slot.length;
+		setg(slot.data.data(), slot.data.data(), slot.data.data() + slot.length);
+		return true;
+	}
+
+	void close() {
+		stopPrefetch();
+#ifdef _WIN32
+		if (handle_ != INVALID_HANDLE_VALUE) {
+			CloseHandle(handle_);
+			handle_ = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (fd_ >= 0) {
+			::close(fd_);
+			fd_ = -1;
+		}
+#endif
+		size_ = 0;
+		blockOffset_ = next_ = end_ = 0;
+		failed_ = false;
+	}
+
+#ifdef _WIN32
+	HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+	int fd_ = -1;
+#endif
+	uint64_t size_ = 0;
+	uint64_t end_ = 0;         // window end
+	uint64_t blockOffset_ = 0; // file offset of eback()
+	uint64_t next_ = 0;        // file offset of the next block to read
+	bool failed_ = false;
+	std::array<Slot, kSlots> slots_;
+	size_t current_ = kSlots; // slots held by the reader; kSlots for none
+	size_t previous_ = kSlots;
+	size_t nextSlot_ = 0;
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	bool stop_ = false;
+};
+
+// Reserve `size` bytes for a download on disk without changing the file's
+// length, so recordings are not laid out in fragments and a partial file
+// still resumes where it stopped. Best effort; other POSIX systems skip it.
+// On Windows the reservation lasts while another handle (the download's
+// ofstream) keeps the file open.
+inline void reserveFileSpace(const std::string& path, uint64_t size) {
+	if (size == 0) {
+		return;
+	}
+#ifdef _WIN32
+	HANDLE file = CreateFileW(std::filesystem::path(path).c_str(), GENERIC_WRITE,
+							  FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	FILE_ALLOCATION_INFO info{};
+	info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+	SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info));
+	CloseHandle(file);
+#elif defined(__linux__)
+	const int fd = ::open(path.c_str(), O_WRONLY);
+	if (fd >= 0) {
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size));
+		::close(fd);
+	}
+#else
+	(void)path;
+#endif
+}
+
+// CRC-32C of each kFileCodecBlock-byte block of `data` (the last may be
+// short), as kFileCodecBlockDigest reports them for a remote file. Every core
+// takes a contiguous slice.
+inline bool fileBlockDigests(const PrefetchFileBuf& file, uint64_t size, std::vector<uint32_t>& digests) {
+	const size_t blocks = static_cast<size_t>((size + kFileCodecBlock - 1) / kFileCodecBlock);
+	digests.assign(blocks, 0);
+	const size_t threads =
+		std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), (blocks + 63) / 64));
+	std::atomic<bool> ok{true};
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t] {
+			std::vector<char> block(kFileCodecBlock);
+			for (size_t i = blocks * t / threads; i < blocks * (t + 1) / threads && ok; ++i) {
+				const uint64_t begin = i * kFileCodecBlock;
+				const size_t length = static_cast<size_t>(std::min<uint64_t>(kFileCodecBlock, size - begin));
+				if (!file.readAt(begin, block.data(), length)) {
+					ok = false;
+					break;
+				}
+				digests[i] = crc32c(0, block.data(), length);
+			}
+		});
+	}
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	return ok;
+}
+
+constexpr uint32_t kTerminalMagic = 0x5445524Du; // 'TERM'
+constexpr uint32_t kTerminalBaseAddr       = 0x30000;
+constexpr uint32_t kTerminalVersionAddr    = kTerminalBaseAddr + 0x4;
+constexpr uint32_t kTerminalStatusAddr     = kTerminalBaseAddr + 0x8;
+constexpr uint32_t kTerminalAvailAddr      = kTerminalBaseAddr + 0xC;
+constexpr uint32_t kTerminalChunkHintAddr  = kTerminalBaseAddr + 0x10;
+constexpr uint32_t kTerminalAuthStatusAddr = kTerminalBaseAddr + 0x14;
+constexpr uint32_t kTerminalAuthCmdAddr    = kTerminalBaseAddr + 0x18;
+constexpr uint32_t kTerminalAuthBufAddr    = kTerminalBaseAddr + 0x1C;
+constexpr uint32_t kTerminalDataAddr       = kTerminalBaseAddr + 0x100;
+
+constexpr uint32_t kTerminalFileCmdAddr         = kTerminalBaseAddr + 0x40;
+constexpr uint32_t kTerminalFileStatusAddr      = kTerminalBaseAddr + 0x44;
+constexpr uint32_t kTerminalFileResultAddr      = kTerminalBaseAddr + 0x48;
+constexpr uint32_t kTerminalFileSizeLowAddr     = kTerminalBaseAddr + 0x4C;
+constexpr uint32_t kTerminalFileSizeHighAddr    = kTerminalBaseAddr + 0x50;
+constexpr uint32_t kTerminalFileCursorLowAddr   = kTerminalBaseAddr + 0x54;
+constexpr uint32_t kTerminalFileCursorHighAddr  = kTerminalBaseAddr + 0x58;
+constexpr uint32_t kTerminalFileDataAvailAddr   = kTerminalBaseAddr + 0x5C;
+constexpr uint32_t kTerminalFilePathAddr        = kTerminalBaseAddr + 0x60;
+constexpr uint32_t kTerminalFilePathCapacity    = 0x60;
+constexpr uint32_t kTerminalFileDataAddr        = kTerminalBaseAddr + 0xC0;
+constexpr uint32_t kTerminalFileDataWindow      = 0x40;
+
+// Extension block, present from kTerminal version 0x00010003. The words after
+// the chunk hint are taken by the auth registers and buffer, so new registers
+// live past the data port.
+constexpr uint32_t kTerminalExtMinVersion       = 0x00010003u;
+constexpr uint32_t kTerminalExtBaseAddr         = kTerminalBaseAddr + 0x200;
+constexpr uint32_t kTerminalCapsAddr            = kTerminalExtBaseAddr + 0x0;
+constexpr uint32_t kTerminalFileWindowAddr      = kTerminalExtBaseAddr + 0x4; // RW: negotiated window
+constexpr uint32_t kTerminalFileWindowMaxAddr   = kTerminalExtBaseAddr + 0x8; // RO: device maximum
+constexpr uint32_t kTerminalEventCtrlAddr       = kTerminalExtBaseAddr + 0xC; // RW: event enables
+constexpr uint32_t kTerminalFileCodecAddr       = kTerminalExtBaseAddr + 0x10; // RW: codec of the next open
+// RO: CRC-32C of the uncompressed file data read or written since the file
+// was opened or its cursor last set.
+constexpr uint32_t kTerminalFileDigestAddr      = kTerminalExtBaseAddr + 0x14;
+// File data port for a negotiated window larger than kTerminalFileDataWindow.
+// It has an address range of its own, so a device decoding by range never
+// sees a large transaction run over the data port or the extension block.
+constexpr uint32_t kTerminalFileWideDataAddr    = kTerminalBaseAddr + 0x10000;
+
+constexpr uint32_t kCapLargeFileWindow = 1u << 0;
+constexpr uint32_t kCapOutputEvents    = 1u << 1;
+constexpr uint32_t kCapFileOpenUpdate  = 1u << 2;
+constexpr uint32_t kCapFileCodec       = 1u << 3;
+constexpr uint32_t kCapFileDigest      = 1u << 4;
+constexpr uint32_t kCapFileBlockDigest = 1u << 5;
+// The device takes several UVCP commands concatenated in one bulk OUT
+// transfer, runs them in order and may answer them in one IN transfer.
+constexpr uint32_t kCapCommandBatch    = 1u << 6;
+
+// kTerminalFileCodecAddr values. The device latches the codec when a file is
+// opened and goes back to raw when it is closed; the size register always
+// counts uncompressed bytes.
+enum FileCodec : uint32_t {
+	kFileCodecRaw = 0,
+	kFileCodecLz4 = 1, // data port carries LZ4 frames, see encodeFileFrame()
+	// kCapFileBlockDigest: reads return a little-endian CRC-32C for each
+	// kFileCodecBlock bytes of the file instead of the data.
+	kFileCodecBlockDigest = 2,
+};
+
+constexpr uint32_t kEventCtrlOutputPending = 1u << 0;
+// Event raised when kStatusOutputPending goes from clear to set.
+constexpr uint16_t kEventIdOutputPending = 0x9001;
+// With events enabled the output is still polled this often in case one is lost.
+constexpr auto kEventSafetyPoll = std::chrono::milliseconds(500);
+// Queues between the interactive shell's stdin reader, USB worker and
+// stdout writer threads.
+constexpr size_t kShellInputRing = 64 * 1024;
+constexpr size_t kShellOutputRing = 256 * 1024;
+// Queue between the session threads and the --log writer; holds several
+// seconds of shell output at USB rates.
+constexpr size_t kSessionLogRing = 4 * 1024 * 1024;
+
+// Largest file data window that still fits a UVCP ACK in TY_UVCP_MAX_MSG_LEN.
+constexpr uint32_t kMaxFileDataWindow = TY_UVCP_MAX_MSG_LEN - 512;
+static_assert(kTerminalFileDataAddr + kTerminalFileDataWindow <= kTerminalDataAddr &&
+				  kTerminalFileDigestAddr < kTerminalFileWideDataAddr,
+			  "file data windows overlap other kTerminal registers");
+
+constexpr uint32_t kStatusReady = 1u << 0;
+constexpr uint32_t kStatusChildAlive = 1u << 1;
+constexpr uint32_t kStatusOutputPending = 1u << 2;
+constexpr uint32_t kStatusOverflow = 1u << 3;
+constexpr uint32_t kStatusError = 1u << 4;
+constexpr uint32_t kStatusEchoEnabled = 1u << 5;
+
+constexpr uint32_t kCtrlStart = 1u << 0;
+constexpr uint32_t kCtrlReset = 1u << 1;
+constexpr uint32_t kCtrlSigInt = 1u << 2;
+constexpr uint32_t kCtrlSigTerm = 1u << 3;
+constexpr uint32_t kCtrlClearFlags = 1u << 4;
+constexpr uint32_t kCtrlEchoEnable = 1u << 5;
+constexpr uint32_t kCtrlEchoDisable = 1u << 6;
+
+enum FileCommandReg : uint32_t {
+	kFileCmdNone     = 0,
+	kFileCmdOpenRead = 1,
+	kFileCmdOpenWrite= 2,
+	kFileCmdClose    = 3,
+	kFileCmdReset    = 4,
+	kFileCmdOpenUpdate = 5, // kCapFileOpenUpdate: open for writing without truncating
+};
+
+// Resumed transfers compare up to this many bytes before the resume point.
+constexpr uint64_t kResumeVerifyBytes = 64 * 1024;
+
+constexpr uint32_t kFileStatusBusy      = 1u << 0;
+constexpr uint32_t kFileStatusError     = 1u << 1;
+constexpr uint32_t kFileStatusEof       = 1u << 2;
+constexpr uint32_t kFileStatusReading   = 1u << 3;
+constexpr uint32_t kFileStatusWriting   = 1u << 4;
+constexpr uint32_t kFileStatusOpen      = 1u << 5;
+constexpr uint32_t kFileStatusPathReady = 1u << 6;
+
+// Register snapshots: adjacent registers fetched with a single block read so
+// the values are consistent with each other and cost one round trip.
+#pragma pack(push, 1)
+struct TerminalStatusBlock {     // kTerminalStatusAddr..kTerminalChunkHintAddr
+	uint32_t status = 0;
+	uint32_t available = 0;
+	uint32_t chunkHint = 0;
+};
+
+struct FileStatusBlock {         // kTerminalFileStatusAddr..kTerminalFileDataAvailAddr
+	uint32_t status = 0;
+	uint32_t result = 0;
+	uint32_t sizeLow = 0;
+	uint32_t sizeHigh = 0;
+	uint32_t cursorLow = 0;
+	uint32_t cursorHigh = 0;
+	uint32_t dataAvail = 0;
+
+	uint64_t size() const { return (static_cast<uint64_t>(sizeHigh) << 32) | sizeLow; }
+	uint64_t cursor() const { return (static_cast<uint64_t>(cursorHigh) << 32) | cursorLow; }
+};
+#pragma pack(pop)
+
+static_assert(sizeof(ManifestEntry) == 64, "ManifestEntry must mirror the manifest table layout");
+static_assert(kTerminalStatusAddr + sizeof(TerminalStatusBlock) == kTerminalChunkHintAddr + 4,
+			  "TerminalStatusBlock must mirror the terminal register layout");
+static_assert(kTerminalFileStatusAddr + sizeof(FileStatusBlock) == kTerminalFileDataAvailAddr + 4,
+			  "FileStatusBlock must mirror the file channel register layout");
+
+// How long a register value read by TerminalClient stays true.
+enum class RegisterPolicy {
+	Volatile,  // read every time
+	Session,   // until an error, a reset or the device says otherwise
+	Immutable, // for as long as the device is open
+};
+
+// Values of the registers TerminalClient checks before most operations, so
+// the command path does not re-read them. Only callers that name a policy
+// go through it; everything else reads the device directly.
+class RegisterCache {
+  public:
+	bool lookup(uint32_t address, uint32_t& value) const {
+		for (const Entry& entry : entries_) {
+			if (entry.address == address) {
+				value = entry.value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void store(uint32_t address, uint32_t value, RegisterPolicy policy) {
+		if (policy == RegisterPolicy::Volatile) {
+			return;
+		}
+		forget(address);
+		entries_.push_back(Entry{address, value, policy});
+	}
+
+	void forget(uint32_t address) {
+		entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+									  [address](const Entry& entry) { return entry.address == address; }),
+					   entries_.end());
+	}
+
+	// Drop every session-scoped value; immutable ones stay.
+	void invalidateSession() {
+		entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+									  [](const Entry& entry) { return entry.policy == RegisterPolicy::Session; }),
+					   entries_.end());
+	}
+
+  private:
+	struct Entry {
+		uint32_t address;
+		uint32_t value;
+		RegisterPolicy policy;
+	};
+	std::vector<Entry> entries_; // a handful of registers; a scan beats a map
+};
+
+// Fixed-bucket latency histogram, cheap enough to leave on: bucket i counts
+// samples below 2^i microseconds, the last one everything slower.
+class LatencyHistogram {
+  public:
+	static constexpr size_t kBuckets = 24; // 2^23 us ~ 8 s
+
+	void record(std::chrono::steady_clock::duration elapsed) {
+		const uint64_t us = static_cast<uint64_t>(
+			std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), 0));
+		size_t bucket = 0;
+		while (bucket + 1 < kBuckets && (uint64_t{1} << bucket) <= us) {
+			++bucket;
+		}
+		buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		totalUs_.fetch_add(us, std::memory_order_relaxed);
+		uint64_t prev = maxUs_.load(std::memory_order_relaxed);
+		while (us > prev && !maxUs_.compare_exchange_weak(prev, us, std::memory_order_relaxed)) {
+		}
+	}
+
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t maxUs() const { return maxUs_.load(std::memory_order_relaxed); }
+	uint64_t meanUs() const { return count() ? totalUs_.load(std::memory_order_relaxed) / count() : 0; }
+
+	// Upper bound of the bucket holding quantile q, in microseconds.
+	uint64_t quantileUs(double q) const {
+		const uint64_t total = count();
+		if (total == 0) {
+			return 0;
+		}
+		const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(total))));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < kBuckets; ++i) {
+			seen += buckets_[i].load(std::memory_order_relaxed);
+			if (seen >= rank) {
+				return std::min(uint64_t{1} << i, maxUs());
+			}
+		}
+		return maxUs();
+	}
+
+  private:
+	std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+	std::atomic<uint64_t> count_{0};
+	std::atomic<uint64_t> totalUs_{0};
+	std::atomic<uint64_t> maxUs_{0};
+};
+
+// Who a UVCP transaction was for, derived from the register it touches.
+enum class TrafficClass : uint8_t { Terminal, File, Auth, Other };
+constexpr size_t kTrafficClassCount = 4;
+
+inline const char* trafficClassName(TrafficClass cls) {
+	switch (cls) {
+	case TrafficClass::Terminal: return "terminal";
+	case TrafficClass::File:     return "file";
+	case TrafficClass::Auth:     return "auth";
+	default:                     return "other";
+	}
+}
+
+inline TrafficClass classifyAddress(uint32_t address) {
+	if (address < kTerminalBaseAddr || address >= kTerminalExtBaseAddr + 0x100) {
+		return TrafficClass::Other;
+	}
+	if (address >= kTerminalAuthStatusAddr && address < kTerminalFileCmdAddr) {
+		return TrafficClass::Auth;
+	}
+	if ((address >= kTerminalFileCmdAddr && address < kTerminalDataAddr) ||
+		address == kTerminalFileWindowAddr || address == kTerminalFileWindowMaxAddr) {
+		return TrafficClass::File;
+	}
+	return TrafficClass::Terminal;
+}
+
+struct TrafficStats {
+	std::atomic<uint64_t> commands{0};
+	std::atomic<uint64_t> failures{0};     // any request that did not complete with a valid ACK
+	std::atomic<uint64_t> timeouts{0};
+	std::atomic<uint64_t> pendingAcks{0};
+	std::atomic<uint64_t> bytesOut{0};
+	std::atomic<uint64_t> bytesIn{0};
+	LatencyHistogram roundTrip;            // submit to ACK, including PENDING_ACK waits
+};
+
+// Counters kept by U3VDevice for --stats.
+struct UVCPStats {
+	std::array<TrafficStats, kTrafficClassCount> byClass;
+	LatencyHistogram bulkSend;    // time to hand one OUT transfer to libusb
+	LatencyHistogram bulkReceive; // time to process one IN transfer
+	LatencyHistogram pendingWait; // first PENDING_ACK to the final ACK
+	std::atomic<uint64_t> unknownIds{0};
+	std::atomic<uint64_t> staleAcks{0};        // late ACKs to failed or retried requests
+	std::atomic<uint64_t> retries{0};
+	std::atomic<uint64_t> haltsCleared{0};
+	std::atomic<uint64_t> pendingExhausted{0}; // gave up after kMaxPendingWait
+	std::atomic<uint64_t> events{0};
+
+	void print(std::ostream& out) const {
+		const auto flags = out.flags();
+		out << "UVCP statistics (latency in us, bucket upper bounds):\n"
+			<< std::left << std::setw(10) << "  class" << std::right << std::setw(9) << "cmds"
+			<< std::setw(7) << "fail" << std::setw(7) << "t/o" << std::setw(7) << "pend"
+			<< std::setw(12) << "bytes out" << std::setw(12) << "bytes in" << std::setw(8) << "p50"
+			<< std::setw(8) << "p99" << std::setw(9) << "max" << '\n';
+		for (size_t i = 0; i < kTrafficClassCount; ++i) {
+			const TrafficStats& s = byClass[i];
+			if (s.commands == 0) {
+				continue;
+			}
+			out << "  " << std::left << std::setw(8) << trafficClassName(static_cast<TrafficClass>(i))
+				<< std::right << std::setw(9) << s.commands << std::setw(7) << s.failures
+				<< std::setw(7) << s.timeouts << std::setw(7) << s.pendingAcks
+				<< std::setw(12) << s.bytesOut << std::setw(12) << s.bytesIn
+				<< std::setw(8) << s.roundTrip.quantileUs(0.50) << std::setw(8) << s.roundTrip.quantileUs(0.99)
+				<< std::setw(9) << s.roundTrip.maxUs() << '\n';
+		}
+		auto line = [&](const char* label, const LatencyHistogram& h) {
+			out << "  " << label << ": n=" << h.count() << " mean=" << h.meanUs()
+				<< " p50=" << h.quantileUs(0.50) << " p99=" << h.quantileUs(0.99) << " max=" << h.maxUs() << '\n';
+		};
+		line("bulk send   ", bulkSend);
+		line("bulk receive", bulkReceive);
+		line("pending wait", pendingWait);
+		out << "  unknown ACK ids: " << unknownIds << ", stale ACKs: " << staleAcks << ", retries: " << retries
+			<< ", halts cleared: " << haltsCleared << ", PENDING_ACK limit hit: " << pendingExhausted
+			<< ", events: " << events << std::endl;
+		out.flags(flags);
+	}
+};
+
+// One command of a batch: a READ_MEMORY into `out`, or a WRITE_MEMORY of
+// `data` when `out` is null.
+struct UVCPTransaction {
+	uint32_t address = 0;
+	uint16_t bytes = 0;
+	const uint8_t* data = nullptr;
+	uint8_t* out = nullptr;
+
+	static UVCPTransaction read(uint32_t address, uint8_t* out, uint16_t bytes) {
+		return {address, bytes, nullptr, out};
+	}
+	static UVCPTransaction write(uint32_t address, const uint8_t* data, uint16_t bytes) {
+		return {address, bytes, data, nullptr};
+	}
+	static UVCPTransaction readRegister(uint32_t address, uint32_t& value) {
+		return read(address, reinterpret_cast<uint8_t*>(&value), sizeof(value));
+	}
+	static UVCPTransaction writeRegister(uint32_t address, const uint32_t& value) {
+		return write(address, reinterpret_cast<const uint8_t*>(&value), sizeof(value));
+	}
+};
+
+// Register and memory access as TerminalClient uses it. U3VDevice speaks
+// UVCP over libusb, or to a MockTerminalDevice emulating a kTerminal target.
+// The synchronous helpers are built on the submit primitives. Every call may
+// come from any thread: requests from all callers share one queue, enter a
+// full pipeline in the order they were submitted and are matched to their
+// ACKs by id, so independent channels can use one device at once.
+class UVCPTransport {
+  public:
+	virtual ~UVCPTransport() = default;
+
+	// Receives U3V events; replaces any previous handler, nullptr removes it.
+	virtual void setEventHandler(UVCPEventHandler handler) = 0;
+
+	// Queue a READ_MEMORY command without waiting for its ACK. Blocks only while
+	// the pipeline is full. The callback sees the payload on success.
+	virtual bool submitReadMemory(uint32_t address, uint16_t bytes, UVCPCallback callback) = 0;
+
+	// Queue a READ_MEMORY whose payload is copied to `out` before `group` is
+	// signalled. `out` must stay valid until then.
+	virtual bool submitReadMemory(uint32_t address, uint8_t* out, uint16_t bytes, UVCPWaitGroup& group) = 0;
+
+	// Queue a WRITE_MEMORY command; the data is copied before this returns.
+	virtual bool submitWriteMemory(uint32_t startAddress, const uint8_t* data, uint16_t bytes,
+								   UVCPCallback callback) = 0;
+
+	// Queue a WRITE_MEMORY; a short write counts as a failure of `group`.
+	virtual bool submitWriteMemory(uint32_t startAddress, const uint8_t* data, uint16_t bytes,
+								   UVCPWaitGroup& group) = 0;
+
+	// Queue transactions that the device runs in order; write data is copied
+	// before this returns. Transports that can put several commands in one
+	// bulk transfer do so, the others queue them one by one.
+	virtual bool submitBatch(const UVCPTransaction* batch, size_t count, UVCPWaitGroup& group) {
+		for (size_t i = 0; i < count; ++i) {
+			const UVCPTransaction& t = batch[i];
+			if (!(t.out ? submitReadMemory(t.address, t.out, t.bytes, group)
+						: submitWriteMemory(t.address, t.data, t.bytes, group))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Whether the device advertised kCapCommandBatch.
+	virtual void setCommandBatching(bool) {}
+
+	virtual const UVCPStats& stats() const = 0;
+
+	// Largest READ_MEMORY and WRITE_MEMORY payloads of one transaction.
+	struct TransferLimits {
+		uint16_t maxRead = 0;
+		uint16_t maxWrite = 0;
+	};
+
+	// Bulk packet sizes of the link (wMaxPacketSize). Payloads are then cut to
+	// whole packets, so only the UVCP header spills into a short last packet
+	// and no transfer needs a zero-length packet to end.
+	void setPacketSizes(uint32_t readPacket, uint32_t writePacket) {
+		std::lock_guard<std::mutex> lock(limitsMutex_);
+		readPacket_ = readPacket;
+		writePacket_ = writePacket;
+		limits_ = {};
+	}
+
+	// Size of the buffers ACKs are received into, when below
+	// TY_UVCP_MAX_MSG_LEN.
+	void setAckBufferLength(uint32_t bytes) {
+		std::lock_guard<std::mutex> lock(limitsMutex_);
+		ackBuffer_ = std::min<uint32_t>(bytes, TY_UVCP_MAX_MSG_LEN);
+		limits_ = {};
+	}
+
+	// Limits from the SBRM maximum command and acknowledge lengths, read on
+	// first use. Devices without a usable SBRM get what fits the ACK and
+	// command buffers.
+	TransferLimits transferLimits() {
+		std::lock_guard<std::mutex> lock(limitsMutex_);
+		if (limits_.maxRead != 0) {
+			return limits_;
+		}
+		uint32_t maxCommand = TY_UVCP_MAX_MSG_LEN;
+		uint32_t maxAck = ackBuffer_;
+		uint64_t sbrm = 0;
+		uint32_t lengths[2] = {};
+		static_assert(kSbrmMaxAckLengthOffset == kSbrmMaxCommandLengthOffset + 4, "adjacent SBRM limits");
+		if (readMemory(kAbrmSbrmAddressAddr, reinterpret_cast<uint8_t*>(&sbrm), sizeof(sbrm)) && sbrm != 0 &&
+			sbrm < 0xFFFFFFFFull - kSbrmMaxAckLengthOffset &&
+			readMemory(static_cast<uint32_t>(sbrm) + kSbrmMaxCommandLengthOffset,
+					   reinterpret_cast<uint8_t*>(lengths), sizeof(lengths))) {
+			if (lengths[0] >= kMinTransferLength) {
+				maxCommand = std::min(maxCommand, lengths[0]);
+			}
+			if (lengths[1] >= kMinTransferLength) {
+				maxAck = std::min(maxAck, lengths[1]);
+			}
+		}
+		// Whole packets where one fits, else whole registers so register
+		// blocks never split a word.
+		auto whole = [](uint32_t bytes, uint32_t packet) {
+			bytes = std::min<uint32_t>(bytes, 0xFFFF);
+			return static_cast<uint16_t>(packet >= 4 && bytes >= packet ? bytes / packet * packet : bytes & ~3u);
+		};
+		limits_.maxRead = whole(maxAck - sizeof(UVCPHeader), readPacket_);
+		limits_.maxWrite = whole(maxCommand - sizeof(UVCPHeader) - sizeof(uint64_t), writePacket_);
+		return limits_;
+	}
+
+	// Queue a read of any length as the fewest transactions the device takes.
+	// `out` holds the data once `group` is done.
+	bool submitReadBlock(uint32_t address, uint8_t* out, size_t bytes, UVCPWaitGroup& group) {
+		const size_t chunk = bytes <= kMinTransferLength ? bytes : transferLimits().maxRead;
+		for (size_t done = 0; done < bytes; done += chunk) {
+			const uint16_t n = static_cast<uint16_t>(std::min(chunk, bytes - done));
+			if (!submitReadMemory(address + static_cast<uint32_t>(done), out + done, n, group)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The write counterpart; `data` may be reused as soon as this returns.
+	bool submitWriteBlock(uint32_t address, const uint8_t* data, size_t bytes, UVCPWaitGroup& group) {
+		const size_t chunk = bytes <= kMinTransferLength ? bytes : transferLimits().maxWrite;
+		for (size_t done = 0; done < bytes; done += chunk) {
+			const uint16_t n = static_cast<uint16_t>(std::min(chunk, bytes - done));
+			if (!submitWriteMemory(address + static_cast<uint32_t>(done), data + done, n, group)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool readRegisters(uint32_t address, uint16_t registerCount, std::vector<uint32_t>& outValues) {
+		outValues.resize(registerCount);
+		UVCPWaitGroup group;
+		const bool queued = submitReadBlock(address, reinterpret_cast<uint8_t*>(outValues.data()),
+											registerCount * sizeof(uint32_t), group);
+		return group.wait() && queued;
+	}
+
+	bool readMemory(uint32_t address, uint16_t bytes, std::vector<uint8_t>& outBytes) {
+		outBytes.resize(bytes);
+		return readMemory(address, outBytes.data(), bytes);
+	}
+
+	// Read into a caller-provided buffer of at least `bytes` bytes; no heap
+	// allocation on this path.
+	bool readMemory(uint32_t address, uint8_t* out, uint16_t bytes) {
+		if (bytes == 0) {
+			return true;
+		}
+		UVCPWaitGroup group;
+		submitReadMemory(address, out, bytes, group);
+		return group.wait();
+	}
+
+	bool writeRegister(uint32_t address, uint32_t value) {
+		return writeMemory(address, reinterpret_cast<const uint8_t*>(&value), sizeof(value));
+	}
+
+	bool writeRegisters(uint32_t startAddress, const std::vector<uint32_t>& values) {
+		UVCPWaitGroup group;
+		const bool queued = submitWriteBlock(startAddress, reinterpret_cast<const uint8_t*>(values.data()),
+											 values.size() * sizeof(uint32_t), group);
+		return group.wait() && queued;
+	}
+
+	bool writeMemory(uint32_t startAddress, const uint8_t* data, uint16_t bytes) {
+		if (bytes == 0) {
+			return true;
+		}
+		UVCPWaitGroup group;
+		submitWriteMemory(startAddress, data, bytes, group);
+		return group.wait();
+	}
+
+	// Run a short setup sequence and wait for all of it; false if any
+	// transaction failed.
+	bool runBatch(std::initializer_list<UVCPTransaction> batch) {
+		UVCPWaitGroup group;
+		const bool queued = submitBatch(batch.begin(), batch.size(), group);
+		return group.wait() && queued;
+	}
+
+	std::future<UVCPCompletion> readMemoryAsync(uint32_t address, uint16_t bytes) {
+		auto promise = std::make_shared<std::promise<UVCPCompletion>>();
+		std::future<UVCPCompletion> future = promise->get_future();
+		if (!submitReadMemory(address, bytes, [promise](UVCPCompletion& c) {
+				if (c.ok) {
+					c.data.assign(c.payload, c.payload + c.payloadSize);
+				}
+				c.payload = nullptr;
+				promise->set_value(std::move(c));
+			})) {
+			promise->set_value(UVCPCompletion{});
+		}
+		return future;
+	}
+
+	std::future<UVCPCompletion> writeMemoryAsync(uint32_t startAddress, const uint8_t* data,
+												 uint16_t bytes) {
+		auto promise = std::make_shared<std::promise<UVCPCompletion>>();
+		std::future<UVCPCompletion> future = promise->get_future();
+		if (!submitWriteMemory(startAddress, data, bytes,
+							   [promise](UVCPCompletion& c) { promise->set_value(std::move(c)); })) {
+			promise->set_value(UVCPCompletion{});
+		}
+		return future;
+	}
+
+  private:
+	std::mutex limitsMutex_;
+	TransferLimits limits_;
+	uint32_t readPacket_ = 0;
+	uint32_t writePacket_ = 0;
+	uint32_t ackBuffer_ = TY_UVCP_MAX_MSG_LEN;
+};
+
+// --trace files: kTraceMagic and kTraceVersion, then one TraceRecordHeader
+// plus the raw transfer bytes per UVCP command, ACK or event.
+constexpr char kTraceMagic[8] = {'U', '3', 'V', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t kTraceVersion = 2; // 2 added kTraceDropped
+
+enum TraceDirection : uint8_t {
+	kTraceOut     = 0, // bulk OUT: command sent by the host
+	kTraceIn      = 1, // bulk IN on the control interface: ACK or event
+	kTraceEvent   = 2, // event interface
+	kTraceDropped = 3, // payload: uint64_t count of records the writer fell behind on
+};
+
+#pragma pack(push, 1)
+struct TraceRecordHeader {
+	uint64_t timestampNs = 0; // since the trace was opened
+	uint32_t length = 0;
+	uint8_t direction = kTraceOut;
+};
+#pragma pack(pop)
+
+// Buffers trace records in memory and writes them from its own thread, so
+// recording costs a memcpy on the USB path. If the writer falls
+// kMaxPendingBytes behind, records are counted in a kTraceDropped record
+// instead of buffered.
+class UVCPTraceWriter {
+  public:
+	~UVCPTraceWriter() { close(); }
+
+	bool open(const std::string& path) {
+		file_.open(path, std::ios::binary | std::ios::trunc);
+		if (!file_) {
+			return false;
+		}
+		file_.write(kTraceMagic, sizeof(kTraceMagic));
+		file_.write(reinterpret_cast<const char*>(&kTraceVersion), sizeof(kTraceVersion));
+		start_ = std::chrono::steady_clock::now();
+		thread_ = std::thread([this] { run(); });
+		return true;
+	}
+
+	void record(TraceDirection direction, const uint8_t* data, size_t length) {
+		TraceRecordHeader header;
+		header.timestampNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start_).count());
+		header.length = static_cast<uint32_t>(length);
+		header.direction = direction;
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (dropped_ != 0 &&
+			pending_.size() + 2 * sizeof(header) + sizeof(dropped_) + length <= kMaxPendingBytes) {
+			appendDropped(header.timestampNs);
+		}
+		if (pending_.size() + sizeof(header) + length > kMaxPendingBytes) {
+			++dropped_;
+		} else {
+			append(header, data);
+		}
+		if (pending_.size() >= kFlushBytes) {
+			cv_.notify_one();
+		}
+	}
+
+	// Flush everything recorded so far and stop the writer thread. False if
+	// the file could not be written.
+	bool close() {
+		if (!thread_.joinable()) {
+			return true;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		cv_.notify_one();
+		thread_.join();
+		file_.close();
+		return !failed_ && !file_.fail();
+	}
+
+  private:
+	static constexpr size_t kFlushBytes = 1u << 20;
+	static constexpr size_t kMaxPendingBytes = 64u << 20;
+
+	// Caller holds mutex_.
+	void append(const TraceRecordHeader& header, const uint8_t* data) {
+		const size_t at = pending_.size();
+		pending_.resize(at + sizeof(header) + header.length);
+		std::memcpy(pending_.data() + at, &header, sizeof(header));
+		std::memcpy(pending_.data() + at + sizeof(header), data, header.length);
+	}
+
+	// Caller holds mutex_.
+	void appendDropped(uint64_t timestampNs) {
+		TraceRecordHeader header;
+		header.timestampNs = timestampNs;
+		header.length = sizeof(dropped_);
+		header.direction = kTraceDropped;
+		append(header, reinterpret_cast<const uint8_t*>(&dropped_));
+		dropped_ = 0;
+	}
+
+	void run() {
+		std::vector<uint8_t> batch;
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			cv_.wait_for(lock, std::chrono::milliseconds(100),
+						 [this] { return stop_ || pending_.size() >= kFlushBytes; });
+			batch.swap(pending_);
+			const bool stop = stop_;
+			lock.unlock();
+			if (!batch.empty()) {
+				file_.write(reinterpret_cast<const char*>(batch.data()), static_cast<std::streamsize>(batch.size()));
+				failed_ = failed_ || !file_;
+				batch.clear();
+			}
+			lock.lock();
+			if (stop && dropped_ != 0) {
+				appendDropped(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start_).count()));
+			}
+			if (stop && pending_.empty()) {
+				return;
+			}
+		}
+	}
+
+	std::ofstream file_;
+	std::chrono::steady_clock::time_point start_;
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::vector<uint8_t> pending_;
+	uint64_t dropped_ = 0;
+	bool stop_ = false;
+	bool failed_ = false; // writer thread until joined
+};
+
+// --log files: kSessionLogMagic and kSessionLogVersion, then one
+// SessionLogRecordHeader plus its payload per record. Sessions append to the
+// file, each starting with a kLogSession record.
+constexpr char kSessionLogMagic[8] = {'U', '3', 'V', 'D', 'B', 'L', 'O', 'G'};
+constexpr uint32_t kSessionLogVersion = 1;
+
+enum SessionLogKind : uint8_t {
+	kLogInput   = 0, // bytes written to kTerminalDataAddr
+	kLogOutput  = 1, // bytes read from kTerminalDataAddr
+	kLogSession = 2, // a session started; payload is the device serial
+	kLogDropped = 3, // payload: uint64_t count of bytes the writer fell behind on
+};
+
+#pragma pack(push, 1)
+struct SessionLogRecordHeader {
+	uint64_t timeNs = 0; // system clock, since the Unix epoch
+	uint32_t length = 0;
+	uint8_t kind = kLogInput;
+};
+#pragma pack(pop)
+
+// Writes --log records from its own thread. record() only copies into a
+// lock-free ring, so logging never holds up keystroke echo or the output
+// drain; if the writer falls that far behind, the bytes are counted in a
+// kLogDropped record instead of waited for. record() must only be called
+// by one thread at a time, as TerminalClient does its terminal I/O.
+class SessionLogWriter {
+  public:
+	~SessionLogWriter() { close(); }
+
+	bool open(const std::string& path, std::ostream& err) {
+		std::error_code ec;
+		const bool fresh = !std::filesystem::exists(path, ec) || std::filesystem::file_size(path, ec) == 0;
+		if (!fresh) {
+			std::ifstream existing(path, std::ios::binary);
+			char magic[sizeof(kSessionLogMagic)] = {};
+			existing.read(magic, sizeof(magic));
+			if (!existing || std::memcmp(magic, kSessionLogMagic, sizeof(magic)) != 0) {
+				err << "Cannot append to " << path << ": not a u3vdb session log" << std::endl;
+				return false;
+			}
+		}
+		file_.open(path, std::ios::binary | std::ios::app);
+		if (!file_) {
+			err << "Cannot open log file " << path << std::endl;
+			return false;
+		}
+		if (fresh) {
+			file_.write(kSessionLogMagic, sizeof(kSessionLogMagic));
+			file_.write(reinterpret_cast<const char*>(&kSessionLogVersion), sizeof(kSessionLogVersion));
+		}
+		stop_ = false;
+		thread_ = std::thread([this] { run(); });
+		return true;
+	}
+
+	void record(SessionLogKind kind, const uint8_t* data, size_t length) {
+		if (!thread_.joinable()) {
+			return;
+		}
+		const uint64_t timeNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count());
+		if (dropped_ != 0 && ring_.freeSpace() >= 2 * sizeof(SessionLogRecordHeader) + sizeof(dropped_) + length) {
+			put(kLogDropped, timeNs, reinterpret_cast<const uint8_t*>(&dropped_), sizeof(dropped_));
+			dropped_ = 0;
+		}
+		if (ring_.freeSpace() < sizeof(SessionLogRecordHeader) + length) {
+			dropped_ += length;
+			return;
+		}
+		put(kind, timeNs, data, length);
+	}
+
+	// Write out everything recorded and stop the writer thread. False if the
+	// file could not be written.
+	bool close() {
+		if (!thread_.joinable()) {
+			return true;
+		}
+		stop_ = true;
+		thread_.join();
+		file_.close();
+		return !failed_;
+	}
+
+  private:
+	// Largest single write to the file.
+	static constexpr size_t kWriteBytes = 1u << 20;
+
+	void put(SessionLogKind kind, uint64_t timeNs, const uint8_t* data, size_t length) {
+		SessionLogRecordHeader header;
+		header.timeNs = timeNs;
+		header.length = static_cast<uint32_t>(length);
+		header.kind = kind;
+		ring_.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+		ring_.write(data, length);
+	}
+
+	// Poll the ring rather than be woken, so producers never take a lock.
+	void run() {
+		std::vector<uint8_t> batch(kWriteBytes);
+		while (true) {
+			const bool stop = stop_;
+			const size_t n = ring_.read(batch.data(), batch.size());
+			if (n > 0) {
+				file_.write(reinterpret_cast<const char*>(batch.data()), static_cast<std::streamsize>(n));
+				if (n == batch.size()) {
+					continue;
+				}
+			}
+			// Caught up: get the data to disk in case the session dies.
+			file_.flush();
+			failed_ = failed_ || !file_;
+			if (stop) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	SpscByteRing ring_{kSessionLogRing};
+	uint64_t dropped_ = 0; // producer side
+	std::ofstream file_;
+	std::thread thread_;
+	std::atomic<bool> stop_{false};
+	bool failed_ = false;  // writer thread until joined
+};
+
+// Per-user cache directory: $XDG_CACHE_HOME/u3vdb or ~/.cache/u3vdb, on
+// Windows %LOCALAPPDATA%\u3vdb. Empty if none of them is set.
+std::filesystem::path cacheDirectory() {
+#ifdef _WIN32
+	const char* base = std::getenv("LOCALAPPDATA");
+	return base && *base ? std::filesystem::path(base) / "u3vdb" : std::filesystem::path();
+#else
+	if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+		return std::filesystem::path(xdg) / "u3vdb";
+	}
+	const char* home = std::getenv("HOME");
+	return home && *home ? std::filesystem::path(home) / ".cache" / "u3vdb" : std::filesystem::path();
+#endif
+}
+
+// Exclusive advisory lock on `path`, created if missing, held while in scope:
+// threads of this process and other u3vdb processes updating the same cache
+// file take turns. Without a lock file the update goes ahead unlocked.
+class CacheFileLock {
+  public:
+	explicit CacheFileLock(const std::filesystem::path& path) : guard_(threadMutex()) {
+#ifdef _WIN32
+		handle_ = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+							  OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		OVERLAPPED whole{};
+		if (handle_ != INVALID_HANDLE_VALUE &&
+			!LockFileEx(handle_, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &whole)) {
+			CloseHandle(handle_);
+			handle_ = INVALID_HANDLE_VALUE;
+		}
+#else
+		fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fd_ >= 0) {
+			while (::flock(fd_, LOCK_EX) != 0 && errno == EINTR) {
+			}
+		}
+#endif
+	}
+
+	~CacheFileLock() {
+#ifdef _WIN32
+		if (handle_ != INVALID_HANDLE_VALUE) {
+			OVERLAPPED whole{};
+			UnlockFileEx(handle_, 0, MAXDWORD, MAXDWORD, &whole);
+			CloseHandle(handle_);
+		}
+#else
+		if (fd_ >= 0) {
+			::close(fd_); // releases the flock
+		}
+#endif
+	}
+
+	CacheFileLock(const CacheFileLock&) = delete;
+	CacheFileLock& operator=(const CacheFileLock&) = delete;
+
+  private:
+	static std::mutex& threadMutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	std::lock_guard<std::mutex> guard_;
+#ifdef _WIN32
+	HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+	int fd_ = -1;
+#endif
+};
+
+// A file name suffix no other thread or process uses at the same time.
+std::string uniqueTempSuffix() {
+	static std::atomic<uint64_t> counter{0};
+#ifdef _WIN32
+	const unsigned long pid = GetCurrentProcessId();
+#else
+	const long pid = static_cast<long>(::getpid());
+#endif
+	return ".tmp" + std::to_string(pid) + "-" + std::to_string(counter.fetch_add(1));
+}
+
+// An in-process device that U3VDevice drives in place of the USB endpoints.
+class UVCPPacketTarget {
+  public:
+	virtual ~UVCPPacketTarget() = default;
+	// Execute the commands of one bulk OUT transfer. Their ACKs go back to
+	// back into `acks`, events into `events`, all arriving at `due`. False
+	// fails the transfer like a USB error would.
+	virtual bool transfer(const uint8_t* data, size_t length, std::vector<uint8_t>& acks,
+						  std::vector<std::vector<uint8_t>>& events, std::chrono::steady_clock::time_point& due) = 0;
+};
+
+class U3VDevice : public UVCPTransport {
+  public:
+	U3VDevice() = default;
+	~U3VDevice() { shutdown(); }
+
+	const UVCPStats& stats() const override { return stats_; }
+
+	// Record every UVCP transfer to `path`; call before claimInterface.
+	bool startTrace(const std::string& path) {
+		auto trace = std::make_unique<UVCPTraceWriter>();
+		if (!trace->open(path)) {
+			*err_ << "Unable to open trace file '" << path << "'" << std::endl;
+			return false;
+		}
+		trace_ = std::move(trace);
+		return true;
+	}
+
+	// Serve ACKs and events from a --trace recording instead of a device.
+	// Each command is matched to the next identical recorded command (ids
+	// aside) and answered with its recorded responses and latency.
+	bool openReplay(const std::string& path) {
+		if (ctx_ || replay_) {
+			*err_ << "Context already initialized" << std::endl;
+			return false;
+		}
+		std::ifstream in(path, std::ios::binary);
+		char magic[sizeof(kTraceMagic)] = {};
+		uint32_t version = 0;
+		in.read(magic, sizeof(magic));
+		in.read(reinterpret_cast<char*>(&version), sizeof(version));
+		if (!in || std::memcmp(magic, kTraceMagic, sizeof(magic)) != 0 || version == 0 || version > kTraceVersion) {
+			*err_ << "'" << path << "' is not a u3vdb trace" << std::endl;
+			return false;
+		}
+		std::map<uint16_t, size_t> commandById;
+		TraceRecordHeader header;
+		while (in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+			std::vector<uint8_t> bytes(header.length);
+			if (!in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()))) {
+				break;
+			}
+			if (header.direction == kTraceDropped) {
+				uint64_t count = 0;
+				std::memcpy(&count, bytes.data(), std::min(bytes.size(), sizeof(count)));
+				*err_ << "Trace '" << path << "' lost " << count
+					  << " records while recording; the replay may diverge there" << std::endl;
+				continue;
+			}
+			if (bytes.size() < sizeof(UVCPHeader)) {
+				break;
+			}
+			const auto at = std::chrono::nanoseconds(header.timestampNs);
+			auto* hdr = reinterpret_cast<UVCPHeader*>(bytes.data());
+			if (header.direction == kTraceOut) {
+				if (hdr->command == UVCPConstants::COMMAND_EVENT_ACK) {
+					continue; // produced by the host, nothing to answer
+				}
+				commandById[hdr->id] = replayCommands_.size();
+				hdr->id = 0;
+				replayCommands_.push_back(ReplayCommand{std::move(bytes), at, {}});
+				continue;
+			}
+			if (replayCommands_.empty()) {
+				continue;
+			}
+			// ACKs belong to the command with their id; events to the latest command.
+			size_t owner = replayCommands_.size() - 1;
+			if (header.direction == kTraceIn && hdr->command != UVCPConstants::COMMAND_EVENT_CMD) {
+				auto it = commandById.find(hdr->id);
+				if (it == commandById.end()) {
+					continue;
+				}
+				owner = it->second;
+			}
+			ReplayCommand& command = replayCommands_[owner];
+			command.responses.push_back(
+				ReplayResponse{at - command.at, std::move(bytes), header.direction == kTraceEvent});
+		}
+		if (replayCommands_.empty()) {
+			*err_ << "Trace '" << path << "' contains no UVCP commands" << std::endl;
+			return false;
+		}
+		replay_ = true;
+		*out_ << "Replaying " << replayCommands_.size() << " UVCP commands from '" << path << "'"
+			  << std::endl;
+		return true;
+	}
+
+	// Drive an in-process target (--mock) instead of a device. Its ACKs and
+	// events go through the same delivery queue as a replay's.
+	bool openEmulated(UVCPPacketTarget& target) {
+		if (ctx_ || replay_ || target_) {
+			*err_ << "Context already initialized" << std::endl;
+			return false;
+		}
+		target_ = &target;
+		return true;
+	}
+
+	// Redirect status and diagnostics, e.g. to a per-device PrefixedLineBuf.
+	void setOutput(std::ostream& out, std::ostream& err) {
+		out_ = &out;
+		err_ = &err;
+	}
+
+	// Serial numbers of every attached device with the given VID/PID.
+	// Serial and port path of every matching device that has a serial, in one
+	// pass; the ports also go to the port cache. Fan-out opens each device by
+	// its port afterwards, so no worker opens another worker's camera (WinUSB
+	// opens are exclusive).
+	struct DeviceEntry {
+		std::string serial;
+		std::string port;
+	};
+	static bool listDevices(uint16_t vendorId, uint16_t productId, std::vector<DeviceEntry>& devices) {
+		devices.clear();
+		libusb_context* ctx = nullptr;
+		if (int err = libusb_init(&ctx); err != LIBUSB_SUCCESS) {
+			std::cerr << "libusb_init failed: " << libusb_error_name(err) << std::endl;
+			return false;
+		}
+		libusb_device** list = nullptr;
+		ssize_t count = libusb_get_device_list(ctx, &list);
+		if (count < 0 || !list) {
+			std::cerr << "libusb_get_device_list failed" << std::endl;
+			libusb_exit(ctx);
+			return false;
+		}
+		for (ssize_t i = 0; i < count; ++i) {
+			libusb_device_descriptor desc{};
+			if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS ||
+				desc.idVendor != vendorId || desc.idProduct != productId || desc.iSerialNumber == 0) {
+				continue;
+			}
+			libusb_device_handle* handle = nullptr;
+			if (libusb_open(list[i], &handle) != LIBUSB_SUCCESS || !handle) {
+				continue;
+			}
+			unsigned char buffer[256] = {0};
+			int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, buffer, sizeof(buffer));
+			if (len > 0) {
+				devices.push_back({std::string(reinterpret_cast<char*>(buffer), len), portPath(list[i])});
+			}
+			libusb_close(handle);
+		}
+		libusb_free_device_list(list, 1);
+		libusb_exit(ctx);
+		for (const DeviceEntry& device : devices) {
+			rememberPortPath(vendorId, productId, device.serial, device.port);
+		}
+		return true;
+	}
+
+	// Suppress the descriptor report and other progress chatter from open/claim.
+	void setQuiet(bool quiet) { quiet_ = quiet; }
+
+	// Serial number and port path of the opened device; the serial is empty
+	// when the device has none or was opened by --path alone.
+	const std::string& serialNumber() const { return serial_; }
+	std::string port() const { return handle_ ? portPath(libusb_get_device(handle_)) : std::string(); }
+
+	// The device went away (unplugged or rebooting); every request fails from
+	// then on and the handle is useless.
+	bool disconnected() const { return disconnected_; }
+
+	// Wait until a device with these ids is attached, at `port` if given.
+	// Hotplug arrivals wake the wait where libusb supports them; elsewhere
+	// (e.g. Windows) the device list is polled every kReconnectRetry.
+	// False once `deadline` passes without one.
+	static bool waitForDevice(uint16_t vendorId, uint16_t productId, const std::string& port,
+							  std::chrono::steady_clock::time_point deadline) {
+		libusb_context* ctx = nullptr;
+		if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+			return false;
+		}
+		libusb_hotplug_callback_handle hotplug{};
+		const bool watching =
+			libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+			libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+											 vendorId, productId, LIBUSB_HOTPLUG_MATCH_ANY,
+											 &U3VDevice::onHotplugArrival, nullptr, &hotplug) == LIBUSB_SUCCESS;
+		bool present = false;
+		while (true) {
+			libusb_device** list = nullptr;
+			const ssize_t count = libusb_get_device_list(ctx, &list);
+			for (ssize_t i = 0; i < count && !present; ++i) {
+				libusb_device_descriptor desc{};
+				present = libusb_get_device_descriptor(list[i], &desc) == LIBUSB_SUCCESS &&
+						  desc.idVendor == vendorId && desc.idProduct == productId &&
+						  (port.empty() || portPath(list[i]) == port);
+			}
+			if (list) {
+				libusb_free_device_list(list, 1);
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (present || now >= deadline) {
+				break;
+			}
+			const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::min<std::chrono::steady_clock::duration>(deadline - now, kReconnectRetry));
+			if (watching) {
+				// Returns early when an arrival (or anything else) is handled.
+				timeval tv{static_cast<long>(wait.count() / 1000000), static_cast<long>(wait.count() % 1000000)};
+				libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+			} else {
+				std::this_thread::sleep_for(wait);
+			}
+		}
+		if (watching) {
+			libusb_hotplug_deregister_callback(ctx, hotplug);
+		}
+		libusb_exit(ctx);
+		return present;
+	}
+
+	// "bus-port.port...", as Linux names it in sysfs (e.g. "2-1.4").
+	static std::string portPath(libusb_device* dev) {
+		uint8_t ports[8];
+		const int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+		std::string path = std::to_string(libusb_get_bus_number(dev));
+		for (int i = 0; i < depth; ++i) {
+			path += (i == 0 ? '-' : '.') + std::to_string(ports[i]);
+		}
+		return path;
+	}
+
+	// `portFilter` ("bus-port.port", see portPath) opens only the device on that
+	// port; otherwise a serial filter first tries the port it was last seen on.
+	bool open(uint16_t vendorId, uint16_t productId, const std::string& serialFilter = {},
+			  const std::string& portFilter = {}) {
+		if (ctx_) {
+			*err_ << "Context already initialized" << std::endl;
+			return false;
+		}
+
+		if (int err = libusb_init(&ctx_); err != LIBUSB_SUCCESS) {
+			*err_ << "libusb_init failed: " << libusb_error_name(err) << std::endl;
+			ctx_ = nullptr;
+			return false;
+		}
+
+		libusb_device** list = nullptr;
+		ssize_t count = libusb_get_device_list(ctx_, &list);
+		if (count < 0 || !list) {
+			*err_ << "libusb_get_device_list failed" << std::endl;
+			libusb_exit(ctx_);
+			ctx_ = nullptr;
+			return false;
+		}
+
+		struct DeviceCandidate {
+			libusb_device_handle* handle = nullptr;
+			std::string serial;
+		};
+		bool found = false;
+		std::vector<DeviceCandidate> candidates;
+		// A port path (from --path or the serial cache) opens only that device.
+		std::string targetPath = portFilter;
+		bool fromCache = false;
+		if (targetPath.empty() && !serialFilter.empty()) {
+			targetPath = cachedPortPath(vendorId, productId, serialFilter);
+			fromCache = !targetPath.empty();
+		}
+		auto scan = [&](const std::string& path) {
+			for (ssize_t i = 0; i < count; ++i) {
+				libusb_device* dev = list[i];
+				libusb_device_descriptor desc{};
+				if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS) {
+					continue;
+				}
+				if (desc.idVendor != vendorId || desc.idProduct != productId) {
+					continue;
+				}
+				if (!path.empty() && portPath(dev) != path) {
+					continue;
+				}
+
+				libusb_device_handle* candidate = nullptr;
+				if (libusb_open(dev, &candidate) != LIBUSB_SUCCESS || !candidate) {
+					continue;
+				}
+
+				std::string serial;
+				if (desc.iSerialNumber != 0 && (path.empty() || !serialFilter.empty())) {
+					unsigned char buffer[256] = {0};
+					int len = libusb_get_string_descriptor_ascii(candidate, desc.iSerialNumber, buffer,
+														 sizeof(buffer));
+					if (len > 0) {
+						serial.assign(reinterpret_cast<char*>(buffer), len);
+					}
+				}
+
+				if (!serialFilter.empty()) {
+					if (!serial.empty() && serial == serialFilter) {
+						handle_ = candidate;
+						serial_ = serial;
+						found = true;
+						break;
+					}
+					libusb_close(candidate);
+					continue;
+				}
+
+				candidates.push_back(DeviceCandidate{candidate, serial});
+			}
+		};
+		scan(targetPath);
+		if (fromCache && !found) {
+			scan(std::string()); // the camera moved since it was cached
+		}
+		if (found && !serialFilter.empty() && portFilter.empty()) {
+			rememberPortPath(vendorId, productId, serialFilter, portPath(libusb_get_device(handle_)));
+		}
+
+		libusb_free_device_list(list, 1);
+		if (!serialFilter.empty()) {
+			if (!found) {
+				*err_ << "Unable to open device " << std::hex << vendorId << ':' << productId
+					  << " with serial '" << serialFilter << '\'' << std::dec;
+				if (!portFilter.empty()) {
+					*err_ << " at " << portFilter;
+				}
+				*err_ << std::endl;
+				libusb_exit(ctx_);
+				ctx_ = nullptr;
+				return false;
+			}
+		} else {
+			if (candidates.empty()) {
+				*err_ << "Unable to open device " << std::hex << vendorId << ':' << productId
+					  << std::dec;
+				if (!portFilter.empty()) {
+					*err_ << " at " << portFilter;
+				}
+				*err_ << std::endl;
+				libusb_exit(ctx_);
+				ctx_ = nullptr;
+				return false;
+			}
+			if (candidates.size() == 1) {
+				handle_ = candidates[0].handle;
+				serial_ = candidates[0].serial;
+				found = true;
+			} else {
+				*out_ << "Multiple USB3 Vision devices detected:" << std::endl;
+				for (size_t idx = 0; idx < candidates.size(); ++idx) {
+					libusb_device* dev = libusb_get_device(candidates[idx].handle);
+					uint8_t bus = libusb_get_bus_number(dev);
+					uint8_t addr = libusb_get_device_address(dev);
+					const std::string serial = candidates[idx].serial.empty()
+												? std::string("<no-serial>")
+												: candidates[idx].serial;
+					*out_ << "  [" << idx << "] bus " << static_cast<int>(bus)
 						  << " addr " << static_cast<int>(addr)
 						  << ", serial: " << serial << std::endl;
 				}
-				std::cout << "Select device index: " << std::flush;
-				std::string line;
-				bool validChoice = false;
-				while (std::getline(std::cin, line)) {
-					if (line.empty()) {
-						std::cout << "Select device index: " << std::flush;
-						continue;
-					}
-					std::istringstream iss(line);
-					size_t idx = 0;
-					if (iss >> idx && idx < candidates.size()) {
-						handle_ = candidates[idx].handle;
-						validChoice = true;
-						break;
+				*out_ << "Select device index: " << std::flush;
+				std::string line;
+				bool validChoice = false;
+				while (std::getline(std::cin, line)) {
+					if (line.empty()) {
+						*out_ << "Select device index: " << std::flush;
+						continue;
+					}
+					std::istringstream iss(line);
+					size_t idx = 0;
+					if (iss >> idx && idx < candidates.size()) {
+						handle_ = candidates[idx].handle;
+						serial_ = candidates[idx].serial;
+						validChoice = true;
+						break;
+					}
+					*out_ << "Invalid selection. Enter a number between 0 and "
+						  << (candidates.size() - 1) << ": " << std::flush;
+				}
+				if (!validChoice) {
+					for (auto& c : candidates) {
+						libusb_close(c.handle);
+					}
+					*err_ << "Failed to select device" << std::endl;
+					libusb_exit(ctx_);
+					ctx_ = nullptr;
+					return false;
+				}
+			}
+			for (auto& c : candidates) {
+				if (c.handle != handle_) {
+					libusb_close(c.handle);
+				}
+			}
+			found = handle_ != nullptr;
+		}
+
+		if (!found) {
+			*err_ << "Unable to open device " << std::hex << vendorId << ':' << productId;
+			if (!serialFilter.empty()) {
+				*err_ << " with serial '" << serialFilter << '\'';
+			}
+			*err_ << std::dec << std::endl;
+			libusb_exit(ctx_);
+			ctx_ = nullptr;
+			return false;
+		}
+		// Opened by port alone: the serial was not read while scanning, but
+		// {serial} in --trace/--log paths wants it.
+		if (serial_.empty()) {
+			libusb_device_descriptor desc{};
+			unsigned char buffer[256] = {0};
+			if (libusb_get_device_descriptor(libusb_get_device(handle_), &desc) == LIBUSB_SUCCESS &&
+				desc.iSerialNumber != 0) {
+				const int len = libusb_get_string_descriptor_ascii(handle_, desc.iSerialNumber, buffer, sizeof(buffer));
+				if (len > 0) {
+					serial_.assign(reinterpret_cast<char*>(buffer), len);
+				}
+			}
+		}
+
+		if (quiet_) {
+			return true;
+		}
+		// Successfully opened; print detailed USB descriptor information.
+		libusb_device* dev = libusb_get_device(handle_);
+		libusb_device_descriptor desc{};
+		if (dev && libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS) {
+			auto printStringByIndex = [&](uint8_t index, const char* label) {
+				if (!index) return;
+				unsigned char strBuf[256] = {0};
+				int len = libusb_get_string_descriptor_ascii(handle_, index, strBuf, sizeof(strBuf));
+				if (len > 0) {
+					*out_ << "  " << std::setw(20) << std::left << label << ": "
+						  << reinterpret_cast<const char*>(strBuf) << '\n';
+				}
+			};
+
+			*out_ << "Opened USB3 Vision device " << std::hex
+				  << std::setw(4) << std::setfill('0') << desc.idVendor << ':'
+				  << std::setw(4) << std::setfill('0') << desc.idProduct
+				  << std::dec << std::setfill(' ') << std::endl;
+			unsigned char strBuf[256] = {0};
+			if (desc.iManufacturer &&
+				libusb_get_string_descriptor_ascii(handle_, desc.iManufacturer, strBuf, sizeof(strBuf)) > 0) {
+				*out_ << "  Manufacturer        : " << strBuf << '\n';
+			}
+			if (desc.iProduct &&
+				libusb_get_string_descriptor_ascii(handle_, desc.iProduct, strBuf, sizeof(strBuf)) > 0) {
+				*out_ << "  Product             : " << strBuf << '\n';
+			}
+			if (desc.iSerialNumber &&
+				libusb_get_string_descriptor_ascii(handle_, desc.iSerialNumber, strBuf, sizeof(strBuf)) > 0) {
+				*out_ << "  SerialNumber        : " << strBuf << '\n';
+			}
+
+			// Parse configuration to locate USB3 Vision Interface Info Descriptor (0x14,0x24,...)
+				if (dev) {
+				libusb_config_descriptor* cfg = nullptr;
+				if (libusb_get_active_config_descriptor(dev, &cfg) == LIBUSB_SUCCESS && cfg) {
+					for (int ifidx = 0; ifidx < cfg->bNumInterfaces; ++ifidx) {
+						const libusb_interface& intf = cfg->interface[ifidx];
+						for (int alt = 0; alt < intf.num_altsetting; ++alt) {
+							const libusb_interface_descriptor& idesc = intf.altsetting[alt];
+							const uint8_t* ptr = idesc.extra;
+							int remain = idesc.extra_length;
+							while (ptr && remain >= 2) {
+								uint8_t len  = ptr[0];
+								uint8_t type = ptr[1];
+								if (len < 2 || len > remain) break;
+								// USB3 Vision Device Info Descriptor (class-specific 0x24)
+								if (type == 0x24 && len == sizeof(usb3v_device_info_descriptor)) {
+									const auto* info = reinterpret_cast<const usb3v_device_info_descriptor*>(ptr);
+									uint32_t genCPVer = info->bGenCPVersion;
+									uint32_t u3vVer   = info->bU3VVersion;
+									*out_ << "  GenCP version       : 0x" << std::hex << genCPVer << std::dec << '\n';
+									*out_ << "  U3V version         : 0x" << std::hex << u3vVer << std::dec << '\n';
+									printStringByIndex(info->iDeviceGUID,      "U3V Device GUID");
+									printStringByIndex(info->iVendorName,      "U3V Vendor Name");
+									printStringByIndex(info->iModelName,       "U3V Model Name");
+									printStringByIndex(info->iFamilyName,      "U3V Family Name");
+									printStringByIndex(info->iDeviceVersion,   "U3V Device Version");
+									printStringByIndex(info->iManufacturerInf, "U3V ManufacturerInfo");
+									printStringByIndex(info->iSerialNumber,    "U3V SerialNumber");
+									printStringByIndex(info->iUserDefinedName, "U3V UserDefinedName");
+									*out_ << "  " << std::setw(20) << std::left << "U3V SpeedSupport" << ": 0x"
+										  << std::hex << static_cast<int>(info->bmSpeedSupport) << std::dec << '\n';
+								}
+								ptr    += len;
+								remain -= len;
+							}
+						}
+					}
+					libusb_free_config_descriptor(cfg);
+				}
+			}
+		} else {
+			*out_ << "Opened USB3 Vision device " << std::hex << vendorId << ':' << productId;
+			if (!serialFilter.empty()) {
+				*out_ << " (serial=" << serialFilter << ')';
+			}
+			*out_ << std::dec << std::endl;
+		}
+		return true;
+	}
+
+	bool claimInterface(uint8_t interfaceNumber, uint8_t epOut, uint8_t epIn) {
+		if (replay_ || target_) {
+			interfaceNumber_ = interfaceNumber;
+			claimed_ = true;
+			startReplay();
+			return true;
+		}
+		if (!handle_) {
+			*err_ << "Device handle is null" << std::endl;
+			return false;
+		}
+
+		interfaceNumber_ = interfaceNumber;
+		bulkOut_ = epOut;
+		bulkIn_ = epIn;
+
+		if (libusb_kernel_driver_active(handle_, interfaceNumber_) == 1) {
+			const int detach = libusb_detach_kernel_driver(handle_, interfaceNumber_);
+			if (detach != LIBUSB_SUCCESS) {
+				*err_ << "Failed to detach kernel driver: " << libusb_error_name(detach)
+						  << std::endl;
+				return false;
+			}
+		}
+
+		const int claim = libusb_claim_interface(handle_, interfaceNumber_);
+		if (claim != LIBUSB_SUCCESS) {
+			*err_ << "Failed to claim interface " << static_cast<int>(interfaceNumber_)
+					  << ": " << libusb_error_name(claim) << std::endl;
+			return false;
+		}
+
+		if (!quiet_) {
+			*out_ << "Claimed interface " << static_cast<int>(interfaceNumber_)
+				  << " (OUT=0x" << std::hex << static_cast<int>(bulkOut_)
+				  << ", IN=0x" << static_cast<int>(bulkIn_) << ")" << std::dec << std::endl;
+		}
+		// A previous run may have left an endpoint halted, which would otherwise
+		// take a replug to recover from.
+		libusb_clear_halt(handle_, bulkOut_);
+		libusb_clear_halt(handle_, bulkIn_);
+		configureInPipe();
+		claimed_ = true;
+		if (!startPipeline()) {
+			libusb_release_interface(handle_, interfaceNumber_);
+			claimed_ = false;
+			return false;
+		}
+		profileLink();
+		return true;
+	}
+
+	// WinUSB splits and buffers reads by default, which leaves the bus idle
+	// between requests. RAW_IO passes them straight to the host controller as
+	// long as each is whole packets within the pipe's MAXIMUM_TRANSFER_SIZE.
+	void configureInPipe() {
+		inTransferLength_ = TY_UVCP_MAX_MSG_LEN;
+		inTransferCount_ = kInTransferCount;
+		setAckBufferLength(inTransferLength_);
+#if defined(_WIN32) && defined(U3VDB_WINUSB_RAW_IO)
+		const uint32_t packet = link_.maxPacketIn;
+		unsigned int maxTransfer = 0;
+		if (packet == 0 ||
+			libusb_set_option(ctx_, LIBUSB_OPTION_WINUSB_RAW_IO, handle_, static_cast<unsigned int>(bulkIn_), 1,
+							  &maxTransfer) != LIBUSB_SUCCESS) {
+			return;
+		}
+		const uint32_t length = std::min<uint32_t>(TY_UVCP_MAX_MSG_LEN, maxTransfer) / packet * packet;
+		if (length < kMinTransferLength + sizeof(UVCPHeader)) {
+			libusb_set_option(ctx_, LIBUSB_OPTION_WINUSB_RAW_IO, handle_, static_cast<unsigned int>(bulkIn_), 0,
+							  nullptr);
+			return;
+		}
+		inTransferLength_ = length;
+		inTransferCount_ = kRawIoInTransferCount;
+		setAckBufferLength(length);
+		if (!quiet_) {
+			*out_ << "WinUSB RAW_IO on bulk IN: " << inTransferCount_ << " reads of " << length << " bytes posted"
+				  << std::endl;
+		}
+#endif
+	}
+
+	// Size UVCP payloads for this link: whole bulk packets, within the
+	// device's SBRM limits. Endpoints that report no packet size (or a
+	// USB 2.0 port without companions) fall back to 512-byte packets.
+	void profileLink() {
+		link_.speed = libusb_get_device_speed(libusb_get_device(handle_));
+		const uint32_t fallback = link_.speed >= LIBUSB_SPEED_HIGH || link_.speed == LIBUSB_SPEED_UNKNOWN ? 512 : 64;
+		setPacketSizes(link_.maxPacketIn ? link_.maxPacketIn : fallback,
+					   link_.maxPacketOut ? link_.maxPacketOut : fallback);
+		const TransferLimits limits = transferLimits();
+		if (!quiet_) {
+			*out_ << "Link: " << speedName(link_.speed) << ", bulk IN " << link_.maxPacketIn << " B x "
+				  << static_cast<int>(link_.burstIn) << ", OUT " << link_.maxPacketOut << " B x "
+				  << static_cast<int>(link_.burstOut) << ", UVCP payloads up to " << limits.maxRead << '/'
+				  << limits.maxWrite << " bytes" << std::endl;
+		}
+		// bmSpeedSupport bit n stands for libusb speed n + 1.
+		if (link_.speed > LIBUSB_SPEED_UNKNOWN && (link_.speedSupport >> link_.speed) != 0) {
+			*err_ << "Warning: link runs at " << speedName(link_.speed)
+				  << " although the device supports faster; check the cable and port" << std::endl;
+		}
+	}
+
+	static const char* speedName(int speed) {
+		switch (speed) {
+		case LIBUSB_SPEED_LOW: return "Low Speed";
+		case LIBUSB_SPEED_FULL: return "Full Speed";
+		case LIBUSB_SPEED_HIGH: return "High Speed";
+		case LIBUSB_SPEED_SUPER: return "SuperSpeed";
+		case LIBUSB_SPEED_SUPER_PLUS: return "SuperSpeed+";
+		default: return "unknown speed";
+		}
+	}
+
+	// Maximum number of UVCP commands in flight at once (>= 1).
+	void setPipelineDepth(size_t depth) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		pipelineDepth_ = std::clamp<size_t>(depth, 1, kMaxPipelineDepth);
+		cv_.notify_all();
+	}
+
+	// Discover the USB3 Vision (U3V) control interface and bulk IN/OUT endpoints.
+	// Matches interfaces with Class=0xEF (Misc), SubClass=0x05 (USB3 Vision), Protocol=0.
+	bool findU3VControlInterface(uint8_t& outInterface, uint8_t& outEpOut, uint8_t& outEpIn) {
+		if (replay_ || target_) {
+			outInterface = 0;
+			outEpOut = 0x01;
+			outEpIn = 0x81;
+			return true;
+		}
+		if (!handle_) {
+			*err_ << "Device handle is null" << std::endl;
+			return false;
+		}
+
+		libusb_device* dev = libusb_get_device(handle_);
+		if (!dev) {
+			*err_ << "Failed to get libusb_device from handle" << std::endl;
+			return false;
+		}
+
+		libusb_config_descriptor* cfg = nullptr;
+		int rc = libusb_get_active_config_descriptor(dev, &cfg);
+		if (rc != LIBUSB_SUCCESS || !cfg) {
+			*err_ << "libusb_get_active_config_descriptor failed: "
+					  << libusb_error_name(rc) << std::endl;
+			return false;
+		}
+
+		bool found = false;
+		for (int i = 0; i < cfg->bNumInterfaces && !found; ++i) {
+			const libusb_interface& intf = cfg->interface[i];
+			for (int a = 0; a < intf.num_altsetting && !found; ++a) {
+				const libusb_interface_descriptor& idesc = intf.altsetting[a];
+				if (idesc.bInterfaceClass == 0xEF && // Miscellaneous Device
+					idesc.bInterfaceSubClass == 0x05 && // USB3 Vision
+					idesc.bInterfaceProtocol == 0x00) {
+					uint8_t epIn = 0, epOut = 0;
+					LinkProfile link;
+					for (int e = 0; e < idesc.bNumEndpoints; ++e) {
+						const libusb_endpoint_descriptor& ep = idesc.endpoint[e];
+						uint8_t type = ep.bmAttributes & 0x3; // transfer type mask
+						if (type == LIBUSB_TRANSFER_TYPE_BULK) {
+							// SuperSpeed endpoints carry a companion with the burst size.
+							uint8_t burst = 1;
+							libusb_ss_endpoint_companion_descriptor* companion = nullptr;
+							if (libusb_get_ss_endpoint_companion_descriptor(ctx_, &ep, &companion) ==
+									LIBUSB_SUCCESS && companion) {
+								burst = static_cast<uint8_t>(companion->bMaxBurst + 1);
+								libusb_free_ss_endpoint_companion_descriptor(companion);
+							}
+							if (ep.bEndpointAddress & 0x80) {
+								epIn = ep.bEndpointAddress;
+								link.maxPacketIn = ep.wMaxPacketSize & 0x7FF;
+								link.burstIn = burst;
+							} else {
+								epOut = ep.bEndpointAddress;
+								link.maxPacketOut = ep.wMaxPacketSize & 0x7FF;
+								link.burstOut = burst;
+							}
+						}
+					}
+					for (int pos = 0; idesc.extra && pos + 2 <= idesc.extra_length && idesc.extra[pos] >= 2;
+						 pos += idesc.extra[pos]) {
+						if (idesc.extra[pos + 1] == 0x24 && idesc.extra[pos] == sizeof(usb3v_device_info_descriptor) &&
+							pos + idesc.extra[pos] <= idesc.extra_length) {
+							link.speedSupport = reinterpret_cast<const usb3v_device_info_descriptor*>(
+								idesc.extra + pos)->bmSpeedSupport;
+						}
+					}
+					if (epIn != 0 && epOut != 0) {
+						outInterface = idesc.bInterfaceNumber;
+						outEpIn = epIn;
+						outEpOut = epOut;
+						link_ = link;
+						found = true;
+					}
+				}
+			}
+		}
+
+		libusb_free_config_descriptor(cfg);
+		if (!found) {
+			*err_ << "No USB3 Vision control interface with bulk IN/OUT found" << std::endl;
+		}
+		return found;
+	}
+
+	// Discover the optional U3V event interface (Protocol=1) and its bulk IN
+	// endpoint. Devices without one may still send events on the control channel.
+	bool findU3VEventInterface(uint8_t& outInterface, uint8_t& outEpIn) {
+		libusb_device* dev = handle_ ? libusb_get_device(handle_) : nullptr;
+		if (!dev) {
+			return false;
+		}
+		libusb_config_descriptor* cfg = nullptr;
+		if (libusb_get_active_config_descriptor(dev, &cfg) != LIBUSB_SUCCESS || !cfg) {
+			return false;
+		}
+		bool found = false;
+		for (int i = 0; i < cfg->bNumInterfaces && !found; ++i) {
+			const libusb_interface& intf = cfg->interface[i];
+			for (int a = 0; a < intf.num_altsetting && !found; ++a) {
+				const libusb_interface_descriptor& idesc = intf.altsetting[a];
+				if (idesc.bInterfaceClass != 0xEF || idesc.bInterfaceSubClass != 0x05 ||
+					idesc.bInterfaceProtocol != 0x01) {
+					continue;
+				}
+				for (int e = 0; e < idesc.bNumEndpoints; ++e) {
+					const libusb_endpoint_descriptor& ep = idesc.endpoint[e];
+					if ((ep.bmAttributes & 0x3) == LIBUSB_TRANSFER_TYPE_BULK &&
+						(ep.bEndpointAddress & 0x80)) {
+						outInterface = idesc.bInterfaceNumber;
+						outEpIn = ep.bEndpointAddress;
+						found = true;
+						break;
+					}
+				}
+			}
+		}
+		libusb_free_config_descriptor(cfg);
+		return found;
+	}
+
+	// Claim the event interface and keep a transfer posted on its endpoint.
+	bool claimEventInterface(uint8_t interfaceNumber, uint8_t epIn) {
+		if (!claimed_ || eventTransfer_) {
+			return false;
+		}
+		if (libusb_kernel_driver_active(handle_, interfaceNumber) == 1 &&
+			libusb_detach_kernel_driver(handle_, interfaceNumber) != LIBUSB_SUCCESS) {
+			return false;
+		}
+		const int claim = libusb_claim_interface(handle_, interfaceNumber);
+		if (claim != LIBUSB_SUCCESS) {
+			*err_ << "Failed to claim event interface " << static_cast<int>(interfaceNumber)
+					  << ": " << libusb_error_name(claim) << std::endl;
+			return false;
+		}
+		eventTransfer_ = libusb_alloc_transfer(0);
+		if (!eventTransfer_) {
+			libusb_release_interface(handle_, interfaceNumber);
+			return false;
+		}
+		eventBuffer_ = allocTransferBuffer();
+		libusb_fill_bulk_transfer(eventTransfer_, handle_, epIn, eventBuffer_.data,
+								  TY_UVCP_MAX_MSG_LEN, &U3VDevice::onEventTransfer, this, 0);
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (libusb_submit_transfer(eventTransfer_) != LIBUSB_SUCCESS) {
+			libusb_free_transfer(eventTransfer_);
+			eventTransfer_ = nullptr;
+			freeTransferBuffer(eventBuffer_);
+			libusb_release_interface(handle_, interfaceNumber);
+			return false;
+		}
+		eventInterface_ = interfaceNumber;
+		++activeIn_;
+		return true;
+	}
+
+	void setEventHandler(UVCPEventHandler handler) override {
+		std::lock_guard<std::mutex> lock(eventMutex_);
+		eventHandler_ = std::move(handler);
+	}
+
+	bool submitReadMemory(uint32_t address, uint16_t bytes, UVCPCallback callback) override {
+		RequestSink sink;
+		sink.callback = std::move(callback);
+		return submitRead(address, bytes, std::move(sink));
+	}
+
+	bool submitReadMemory(uint32_t address, uint8_t* out, uint16_t bytes, UVCPWaitGroup& group) override {
+		RequestSink sink;
+		sink.dest = out;
+		sink.group = &group;
+		return submitRead(address, bytes, std::move(sink));
+	}
+
+	bool submitWriteMemory(uint32_t startAddress, const uint8_t* data, uint16_t bytes,
+						   UVCPCallback callback) override {
+		RequestSink sink;
+		sink.callback = std::move(callback);
+		return submitWrite(startAddress, data, bytes, std::move(sink));
+	}
+
+	bool submitWriteMemory(uint32_t startAddress, const uint8_t* data, uint16_t bytes,
+						   UVCPWaitGroup& group) override {
+		RequestSink sink;
+		sink.group = &group;
+		return submitWrite(startAddress, data, bytes, std::move(sink));
+	}
+
+	// With command batching on, consecutive transactions share bulk OUT
+	// transfers up to kMaxBatchCommands, the pipeline depth and the device's
+	// command length. Replays keep one command per transfer like the trace.
+	bool submitBatch(const UVCPTransaction* batch, size_t count, UVCPWaitGroup& group) override {
+		if (!commandBatching_ || replay_ || count < 2) {
+			return UVCPTransport::submitBatch(batch, count, group);
+		}
+		const size_t maxLength = transferLimits().maxWrite + kWriteMemoryCmdHeaderSize;
+		size_t maxCount = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			maxCount = std::min(kMaxBatchCommands, pipelineDepth_);
+		}
+		size_t begin = 0;
+		while (begin < count) {
+			size_t end = begin;
+			size_t length = 0;
+			while (end < count && end - begin < maxCount) {
+				const UVCPTransaction& t = batch[end];
+				const size_t n = t.out ? sizeof(UVCPReadMemoryCmd) : kWriteMemoryCmdHeaderSize + t.bytes;
+				if (end > begin && length + n > maxLength) {
+					break;
+				}
+				length += n;
+				++end;
+			}
+			const bool queued = end - begin == 1 ? UVCPTransport::submitBatch(batch + begin, 1, group)
+												 : submitBatchTransfer(batch + begin, end - begin, length, group);
+			if (!queued) {
+				return false;
+			}
+			begin = end;
+		}
+		return true;
+	}
+
+	void setCommandBatching(bool enable) override { commandBatching_ = enable; }
+
+	// Wait until every submitted command has completed (successfully or not).
+	void waitIdle() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return inflightCount_ == 0; });
+	}
+
+	void shutdown() {
+		stopPipeline();
+		if (trace_) {
+			if (!trace_->close()) {
+				*err_ << "Writing the trace file failed; it is incomplete" << std::endl;
+			}
+		}
+		if (replay_ || target_) {
+			claimed_ = false;
+		}
+		if (handle_ && claimed_) {
+			libusb_release_interface(handle_, interfaceNumber_);
+			claimed_ = false;
+		}
+		if (handle_) {
+			libusb_close(handle_);
+			handle_ = nullptr;
+		}
+		if (ctx_) {
+			libusb_exit(ctx_);
+			ctx_ = nullptr;
+		}
+	}
+
+  private:
+	// Where each serial was last opened, one "vid:pid serial port-path" line per
+	// camera, so the next open can skip reading every camera's serial.
+	static std::filesystem::path portCacheFile() {
+		const std::filesystem::path dir = cacheDirectory();
+		return dir.empty() ? dir : dir / "ports";
+	}
+
+	static std::string portCacheKey(uint16_t vendorId, uint16_t productId, const std::string& serial) {
+		std::ostringstream key;
+		key << std::hex << std::setfill('0') << std::setw(4) << vendorId << ':' << std::setw(4) << productId
+			<< ' ' << serial << ' ';
+		return key.str();
+	}
+
+	static std::string cachedPortPath(uint16_t vendorId, uint16_t productId, const std::string& serial) {
+		const std::filesystem::path file = portCacheFile();
+		if (file.empty()) {
+			return {};
+		}
+		std::ifstream in(file);
+		const std::string key = portCacheKey(vendorId, productId, serial);
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.compare(0, key.size(), key) == 0) {
+				return line.substr(key.size());
+			}
+		}
+		return {};
+	}
+
+	// Best effort: a cache that cannot be written only costs the next full scan.
+	static void rememberPortPath(uint16_t vendorId, uint16_t productId, const std::string& serial,
+								 const std::string& path) {
+		const std::filesystem::path file = portCacheFile();
+		if (file.empty() || cachedPortPath(vendorId, productId, serial) == path) {
+			return;
+		}
+		const std::string key = portCacheKey(vendorId, productId, serial);
+		std::error_code ec;
+		std::filesystem::create_directories(file.parent_path(), ec);
+		// Fan-out workers and parallel sessions merge their entries in turn.
+		const CacheFileLock lock(file.string() + ".lock");
+		std::vector<std::string> lines;
+		{
+			std::ifstream in(file);
+			std::string line;
+			while (std::getline(in, line)) {
+				if (line.compare(0, key.size(), key) != 0) {
+					lines.push_back(line);
+				}
+			}
+		}
+		lines.push_back(key + path);
+		// Write a private copy and rename it, so readers never see half a file.
+		const std::filesystem::path tmp = file.string() + uniqueTempSuffix();
+		bool written = false;
+		{
+			std::ofstream out(tmp, std::ios::trunc);
+			for (const std::string& line : lines) {
+				out << line << '\n';
+			}
+			written = static_cast<bool>(out);
+		}
+		if (!written) {
+			std::filesystem::remove(tmp, ec);
+			return;
+		}
+		std::filesystem::rename(tmp, file, ec);
+	}
+
+	// Where a completion goes: into a caller buffer and/or wait group, or to a
+	// callback.
+	struct RequestSink {
+		UVCPCallback callback;
+		uint8_t* dest = nullptr;
+		UVCPWaitGroup* group = nullptr;
+	};
+
+	struct PendingRequest {
+		bool active = false;
+		uint16_t id = 0;
+		uint16_t expectedAck = 0;
+		uint16_t expectedBytes = 0;
+		std::chrono::steady_clock::time_point firstPending; // epoch until a PENDING_ACK arrives
+		TrafficClass cls = TrafficClass::Other;
+		std::chrono::steady_clock::time_point submitted;
+		std::chrono::steady_clock::time_point deadline;
+		RequestSink sink;
+		uint32_t address = 0;     // READ_MEMORY target, kept to send it again
+		uint8_t retriesLeft = 0;
+		bool retryDue = false;    // failed, waiting for resendRetries()
+	};
+
+	// A transfer buffer from libusb_dev_mem_alloc (DMA-able memory, so usbfs
+	// can skip its bounce copy) or, where unsupported, from the heap.
+	struct TransferBuffer {
+		uint8_t* data = nullptr;
+		bool devMem = false;
+	};
+
+	// Pooled bulk OUT transfer; reused for the lifetime of the pipeline.
+	struct OutTransfer {
+		U3VDevice* device = nullptr;
+		std::array<uint16_t, kMaxBatchCommands> ids{}; // requests carried, in wire order
+		uint8_t count = 0;       // 0 for fire-and-forget EVENT_ACKs
+		libusb_transfer* transfer = nullptr;
+		TransferBuffer buffer;
+	};
+
+	TransferBuffer allocTransferBuffer() {
+		TransferBuffer buf;
+		buf.data = handle_ ? libusb_dev_mem_alloc(handle_, TY_UVCP_MAX_MSG_LEN) : nullptr;
+		buf.devMem = buf.data != nullptr;
+		if (!buf.data) {
+			buf.data = new uint8_t[TY_UVCP_MAX_MSG_LEN];
+		}
+		return buf;
+	}
+
+	void freeTransferBuffer(TransferBuffer& buf) {
+		if (buf.devMem) {
+			libusb_dev_mem_free(handle_, buf.data, TY_UVCP_MAX_MSG_LEN);
+		} else {
+			delete[] buf.data;
+		}
+		buf.data = nullptr;
+	}
+
+	// Caller holds mutex_.
+	OutTransfer* acquireOutTransfer() {
+		if (!freeOut_.empty()) {
+			OutTransfer* out = freeOut_.back();
+			freeOut_.pop_back();
+			return out;
+		}
+		auto out = std::make_unique<OutTransfer>();
+		out->device = this;
+		out->transfer = libusb_alloc_transfer(0);
+		if (!out->transfer) {
+			*err_ << "libusb_alloc_transfer failed" << std::endl;
+			return nullptr;
+		}
+		out->buffer = allocTransferBuffer();
+		outPool_.push_back(std::move(out));
+		return outPool_.back().get();
+	}
+
+	bool startPipeline() {
+		stopEvents_ = false;
+		stopping_ = false;
+		freeOut_.reserve(kMaxPipelineDepth);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (size_t i = 0; i < kDefaultPipelineDepth; ++i) {
+				OutTransfer* out = acquireOutTransfer();
+				if (!out) {
+					break;
+				}
+				freeOut_.push_back(out);
+			}
+		}
+		for (size_t i = 0; i < inTransferCount_; ++i) {
+			libusb_transfer* transfer = libusb_alloc_transfer(0);
+			if (!transfer) {
+				*err_ << "libusb_alloc_transfer failed" << std::endl;
+				stopPipeline();
+				return false;
+			}
+			inBuffers_.push_back(allocTransferBuffer());
+			libusb_fill_bulk_transfer(transfer, handle_, bulkIn_, inBuffers_.back().data,
+									  static_cast<int>(inTransferLength_), &U3VDevice::onInTransfer, this, 0);
+			inTransfers_.push_back(transfer);
+		}
+		eventThread_ = std::thread([this] {
+			while (!stopEvents_) {
+				timeval tv{0, 50000};
+				libusb_handle_events_timeout_completed(ctx_, &tv, nullptr);
+				if (haltPending_) {
+					recoverEndpoints();
+				}
+				expireRequests();
+				resendRetries();
+			}
+		});
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (libusb_transfer* transfer : inTransfers_) {
+			const int rc = libusb_submit_transfer(transfer);
+			if (rc != LIBUSB_SUCCESS) {
+				*err_ << "Bulk IN submit failed: " << libusb_error_name(rc) << std::endl;
+				continue;
+			}
+			++activeIn_;
+		}
+		if (activeIn_ == 0) {
+			stopping_ = true;
+		}
+		return activeIn_ != 0;
+	}
+
+	void stopPipeline() {
+		if (replayThread_.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stopping_ = true;
+				cv_.notify_all();
+			}
+			failAll("device shutting down");
+			{
+				std::lock_guard<std::mutex> lock(replayMutex_);
+				stopEvents_ = true;
+			}
+			replayCv_.notify_all();
+			replayThread_.join();
+		}
+		if (eventThread_.joinable()) {
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				stopping_ = true;
+				cv_.notify_all();
+			}
+			failAll("device shutting down");
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				for (libusb_transfer* transfer : inTransfers_) {
+					libusb_cancel_transfer(transfer);
+				}
+				if (eventTransfer_) {
+					libusb_cancel_transfer(eventTransfer_);
+				}
+				cv_.wait_for(lock, std::chrono::seconds(1),
+							 [this] { return activeIn_ == 0 && activeOut_ == 0; });
+			}
+			stopEvents_ = true;
+			libusb_interrupt_event_handler(ctx_);
+			eventThread_.join();
+		}
+		for (libusb_transfer* transfer : inTransfers_) {
+			libusb_free_transfer(transfer);
+		}
+		inTransfers_.clear();
+		if (eventTransfer_) {
+			libusb_free_transfer(eventTransfer_);
+			eventTransfer_ = nullptr;
+			freeTransferBuffer(eventBuffer_);
+			if (handle_) {
+				libusb_release_interface(handle_, eventInterface_);
+			}
+		}
+		for (TransferBuffer& buf : inBuffers_) {
+			freeTransferBuffer(buf);
+		}
+		inBuffers_.clear();
+		for (auto& out : outPool_) {
+			libusb_free_transfer(out->transfer);
+			freeTransferBuffer(out->buffer);
+		}
+		outPool_.clear();
+		freeOut_.clear();
+	}
+
+	// Reads without side effects may be sent again after a lost ACK.
+	bool isRetryableRead(uint32_t address) const {
+		return !replay_ && address != kTerminalDataAddr && address != kTerminalFileDataAddr &&
+			   address != kTerminalFileWideDataAddr;
+	}
+
+	bool submitRead(uint32_t address, uint16_t bytes, RequestSink sink) {
+		const UVCPReadMemoryCmd cmd = makeReadMemoryCmd(address, bytes);
+		return submitRequest(&cmd, sizeof(cmd), nullptr, 0, UVCPConstants::COMMAND_READ_MEMORY_ACK,
+							 bytes, classifyAddress(address), std::move(sink), isRetryableRead(address));
+	}
+
+	bool submitWrite(uint32_t startAddress, const uint8_t* data, uint16_t bytes, RequestSink sink) {
+		const UVCPWriteMemoryCmd cmd = makeWriteMemoryCmd(startAddress, bytes);
+		return submitRequest(&cmd, kWriteMemoryCmdHeaderSize, data, bytes, UVCPConstants::COMMAND_WRITE_MEMORY_ACK,
+							 bytes, classifyAddress(startAddress), std::move(sink));
+	}
+
+	// Copy the command into a pooled OUT transfer and send it. On failure the
+	// sink's wait group is signalled so callers can always wait on it.
+	// `retryable` marks a READ_MEMORY command that may be sent again.
+	bool submitRequest(const void* header, size_t headerSize, const uint8_t* payload,
+					   size_t payloadSize, uint16_t expectedAck, uint16_t expectedBytes,
+					   TrafficClass cls, RequestSink sink, bool retryable = false) {
+		if (sink.group) {
+			sink.group->add();
+		}
+		auto fail = [&sink]() {
+			if (sink.group) {
+				sink.group->done(false);
+			}
+			return false;
+		};
+		if (!claimed_) {
+			*err_ << "Interface not claimed" << std::endl;
+			return fail();
+		}
+		if (headerSize + payloadSize > TY_UVCP_MAX_MSG_LEN) {
+			*err_ << "UVCP command exceeds " << TY_UVCP_MAX_MSG_LEN << " bytes" << std::endl;
+			return fail();
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		// Submitters get into a full pipeline in arrival order, so a thread
+		// streaming a file cannot starve the shell or a register monitor.
+		const uint64_t ticket = nextTicket_++;
+		cv_.wait(lock, [&] { return stopping_ || (ticket == servingTicket_ && inflightCount_ < pipelineDepth_); });
+		++servingTicket_;
+		cv_.notify_all();
+		if (stopping_) {
+			return fail();
+		}
+		OutTransfer* out = acquireOutTransfer();
+		if (!out) {
+			return fail();
+		}
+		std::memcpy(out->buffer.data, header, headerSize);
+		if (payloadSize) {
+			std::memcpy(out->buffer.data + headerSize, payload, payloadSize);
+		}
+		const uint16_t id = trackRequest(header, headerSize + payloadSize, expectedAck, expectedBytes, cls,
+										 std::move(sink), retryable);
+		reinterpret_cast<UVCPHeader*>(out->buffer.data)->id = id;
+		out->ids[0] = id;
+		out->count = 1;
+
+		if (!bulkSend(out, static_cast<int>(headerSize + payloadSize))) {
+			RequestSink failed = untrackRequest(id);
+			freeOut_.push_back(out);
+			if (failed.group) {
+				failed.group->done(false);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	// Several commands in one bulk OUT transfer of `length` bytes, for devices
+	// with kCapCommandBatch. Each is still its own request with its own ACK;
+	// they enter the pipeline together, so it must have room for all of them.
+	bool submitBatchTransfer(const UVCPTransaction* batch, size_t count, size_t length, UVCPWaitGroup& group) {
+		for (size_t i = 0; i < count; ++i) {
+			group.add();
+		}
+		auto fail = [&group, count]() {
+			for (size_t i = 0; i < count; ++i) {
+				group.done(false);
+			}
+			return false;
+		};
+		if (!claimed_) {
+			*err_ << "Interface not claimed" << std::endl;
+			return fail();
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		const uint64_t ticket = nextTicket_++;
+		cv_.wait(lock, [&] {
+			// A batch deeper than the pipeline (set shallower meanwhile)
+			// goes out once the pipeline has drained.
+			return stopping_ || (ticket == servingTicket_ &&
+								 (inflightCount_ == 0 || inflightCount_ + count <= pipelineDepth_));
+		});
+		++servingTicket_;
+		cv_.notify_all();
+		if (stopping_) {
+			return fail();
+		}
+		OutTransfer* out = acquireOutTransfer();
+		if (!out) {
+			return fail();
+		}
+		size_t pos = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const UVCPTransaction& t = batch[i];
+			RequestSink sink;
+			sink.dest = t.out;
+			sink.group = &group;
+			uint16_t id = 0;
+			if (t.out) {
+				const UVCPReadMemoryCmd cmd = makeReadMemoryCmd(t.address, t.bytes);
+				std::memcpy(out->buffer.data + pos, &cmd, sizeof(cmd));
+				id = trackRequest(&cmd, sizeof(cmd), UVCPConstants::COMMAND_READ_MEMORY_ACK, t.bytes,
+								  classifyAddress(t.address), std::move(sink), isRetryableRead(t.address));
+			} else {
+				const UVCPWriteMemoryCmd cmd = makeWriteMemoryCmd(t.address, t.bytes);
+				std::memcpy(out->buffer.data + pos, &cmd, kWriteMemoryCmdHeaderSize);
+				std::memcpy(out->buffer.data + pos + kWriteMemoryCmdHeaderSize, t.data, t.bytes);
+				id = trackRequest(&cmd, kWriteMemoryCmdHeaderSize + t.bytes, UVCPConstants::COMMAND_WRITE_MEMORY_ACK,
+								  t.bytes, classifyAddress(t.address), std::move(sink), false);
+			}
+			auto* hdr = reinterpret_cast<UVCPHeader*>(out->buffer.data + pos);
+			hdr->id = id;
+			pos += sizeof(UVCPHeader) + hdr->size;
+			out->ids[i] = id;
+		}
+		out->count = static_cast<uint8_t>(count);
+
+		if (!bulkSend(out, static_cast<int>(length))) {
+			for (size_t i = 0; i < count; ++i) {
+				untrackRequest(out->ids[i]);
+			}
+			freeOut_.push_back(out);
+			return fail();
+		}
+		return true;
+	}
+
+	// Caller holds mutex_. Give a command of `commandSize` bytes, starting
+	// with `header`, a free request id and slot; returns the id to send it with.
+	uint16_t trackRequest(const void* header, size_t commandSize, uint16_t expectedAck, uint16_t expectedBytes,
+						  TrafficClass cls, RequestSink sink, bool retryable) {
+		uint16_t id = nextRequestId();
+		while (slots_[id % kMaxPipelineDepth].active) {
+			id = nextRequestId();
+		}
+		PendingRequest& req = slots_[id % kMaxPipelineDepth];
+		req.active = true;
+		req.id = id;
+		req.expectedAck = expectedAck;
+		req.expectedBytes = expectedBytes;
+		req.firstPending = {};
+		req.cls = cls;
+		req.submitted = std::chrono::steady_clock::now();
+		req.deadline = req.submitted + std::chrono::milliseconds(retryable ? kReadTimeoutMs : kTransferTimeoutMs);
+		req.sink = std::move(sink);
+		req.address = retryable ? static_cast<uint32_t>(static_cast<const UVCPReadMemoryCmd*>(header)->address) : 0;
+		req.retriesLeft = retryable ? kReadRetries : 0;
+		req.retryDue = false;
+		++inflightCount_;
+		TrafficStats& traffic = stats_.byClass[static_cast<size_t>(cls)];
+		traffic.commands.fetch_add(1, std::memory_order_relaxed);
+		traffic.bytesOut.fetch_add(commandSize, std::memory_order_relaxed);
+		return id;
+	}
+
+	// Caller holds mutex_. Drop a tracked request that was never sent and
+	// hand back its sink.
+	RequestSink untrackRequest(uint16_t id) {
+		PendingRequest& req = slots_[id % kMaxPipelineDepth];
+		RequestSink sink = std::move(req.sink);
+		req.active = false;
+		--inflightCount_;
+		return sink;
+	}
+
+	// Caller holds mutex_; submission order under the lock is the wire order.
+	bool bulkSend(OutTransfer* out, int length) {
+		if (trace_) {
+			// One record per command, so batched transfers replay like any other.
+			for (int pos = 0; pos < length;) {
+				const auto* hdr = reinterpret_cast<const UVCPHeader*>(out->buffer.data + pos);
+				const int n = std::min<int>(length - pos, static_cast<int>(sizeof(UVCPHeader)) + hdr->size);
+				trace_->record(kTraceOut, out->buffer.data + pos, static_cast<size_t>(n));
+				pos += n;
+			}
+		}
+		if (replay_) {
+			replayCommand(out->buffer.data, length);
+			freeOut_.push_back(out);
+			return true;
+		}
+		if (target_) {
+			emulateTransfer(out, length);
+			freeOut_.push_back(out);
+			return true;
+		}
+		libusb_fill_bulk_transfer(out->transfer, handle_, bulkOut_, out->buffer.data, length,
+								  &U3VDevice::onOutTransfer, out, kTransferTimeoutMs);
+		const auto start = std::chrono::steady_clock::now();
+		const int rc = libusb_submit_transfer(out->transfer);
+		stats_.bulkSend.record(std::chrono::steady_clock::now() - start);
+		if (rc != LIBUSB_SUCCESS) {
+			*err_ << "Bulk OUT failed: " << libusb_error_name(rc) << std::endl;
+			if (rc == LIBUSB_ERROR_NO_DEVICE) {
+				stopping_ = true;
+				disconnected_ = true;
+				cv_.notify_all();
+			}
+			return false;
+		}
+		++activeOut_;
+		return true;
+	}
+
+	static void LIBUSB_CALL onOutTransfer(libusb_transfer* transfer) {
+		auto* out = static_cast<OutTransfer*>(transfer->user_data);
+		U3VDevice* self = out->device;
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			transfer->actual_length != transfer->length) {
+			*self->err_ << "Bulk OUT failed: status " << transfer->status << ", bytes="
+					  << transfer->actual_length << '/' << transfer->length << std::endl;
+			if (transfer->status == LIBUSB_TRANSFER_STALL || transfer->status == LIBUSB_TRANSFER_ERROR) {
+				self->haltPending_ = true;
+			} else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+				self->disconnected_ = true;
+			}
+			for (uint8_t i = 0; i < out->count; ++i) {
+				if (!self->scheduleRetry(out->ids[i])) {
+					self->complete(out->ids[i], nullptr);
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lock(self->mutex_);
+		self->freeOut_.push_back(out);
+		--self->activeOut_;
+		self->cv_.notify_all();
+	}
+
+	static void LIBUSB_CALL onInTransfer(libusb_transfer* transfer) {
+		auto* self = static_cast<U3VDevice*>(transfer->user_data);
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			self->receive(transfer->buffer, transfer->actual_length);
+		} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+			*self->err_ << "Bulk IN failed: status " << transfer->status << std::endl;
+			if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+				{
+					std::lock_guard<std::mutex> lock(self->mutex_);
+					self->stopping_ = true;
+				}
+				self->disconnected_ = true;
+				self->failAll("device disconnected");
+			} else if (transfer->status == LIBUSB_TRANSFER_STALL || transfer->status == LIBUSB_TRANSFER_ERROR) {
+				// Resubmitting to a halted endpoint fails straight away; park the
+				// transfer until the event thread has cleared the halt.
+				std::lock_guard<std::mutex> lock(self->mutex_);
+				if (!self->stopping_) {
+					self->parkedIn_.push_back(transfer);
+					self->haltPending_ = true;
+				}
+				--self->activeIn_;
+				self->cv_.notify_all();
+				return;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(self->mutex_);
+		if (!self->stopping_ && libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+			return;
+		}
+		--self->activeIn_;
+		self->cv_.notify_all();
+	}
+
+	// Handling the arrival is what ends waitForDevice's wait; nothing to do.
+	static int LIBUSB_CALL onHotplugArrival(libusb_context*, libusb_device*, libusb_hotplug_event, void*) {
+		return 0; // stay registered
+	}
+
+	static void LIBUSB_CALL onEventTransfer(libusb_transfer* transfer) {
+		auto* self = static_cast<U3VDevice*>(transfer->user_data);
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+			checkPacket(transfer->buffer, static_cast<size_t>(transfer->actual_length)) == UVCPCheck::Ok) {
+			if (self->trace_) {
+				self->trace_->record(kTraceEvent, transfer->buffer, static_cast<size_t>(transfer->actual_length));
+			}
+			self->dispatchEvent(transfer->buffer, transfer->actual_length);
+		}
+		std::lock_guard<std::mutex> lock(self->mutex_);
+		if (!self->stopping_ && transfer->status != LIBUSB_TRANSFER_NO_DEVICE &&
+			libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+			return;
+		}
+		--self->activeIn_;
+		self->cv_.notify_all();
+	}
+
+	void dispatchEvent(const uint8_t* data, int length) {
+		const size_t headerSize = sizeof(UVCPEventCmd) - sizeof(((UVCPEventCmd*)0)->data);
+		if (length < static_cast<int>(headerSize)) {
+			return;
+		}
+		const auto* ev = reinterpret_cast<const UVCPEventCmd*>(data);
+		const size_t size = std::min<size_t>(static_cast<size_t>(length) - headerSize,
+											 ev->event_size > 12 ? ev->event_size - 12 : 0);
+		std::lock_guard<std::mutex> lock(eventMutex_);
+		if (eventHandler_) {
+			eventHandler_(ev->event_id, ev->data, size);
+		}
+	}
+
+	// Acknowledge a control-channel event that asked for it; fire and forget.
+	void sendEventAck(uint16_t id) {
+		UVCPHeader ack{};
+		ack.magic = UVCPConstants::MAGIC;
+		ack.command = UVCPConstants::COMMAND_EVENT_ACK;
+		ack.id = id;
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stopping_) {
+			return;
+		}
+		OutTransfer* out = acquireOutTransfer();
+		if (!out) {
+			return;
+		}
+		std::memcpy(out->buffer.data, &ack, sizeof(ack));
+		out->count = 0;
+		if (!bulkSend(out, sizeof(ack))) {
+			freeOut_.push_back(out);
+		}
+	}
+
+	struct ReplayResponse {
+		std::chrono::nanoseconds delay; // after the command was sent
+		std::vector<uint8_t> bytes;
+		bool eventEndpoint = false;
+	};
+	struct ReplayCommand {
+		std::vector<uint8_t> command; // request id zeroed
+		std::chrono::nanoseconds at;
+		std::vector<ReplayResponse> responses;
+	};
+	struct ReplayDelivery {
+		uint16_t id = 0;              // live request id; no bytes means its OUT transfer failed
+		std::vector<uint8_t> bytes;
+		bool eventEndpoint = false;
+	};
+
+	// One completed bulk IN transfer from the control interface.
+	void receive(const uint8_t* data, int length) {
+		const auto start = std::chrono::steady_clock::now();
+		// A device taking batched commands may answer several in one transfer.
+		while (commandBatching_ && checkPacket(data, static_cast<size_t>(length)) == UVCPCheck::Ok) {
+			const int n = static_cast<int>(sizeof(UVCPHeader)) + reinterpret_cast<const UVCPHeader*>(data)->size;
+			if (n >= length) {
+				break;
+			}
+			receivePacket(data, n);
+			data += n;
+			length -= n;
+		}
+		receivePacket(data, length);
+		stats_.bulkReceive.record(std::chrono::steady_clock::now() - start);
+	}
+
+	void receivePacket(const uint8_t* data, int length) {
+		if (trace_) {
+			trace_->record(kTraceIn, data, static_cast<size_t>(length));
+		}
+		bulkReceive(data, length);
+	}
+
+	void startReplay() {
+		stopEvents_ = false;
+		stopping_ = false;
+		replayCursor_ = 0;
+		replayThread_ = std::thread([this] {
+			std::unique_lock<std::mutex> lock(replayMutex_);
+			while (!stopEvents_) {
+				if (replayQueue_.empty()) {
+					replayCv_.wait_for(lock, std::chrono::milliseconds(50));
+				} else if (replayQueue_.begin()->first > std::chrono::steady_clock::now()) {
+					replayCv_.wait_until(lock, replayQueue_.begin()->first);
+				} else {
+					ReplayDelivery delivery = std::move(replayQueue_.begin()->second);
+					replayQueue_.erase(replayQueue_.begin());
+					lock.unlock();
+					deliverReplay(delivery);
+					lock.lock();
+					continue;
+				}
+				lock.unlock();
+				expireRequests();
+				resendRetries();
+				lock.lock();
+			}
+		});
+	}
+
+	// Caller holds mutex_. Queue the recorded responses to this command.
+	void replayCommand(const uint8_t* data, int length) {
+		const auto* hdr = reinterpret_cast<const UVCPHeader*>(data);
+		if (hdr->command == UVCPConstants::COMMAND_EVENT_ACK) {
+			return;
+		}
+		std::vector<uint8_t> key(data, data + length);
+		reinterpret_cast<UVCPHeader*>(key.data())->id = 0;
+		const auto now = std::chrono::steady_clock::now();
+		const size_t limit = std::min(replayCommands_.size(), replayCursor_ + kReplaySearchWindow);
+		std::lock_guard<std::mutex> lock(replayMutex_);
+		for (size_t i = replayCursor_; i < limit; ++i) {
+			if (replayCommands_[i].command != key) {
+				continue;
+			}
+			replayCursor_ = i + 1;
+			for (const ReplayResponse& response : replayCommands_[i].responses) {
+				ReplayDelivery delivery{hdr->id, response.bytes, response.eventEndpoint};
+				auto* ack = reinterpret_cast<UVCPHeader*>(delivery.bytes.data());
+				if (!response.eventEndpoint && ack->command != UVCPConstants::COMMAND_EVENT_CMD) {
+					ack->id = hdr->id;
+				}
+				replayQueue_.emplace(now + response.delay, std::move(delivery));
+			}
+			replayCv_.notify_all();
+			return;
+		}
+		*err_ << "Replay diverged: no recorded response for command 0x" << std::hex << hdr->command
+			  << std::dec << " (request id " << hdr->id << ")" << std::endl;
+		replayQueue_.emplace(now, ReplayDelivery{hdr->id, {}, false});
+		replayCv_.notify_all();
+	}
+
+	// Caller holds mutex_. Hand one OUT transfer to the --mock target and
+	// queue what it answers; a failed transfer fails or retries each of its
+	// commands as onOutTransfer() does.
+	void emulateTransfer(const OutTransfer* out, int length) {
+		std::vector<uint8_t> acks;
+		std::vector<std::vector<uint8_t>> events;
+		auto due = std::chrono::steady_clock::now();
+		const bool ok = target_->transfer(out->buffer.data, static_cast<size_t>(length), acks, events, due);
+		std::lock_guard<std::mutex> lock(replayMutex_);
+		if (!ok) {
+			*err_ << "Bulk OUT failed: emulated transfer error, bytes=0/" << length << std::endl;
+			for (uint8_t i = 0; i < out->count; ++i) {
+				replayQueue_.emplace(due, ReplayDelivery{out->ids[i], {}, false});
+			}
+		} else if (!acks.empty()) {
+			replayQueue_.emplace(due, ReplayDelivery{0, std::move(acks), false});
+		}
+		for (std::vector<uint8_t>& event : events) {
+			replayQueue_.emplace(due, ReplayDelivery{0, std::move(event), true});
+		}
+		replayCv_.notify_all();
+	}
+
+	void deliverReplay(ReplayDelivery& delivery) {
+		if (delivery.bytes.empty()) {
+			if (scheduleRetry(delivery.id)) {
+				resendRetries();
+			} else {
+				complete(delivery.id, nullptr);
+			}
+			return;
+		}
+		const int length = static_cast<int>(delivery.bytes.size());
+		if (delivery.eventEndpoint) {
+			dispatchEvent(delivery.bytes.data(), length);
+			return;
+		}
+		receive(delivery.bytes.data(), length);
+	}
+
+	// Caller holds mutex_.
+	PendingRequest* findRequest(uint16_t id) {
+		PendingRequest& req = slots_[id % kMaxPipelineDepth];
+		return (req.active && req.id == id) ? &req : nullptr;
+	}
+
+	// Match one ACK to its request by id and complete it.
+	void bulkReceive(const uint8_t* data, int length) {
+		switch (checkPacket(data, static_cast<size_t>(length))) {
+		case UVCPCheck::Ok:
+			break;
+		case UVCPCheck::Short:
+			*err_ << "Bulk IN returned " << length << " bytes" << std::endl;
+			return;
+		default:
+			*err_ << "Invalid ACK magic" << std::endl;
+			return;
+		}
+		const auto* hdr = reinterpret_cast<const UVCPHeader*>(data);
+		if (hdr->command == UVCPConstants::COMMAND_EVENT_CMD) {
+			stats_.events.fetch_add(1, std::memory_order_relaxed);
+			dispatchEvent(data, length);
+			if (hdr->flags & UVCPConstants::FLAGS_REQUEST_ACK) {
+				sendEventAck(hdr->id);
+			}
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		PendingRequest* req = findRequest(hdr->id);
+		if (!req) {
+			if (std::find(staleIds_.begin(), staleIds_.end(), hdr->id) != staleIds_.end()) {
+				stats_.staleAcks.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			stats_.unknownIds.fetch_add(1, std::memory_order_relaxed);
+			*err_ << "Discarding ACK with unknown id " << hdr->id << std::endl;
+			return;
+		}
+		TrafficStats& traffic = stats_.byClass[static_cast<size_t>(req->cls)];
+		traffic.bytesIn.fetch_add(static_cast<uint64_t>(length), std::memory_order_relaxed);
+		if (hdr->command == UVCPConstants::COMMAND_PENDING_ACK) {
+			const auto* p = reinterpret_cast<const UVCPPendingAck*>(data);
+			traffic.pendingAcks.fetch_add(1, std::memory_order_relaxed);
+			const auto now = std::chrono::steady_clock::now();
+			if (req->firstPending == std::chrono::steady_clock::time_point{}) {
+				req->firstPending = now;
+			}
+			const auto extended = now + std::chrono::milliseconds(p->timeout_ms) + kPendingAckGrace;
+			if (extended - req->submitted > kMaxPendingWait) {
+				lock.unlock();
+				stats_.pendingExhausted.fetch_add(1, std::memory_order_relaxed);
+				*err_ << "PENDING_ACK extensions passed " << kMaxPendingWait.count() << " s (request id "
+					  << hdr->id << ")" << std::endl;
+				complete(hdr->id, nullptr);
+				return;
+			}
+			req->deadline = extended;
+			return;
+		}
+		const uint16_t expectedAck = req->expectedAck;
+		const uint16_t expectedBytes = req->expectedBytes;
+		lock.unlock();
+
+		switch (checkAck(data, static_cast<size_t>(length), expectedAck, expectedBytes)) {
+		case UVCPCheck::Ok:
+			complete(hdr->id, data);
+			return;
+		case UVCPCheck::WrongCommand:
+			*err_ << "Unexpected ACK command: 0x" << std::hex << hdr->command << std::dec
+					  << std::endl;
+			break;
+		case UVCPCheck::SizeMismatch:
+			*err_ << "Read size mismatch: got " << hdr->size << ", expected "
+					  << expectedBytes << std::endl;
+			break;
+		default:
+			*err_ << "Short WRITE_MEMORY_ACK" << std::endl;
+			complete(hdr->id, nullptr);
+			return;
+		}
+		if (!scheduleRetry(hdr->id)) {
+			complete(hdr->id, nullptr);
+		}
+	}
+
+	// Retire a request and deliver its result to the sink. A null ack reports
+	// failure.
+	void complete(uint16_t id, const uint8_t* ack) {
+		RequestSink sink;
+		uint16_t expectedBytes = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			PendingRequest* req = findRequest(id);
+			if (!req) {
+				return;
+			}
+			sink = std::move(req->sink);
+			expectedBytes = req->expectedBytes;
+			TrafficStats& traffic = stats_.byClass[static_cast<size_t>(req->cls)];
+			if (ack) {
+				const auto now = std::chrono::steady_clock::now();
+				traffic.roundTrip.record(now - req->submitted);
+				if (req->firstPending != std::chrono::steady_clock::time_point{}) {
+					stats_.pendingWait.record(now - req->firstPending);
+				}
+			} else {
+				traffic.failures.fetch_add(1, std::memory_order_relaxed);
+				noteStaleId(id);
+			}
+			req->active = false;
+			--inflightCount_;
+			cv_.notify_all();
+		}
+		UVCPCompletion c;
+		c.id = id;
+		if (ack) {
+			const UVCPAck parsed = parseAck(ack);
+			c.ok = true;
+			c.command = parsed.command;
+			c.payload = parsed.payload;
+			c.payloadSize = parsed.payloadSize;
+			c.bytesWritten = parsed.bytesWritten;
+		}
+		if (sink.dest && c.ok) {
+			std::memcpy(sink.dest, c.payload, c.payloadSize);
+		}
+		if (sink.group) {
+			bool ok = c.ok;
+			if (ok && c.command == UVCPConstants::COMMAND_WRITE_MEMORY_ACK &&
+				c.bytesWritten != expectedBytes) {
+				*err_ << "Write bytes mismatch: got " << c.bytesWritten << ", expected "
+						  << expectedBytes << std::endl;
+				ok = false;
+			}
+			sink.group->done(ok);
+		}
+		if (sink.callback) {
+			sink.callback(c);
+		}
+	}
+
+	void expireRequests() {
+		std::vector<uint16_t> expired;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (inflightCount_ == 0) {
+				return;
+			}
+			const auto now = std::chrono::steady_clock::now();
+			for (const PendingRequest& req : slots_) {
+				if (req.active && now >= req.deadline) {
+					expired.push_back(req.id);
+					stats_.byClass[static_cast<size_t>(req.cls)].timeouts.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		}
+		for (uint16_t id : expired) {
+			if (scheduleRetry(id)) {
+				continue;
+			}
+			*err_ << "Bulk IN failed: " << libusb_error_name(LIBUSB_ERROR_TIMEOUT)
+					  << " (request id " << id << ")" << std::endl;
+			complete(id, nullptr);
+		}
+	}
+
+	// Mark a failed request to be sent again by resendRetries() if it is a
+	// read with retries left; false means the caller completes it as failed.
+	bool scheduleRetry(uint16_t id) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		PendingRequest* req = findRequest(id);
+		if (!req || req->retriesLeft == 0 || req->retryDue || stopping_) {
+			return false;
+		}
+		--req->retriesLeft;
+		req->retryDue = true;
+		req->deadline = std::chrono::steady_clock::time_point::max();
+		retryDue_ = true;
+		return true;
+	}
+
+	// Event thread. Send each request marked by scheduleRetry() again under a
+	// fresh id, so that a late ACK to the old one is dropped as stale rather
+	// than taken for the answer to the new one.
+	void resendRetries() {
+		std::vector<uint16_t> failed;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!retryDue_) {
+				return;
+			}
+			retryDue_ = false;
+			for (PendingRequest& old : slots_) {
+				if (!old.active || !old.retryDue) {
+					continue;
+				}
+				noteStaleId(old.id);
+				uint16_t id = nextRequestId();
+				while (slots_[id % kMaxPipelineDepth].active) {
+					id = nextRequestId();
+				}
+				PendingRequest& req = slots_[id % kMaxPipelineDepth];
+				req = std::move(old);
+				old.active = false;
+				req.id = id;
+				req.retryDue = false;
+				req.firstPending = {};
+				req.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kReadTimeoutMs);
+				stats_.retries.fetch_add(1, std::memory_order_relaxed);
+
+				const UVCPReadMemoryCmd cmd = makeReadMemoryCmd(req.address, req.expectedBytes, id);
+				OutTransfer* out = acquireOutTransfer();
+				if (!out) {
+					failed.push_back(id);
+					continue;
+				}
+				std::memcpy(out->buffer.data, &cmd, sizeof(cmd));
+				out->ids[0] = id;
+				out->count = 1;
+				stats_.byClass[static_cast<size_t>(req.cls)].bytesOut.fetch_add(sizeof(cmd), std::memory_order_relaxed);
+				if (!bulkSend(out, sizeof(cmd))) {
+					freeOut_.push_back(out);
+					failed.push_back(id);
+				}
+			}
+		}
+		for (uint16_t id : failed) {
+			complete(id, nullptr);
+		}
+	}
+
+	// Event thread, outside libusb callbacks (clearing a halt is a control
+	// transfer). Clear both bulk endpoints after a stall or protocol error,
+	// repost the IN transfers parked meanwhile, and stop waiting the full
+	// timeout for ACKs to requests sent before the halt: reads go out again
+	// once kRecoveryAckWait passes, everything else fails then.
+	void recoverEndpoints() {
+		haltPending_ = false;
+		for (const uint8_t ep : {bulkOut_, bulkIn_}) {
+			const int rc = libusb_clear_halt(handle_, ep);
+			if (rc == LIBUSB_ERROR_NO_DEVICE) {
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					stopping_ = true;
+				}
+				disconnected_ = true;
+				failAll("device disconnected");
+				return;
+			}
+			if (rc != LIBUSB_SUCCESS) {
+				*err_ << "Clearing halt on endpoint 0x" << std::hex << static_cast<int>(ep) << std::dec
+					  << " failed: " << libusb_error_name(rc) << std::endl;
+			}
+		}
+		stats_.haltsCleared.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Ids issued from here on are well clear of any the device may still
+		// answer from before the halt.
+		requestId_ = static_cast<uint16_t>(requestId_ + kMaxPipelineDepth);
+		const auto wait = std::chrono::steady_clock::now() + kRecoveryAckWait;
+		for (PendingRequest& req : slots_) {
+			if (req.active && !req.retryDue && req.deadline > wait) {
+				req.deadline = wait;
+			}
+		}
+		for (libusb_transfer* transfer : parkedIn_) {
+			if (stopping_) {
+				break;
+			}
+			const int rc = libusb_submit_transfer(transfer);
+			if (rc != LIBUSB_SUCCESS) {
+				*err_ << "Bulk IN submit failed: " << libusb_error_name(rc) << std::endl;
+				continue;
+			}
+			++activeIn_;
+		}
+		parkedIn_.clear();
+	}
+
+	// Caller holds mutex_.
+	void noteStaleId(uint16_t id) {
+		staleIds_[staleNext_++ % kStaleIdHistory] = id;
+	}
+
+	void failAll(const char* reason) {
+		std::vector<uint16_t> ids;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (const PendingRequest& req : slots_) {
+				if (req.active) {
+					ids.push_back(req.id);
+				}
+			}
+		}
+		if (!ids.empty()) {
+			*err_ << "Aborting " << ids.size() << " UVCP request(s): " << reason << std::endl;
+		}
+		for (uint16_t id : ids) {
+			complete(id, nullptr);
+		}
+	}
+
+	uint16_t nextRequestId() { return ++requestId_; }
+
+	libusb_context* ctx_ = nullptr;
+	libusb_device_handle* handle_ = nullptr;
+	std::string serial_;
+	uint8_t interfaceNumber_ = 0;
+	uint8_t bulkOut_ = 0;
+	uint8_t bulkIn_ = 0;
+	// Control endpoint sizes and link speed, see profileLink().
+	struct LinkProfile {
+		int speed = LIBUSB_SPEED_UNKNOWN;
+		uint8_t speedSupport = 0; // U3V bmSpeedSupport
+		uint16_t maxPacketIn = 0;
+		uint16_t maxPacketOut = 0;
+		uint8_t burstIn = 1;      // packets per burst, bMaxBurst + 1
+		uint8_t burstOut = 1;
+	};
+	LinkProfile link_;
+	bool claimed_ = false;
+
+	// Async engine state; everything below is guarded by mutex_.
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	uint16_t requestId_ = 0;
+	uint64_t nextTicket_ = 0;    // handed to each submitter in turn...
+	uint64_t servingTicket_ = 0; // ...and the one allowed in next
+	std::array<PendingRequest, kMaxPipelineDepth> slots_{};
+	size_t inflightCount_ = 0;
+	size_t pipelineDepth_ = kDefaultPipelineDepth;
+	size_t activeIn_ = 0;
+	size_t activeOut_ = 0;
+	bool stopping_ = false;
+	bool retryDue_ = false;                   // some slot waits for resendRetries()
+	std::array<uint16_t, kStaleIdHistory> staleIds_{};
+	size_t staleNext_ = 0;
+	std::vector<libusb_transfer*> parkedIn_;  // IN transfers that hit a halt
+	std::atomic<bool> haltPending_{false};
+	std::atomic<bool> commandBatching_{false};
+	std::atomic<bool> disconnected_{false};
+	std::atomic<bool> stopEvents_{false};
+	std::vector<libusb_transfer*> inTransfers_;
+	std::vector<TransferBuffer> inBuffers_;
+	uint32_t inTransferLength_ = TY_UVCP_MAX_MSG_LEN;  // see configureInPipe()
+	size_t inTransferCount_ = kInTransferCount;
+	std::vector<std::unique_ptr<OutTransfer>> outPool_;
+	std::vector<OutTransfer*> freeOut_;
+	std::thread eventThread_;
+
+	libusb_transfer* eventTransfer_ = nullptr;
+	TransferBuffer eventBuffer_;
+	uint8_t eventInterface_ = 0;
+	std::mutex eventMutex_;
+	UVCPEventHandler eventHandler_;
+
+	std::ostream* out_ = &std::cout;
+	std::ostream* err_ = &std::cerr;
+	UVCPStats stats_;
+	bool quiet_ = false;
+	std::unique_ptr<UVCPTraceWriter> trace_;
+
+	// --replay state. replayCommands_/replayCursor_ are guarded by mutex_,
+	// the delivery queue by replayMutex_.
+	// How far ahead of the last match a command may be found, so extra or
+	// missing polls don't derail the replay.
+	static constexpr size_t kReplaySearchWindow = 256;
+	bool replay_ = false;
+	std::vector<ReplayCommand> replayCommands_;
+	size_t replayCursor_ = 0;
+	std::thread replayThread_;
+	std::mutex replayMutex_;
+	std::condition_variable replayCv_;
+	std::multimap<std::chrono::steady_clock::time_point, ReplayDelivery> replayQueue_;
+	UVCPPacketTarget* target_ = nullptr; // --mock
+	};
+
+	std::vector<std::string> expandLocalPattern(const std::string& pattern) {
+		std::vector<std::string> results;
+		if (!hasWildcard(pattern)) {
+			results.push_back(pattern);
+			return results;
+		}
+		namespace fs = std::filesystem;
+		fs::path p(pattern);
+		fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
+		std::string namePattern = p.filename().string();
+		std::error_code ec;
+		fs::directory_iterator it(dir, ec);
+		if (ec) {
+			return results;
+		}
+		std::vector<std::pair<uint64_t, std::string>> matches;
+		for (const auto& entry : it) {
+			std::string filename = entry.path().filename().string();
+			if (wildcardMatch(namePattern.c_str(), filename.c_str())) {
+				std::error_code sizeError;
+				const uint64_t size = entry.is_regular_file(sizeError) ? entry.file_size(sizeError) : 0;
+				matches.emplace_back(sizeError ? 0 : size, entry.path().string());
+			}
+		}
+		// Smallest first, like expandRemotePattern().
+		std::sort(matches.begin(), matches.end());
+		for (auto& match : matches) {
+			results.push_back(std::move(match.second));
+		}
+		return results;
+	}
+
+// In-process kTerminal target for benchmarks and perf-regression runs without
+// a camera. U3VDevice drives it like a USB device, so the whole pipeline runs:
+// request ids, command batching under kCapCommandBatch (several commands per
+// OUT transfer answered by as many ACKs in one IN transfer) and retries. Each
+// transfer costs its bytes at `bandwidthMBps` on a shared link plus a fixed
+// `latency`, and transfers up to the pipeline depth overlap, so pipelining and
+// polling changes show up the way they would on USB. The shell knows a few
+// built-ins (echo, printf, pwd, cd, ls, cat, rm, true, false, exit) with
+// quoting and $?; files live in memory, next to an endless /dev/zero and a
+// /dev/null sink. The file channel compresses and decompresses when a
+// transfer asks for kFileCodecLz4 and keeps the kCapFileDigest CRC.
+class MockTerminalDevice : public UVCPPacketTarget {
+  public:
+	struct Options {
+		std::chrono::microseconds latency{100};
+		double bandwidthMBps = 350; // 0 = unlimited
+		uint32_t version = kTerminalExtMinVersion;
+		uint32_t caps = kCapLargeFileWindow | kCapOutputEvents | kCapFileOpenUpdate | kCapFileCodec | kCapFileDigest |
+						kCapFileBlockDigest | kCapCommandBatch;
+		uint32_t fileWindowMax = kMaxFileDataWindow;
+		std::string password = "U3V";
+		// SBRM limits; larger transactions fail like they would on a device.
+		uint32_t maxCommandLength = TY_UVCP_MAX_MSG_LEN;
+		uint32_t maxAckLength = TY_UVCP_MAX_MSG_LEN;
+		// Fail every Nth bulk OUT transfer of reads without side effects
+		// (0 = never), which the host sends again.
+		uint32_t failTransferEvery = 0;
+	};
+
+	explicit MockTerminalDevice(Options options) : options_(std::move(options)) {
+		const uint64_t sbrm = kMockSbrmAddr;
+		std::memcpy(&memory_[kAbrmSbrmAddressAddr], &sbrm, sizeof(sbrm));
+		std::memcpy(&memory_[kMockSbrmAddr + kSbrmMaxCommandLengthOffset], &options_.maxCommandLength, 4);
+		std::memcpy(&memory_[kMockSbrmAddr + kSbrmMaxAckLengthOffset], &options_.maxAckLength, 4);
+		std::memcpy(&memory_[kAbrmModelNameAddr], kMockModelName, sizeof(kMockModelName));
+		const uint64_t manifest = kMockManifestAddr;
+		const uint64_t entryCount = 1;
+		ManifestEntry entry = {};
+		entry.file_version_major = 1;
+		entry.schema = (1u << 24) | (1u << 16) | (kManifestFileXml << 10);
+		entry.address = kMockGenICamAddr;
+		entry.size = sizeof(kMockGenICamXml) - 1;
+		std::memcpy(&memory_[kAbrmManifestTableAddr], &manifest, sizeof(manifest));
+		std::memcpy(&memory_[kMockManifestAddr], &entryCount, sizeof(entryCount));
+		std::memcpy(&memory_[kMockManifestAddr + sizeof(entryCount)], &entry, sizeof(entry));
+		std::memcpy(&memory_[kMockGenICamAddr], kMockGenICamXml, entry.size);
+	}
+
+	// U3VDevice calls this with its pipeline lock held, one transfer at a
+	// time and in submission order, which is what serializes the device state.
+	bool transfer(const uint8_t* data, size_t length, std::vector<uint8_t>& acks,
+				  std::vector<std::vector<uint8_t>>& events, std::chrono::steady_clock::time_point& due) override {
+		if (options_.failTransferEvery != 0 && onlyPlainReads(data, length) &&
+			++readTransfers_ % options_.failTransferEvery == 0) {
+			return false;
+		}
+		// Without kCapCommandBatch only the first command counts, as on a
+		// device that does not parse past it.
+		for (size_t pos = 0; length - pos >= sizeof(UVCPHeader);) {
+			const auto* hdr = reinterpret_cast<const UVCPHeader*>(data + pos);
+			const size_t n = sizeof(UVCPHeader) + hdr->size;
+			if (hdr->magic != UVCPConstants::MAGIC || n > length - pos) {
+				break;
+			}
+			serve(data + pos, n, acks);
+			pos += n;
+			if ((options_.caps & kCapCommandBatch) == 0) {
+				break;
+			}
+		}
+		if (outputEvent_) {
+			outputEvent_ = false;
+			UVCPEventCmd event{};
+			event.header.magic = UVCPConstants::MAGIC;
+			event.header.command = UVCPConstants::COMMAND_EVENT_CMD;
+			event.header.size = sizeof(event) - sizeof(event.header) - sizeof(event.data);
+			event.event_size = 12;
+			event.event_id = kEventIdOutputPending;
+			const auto* bytes = reinterpret_cast<const uint8_t*>(&event);
+			events.emplace_back(bytes, bytes + sizeof(event) - sizeof(event.data));
+		}
+		// Command and ACKs share the link; the latency overlaps with whatever
+		// else is in flight.
+		const auto now = std::chrono::steady_clock::now();
+		std::chrono::nanoseconds wireTime{0};
+		if (options_.bandwidthMBps > 0) {
+			const double wireBytes = static_cast<double>(length + acks.size());
+			wireTime = std::chrono::nanoseconds(static_cast<int64_t>(wireBytes * 1e3 / options_.bandwidthMBps));
+		}
+		linkFree_ = std::max(linkFree_, now) + wireTime;
+		due = linkFree_ + options_.latency;
+		return true;
+	}
+
+  private:
+	static constexpr size_t kOutputLimit = 1u << 20;
+	static constexpr uint32_t kChunkHint = 4096;
+	static constexpr uint32_t kErrNoEnt = 2;
+	static constexpr uint32_t kErrBadF = 9;
+	static constexpr uint32_t kErrIo = 5;
+	static constexpr uint32_t kMockSbrmAddr = 0x1000;
+	static constexpr uint32_t kMockManifestAddr = 0x1100;
+	static constexpr uint32_t kMockGenICamAddr = 0x10000;
+	static constexpr char kMockModelName[] = "MockTerminal";
+	static constexpr char kMockGenICamXml[] =
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<RegisterDescription ModelName=\"MockTerminal\" VendorName=\"u3vdb\" StandardNameSpace=\"None\"\n"
+		"    SchemaMajorVersion=\"1\" SchemaMinorVersion=\"1\" SchemaSubMinorVersion=\"0\"\n"
+		"    MajorVersion=\"1\" MinorVersion=\"0\" SubMinorVersion=\"0\"\n"
+		"    xmlns=\"http://www.genicam.org/GenApi/Version_1_1\">\n"
+		"  <Category Name=\"Root\" NameSpace=\"Standard\"><pFeature>TerminalVersion</pFeature></Category>\n"
+		"  <IntReg Name=\"TerminalVersion\"><Address>0x30004</Address><Length>4</Length>"
+		"<AccessMode>RO</AccessMode><pPort>Device</pPort><Sign>Unsigned</Sign>"
+		"<Endianess>LittleEndian</Endianess></IntReg>\n"
+		"  <Port Name=\"Device\"/>\n"
+		"</RegisterDescription>\n";
+
+	static bool onlyPlainReads(const uint8_t* data, size_t length) {
+		for (size_t pos = 0; length - pos >= sizeof(UVCPReadMemoryCmd);) {
+			const auto* cmd = reinterpret_cast<const UVCPReadMemoryCmd*>(data + pos);
+			if (cmd->header.command != UVCPConstants::COMMAND_READ_MEMORY_CMD ||
+				cmd->address == kTerminalDataAddr || cmd->address == kTerminalFileDataAddr ||
+				cmd->address == kTerminalFileWideDataAddr) {
+				return false;
+			}
+			pos += sizeof(UVCPHeader) + cmd->header.size;
+		}
+		return true;
+	}
+
+	// Answer one command. Transactions past the SBRM limits get a short ACK,
+	// which the host rejects.
+	void serve(const uint8_t* command, size_t length, std::vector<uint8_t>& acks) {
+		const auto* hdr = reinterpret_cast<const UVCPHeader*>(command);
+		const size_t at = acks.size();
+		if (hdr->command == UVCPConstants::COMMAND_READ_MEMORY_CMD && length >= sizeof(UVCPReadMemoryCmd)) {
+			const auto* cmd = reinterpret_cast<const UVCPReadMemoryCmd*>(command);
+			UVCPHeader ack{};
+			ack.magic = UVCPConstants::MAGIC;
+			ack.command = UVCPConstants::COMMAND_READ_MEMORY_ACK;
+			ack.size = sizeof(UVCPHeader) + cmd->size <= options_.maxAckLength ? cmd->size : 0;
+			ack.id = hdr->id;
+			acks.resize(at + sizeof(ack) + ack.size);
+			std::memcpy(&acks[at], &ack, sizeof(ack));
+			readMem(static_cast<uint32_t>(cmd->address), &acks[at + sizeof(ack)], ack.size);
+		} else if (hdr->command == UVCPConstants::COMMAND_WRITE_MEMORY_CMD && length >= kWriteMemoryCmdHeaderSize) {
+			const auto* cmd = reinterpret_cast<const UVCPWriteMemoryCmd*>(command);
+			UVCPWriteMemoryAck ack{};
+			ack.header.magic = UVCPConstants::MAGIC;
+			ack.header.command = UVCPConstants::COMMAND_WRITE_MEMORY_ACK;
+			ack.header.size = sizeof(ack) - sizeof(ack.header);
+			ack.header.id = hdr->id;
+			if (length <= options_.maxCommandLength) {
+				ack.bytes_written = writeMem(static_cast<uint32_t>(cmd->address), command + kWriteMemoryCmdHeaderSize,
+											 static_cast<uint16_t>(length - kWriteMemoryCmdHeaderSize));
+			}
+			acks.resize(at + sizeof(ack));
+			std::memcpy(&acks[at], &ack, sizeof(ack));
+		}
+	}
+
+	bool extended() const { return options_.version >= kTerminalExtMinVersion; }
+
+	bool isDevice(const std::string& path) const { return path == "/dev/zero" || path == "/dev/null"; }
+
+	uint64_t fileSize() const {
+		auto it = files_.find(openPath_);
+		return it == files_.end() ? 0 : it->second.size();
+	}
+
+	uint64_t remaining() const {
+		if (openPath_ == "/dev/zero") {
+			return UINT64_MAX;
+		}
+		const uint64_t size = fileSize();
+		return cursor_ < size ? size - cursor_ : 0;
+	}
+
+	// Compressed or block digest reads: keep a window's worth ready while the
+	// file has data left. cursor_ counts the file bytes consumed so far.
+	void refillFrames() {
+		while (codec_ && frames_.size() < fileWindow_ && remaining() > 0) {
+			const size_t n = static_cast<size_t>(std::min<uint64_t>(remaining(), kFileCodecBlock));
+			const std::string zeros(openPath_ == "/dev/zero" ? n : 0, '\0');
+			const char* block = zeros.empty() ? reinterpret_cast<const char*>(files_.at(openPath_).data() + cursor_)
+											  : zeros.data();
+			if (codec_ == kFileCodecBlockDigest) {
+				const uint32_t blockDigest = crc32c(0, block, n);
+				frames_.append(reinterpret_cast<const char*>(&blockDigest), sizeof(blockDigest));
+			} else {
+				encodeFileFrame(block, n, frames_);
+			}
+			digest_ = crc32c(digest_, block, n);
+			cursor_ += n;
+		}
+	}
+
+	// Compressed writes: buffer the bytes and store every complete frame.
+	bool writeFrames(const uint8_t* src, uint16_t bytes) {
+		frames_.append(reinterpret_cast<const char*>(src), bytes);
+		std::string block;
+		for (size_t length; (length = fileFrameLength(frames_)) != 0;) {
+			block.clear();
+			if (length == std::string::npos || !decodeFileFrame(frames_.data(), length, block)) {
+				fileStatus_ |= kFileStatusError;
+				fileResult_ = kErrIo;
+				return false;
+			}
+			frames_.erase(0, length);
+			digest_ = crc32c(digest_, block.data(), block.size());
+			if (!isDevice(openPath_)) {
+				std::vector<uint8_t>& file = files_[openPath_];
+				if (file.size() < cursor_ + block.size()) {
+					file.resize(static_cast<size_t>(cursor_ + block.size()));
+				}
+				std::memcpy(file.data() + cursor_, block.data(), block.size());
+			}
+			cursor_ += block.size();
+		}
+		return true;
+	}
+
+	std::string resolve(const std::string& path) const {
+		if (path.empty() || path[0] == '/') {
+			return path;
+		}
+		return cwd_ == "/" ? "/" + path : cwd_ + "/" + path;
+	}
+
+	void appendOutput(const std::string& text) {
+		if (text.empty()) {
+			return;
+		}
+		const size_t room = kOutputLimit - std::min(kOutputLimit, output_.size());
+		if (text.size() > room) {
+			overflow_ = true;
+		}
+		if (output_.empty() && room > 0 && (eventCtrl_ & kEventCtrlOutputPending)) {
+			outputEvent_ = true;
+		}
+		output_.append(text, 0, room);
+	}
+
+	// Split one command into words: quotes group, "$?" expands outside single quotes.
+	std::vector<std::string> shellWords(const std::string& command) const {
+		std::vector<std::string> words;
+		std::string word;
+		bool inWord = false;
+		char quote = 0;
+		for (size_t i = 0; i < command.size(); ++i) {
+			const char ch = command[i];
+			if (quote != '\'' && ch == '$' && i + 1 < command.size() && command[i + 1] == '?') {
+				word += std::to_string(lastStatus_);
+				inWord = true;
+				++i;
+			} else if (quote && ch == quote) {
+				quote = 0;
+			} else if (quote) {
+				word += ch;
+			} else if (ch == '\'' || ch == '"') {
+				quote = ch;
+				inWord = true;
+			} else if (ch == ' ' || ch == '\t') {
+				if (inWord) {
+					words.push_back(word);
+				}
+				word.clear();
+				inWord = false;
+			} else {
+				word += ch;
+				inWord = true;
+			}
+		}
+		if (inWord) {
+			words.push_back(word);
+		}
+		return words;
+	}
+
+	// printf subset: %s, %d, %% and the \n \t \\ escapes; the format is reused
+	// while arguments remain.
+	static std::string formatPrintf(const std::string& format, const std::vector<std::string>& args) {
+		std::string text;
+		size_t next = 0;
+		do {
+			for (size_t i = 0; i < format.size(); ++i) {
+				const char ch = format[i];
+				if (ch == '\\' && i + 1 < format.size()) {
+					const char esc = format[++i];
+					text += esc == 'n' ? '\n' : esc == 't' ? '\t' : esc;
+				} else if (ch == '%' && i + 1 < format.size()) {
+					const char conv = format[++i];
+					if (conv == '%') {
+						text += '%';
+					} else {
+						const std::string arg = next < args.size() ? args[next++] : std::string();
+						text += conv == 'd' ? std::to_string(std::atoi(arg.c_str())) : arg;
+					}
+				} else {
+					text += ch;
+				}
+			}
+		} while (next < args.size() && format.find('%') != std::string::npos);
+		return text;
+	}
+
+	void runShellLine(const std::string& line) {
+		std::stringstream commands(line);
+		std::string command;
+		while (shellAlive_ && std::getline(commands, command, ';')) {
+			std::vector<std::string> args = shellWords(command);
+			if (args.empty()) {
+				continue;
+			}
+			const std::string name = args[0];
+			args.erase(args.begin());
+			lastStatus_ = 0;
+			if (name == "true" || name == "false") {
+				lastStatus_ = name == "false" ? 1 : 0;
+			} else if (name == "printf") {
+				if (!args.empty()) {
+					const std::string format = args[0];
+					args.erase(args.begin());
+					appendOutput(formatPrintf(format, args));
+				}
+			} else if (name == "echo") {
+				std::string text;
+				for (const std::string& arg : args) {
+					text += (text.empty() ? "" : " ") + arg;
+				}
+				appendOutput(text + "\n");
+			} else if (name == "pwd") {
+				appendOutput(cwd_ + "\n");
+			} else if (name == "cd") {
+				cwd_ = args.empty() ? "/" : resolve(args[0]);
+			} else if (name == "ls") {
+				for (const auto& file : files_) {
+					appendOutput(file.first + "\n");
+				}
+			} else if (name == "cat" || name == "rm") {
+				for (const std::string& arg : args) {
+					auto it = files_.find(resolve(arg));
+					if (it == files_.end()) {
+						appendOutput(name + ": " + arg + ": No such file or directory\n");
+						lastStatus_ = 1;
+					} else if (name == "cat") {
+						appendOutput(std::string(it->second.begin(), it->second.end()));
+					} else {
+						files_.erase(it);
+					}
+				}
+			} else if (name == "exit") {
+				shellAlive_ = false;
+			} else {
+				appendOutput("sh: " + name + ": not found\n");
+				lastStatus_ = 127;
+			}
+		}
+	}
+
+	void closeFile() {
+		reading_ = writing_ = false;
+		openPath_.clear();
+		codec_ = codecRequest_ = kFileCodecRaw;
+		frames_.clear();
+		fileStatus_ &= ~(kFileStatusReading | kFileStatusWriting | kFileStatusOpen | kFileStatusEof);
+	}
+
+	void fileCommand(uint32_t cmd) {
+		if (cmd == kFileCmdReset) {
+			closeFile();
+			fileStatus_ = 0;
+			fileResult_ = 0;
+			std::memset(filePath_, 0, sizeof(filePath_));
+			return;
+		}
+		if (cmd == kFileCmdClose) {
+			if (writing_ && !frames_.empty()) {
+				fileStatus_ |= kFileStatusError; // upload stopped inside a frame
+				fileResult_ = kErrIo;
+			}
+			closeFile();
+			return;
+		}
+		const bool update = cmd == kFileCmdOpenUpdate && (options_.caps & kCapFileOpenUpdate);
+		if (cmd != kFileCmdOpenRead && cmd != kFileCmdOpenWrite && !update) {
+			return;
+		}
+		const uint32_t codec = ((codecRequest_ == kFileCodecLz4 && (options_.caps & kCapFileCodec)) ||
+								(codecRequest_ == kFileCodecBlockDigest && cmd == kFileCmdOpenRead &&
+								 (options_.caps & kCapFileBlockDigest)))
+								   ? codecRequest_
+								   : kFileCodecRaw;
+		closeFile();
+		const std::string path = resolve(std::string(filePath_, strnlen(filePath_, sizeof(filePath_))));
+		if (path.empty() || (cmd == kFileCmdOpenRead && !isDevice(path) && !files_.count(path))) {
+			fileStatus_ |= kFileStatusError;
+			fileResult_ = kErrNoEnt;
+			return;
+		}
+		openPath_ = path;
+		cursor_ = 0;
+		digest_ = 0;
+		codec_ = codec;
+		if (cmd == kFileCmdOpenRead) {
+			reading_ = true;
+			fileStatus_ = kFileStatusReading | kFileStatusOpen;
+			refillFrames();
+			return;
+		}
+		if (!isDevice(path) && (cmd == kFileCmdOpenWrite || !files_.count(path))) {
+			files_[path].clear();
+		}
+		writing_ = true;
+		fileStatus_ = kFileStatusWriting | kFileStatusOpen;
+	}
+
+	uint32_t readReg(uint32_t address) const {
+		const uint64_t size = fileSize();
+		switch (address) {
+		case kTerminalBaseAddr: return kTerminalMagic;
+		case kTerminalVersionAddr: return options_.version;
+		case kTerminalStatusAddr:
+			return (shellAlive_ ? kStatusReady | kStatusChildAlive : 0) |
+				   (output_.empty() ? 0 : kStatusOutputPending) | (overflow_ ? kStatusOverflow : 0) |
+				   (echo_ ? kStatusEchoEnabled : 0);
+		case kTerminalAvailAddr: return static_cast<uint32_t>(output_.size());
+		case kTerminalChunkHintAddr: return kChunkHint;
+		case kTerminalAuthStatusAddr: return authed_ ? 1 : 0;
+		case kTerminalFileStatusAddr:
+			return fileStatus_ | (reading_ && remaining() == 0 && frames_.empty() ? kFileStatusEof : 0);
+		case kTerminalFileResultAddr: return fileResult_;
+		case kTerminalFileSizeLowAddr: return static_cast<uint32_t>(size);
+		case kTerminalFileSizeHighAddr: return static_cast<uint32_t>(size >> 32);
+		case kTerminalFileCursorLowAddr: return static_cast<uint32_t>(cursor_);
+		case kTerminalFileCursorHighAddr: return static_cast<uint32_t>(cursor_ >> 32);
+		case kTerminalFileDataAvailAddr:
+			if (!reading_) {
+				return 0;
+			}
+			return static_cast<uint32_t>(std::min<uint64_t>(codec_ ? frames_.size() : remaining(), fileWindow_));
+		default: break;
+		}
+		if (!extended()) {
+			return 0;
+		}
+		switch (address) {
+		case kTerminalCapsAddr: return options_.caps;
+		case kTerminalFileWindowAddr: return fileWindow_;
+		case kTerminalFileWindowMaxAddr: return options_.fileWindowMax;
+		case kTerminalEventCtrlAddr: return eventCtrl_;
+		case kTerminalFileCodecAddr: return codecRequest_;
+		case kTerminalFileDigestAddr: return (options_.caps & kCapFileDigest) ? digest_ : 0;
+		default: return 0;
+		}
+	}
+
+	void writeReg(uint32_t address, uint32_t value) {
+		switch (address) {
+		case kTerminalStatusAddr:
+			if (value & kCtrlEchoEnable) echo_ = true;
+			if (value & kCtrlEchoDisable) echo_ = false;
+			if (value & kCtrlClearFlags) overflow_ = false;
+			if (value & kCtrlReset) {
+				shellAlive_ = false;
+				output_.clear();
+				line_.clear();
+				cwd_ = "/";
+			}
+			if (value & kCtrlSigInt) line_.clear();
+			if (value & kCtrlStart) shellAlive_ = true;
+			return;
+		case kTerminalAuthCmdAddr:
+			authed_ = value == 1 && authBuf_ == options_.password;
+			return;
+		case kTerminalFileCmdAddr:
+			fileCommand(value);
+			return;
+		case kTerminalFileCursorLowAddr:
+			cursorRequest_ = (cursorRequest_ & 0xFFFFFFFF00000000ull) | value;
+			return;
+		case kTerminalFileCursorHighAddr:
+			cursorRequest_ = (cursorRequest_ & 0xFFFFFFFFull) | (static_cast<uint64_t>(value) << 32);
+			if (reading_ || writing_) {
+				cursor_ = cursorRequest_;
+				digest_ = 0;
+			}
+			return;
+		default: break;
+		}
+		if (!extended()) {
+			return;
+		}
+		if (address == kTerminalFileWindowAddr) {
+			fileWindow_ = std::min(value, options_.fileWindowMax);
+		} else if (address == kTerminalEventCtrlAddr) {
+			eventCtrl_ = value;
+		} else if (address == kTerminalFileCodecAddr) {
+			codecRequest_ = value;
+		}
+	}
+
+	// The small window's port always works, the wide one once negotiated.
+	bool isFileDataPort(uint32_t address) const {
+		return address == kTerminalFileDataAddr ||
+			   (address == kTerminalFileWideDataAddr && fileWindow_ > kTerminalFileDataWindow);
+	}
+
+	void readMem(uint32_t address, uint8_t* dst, uint16_t bytes) {
+		std::memset(dst, 0, bytes);
+		if (static_cast<uint64_t>(address) + bytes <= memory_.size()) {
+			std::memcpy(dst, memory_.data() + address, bytes);
+			return;
+		}
+		if (address == kTerminalDataAddr) {
+			const size_t n = std::min<size_t>(bytes, output_.size());
+			std::memcpy(dst, output_.data(), n);
+			output_.erase(0, n);
+			return;
+		}
+		if (isFileDataPort(address)) {
+			if (!reading_) {
+				return;
+			}
+			if (codec_) {
+				const size_t n = std::min<size_t>(bytes, frames_.size());
+				std::memcpy(dst, frames_.data(), n);
+				frames_.erase(0, n);
+				refillFrames();
+				return;
+			}
+			const size_t n = static_cast<size_t>(std::min<uint64_t>(bytes, remaining()));
+			if (openPath_ != "/dev/zero") {
+				std::memcpy(dst, files_.at(openPath_).data() + cursor_, n);
+			}
+			digest_ = crc32c(digest_, dst, n);
+			cursor_ += n;
+			return;
+		}
+		for (uint16_t i = 0; i < bytes; i += 4) {
+			const uint32_t value = readReg(address + i);
+			std::memcpy(dst + i, &value, std::min<size_t>(4, bytes - i));
+		}
+	}
+
+	uint16_t writeMem(uint32_t address, const uint8_t* src, uint16_t bytes) {
+		if (static_cast<uint64_t>(address) + bytes <= memory_.size()) {
+			std::memcpy(memory_.data() + address, src, bytes);
+			return bytes;
+		}
+		if (address == kTerminalDataAddr) {
+			if (!shellAlive_) {
+				return bytes;
+			}
+			if (echo_) {
+				appendOutput(std::string(reinterpret_cast<const char*>(src), bytes));
+			}
+			for (uint16_t i = 0; i < bytes; ++i) {
+				const char ch = static_cast<char>(src[i]);
+				if (ch == '\n' || ch == '\r') {
+					runShellLine(line_);
+					line_.clear();
+				} else if ((ch == '\b' || ch == 0x7f) && !line_.empty()) {
+					line_.pop_back();
+				} else if (ch == 0x03) {
+					line_.clear();
+				} else {
+					line_ += ch;
+				}
+			}
+			return bytes;
+		}
+		if (isFileDataPort(address)) {
+			if (!writing_) {
+				fileStatus_ |= kFileStatusError;
+				fileResult_ = kErrBadF;
+				return 0;
+			}
+			const uint16_t n = static_cast<uint16_t>(std::min<uint32_t>(bytes, fileWindow_));
+			if (codec_) {
+				return writeFrames(src, n) ? n : 0;
+			}
+			digest_ = crc32c(digest_, src, n);
+			if (!isDevice(openPath_)) {
+				std::vector<uint8_t>& file = files_[openPath_];
+				if (file.size() < cursor_ + n) {
+					file.resize(static_cast<size_t>(cursor_ + n));
+				}
+				std::memcpy(file.data() + cursor_, src, n);
+			}
+			cursor_ += n;
+			return n;
+		}
+		if (address >= kTerminalAuthBufAddr && address < kTerminalFileCmdAddr) {
+			const char* text = reinterpret_cast<const char*>(src);
+			authBuf_.assign(text, strnlen(text, bytes));
+			return bytes;
+		}
+		if (address >= kTerminalFilePathAddr && address < kTerminalFilePathAddr + kTerminalFilePathCapacity) {
+			const uint32_t offset = address - kTerminalFilePathAddr;
+			std::memcpy(filePath_ + offset, src, std::min<size_t>(bytes, sizeof(filePath_) - offset));
+			fileStatus_ |= kFileStatusPathReady;
+			return bytes;
+		}
+		for (uint16_t i = 0; i + 4 <= bytes; i += 4) {
+			uint32_t value = 0;
+			std::memcpy(&value, src + i, sizeof(value));
+			writeReg(address + i, value);
+		}
+		return bytes;
+	}
+
+	const Options options_;
+	std::chrono::steady_clock::time_point linkFree_;
+	uint64_t readTransfers_ = 0;
+
+	// Emulated device state. Below the kTerminal block is plain memory that
+	// starts with an ABRM pointing at the SBRM and a one-entry manifest.
+	std::vector<uint8_t> memory_ = std::vector<uint8_t>(kTerminalBaseAddr);
+	bool shellAlive_ = false;
+	int lastStatus_ = 0;
+	bool echo_ = true;
+	bool overflow_ = false;
+	bool authed_ = false;
+	bool outputEvent_ = false;
+	std::string authBuf_;
+	std::string output_;
+	std::string line_;
+	std::string cwd_ = "/";
+	uint32_t eventCtrl_ = 0;
+	uint32_t fileWindow_ = kTerminalFileDataWindow;
+	std::map<std::string, std::vector<uint8_t>> files_;
+	char filePath_[kTerminalFilePathCapacity] = {};
+	std::string openPath_;
+	uint32_t fileStatus_ = 0;
+	uint32_t fileResult_ = 0;
+	uint64_t cursor_ = 0;
+	uint64_t cursorRequest_ = 0;
+	bool reading_ = false;
+	bool writing_ = false;
+	uint32_t codecRequest_ = kFileCodecRaw;
+	uint32_t codec_ = kFileCodecRaw;
+	std::string frames_; // compressed data not yet read out, or written but not stored
+	uint32_t digest_ = 0;
+};
+
+	// Escape `text` for use inside a JSON string literal.
+	std::string jsonEscape(const std::string& text) {
+		std::string escaped;
+		escaped.reserve(text.size());
+		for (unsigned char ch : text) {
+			switch (ch) {
+			case '"':  escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\r': escaped += "\\r"; break;
+			case '\t': escaped += "\\t"; break;
+			default:
+				if (ch < 0x20) {
+					char buf[8];
+					std::snprintf(buf, sizeof(buf), "\\u%04x", ch);
+					escaped += buf;
+				} else {
+					escaped += static_cast<char>(ch);
+				}
+			}
+		}
+		return escaped;
+	}
+
+	// Set from the SIGUSR1 handler; TerminalClient prints UVCP statistics
+	// the next time it waits on the device.
+	std::atomic<bool> gStatsRequested{false};
+
+	class TerminalClient {
+  public:
+	// Receives terminal output as it is read; `data` is valid during the call only.
+	using OutputSink = std::function<void(const char* data, size_t size)>;
+
+	explicit TerminalClient(UVCPTransport& dev) : device_(dev) {}
+	void setOutput(std::ostream& out, std::ostream& err) {
+		out_ = &out;
+		err_ = &err;
+	}
+	~TerminalClient() {
+		stopJobs(true);
+		if (outputEvents_) {
+			device_.setEventHandler(nullptr);
+		}
+#ifndef _WIN32
+		for (int& fd : eventPipe_) {
+			if (fd >= 0) {
+				::close(fd);
+				fd = -1;
+			}
+		}
+#endif
+	}
+	uint32_t getVersion() const { return version_; }
+
+	bool initialize() {
+		if (initialized_) {
+			return true;
+		}
+		std::vector<uint32_t> regs;
+		uint32_t magic = 0;
+		uint32_t headerVersion = 0;
+		if (!cache_.lookup(kTerminalBaseAddr, magic) || !cache_.lookup(kTerminalBaseAddr + 4, headerVersion)) {
+			if (!device_.readRegisters(kTerminalBaseAddr, 2, regs)) {
+				*err_ << "Failed to read terminal header" << std::endl;
+				return false;
+			}
+			magic = regs[0];
+			headerVersion = regs[1];
+		}
+		if (magic != kTerminalMagic) {
+			*err_ << "Unexpected terminal magic 0x" << std::hex << magic
+					  << ", expected 0x" << kTerminalMagic << std::dec << std::endl;
+			return false;
+		}
+		cache_.store(kTerminalBaseAddr, magic, RegisterPolicy::Immutable);
+		cache_.store(kTerminalBaseAddr + 4, headerVersion, RegisterPolicy::Immutable);
+		version_ = headerVersion;
+		// also read explicit version register if available
+		uint32_t verReg = 0;
+		if (readCachedRegister(kTerminalVersionAddr, verReg, RegisterPolicy::Immutable) && verReg != 0) {
+			version_ = verReg;
+		}
+		chunkHint_ = readRegisterOr(kTerminalChunkHintAddr, chunkHint_);
+		if (chunkHint_ == 0) {
+			chunkHint_ = 512;
+		}
+		caps_ = 0;
+		if (version_ >= kTerminalExtMinVersion && !readCachedRegister(kTerminalCapsAddr, caps_, RegisterPolicy::Immutable)) {
+			caps_ = 0;
+		}
+		device_.setCommandBatching((caps_ & kCapCommandBatch) != 0);
+		negotiateFileWindow();
+		initialized_ = true;
+		return true;
+	}
+
+	uint32_t getFileWindow() const { return fileWindow_; }
+	// Upper bound for the negotiated file data window; 0 means no limit.
+	void setFileWindowLimit(uint32_t limit) { fileWindowLimit_ = limit; }
+	void setPollPolicy(const PollPolicy& policy) { pollPolicy_ = policy; }
+	// Read the file status every `chunks` upload chunks; 1 checks every chunk.
+	void setUploadStatusInterval(uint32_t chunks) { uploadStatusInterval_ = std::max<uint32_t>(chunks, 1); }
+	// Compress file data on the link when the device offers kCapFileCodec.
+	void setCompressTransfers(bool compress) { compressTransfers_ = compress; }
+	// Make u3vget/u3vput behave as if --resume was given.
+	void setResumeTransfers(bool resume) { resumeTransfers_ = resume; }
+	// Resolve relative local paths of file commands against `dir` (a daemon
+	// client's directory); empty uses the process's own.
+	void setLocalDirectory(const std::string& dir) { localDirectory_ = dir; }
+
+	// Draw transfer progress on the output even when it is not the terminal.
+	void setProgressOutput(bool on) { progressToOutput_ = on; }
+	// One-shot commands end at an end marker rather than after 200 ms of silence.
+	void setFramedCommands(bool framed) { framedCommands_ = framed; }
+	// Record shell input and output to `log` (--log); nullptr stops.
+	void setSessionLog(SessionLogWriter* log) { log_ = log; }
+	// $? of the last framed command, -1 if it did not report one.
+	int lastExitStatus() const { return lastExitStatus_; }
+
+	bool ensureSession() {
+		if (!initialized_ && !initialize()) {
+			return false;
+		}
+		if (!ensureAuth()) {
+			return false;
+		}
+		// The status value is only cached while it shows a ready session; a
+		// status read that does not clears it (see noteTerminalStatus()).
+		uint32_t status = 0;
+		if (!readCachedRegister(kTerminalStatusAddr, status, RegisterPolicy::Session)) {
+			return false;
+		}
+		if (status & kStatusReady) {
+			return true;
+		}
+		promptsQuiet_ = false;
+		framePending_.clear();
+		uint32_t ctrl = kCtrlStart | kCtrlClearFlags;
+		if (echoEnabled_) {
+			ctrl |= kCtrlEchoEnable;
+		} else {
+			ctrl |= kCtrlEchoDisable;
+		}
+		if (!writeRegister(kTerminalStatusAddr, ctrl)) {
+			return false;
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+		PollBackoff backoff(pollPolicy_);
+		while (std::chrono::steady_clock::now() < deadline) {
+			if (!readCachedRegister(kTerminalStatusAddr, status, RegisterPolicy::Session)) {
+				return false;
+			}
+			if (status & kStatusReady) {
+				return true;
+			}
+			backoff.wait(deadline);
+		}
+		*err_ << "Timed out waiting for terminal session" << std::endl;
+		return false;
+	}
+
+	bool reset() {
+		if (!initialize()) {
+			return false;
+		}
+		if (!ensureAuth()) {
+			return false;
+		}
+		// do not clear auth
+		cache_.forget(kTerminalStatusAddr);
+		uint32_t ctrl = kCtrlReset | kCtrlClearFlags;
+		if (echoEnabled_) {
+			ctrl |= kCtrlEchoEnable;
+		} else {
+			ctrl |= kCtrlEchoDisable;
+		}
+		if (!writeRegister(kTerminalStatusAddr, ctrl)) {
+			return false;
+		}
+		// Give the old shell up to 200 ms to go away before starting a new one.
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+		PollBackoff backoff(pollPolicy_);
+		uint32_t status = 0;
+		while (std::chrono::steady_clock::now() < deadline) {
+			if (!readRegister(kTerminalStatusAddr, status)) {
+				return false;
+			}
+			if ((status & kStatusChildAlive) == 0) {
+				break;
+			}
+			backoff.wait(deadline);
+		}
+		return ensureSession();
+	}
+
+	void setPassword(const std::string& pass) { password_ = pass; }
+
+	bool ensureAuth() {
+		uint32_t authed = 0;
+		if (!readCachedRegister(kTerminalAuthStatusAddr, authed, RegisterPolicy::Session)) {
+			return false;
+		}
+		if (authed) return true;
+		cache_.forget(kTerminalAuthStatusAddr);
+		std::string pw = password_;
+		if (pw.empty()) {
+			*err_ << "Terminal locked: provide password via --password" << std::endl;
+			return false;
+		}
+		// write password to auth buffer (as C-string with NUL terminator recommended but not required),
+		// run the auth command and re-check, in one round trip where the device batches
+		const uint32_t authCmd = 1;
+		if (!device_.runBatch({UVCPTransaction::write(kTerminalAuthBufAddr,
+													  reinterpret_cast<const uint8_t*>(pw.data()),
+													  static_cast<uint16_t>(pw.size())),
+							   UVCPTransaction::writeRegister(kTerminalAuthCmdAddr, authCmd),
+							   UVCPTransaction::readRegister(kTerminalAuthStatusAddr, authed)})) {
+			return false;
+		}
+		cache_.store(kTerminalAuthStatusAddr, authed, RegisterPolicy::Session);
+		if (!authed) {
+			*err_ << "Authentication failed" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// Have the device raise kEventIdOutputPending instead of being polled for
+	// output. Returns false (and keeps polling) when the device can't.
+	bool enableOutputEvents() {
+		if ((caps_ & kCapOutputEvents) == 0) {
+			return false;
+		}
+#ifndef _WIN32
+		if (eventPipe_[0] < 0) {
+			if (::pipe(eventPipe_) != 0) {
+				return false;
+			}
+			for (int fd : eventPipe_) {
+				::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+			}
+		}
+#endif
+		device_.setEventHandler([this](uint16_t eventId, const uint8_t*, size_t) {
+			if (eventId == kEventIdOutputPending) {
+				signalOutputEvent();
+			}
+		});
+		if (!writeRegister(kTerminalEventCtrlAddr, kEventCtrlOutputPending)) {
+			device_.setEventHandler(nullptr);
+			return false;
+		}
+		outputEvents_ = true;
+		return true;
+	}
+
+	void disableOutputEvents() {
+		if (!outputEvents_) {
+			return;
+		}
+		writeRegister(kTerminalEventCtrlAddr, 0);
+		device_.setEventHandler(nullptr);
+		outputEvents_ = false;
+	}
+
+	bool lock(){
+		cache_.invalidateSession();
+		if (!device_.writeRegister(kTerminalAuthCmdAddr, 0)) {
+			return false;
+		}
+		return true;
+	}
+
+	bool sendCommand(const std::string& command) {
+		if (!ensureSession()) {
+			return false;
+		}
+		std::string payload = command;
+		if (payload.empty() || payload.back() != '\n') {
+			payload.push_back('\n');
+		}
+		return writeTerminalInput(reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+	}
+
+	// Write raw bytes to the shell in chunkHint_ pieces, queued back to back
+	// (the device consumes them in order) with a single wait at the end.
+	bool writeTerminalInput(const uint8_t* data, size_t size) {
+		if (log_) {
+			log_->record(kLogInput, data, size);
+		}
+		UVCPWaitGroup group;
+		size_t offset = 0;
+		while (offset < size) {
+			const size_t chunk = std::min<size_t>(chunkHint_, size - offset);
+			device_.submitWriteMemory(kTerminalDataAddr, data + offset, static_cast<uint16_t>(chunk), group);
+			offset += chunk;
+		}
+		return group.wait();
+	}
+
+	// Read shell output the status block reported as available.
+	bool readTerminalOutput(uint8_t* out, uint32_t bytes) {
+		if (!device_.readMemory(kTerminalDataAddr, out, static_cast<uint16_t>(bytes))) {
+			return false;
+		}
+		if (log_) {
+			log_->record(kLogOutput, out, bytes);
+		}
+		return true;
+	}
+
+	bool drainOutput(std::string& out,
+					 std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(200),
+					 std::chrono::milliseconds maxWait = std::chrono::seconds(5)) {
+		return drainOutput([&out](const char* data, size_t size) { out.append(data, size); }, idleTimeout,
+						   maxWait);
+	}
+
+	// Print UVCP statistics if SIGUSR1 arrived since the last check. They go
+	// to the process's stderr, not into a script or daemon client's output.
+	void printRequestedStats() {
+		if (gStatsRequested.exchange(false)) {
+			device_.stats().print(std::cerr);
+		}
+	}
+
+	// Hand output to `sink` chunk by chunk until nothing arrived for idleTimeout.
+	bool drainOutput(const OutputSink& sink,
+					 std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(200),
+					 std::chrono::milliseconds maxWait = std::chrono::seconds(5)) {
+		if (!ensureSession()) {
+			return false;
+		}
+
+		auto lastData = std::chrono::steady_clock::now();
+		auto deadline = std::chrono::steady_clock::now() + maxWait;
+		bool warnedOverflow = false;
+		PollBackoff backoff(pollPolicy_);
+
+		while (std::chrono::steady_clock::now() < deadline) {
+			printRequestedStats();
+			TerminalStatusBlock snap;
+			if (!readSnapshot(kTerminalStatusAddr, snap)) {
+				return false;
+			}
+			if ((snap.status & kStatusOverflow) && !warnedOverflow) {
+				*err_ << "Warning: terminal output overflowed, some bytes dropped" << std::endl;
+				warnedOverflow = true;
+			}
+			if (snap.status & kStatusError) {
+				*err_ << "Terminal reported error bit" << std::endl;
+			}
+			if (snap.chunkHint != 0) {
+				chunkHint_ = snap.chunkHint;
+			}
+
+			const uint32_t available = snap.available;
+			if (available == 0) {
+				if (std::chrono::steady_clock::now() - lastData > idleTimeout) {
+					break;
+				}
+				backoff.wait(std::min(deadline, lastData + idleTimeout));
+				continue;
+			}
+
+			const uint32_t toRead = std::min<uint32_t>({available, chunkHint_, kMaxFileDataWindow});
+			if (!readTerminalOutput(rxBuffer_.data(), toRead)) {
+				return false;
+			}
+			sink(reinterpret_cast<const char*>(rxBuffer_.data()), toRead);
+			lastData = std::chrono::steady_clock::now();
+			backoff.reset();
+		}
+		return true;
+	}
+
+	// Sink that writes straight to the output stream, so pipelines see data
+	// as soon as the device produced it.
+	OutputSink printOutput() {
+		return [this](const char* data, size_t size) {
+			out_->write(data, static_cast<std::streamsize>(size));
+			out_->flush();
+		};
+	}
+
+	// A command whose end is marked in the output stream, see sendFramed().
+	struct FramedCommand {
+		std::string marker; // printed right before the command's $?
+		OutputSink sink;    // receives the command's output
+		int status = -1;
+	};
+
+	// Send `command` followed by a printf of its end marker and $?. printf
+	// joins the marker from two halves, so an echoed command line never
+	// matches it.
+	bool sendFramed(const std::string& command, FramedCommand& frame) {
+		if (frameNonce_.empty()) {
+			std::random_device rd;
+			std::ostringstream nonce;
+			nonce << std::hex << rd() << rd();
+			frameNonce_ = nonce.str();
+		}
+		const std::string head = "__u3vdb_end_";
+		const std::string tail = std::to_string(++frameSeq_) + "_" + frameNonce_ + "__";
+		frame.marker = head + tail + ":";
+		return sendCommand(command + "\nprintf '%s%s:%d\\n' '" + head + "' '" + tail + "' \"$?\"");
+	}
+
+	// Read shell output for `frames` in order, handing it to the front frame's
+	// sink, until at least one frame saw its marker. Finished frames go to
+	// `done` and are popped; bytes after the last marker stay buffered for the
+	// next frame.
+	bool readFrames(std::deque<FramedCommand>& frames, const std::function<void(FramedCommand&)>& done) {
+		constexpr auto kMarkerLostTimeout = std::chrono::seconds(2);
+		std::string& pending = framePending_;
+		// Hand the first `size` pending bytes to the front frame.
+		auto emit = [&](size_t size) {
+			if (size != 0) {
+				frames.front().sink(pending.data(), size);
+				pending.erase(0, size);
+			}
+		};
+		bool warnedOverflow = false;
+		auto lastData = std::chrono::steady_clock::now();
+		PollBackoff backoff(pollPolicy_);
+		bool finished = false;
+		while (!frames.empty()) {
+			const std::string& marker = frames.front().marker;
+			const size_t at = pending.find(marker);
+			if (at != std::string::npos) {
+				emit(at);
+				const size_t eol = pending.find('\n');
+				if (eol != std::string::npos) {
+					frames.front().status = std::atoi(pending.c_str() + marker.size());
+					pending.erase(0, eol + 1);
+					done(frames.front());
+					frames.pop_front();
+					finished = true;
+					continue;
+				}
+			} else {
+				// Hold back only a tail that could be the start of a split marker.
+				size_t keep = std::min(pending.size(), marker.size() - 1);
+				while (keep > 0 && pending.compare(pending.size() - keep, keep, marker, 0, keep) != 0) {
+					--keep;
+				}
+				emit(pending.size() - keep);
+			}
+			if (finished) {
+				break;
+			}
+
+			printRequestedStats();
+			TerminalStatusBlock snap;
+			if (!readSnapshot(kTerminalStatusAddr, snap)) {
+				return false;
+			}
+			if ((snap.status & kStatusOverflow) && !warnedOverflow) {
+				*err_ << "Warning: terminal output overflowed, some bytes dropped" << std::endl;
+				warnedOverflow = true;
+			}
+			if (snap.chunkHint != 0) {
+				chunkHint_ = snap.chunkHint;
+			}
+			if (snap.available == 0) {
+				if ((snap.status & kStatusChildAlive) == 0) {
+					emit(pending.size());
+					*err_ << "Remote shell exited before the command finished" << std::endl;
+					return false;
+				}
+				// Dropped output may have taken the marker with it.
+				if (warnedOverflow && std::chrono::steady_clock::now() - lastData > kMarkerLostTimeout) {
+					emit(pending.size());
+					*err_ << "End marker lost to the overflow; stopped after "
+						  << kMarkerLostTimeout.count() << " s without output" << std::endl;
+					return false;
+				}
+				backoff.wait();
+				continue;
+			}
+			const uint32_t toRead = std::min<uint32_t>({snap.available, chunkHint_, kMaxFileDataWindow});
+			if (!readTerminalOutput(rxBuffer_.data(), toRead)) {
+				return false;
+			}
+			pending.append(reinterpret_cast<const char*>(rxBuffer_.data()), toRead);
+			lastData = std::chrono::steady_clock::now();
+			backoff.reset();
+		}
+		return true;
+	}
+
+	// Once per shell, before the first framed command of -c, --script or the
+	// daemon: empty the prompts, which an interactive shell prints around every
+	// line and would otherwise land in the commands' output, and swallow
+	// whatever the shell printed before.
+	bool quietPrompts() {
+		if (promptsQuiet_) {
+			return true;
+		}
+		if (!ensureSession() || !runFramed("PS1= PS2=", [](const char*, size_t) {})) {
+			return false;
+		}
+		promptsQuiet_ = true;
+		return true;
+	}
+
+	// Run `command` in the shell and stream its output to `sink` until its
+	// end marker arrives. Fails only if the session does; the command's own
+	// status is left in lastExitStatus().
+	bool runFramed(const std::string& command, const OutputSink& sink) {
+		lastExitStatus_ = -1;
+		std::deque<FramedCommand> frames(1);
+		frames.front().sink = sink;
+		if (!sendFramed(command, frames.front())) {
+			return false;
+		}
+		return readFrames(frames, [this](FramedCommand& frame) { lastExitStatus_ = frame.status; });
+	}
+
+	// --script: send `commands` back to back, keeping up to kScriptWindow queued
+	// in the shell, and report each as one JSON line with its index, command,
+	// exit status, elapsed milliseconds and output. u3vget/u3vput and
+	// memread/memwrite run here once everything before them finished. False if any command failed.
+	bool runScript(const std::vector<std::string>& commands) {
+		if (!ensureSession() || !quietPrompts()) {
+			return false;
+		}
+		using Clock = std::chrono::steady_clock;
+		constexpr size_t kScriptWindow = 16;
+		struct ScriptEntry {
+			size_t index = 0;
+			std::string output;
+			Clock::time_point sent;
+		};
+		bool allOk = true;
+		auto lastDone = Clock::now();
+		auto report = [&](size_t index, int status, Clock::time_point start, const std::string& output) {
+			const auto now = Clock::now();
+			const double ms = std::chrono::duration<double, std::milli>(now - std::max(start, lastDone)).count();
+			lastDone = now;
+			if (status != 0) {
+				allOk = false;
+			}
+			std::ostringstream line;
+			line << std::fixed << std::setprecision(1) << "{\"index\":" << index << ",\"command\":\""
+				 << jsonEscape(commands[index]) << "\",\"status\":" << status << ",\"ms\":" << ms
+				 << ",\"output\":\"" << jsonEscape(output) << "\"}\n";
+			*out_ << line.str() << std::flush;
+		};
+		auto isTransfer = [this](const std::string& command) { return tryHandleFileTransferCommand(command); };
+
+		std::deque<FramedCommand> frames;
+		std::deque<ScriptEntry> entries;
+		size_t next = 0;
+		while (next < commands.size() || !frames.empty()) {
+			while (next < commands.size() && frames.size() < kScriptWindow && !isTransfer(commands[next])) {
+				entries.push_back(ScriptEntry{next, {}, Clock::now()});
+				ScriptEntry* entry = &entries.back();
+				FramedCommand frame;
+				frame.sink = [entry](const char* data, size_t size) { entry->output.append(data, size); };
+				if (!sendFramed(commands[next], frame)) {
+					return false;
+				}
+				frames.push_back(std::move(frame));
+				++next;
+			}
+			if (frames.empty()) {
+				// A transfer, with the shell idle: capture its messages for the report.
+				const auto start = Clock::now();
+				std::ostringstream captured;
+				std::ostream* out = out_;
+				std::ostream* err = err_;
+				out_ = err_ = &captured;
+				bool handled = false;
+				const bool ok = handleFileTransferCommand(commands[next], handled);
+				out_ = out;
+				err_ = err;
+				// Keep only the final state of \r-updated progress lines.
+				std::string text;
+				for (char ch : captured.str()) {
+					if (ch == '\r') {
+						text.erase(text.rfind('\n') == std::string::npos ? 0 : text.rfind('\n') + 1);
+					} else {
+						text += ch;
 					}
-					std::cout << "Invalid selection. Enter a number between 0 and "
-						  << (candidates.size() - 1) << ": " << std::flush;
 				}
-				if (!validChoice) {
-					for (auto& c : candidates) {
-						libusb_close(c.handle);
-					}
-					std::cerr << "Failed to select device" << std::endl;
-					libusb_exit(ctx_);
-					ctx_ = nullptr;
+				report(next, ok ? 0 : 1, start, text);
+				++next;
+				continue;
+			}
+			const bool ok = readFrames(frames, [&](FramedCommand& frame) {
+				report(entries.front().index, frame.status, entries.front().sent, entries.front().output);
+				entries.pop_front();
+			});
+			if (!ok) {
+				return false;
+			}
+		}
+		return allOk;
+	}
+
+	bool runOnce(const std::string& command) {
+		if (framedCommands_ && !quietPrompts()) {
+			return false;
+		}
+		lastExitStatus_ = -1;
+		bool handled = false;
+		if (!handleFileTransferCommand(command, handled)) {
+			return false;
+		}
+		if (handled) {
+			return true;
+		}
+		if (framedCommands_) {
+			return runFramed(command, printOutput()) && lastExitStatus_ == 0;
+		}
+		return sendCommand(command) && drainOutput(printOutput());
+	}
+
+	bool interactiveLoopV1() {
+		if (!ensureSession()) {
+			return false;
+		}
+		*out_ << "Interactive shell ready (kTerminal version 0x" << std::hex << version_
+				  << std::dec << "). Type 'exit' to quit." << std::endl;
+
+		drainOutput(printOutput(), std::chrono::milliseconds(50), std::chrono::milliseconds(500));
+		
+		{
+			if (!sendCommand("cd /root")) {
+				return false;
+			}
+			if (!drainOutput(printOutput())) {
+				return false;
+			}
+		}
+
+		std::string line;
+		while (true) {
+			if (!std::getline(std::cin, line)) {
+				*out_ << std::endl;
+				break;
+			}
+			printRequestedStats();
+			if (line == "exit" || line == "quit") {
+				break;
+			}
+			bool handled = false;
+			handleFileTransferCommand(line, handled);
+			if (handled) {
+				if (!sendCommand(" ")) {
+					return false;
+				}
+				if (!drainOutput(printOutput())) {
 					return false;
 				}
+				continue;
 			}
-			for (auto& c : candidates) {
-				if (c.handle != handle_) {
-					libusb_close(c.handle);
-				}
+			if (!sendCommand(line)) {
+				return false;
+			}
+			if (!drainOutput(printOutput())) {
+				return false;
 			}
-			found = handle_ != nullptr;
 		}
+		return true;
+	}
 
-		if (!found) {
-			std::cerr << "Unable to open device " << std::hex << vendorId << ':' << productId;
-			if (!serialFilter.empty()) {
-				std::cerr << " with serial '" << serialFilter << '\'';
-			}
-			std::cerr << std::dec << std::endl;
-			libusb_exit(ctx_);
-			ctx_ = nullptr;
+	bool interactiveLoopV2() {
+		if (!ensureSession()) {
 			return false;
 		}
+		*out_ << "Interactive shell ready (kTerminal version 0x" << std::hex << version_
+				  << std::dec << "). Type 'exit' to quit." << std::endl;
 
-		// Successfully opened; print detailed USB descriptor information.
-		libusb_device* dev = libusb_get_device(handle_);
-		libusb_device_descriptor desc{};
-		if (dev && libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS) {
-			auto printStringByIndex = [&](uint8_t index, const char* label) {
-				if (!index) return;
-				unsigned char strBuf[256] = {0};
-				int len = libusb_get_string_descriptor_ascii(handle_, index, strBuf, sizeof(strBuf));
-				if (len > 0) {
-					std::cout << "  " << std::setw(20) << std::left << label << ": "
-						  << reinterpret_cast<const char*>(strBuf) << '\n';
+		// Drain any warmup output.
+		drainOutput(printOutput(), std::chrono::milliseconds(50), std::chrono::milliseconds(500));
+
+		// Send initial working directory.
+		if (!sendCommand("cd /root")) {
+			return false;
+		}
+		if (!drainOutput(printOutput())) {
+			return false;
+		}
+
+		// Configure local terminal to raw mode for byte-stream behaviour.
+		StdinState stdinState{};
+		if (!setStdinRaw(stdinState)) {
+			return false;
+		}
+		auto restore = [&stdinState]() { restoreStdin(stdinState); };
+		// Ensure restoration even if we early-return below.
+		struct Guard {
+			std::function<void()> fn;
+			~Guard() { if (fn) fn(); }
+		} guard{restore};
+
+		constexpr char kExitKey = 0x1d; // Ctrl+]
+		// Keystrokes are held this long for more input before they are sent...
+		constexpr auto kKeystrokeCoalesce = std::chrono::microseconds(500);
+		// ...and a paste (a read of more bytes than a key sequence) until
+		// stdin stayed quiet this long or kMaxCoalescedInput bytes piled up.
+		constexpr auto kPasteCoalesce = std::chrono::milliseconds(2);
+		constexpr ssize_t kPasteReadBytes = 8;
+		constexpr size_t kMaxCoalescedInput = 64 * 1024;
+		std::array<char, 16 * 1024> inBuf{};
+		std::string currentLine;
+		std::vector<uint8_t> toSend;
+		bool pasting = false;
+		auto flushDeadline = std::chrono::steady_clock::time_point::max();
+
+		// From here on this thread only reads stdin; the USB worker owns
+		// device_ and the writer owns stdout until stopShellThreads().
+		ShellThreads threads;
+		startShellThreads(threads);
+		struct ThreadsGuard {
+			TerminalClient& client;
+			ShellThreads& threads;
+			~ThreadsGuard() {
+				client.stopShellThreads(threads);
+				client.stopJobs(true);
+			}
+		} threadsGuard{*this, threads};
+		bool exitWarned = false;
+#ifdef _WIN32
+		const HANDLE consoleIn = GetStdHandle(STD_INPUT_HANDLE);
+		wchar_t surrogate = 0; // first half of a UTF-16 pair typed as two events
+#endif
+
+		auto flush = [&]() {
+			size_t offset = 0;
+			while (offset < toSend.size()) {
+				offset += threads.input.write(toSend.data() + offset, toSend.size() - offset);
+				ioWake_.notify();
+				if (offset < toSend.size()) {
+					if (threads.failed) {
+						return false;
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
 				}
-			};
+			}
+			toSend.clear();
+			pasting = false;
+			flushDeadline = std::chrono::steady_clock::time_point::max();
+			return true;
+		};
 
-			std::cout << "Opened USB3 Vision device " << std::hex
-				  << std::setw(4) << std::setfill('0') << desc.idVendor << ':'
-				  << std::setw(4) << std::setfill('0') << desc.idProduct
-				  << std::dec << std::setfill(' ') << std::endl;
-			unsigned char strBuf[256] = {0};
-			if (desc.iManufacturer &&
-				libusb_get_string_descriptor_ascii(handle_, desc.iManufacturer, strBuf, sizeof(strBuf)) > 0) {
-				std::cout << "  Manufacturer        : " << strBuf << '\n';
+		while (true) {
+			if (threads.failed) {
+				return false;
 			}
-			if (desc.iProduct &&
-				libusb_get_string_descriptor_ascii(handle_, desc.iProduct, strBuf, sizeof(strBuf)) > 0) {
-				std::cout << "  Product             : " << strBuf << '\n';
+			// 1) Read from stdin; the timeout only bounds how late coalesced
+			// input and a failed worker are noticed.
+			ssize_t n = 0;
+#ifndef _WIN32
+			fd_set rfds;
+			FD_ZERO(&rfds);
+			FD_SET(STDIN_FILENO, &rfds);
+			timeval tv{};
+			tv.tv_sec = 0;
+			tv.tv_usec = 20000; // 20 ms
+			if (!toSend.empty()) {
+				// Wake up in time to send coalesced input.
+				const auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+					flushDeadline - std::chrono::steady_clock::now());
+				tv.tv_usec = std::clamp<long>(static_cast<long>(left.count()), 0, tv.tv_usec);
 			}
-			if (desc.iSerialNumber &&
-				libusb_get_string_descriptor_ascii(handle_, desc.iSerialNumber, strBuf, sizeof(strBuf)) > 0) {
-				std::cout << "  SerialNumber        : " << strBuf << '\n';
+			int sel = select(STDIN_FILENO + 1, &rfds, nullptr, nullptr, &tv);
+			if (sel > 0 && FD_ISSET(STDIN_FILENO, &rfds)) {
+				n = ::read(STDIN_FILENO, inBuf.data(), inBuf.size());
+			}
+#else
+			// Sleep until a console event, the end of the USB worker or, with
+			// input held back, its flush deadline; an idle shell never wakes.
+			DWORD waitMs = INFINITE;
+			if (!toSend.empty()) {
+				const auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+					flushDeadline - std::chrono::steady_clock::now());
+				waitMs = static_cast<DWORD>(std::max<long long>(0, (left.count() + 999) / 1000));
+			}
+			const HANDLE waits[] = {consoleIn, threads.ioEnded};
+			// A worker that ended without failing (stopped for a transfer) is no news.
+			const DWORD handles = threads.ioDone ? 1 : 2;
+			bool consoleDrained = false;
+			if (WaitForMultipleObjects(handles, waits, FALSE, waitMs) == WAIT_OBJECT_0) {
+				std::array<INPUT_RECORD, 256> records{};
+				DWORD count = 0;
+				if (ReadConsoleInputW(consoleIn, records.data(), static_cast<DWORD>(records.size()), &count)) {
+					char key[kMaxConsoleKeyBytes];
+					for (DWORD r = 0; r < count; ++r) {
+						if (records[r].EventType != KEY_EVENT) {
+							continue; // focus, mouse, menu and resize events
+						}
+						const KEY_EVENT_RECORD& event = records[r].Event.KeyEvent;
+						const size_t bytes = consoleKeyBytes(event, surrogate, key);
+						for (WORD repeat = 0; bytes && repeat < std::max<WORD>(event.wRepeatCount, 1) &&
+											  static_cast<size_t>(n) + bytes <= inBuf.size(); ++repeat) {
+							std::memcpy(inBuf.data() + n, key, bytes);
+							n += static_cast<ssize_t>(bytes);
+						}
+					}
+					DWORD pending = 0;
+					consoleDrained = GetNumberOfConsoleInputEvents(consoleIn, &pending) && pending == 0;
+				}
 			}
+#endif
+			// Check for Ctrl+] to exit locally.
+			bool exitRequested = false;
+			if (n > 0) {
+				const auto now = std::chrono::steady_clock::now();
+				pasting = pasting || n > kPasteReadBytes;
+				flushDeadline = now + (pasting ? std::chrono::duration_cast<std::chrono::microseconds>(kPasteCoalesce)
+											   : kKeystrokeCoalesce);
+				for (ssize_t i = 0; i < n; ++i) {
+					unsigned char ch = static_cast<unsigned char>(inBuf[static_cast<size_t>(i)]);
 
-			// Parse configuration to locate USB3 Vision Interface Info Descriptor (0x14,0x24,...)
-				if (dev) {
-				libusb_config_descriptor* cfg = nullptr;
-				if (libusb_get_active_config_descriptor(dev, &cfg) == LIBUSB_SUCCESS && cfg) {
-					for (int ifidx = 0; ifidx < cfg->bNumInterfaces; ++ifidx) {
-						const libusb_interface& intf = cfg->interface[ifidx];
-						for (int alt = 0; alt < intf.num_altsetting; ++alt) {
-							const libusb_interface_descriptor& idesc = intf.altsetting[alt];
-							const uint8_t* ptr = idesc.extra;
-							int remain = idesc.extra_length;
-							while (ptr && remain >= 2) {
-								uint8_t len  = ptr[0];
-								uint8_t type = ptr[1];
-								if (len < 2 || len > remain) break;
-								// USB3 Vision Device Info Descriptor (class-specific 0x24)
-								if (type == 0x24 && len == sizeof(usb3v_device_info_descriptor)) {
-									const auto* info = reinterpret_cast<const usb3v_device_info_descriptor*>(ptr);
-									uint32_t genCPVer = info->bGenCPVersion;
-									uint32_t u3vVer   = info->bU3VVersion;
-									std::cout << "  GenCP version       : 0x" << std::hex << genCPVer << std::dec << '\n';
-									std::cout << "  U3V version         : 0x" << std::hex << u3vVer << std::dec << '\n';
-									printStringByIndex(info->iDeviceGUID,      "U3V Device GUID");
-									printStringByIndex(info->iVendorName,      "U3V Vendor Name");
-									printStringByIndex(info->iModelName,       "U3V Model Name");
-									printStringByIndex(info->iFamilyName,      "U3V Family Name");
-									printStringByIndex(info->iDeviceVersion,   "U3V Device Version");
-									printStringByIndex(info->iManufacturerInf, "U3V ManufacturerInfo");
-									printStringByIndex(info->iSerialNumber,    "U3V SerialNumber");
-									printStringByIndex(info->iUserDefinedName, "U3V UserDefinedName");
-									std::cout << "  " << std::setw(20) << std::left << "U3V SpeedSupport" << ": 0x"
-										  << std::hex << static_cast<int>(info->bmSpeedSupport) << std::dec << '\n';
+					if (ch == static_cast<unsigned char>(kExitKey)) {
+						exitRequested = true;
+						continue;
+					}
+					// Maintain a simple local line buffer to intercept "exit".
+					if (ch == '\r' || ch == '\n') {
+						// End of line: check if the line is exactly "exit".
+						if (currentLine == "exit") {
+							// Do not send this line to remote, just exit locally.
+							toSend.push_back('\b');
+							toSend.push_back('\b');
+							toSend.push_back('\b');
+							toSend.push_back('\b');
+							flush();
+							exitRequested = true;
+							currentLine.clear();
+							continue;
+						} else {
+							if(tryHandleFileTransferCommand(currentLine) || currentLine.rfind("u3vjobs", 0) == 0){
+								bool handle = false;
+								for(int i =0;i<currentLine.size();i++){
+									toSend.push_back('\b');
 								}
-								ptr    += len;
-								remain -= len;
+								toSend.push_back('\n');
+								flush();
+								// Background jobs report through the I/O worker; foreground
+								// transfers use device_ and out_ directly.
+								if (!handleJobCommand(currentLine)) {
+									stopShellThreads(threads);
+									*out_ << std::endl;
+									handleFileTransferCommand(currentLine,handle);
+									startShellThreads(threads);
+								}
+								currentLine.clear();
+								continue;	
 							}
 						}
+						currentLine.clear();
+					} else if (ch == 0x7f || ch == '\b') {
+						// Handle backspace locally for the line buffer.
+						if (!currentLine.empty()) {
+							currentLine.pop_back();
+						}
+					} else if (std::isprint(ch)) {
+						currentLine.push_back(static_cast<char>(ch));
+					}
+					toSend.push_back(ch);
+					// Signals go out at once, even in the middle of a paste.
+					if (ch == 0x03 || ch == 0x1a || ch == 0x1c) {
+						flushDeadline = now;
 					}
-					libusb_free_config_descriptor(cfg);
 				}
 			}
-		} else {
-			std::cout << "Opened USB3 Vision device " << std::hex << vendorId << ':' << productId;
-			if (!serialFilter.empty()) {
-				std::cout << " (serial=" << serialFilter << ')';
+#ifdef _WIN32
+			if (consoleDrained) {
+				// Nothing more is buffered in the console: send now.
+				flushDeadline = std::chrono::steady_clock::now();
+			}
+#endif
+			if (!toSend.empty() && (exitRequested || toSend.size() >= kMaxCoalescedInput ||
+									std::chrono::steady_clock::now() >= flushDeadline)) {
+				if (!flush()) {
+					return false;
+				}
+			}
+			if (exitRequested) {
+				if (!exitWarned && jobsActive()) {
+					postJobNotice("\nbackground transfers are still running (see u3vjobs); exit again to cancel them\n");
+					exitWarned = true;
+					continue;
+				}
+				break;
+			}
+
+			printRequestedStats();
+		}
+
+		stopShellThreads(threads);
+		stopJobs(true);
+		std::string notices;
+		if (takeJobNotices(notices)) {
+			*out_ << notices << std::flush;
+		}
+		return true;
+	}
+
+	// Worker threads of interactiveLoopV2, connected by the two rings.
+	struct ShellThreads {
+		SpscByteRing input{kShellInputRing};   // stdin reader -> USB worker
+		SpscByteRing output{kShellOutputRing}; // USB worker -> stdout writer
+		Wakeup outputWake;
+		std::atomic<bool> stop{false};
+		std::atomic<bool> ioDone{false};
+		std::atomic<bool> failed{false};
+		std::thread io;
+		std::thread writer;
+#ifdef _WIN32
+		// Set when the USB worker ends, so the console wait wakes for it.
+		HANDLE ioEnded = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		~ShellThreads() { CloseHandle(ioEnded); }
+#endif
+	};
+
+	void startShellThreads(ShellThreads& threads) {
+		threads.stop = false;
+		threads.ioDone = false;
+#ifdef _WIN32
+		ResetEvent(threads.ioEnded);
+#endif
+		threads.io = std::thread([this, &threads] {
+			if (!shellIoLoop(threads)) {
+				threads.failed = true;
+			}
+			threads.ioDone = true;
+			threads.outputWake.notify();
+#ifdef _WIN32
+			SetEvent(threads.ioEnded);
+#endif
+		});
+		threads.writer = std::thread([&threads] { shellWriterLoop(threads); });
+	}
+
+	// Send whatever input is queued, print whatever output was read, then stop.
+	void stopShellThreads(ShellThreads& threads) {
+		threads.stop = true;
+		ioWake_.notify();
+		if (threads.io.joinable()) {
+			threads.io.join();
+		}
+		if (threads.writer.joinable()) {
+			threads.writer.join();
+		}
+	}
+
+	// The only user of device_ while the shell threads run. Queued input goes
+	// out first, in one pipelined write, then the output is polled, so
+	// neither waits on the other for longer than one transaction.
+	bool shellIoLoop(ShellThreads& threads) {
+		std::vector<uint8_t> input(kShellInputRing);
+		PollBackoff backoff(pollPolicy_);
+		auto lastPoll = std::chrono::steady_clock::time_point{};
+		bool moreOutput = false;
+		bool warnedOverflow = false;
+		std::string notices; // background job messages, printed between shell output chunks
+		while (true) {
+			// Anything queued before stop was set still goes out.
+			const bool stopping = threads.stop;
+			const size_t sent = threads.input.read(input.data(), input.size());
+			if (sent > 0) {
+				ForegroundGate::Scope busy(foreground_);
+				if (!writeTerminalInput(input.data(), sent)) {
+					return false;
+				}
+			}
+			if (takeJobNotices(notices) || !notices.empty()) {
+				notices.erase(0, threads.output.write(reinterpret_cast<const uint8_t*>(notices.data()),
+													  notices.size()));
+				threads.outputWake.notify();
+			}
+			if (stopping) {
+				if (!notices.empty()) {
+					postJobNotice(notices); // for whoever prints next
+				}
+				return true;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			const bool poll = !outputEvents_ || moreOutput || sent > 0 || consumeOutputEvent() ||
+							  now - lastPoll >= kEventSafetyPoll;
+			uint32_t received = 0;
+			if (poll) {
+				ForegroundGate::Scope busy(foreground_);
+				lastPoll = now;
+				TerminalStatusBlock snap;
+				if (!readSnapshot(kTerminalStatusAddr, snap)) {
+					return false;
+				}
+				if ((snap.status & kStatusOverflow) && !warnedOverflow) {
+					*err_ << "Warning: terminal output overflowed, some bytes dropped" << std::endl;
+					warnedOverflow = true;
+				}
+				if (snap.status & kStatusError) {
+					*err_ << "Terminal reported error bit" << std::endl;
+				}
+				if (snap.chunkHint != 0) {
+					chunkHint_ = snap.chunkHint;
+				}
+				const size_t space = threads.output.freeSpace();
+				received = static_cast<uint32_t>(
+					std::min<size_t>({snap.available, chunkHint_, kMaxFileDataWindow, space}));
+				if (received > 0) {
+					if (!readTerminalOutput(rxBuffer_.data(), received)) {
+						return false;
+					}
+					threads.output.write(rxBuffer_.data(), received);
+					threads.outputWake.notify();
+				}
+				moreOutput = snap.available > received;
 			}
-			std::cout << std::dec << std::endl;
+			if (sent > 0 || received > 0) {
+				backoff.reset();
+				continue;
+			}
+
+			// Idle, or the writer is behind: sleep until input is queued, an
+			// output event arrives or the next poll is due.
+			now = std::chrono::steady_clock::now();
+			const bool behind = moreOutput || !notices.empty();
+			ioWake_.waitUntil(behind          ? now + std::chrono::milliseconds(1)
+							  : outputEvents_ ? lastPoll + kEventSafetyPoll
+											  : now + backoff.nextDelay());
 		}
-		return true;
 	}
 
-	bool claimInterface(uint8_t interfaceNumber, uint8_t epOut, uint8_t epIn) {
-		if (!handle_) {
-			std::cerr << "Device handle is null" << std::endl;
-			return false;
+	static void shellWriterLoop(ShellThreads& threads) {
+		std::array<uint8_t, 16 * 1024> buf{};
+		while (true) {
+			// Checked before reading so the worker's last output is not lost.
+			const bool done = threads.ioDone;
+			const size_t n = threads.output.read(buf.data(), buf.size());
+			if (n > 0) {
+#ifndef _WIN32
+				int wr = ::write(STDOUT_FILENO, buf.data(), n);
+				(void)wr;
+#else
+				std::cout.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(n));
+				std::cout.flush();
+#endif
+				continue;
+			}
+			if (done) {
+				return;
+			}
+			threads.outputWake.waitUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
 		}
+	}
 
-		interfaceNumber_ = interfaceNumber;
-		bulkOut_ = epOut;
-		bulkIn_ = epIn;
+	// u3vget/u3vput started with a trailing '&' in the raw-mode shell. The
+	// device has one file channel, so jobs run one after another on their
+	// own thread, each through a TerminalClient of its own on device_.
+	enum class JobState { Queued, Running, Done, Failed };
+	struct TransferJob {
+		unsigned id = 0;
+		std::string command;
+		JobLogBuf log;
+		std::atomic<JobState> state{JobState::Queued};
+	};
 
-		if (libusb_kernel_driver_active(handle_, interfaceNumber_) == 1) {
-			const int detach = libusb_detach_kernel_driver(handle_, interfaceNumber_);
-			if (detach != LIBUSB_SUCCESS) {
-				std::cerr << "Failed to detach kernel driver: " << libusb_error_name(detach)
-						  << std::endl;
-				return false;
+	// Handle the shell-line forms that involve background jobs: "<transfer> &",
+	// u3vjobs, and transfers that would collide with a running job. Replies
+	// go out as job notices. Returns false for lines that are not such forms.
+	bool handleJobCommand(const std::string& line) {
+		auto tokens = splitTokens(line);
+		if (tokens.empty()) {
+			return false;
+		}
+		const std::string& op = tokens[0];
+		if (op == "u3vjobs") {
+			postJobNotice(listJobs());
+			return true;
+		}
+		const bool background = tokens.back() == "&" ||
+			(tokens.back().size() > 1 && tokens.back().back() == '&');
+		if (background) {
+			std::string command = line.substr(0, line.find_last_of('&'));
+			command.erase(command.find_last_not_of(" \t") + 1);
+			// Without the '&' and the options, the remote path is args[1].
+			std::vector<std::string> args = tokens;
+			if (args.back() == "&") {
+				args.pop_back();
+			} else {
+				args.back().pop_back();
+			}
+			const bool recursive = std::find(args.begin(), args.end(), "-r") != args.end();
+			args.erase(std::remove_if(args.begin(), args.end(),
+									  [](const std::string& arg) { return arg == "--resume" || arg == "-r"; }),
+					   args.end());
+			if (op != "u3vget" && op != "u3vput") {
+				postJobNotice("only u3vget and u3vput can run in the background\n");
+			} else if (op == "u3vget" && args.size() > 1 && hasWildcard(args[1])) {
+				// Expanding it would need the shell, which is in use.
+				postJobNotice("u3vget: remote wildcards cannot run in the background\n");
+			} else if (recursive) {
+				// The remote tar runs in the shell, which is in use.
+				postJobNotice(op + " -r cannot run in the background\n");
+			} else {
+				startBackgroundJob(command);
 			}
+			return true;
 		}
-
-		const int claim = libusb_claim_interface(handle_, interfaceNumber_);
-		if (claim != LIBUSB_SUCCESS) {
-			std::cerr << "Failed to claim interface " << static_cast<int>(interfaceNumber_)
-					  << ": " << libusb_error_name(claim) << std::endl;
-			return false;
+		if ((op == "u3vget" || op == "u3vput" || op == "u3vexec") && jobsActive()) {
+			postJobNotice(op + ": the file channel is busy with a background job, append '&' to queue it"
+							   " (see u3vjobs)\n");
+			return true;
 		}
-
-		std::cout << "Claimed interface " << static_cast<int>(interfaceNumber_)
-				  << " (OUT=0x" << std::hex << static_cast<int>(bulkOut_)
-				  << ", IN=0x" << static_cast<int>(bulkIn_) << ")" << std::dec << std::endl;
-		claimed_ = true;
-		return true;
+		return false;
 	}
 
-	// Discover the USB3 Vision (U3V) control interface and bulk IN/OUT endpoints.
-	// Matches interfaces with Class=0xEF (Misc), SubClass=0x05 (USB3 Vision), Protocol=0.
-	bool findU3VControlInterface(uint8_t& outInterface, uint8_t& outEpOut, uint8_t& outEpIn) {
-		if (!handle_) {
-			std::cerr << "Device handle is null" << std::endl;
-			return false;
+	void startBackgroundJob(const std::string& command) {
+		auto job = std::make_shared<TransferJob>();
+		{
+			std::lock_guard<std::mutex> lock(jobsMutex_);
+			job->id = nextJobId_++;
+			job->command = command;
+			jobs_.push_back(job);
+			if (!jobThread_.joinable()) {
+				jobsStop_ = false;
+				jobThread_ = std::thread([this] { runJobs(); });
+			}
 		}
+		jobsCv_.notify_all();
+		postJobNotice("[" + std::to_string(job->id) + "] " + command + "\n");
+	}
 
-		libusb_device* dev = libusb_get_device(handle_);
-		if (!dev) {
-			std::cerr << "Failed to get libusb_device from handle" << std::endl;
-			return false;
-		}
+	bool jobsActive() {
+		std::lock_guard<std::mutex> lock(jobsMutex_);
+		return std::any_of(jobs_.begin(), jobs_.end(), [](const std::shared_ptr<TransferJob>& job) {
+			return job->state == JobState::Queued || job->state == JobState::Running;
+		});
+	}
 
-		libusb_config_descriptor* cfg = nullptr;
-		int rc = libusb_get_active_config_descriptor(dev, &cfg);
-		if (rc != LIBUSB_SUCCESS || !cfg) {
-			std::cerr << "libusb_get_active_config_descriptor failed: "
-					  << libusb_error_name(rc) << std::endl;
-			return false;
+	// u3vjobs: one line per job; finished jobs are dropped once listed.
+	std::string listJobs() {
+		std::lock_guard<std::mutex> lock(jobsMutex_);
+		if (jobs_.empty()) {
+			return "no background transfers\n";
+		}
+		std::ostringstream text;
+		for (auto it = jobs_.begin(); it != jobs_.end();) {
+			const TransferJob& job = **it;
+			const JobState state = job.state;
+			static const char* const kNames[] = {"Queued", "Running", "Done", "Failed"};
+			text << '[' << job.id << "] " << std::left << std::setw(8) << kNames[static_cast<int>(state)]
+				 << job.command;
+			const std::string current = job.log.current();
+			if (state != JobState::Queued && !current.empty()) {
+				text << "  " << current;
+			}
+			text << '\n';
+			const bool finished = state == JobState::Done || state == JobState::Failed;
+			it = finished ? jobs_.erase(it) : it + 1;
 		}
+		return text.str();
+	}
 
-		bool found = false;
-		for (int i = 0; i < cfg->bNumInterfaces && !found; ++i) {
-			const libusb_interface& intf = cfg->interface[i];
-			for (int a = 0; a < intf.num_altsetting && !found; ++a) {
-				const libusb_interface_descriptor& idesc = intf.altsetting[a];
-				if (idesc.bInterfaceClass == 0xEF && // Miscellaneous Device
-					idesc.bInterfaceSubClass == 0x05 && // USB3 Vision
-					idesc.bInterfaceProtocol == 0x00) {
-					uint8_t epIn = 0, epOut = 0;
-					for (int e = 0; e < idesc.bNumEndpoints; ++e) {
-						const libusb_endpoint_descriptor& ep = idesc.endpoint[e];
-						uint8_t type = ep.bmAttributes & 0x3; // transfer type mask
-						if (type == LIBUSB_TRANSFER_TYPE_BULK) {
-							if (ep.bEndpointAddress & 0x80) {
-								epIn = ep.bEndpointAddress;
-							} else {
-								epOut = ep.bEndpointAddress;
-							}
-						}
-					}
-					if (epIn != 0 && epOut != 0) {
-						outInterface = idesc.bInterfaceNumber;
-						outEpIn = epIn;
-						outEpOut = epOut;
-						found = true;
-					}
-				}
+	// Let the job thread finish the queue and exit; with `cancel` the running
+	// and queued jobs give up instead.
+	void stopJobs(bool cancel) {
+		{
+			std::unique_lock<std::mutex> lock(jobsMutex_);
+			if (cancel) {
+				cancelJobs_ = true;
 			}
+			jobsStop_ = true;
 		}
-
-		libusb_free_config_descriptor(cfg);
-		if (!found) {
-			std::cerr << "No USB3 Vision control interface with bulk IN/OUT found" << std::endl;
+		jobsCv_.notify_all();
+		if (jobThread_.joinable()) {
+			jobThread_.join();
 		}
-		return found;
+		cancelJobs_ = false;
 	}
 
-	bool readRegisters(uint32_t address, uint16_t registerCount, std::vector<uint32_t>& outValues) {
-		if (registerCount == 0) {
-			outValues.clear();
-			return true;
-		}
-
-		const uint16_t bytesToRead = static_cast<uint16_t>(registerCount * 4);
-		std::vector<uint8_t> raw;
-		if (!readMemory(address, bytesToRead, raw)) {
+	bool takeJobNotices(std::string& text) {
+		if (!jobNoticesPending_.exchange(false)) {
 			return false;
 		}
-		outValues.resize(registerCount);
-		for (uint16_t i = 0; i < registerCount; ++i) {
-			uint32_t v = 0;
-			std::memcpy(&v, raw.data() + i * 4, 4);
-			outValues[i] = v;
-		}
+		std::lock_guard<std::mutex> lock(jobsMutex_);
+		text += jobNotices_;
+		jobNotices_.clear();
 		return true;
 	}
 
-	bool readMemory(uint32_t address, uint16_t bytes, std::vector<uint8_t>& outBytes) {
-		if (!claimed_) {
-			std::cerr << "Interface not claimed" << std::endl;
-			return false;
+	void postJobNotice(const std::string& text) {
+		{
+			std::lock_guard<std::mutex> lock(jobsMutex_);
+			jobNotices_ += text;
 		}
-		if (bytes == 0) {
-			outBytes.clear();
-			return true;
+		jobNoticesPending_ = true;
+		ioWake_.notify();
+	}
+
+	void runJobs() {
+		std::unique_lock<std::mutex> lock(jobsMutex_);
+		while (true) {
+			auto next = std::find_if(jobs_.begin(), jobs_.end(), [](const std::shared_ptr<TransferJob>& job) {
+				return job->state == JobState::Queued;
+			});
+			if (next == jobs_.end()) {
+				if (jobsStop_) {
+					return;
+				}
+				jobsCv_.wait(lock);
+				continue;
+			}
+			std::shared_ptr<TransferJob> job = *next;
+			job->state = JobState::Running;
+			lock.unlock();
+
+			std::ostream log(&job->log);
+			TerminalClient client(device_);
+			client.setOutput(log, log);
+			client.setProgressOutput(true);
+			client.shareSession(*this);
+			bool handled = false;
+			bool ok = false;
+			if (cancelJobs_) {
+				log << "cancelled before it started" << std::endl;
+			} else {
+				ok = client.handleFileTransferCommand(job->command, handled);
+			}
+			job->state = ok ? JobState::Done : JobState::Failed;
+			std::string notice = "[" + std::to_string(job->id) + "] " + (ok ? "Done" : "Failed") + "  " +
+								 job->command + "\n";
+			for (const std::string& line : job->log.lines()) {
+				notice += "    " + line + "\n";
+			}
+			postJobNotice(notice);
+			lock.lock();
 		}
+	}
 
-		UVCPReadMemoryCmd cmd{};
-		cmd.header.magic = UVCPConstants::MAGIC;
-		cmd.header.flags = UVCPConstants::FLAGS_REQUEST_ACK;
-		cmd.header.command = UVCPConstants::COMMAND_READ_MEMORY_CMD;
-		cmd.header.size = sizeof(cmd.address) + sizeof(cmd.unknown) + sizeof(cmd.size);
-		cmd.header.id = nextRequestId();
-		cmd.address = static_cast<uint64_t>(address);
-		cmd.unknown = 0;
-		cmd.size = bytes;
+	// Take over the session state of `owner` so this client can work next
+	// to it on the same device, yielding to its shell traffic.
+	void shareSession(TerminalClient& owner) {
+		initialized_ = owner.initialized_;
+		version_ = owner.version_;
+		caps_ = owner.caps_;
+		fileWindow_ = owner.fileWindow_;
+		fileWindowLimit_ = owner.fileWindowLimit_;
+		pollPolicy_ = owner.pollPolicy_;
+		uploadStatusInterval_ = owner.uploadStatusInterval_;
+		compressTransfers_ = owner.compressTransfers_;
+		resumeTransfers_ = owner.resumeTransfers_;
+		password_ = owner.password_;
+		echoEnabled_ = owner.echoEnabled_;
+		cache_ = owner.cache_;
+		yieldTo_ = &owner.foreground_;
+		cancel_ = &owner.cancelJobs_;
+	}
+
+	bool cancelled() const { return cancel_ && cancel_->load(); }
+
+	// Background work waits for the owner's shell traffic before queueing more.
+	void yieldToForeground() {
+		if (yieldTo_) {
+			yieldTo_->yield();
+		}
+	}
 
-		if (!bulkSend(&cmd, sizeof(cmd))) {
+	bool tryHandleFileTransferCommand(const std::string& line) {
+		auto tokens = splitTokens(line);
+		if (tokens.empty()) {
 			return false;
 		}
+		const std::string& op = tokens[0];
+		return op == "u3vget" || op == "u3vput" || op == "u3vexec" || op == "memread" || op == "memwrite" ||
+			   op == "u3vxml";
+	}
 
-		std::array<uint8_t, TY_UVCP_MAX_MSG_LEN> buffer{};
-		int pendingLoops = 0;
-		constexpr int kMaxPendingLoops = 5;
-		while (true) {
-			if (!bulkReceive(buffer.data(), static_cast<int>(buffer.size()))) {
-				return false;
+	// Expand a remote wildcard into the regular files it matches, smallest
+	// first. One stat call lists the names with their sizes and types; shells
+	// without stat(1) fall back to ls, in its order.
+	bool expandRemotePattern(const std::string& pattern, std::vector<std::string>& outPaths) {
+		outPaths.clear();
+		auto run = [&](const std::string& cmd, std::string& output) {
+			if (framedCommands_) {
+				if (!runFramed(cmd, [&output](const char* data, size_t size) { output.append(data, size); })) {
+					*err_ << "Failed to read remote pattern expansion output" << std::endl;
+					return false;
+				}
+				return true;
 			}
-
-			auto* hdr = reinterpret_cast<UVCPHeader*>(buffer.data());
-			if (hdr->magic != UVCPConstants::MAGIC) {
-				std::cerr << "Invalid ACK magic" << std::endl;
+			if (!sendCommand(cmd)) {
+				*err_ << "Failed to send remote pattern expansion command" << std::endl;
 				return false;
 			}
-			if (hdr->id != cmd.header.id) {
-				std::cerr << "ACK id mismatch: got " << hdr->id << ", expected " << cmd.header.id
-						  << std::endl;
+			if (!drainOutput(output, std::chrono::milliseconds(200), std::chrono::seconds(3))) {
+				*err_ << "Failed to read remote pattern expansion output" << std::endl;
 				return false;
 			}
-
-			if (hdr->command == UVCPConstants::COMMAND_PENDING_ACK) {
-				auto* p = reinterpret_cast<UVCPPendingAck*>(buffer.data());
-				const uint16_t waitMs = p->timeout_ms;
-				if (++pendingLoops > kMaxPendingLoops) {
-					std::cerr << "Too many PENDING_ACK responses" << std::endl;
-					return false;
-				}
-				std::this_thread::sleep_for(std::chrono::milliseconds(waitMs ? waitMs : 1));
+			return true;
+		};
+		auto trim = [](const std::string& line) {
+			const size_t start = line.find_first_not_of(" \t\r\n");
+			if (start == std::string::npos) {
+				return std::string();
+			}
+			return line.substr(start, line.find_last_not_of(" \t\r\n") - start + 1);
+		};
+		std::string output;
+		if (!run("stat -L -c '%s %f %n' -- " + pattern + " 2>/dev/null", output)) {
+			return false;
+		}
+		// "<size> <hex mode> <name>"
+		std::vector<std::pair<uint64_t, std::string>> files;
+		std::istringstream iss(output);
+		std::string line;
+		while (std::getline(iss, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			const size_t sizeEnd = line.find(' ');
+			const size_t modeEnd = sizeEnd == std::string::npos ? sizeEnd : line.find(' ', sizeEnd + 1);
+			if (modeEnd == std::string::npos || sizeEnd == 0 ||
+				line.find_first_not_of("0123456789", 0) != sizeEnd ||
+				line.find_first_not_of("0123456789abcdef", sizeEnd + 1) != modeEnd) {
 				continue;
 			}
-
-			if (hdr->command != UVCPConstants::COMMAND_READ_MEMORY_ACK) {
-				std::cerr << "Unexpected ACK command: 0x" << std::hex << hdr->command << std::dec
-						  << std::endl;
-				return false;
+			const std::string name = line.substr(modeEnd + 1);
+			const unsigned long mode = std::stoul(line.substr(sizeEnd + 1, modeEnd - sizeEnd - 1), nullptr, 16);
+			if ((mode & 0170000) == 0100000 && wildcardMatch(pattern.c_str(), name.c_str())) {
+				files.emplace_back(std::stoull(line.substr(0, sizeEnd)), name);
 			}
-
-			if (hdr->size != bytes) {
-				std::cerr << "Read size mismatch: got " << hdr->size << ", expected " << bytes
-						  << std::endl;
+		}
+		if (files.empty()) {
+			output.clear();
+			if (!run("ls -1 -d " + pattern + " 2>/dev/null", output)) {
 				return false;
 			}
-
-			auto* ack = reinterpret_cast<UVCPReadMemoryAck*>(buffer.data());
-			outBytes.assign(ack->data, ack->data + bytes);
+			std::istringstream names(output);
+			while (std::getline(names, line)) {
+				const std::string candidate = trim(line);
+				if (!candidate.empty() && wildcardMatch(pattern.c_str(), candidate.c_str())) {
+					outPaths.push_back(candidate);
+				}
+			}
 			return true;
 		}
+		std::stable_sort(files.begin(), files.end(),
+						 [](const auto& a, const auto& b) { return a.first < b.first; });
+		for (auto& file : files) {
+			outPaths.push_back(std::move(file.second));
+		}
+		return true;
 	}
 
-	bool writeRegister(uint32_t address, uint32_t value) {
-		return writeRegisters(address, std::vector<uint32_t>{value});
+	std::string resolveLocalPath(const std::string& path) const {
+		if (localDirectory_.empty() || path.empty() || std::filesystem::path(path).is_absolute()) {
+			return path;
+		}
+		return (localDirectory_ / path).string();
 	}
 
-	bool writeRegisters(uint32_t startAddress, const std::vector<uint32_t>& values) {
-		if (values.empty()) {
+	bool handleFileTransferCommand(const std::string& line, bool& handled) {
+		handled = false;
+		auto tokens = splitTokens(line);
+		if (tokens.empty()) {
+			return true;
+		}
+		const std::string& op = tokens[0];
+		if (op == "memread" || op == "memwrite") {
+			handled = true;
+			return handleMemoryCommand(tokens);
+		}
+		if (op == "u3vxml") {
+			handled = true;
+			return handleGenICamCommand(tokens);
+		}
+		if (op == "u3vexec") {
+			handled = true;
+			// The command is the raw text between the keyword and the last word.
+			const size_t begin = line.find_first_not_of(" \t", line.find(op) + op.size());
+			const size_t end = line.find_last_not_of(" \t");
+			const size_t last = line.find_last_of(" \t", end);
+			if (tokens.size() < 3 || !framedCommands_ || last == std::string::npos || last < begin) {
+				*err_ << "Usage: u3vexec <command...> <local-path> (needs framed shell commands)" << std::endl;
+				return tokens.size() < 3;
+			}
+			return performRemoteExec(line.substr(begin, line.find_last_not_of(" \t", last) - begin + 1),
+									 resolveLocalPath(tokens.back()));
+		}
+		if (op != "u3vget" && op != "u3vput") {
 			return true;
 		}
-		std::vector<uint8_t> bytes(values.size() * 4);
-		for (size_t i = 0; i < values.size(); ++i) {
-			std::memcpy(bytes.data() + i * 4, &values[i], 4);
+		handled = true;
+		bool resume = resumeTransfers_;
+		bool delta = false;
+		bool recursive = false;
+		for (auto it = tokens.begin() + 1; it != tokens.end();) {
+			if (*it == "--resume") {
+				resume = true;
+				it = tokens.erase(it);
+			} else if (*it == "--delta" && op == "u3vput") {
+				delta = true;
+				it = tokens.erase(it);
+			} else if (*it == "-r") {
+				recursive = true;
+				it = tokens.erase(it);
+			} else {
+				++it;
+			}
 		}
-		return writeMemory(startAddress, bytes.data(), static_cast<uint16_t>(bytes.size()));
-	}
-
-	bool writeMemory(uint32_t startAddress, const uint8_t* data, uint16_t bytes) {
-		if (!claimed_) {
-			std::cerr << "Interface not claimed" << std::endl;
-			return false;
+		if (tokens.size() == 3) {
+			std::string& local = op == "u3vget" ? tokens[2] : tokens[1];
+			local = resolveLocalPath(local);
 		}
-		if (bytes == 0) {
+		if (recursive && tokens.size() == 3) {
+			if (!framedCommands_) {
+				*err_ << op << " -r: needs framed shell commands" << std::endl;
+				return false;
+			}
+			return op == "u3vget" ? performArchiveDownload(tokens[1], tokens[2])
+								  : performArchiveUpload(tokens[1], tokens[2]);
+		}
+		if (op == "u3vget") {
+			if (tokens.size() != 3) {
+				*err_ << "Usage: u3vget [--resume] <remote-path> <local-path>\n"
+						 "       u3vget -r <remote-dir> <local-dir>" << std::endl;
+				return true;
+			}
+			const std::string& remoteSpec = tokens[1];
+			const std::string& localSpec = tokens[2];
+			if (!hasWildcard(remoteSpec)) {
+				return performFileDownload(remoteSpec, localSpec, resume);
+			}
+			// Remote wildcard: download multiple remote files into local directory
+			namespace fs = std::filesystem;
+			fs::path localDir(localSpec);
+			if (!localSpec.empty() && localSpec.back() == '/') {
+				// Treat as directory path
+			} else if (fs::exists(localDir) && fs::is_directory(localDir)) {
+				// Existing directory
+			} else {
+				// Ensure directory exists when using wildcard remote path
+				std::error_code ec;
+				if (!fs::create_directories(localDir, ec) && ec) {
+					*err_ << "u3vget: local path must be a directory when remote path contains wildcards" << std::endl;
+					return true;
+				}
+			}
+			std::vector<std::string> remotePaths;
+			if (!expandRemotePattern(remoteSpec, remotePaths)) {
+				return false;
+			}
+			if (remotePaths.empty()) {
+				*err_ << "u3vget: no remote files match pattern '" << remoteSpec << "'" << std::endl;
+				return true;
+			}
+			bool allOk = true;
+			for (const auto& rp : remotePaths) {
+				fs::path lp = localDir / fs::path(rp).filename();
+				if (!performFileDownload(rp, lp.string(), resume)) {
+					allOk = false;
+				}
+			}
+			return allOk;
+		}
+		// u3vput
+		if (tokens.size() != 3) {
+			*err_ << "Usage: u3vput [--resume | --delta] <local-path> <remote-path>\n"
+					 "       u3vput -r <local-dir> <remote-dir>" << std::endl;
 			return true;
 		}
+		const std::string& localSpec = tokens[1];
+		const std::string& remoteDest = tokens[2];
+		std::vector<std::string> sources = expandLocalPattern(localSpec);
+		if (sources.empty()) {
+			*err_ << "u3vput: no local files match '" << localSpec << "'" << std::endl;
+			return true;
+		}
+		if (sources.size() > 1) {
+			if (remoteDest.empty() || remoteDest.back() != '/') {
+				*err_ << "u3vput: multiple source files matched; remote path must end with '/'" << std::endl;
+				return true;
+			}
+		}
+		bool allOk = true;
+		namespace fs = std::filesystem;
+		for (const auto& src : sources) {
+			std::string remotePath = remoteDest;
+			if (sources.size() > 1 || (!remoteDest.empty() && remoteDest.back() == '/')) {
+				fs::path sp(src);
+				remotePath = remoteDest + sp.filename().string();
+			}
+			if (delta ? !performDeltaUpload(src, remotePath) : !performFileUpload(src, remotePath, resume)) {
+				allOk = false;
+			}
+		}
+		return allOk;
+	}
+	struct BenchOptions {
+		size_t iterations = 1000;        // samples per latency test
+		uint64_t fileBytes = 16u << 20;  // bytes streamed per file channel test
+		bool csv = false;
+	};
 
-		const size_t headerSize = sizeof(UVCPWriteMemoryCmd) - sizeof(((UVCPWriteMemoryCmd*)0)->data);
-		std::vector<uint8_t> tx(headerSize + bytes, 0);
-		auto* cmd = reinterpret_cast<UVCPWriteMemoryCmd*>(tx.data());
-		cmd->header.magic = UVCPConstants::MAGIC;
-		cmd->header.flags = UVCPConstants::FLAGS_REQUEST_ACK;
-		cmd->header.command = UVCPConstants::COMMAND_WRITE_MEMORY_CMD;
-		cmd->header.size = sizeof(cmd->address) + bytes;
-		cmd->header.id = nextRequestId();
-		cmd->address = static_cast<uint64_t>(startAddress);
-		std::memcpy(cmd->data, data, bytes);
-
-		if (!bulkSend(tx.data(), static_cast<int>(tx.size()))) {
+	// Measure register latency, readMemory throughput, shell round trips and
+	// file channel throughput using the same primitives as normal operation.
+	bool benchmark(const BenchOptions& opts) {
+		if (!ensureSession()) {
 			return false;
 		}
-
-		std::array<uint8_t, TY_UVCP_MAX_MSG_LEN> buffer{};
-		int pendingLoops = 0;
-		constexpr int kMaxPendingLoops = 5;
-		while (true) {
-			if (!bulkReceive(buffer.data(), static_cast<int>(buffer.size()))) {
-				return false;
-			}
-			auto* hdr = reinterpret_cast<UVCPHeader*>(buffer.data());
-			if (hdr->magic != UVCPConstants::MAGIC) {
-				std::cerr << "Invalid ACK magic" << std::endl;
-				return false;
-			}
-			if (hdr->id != cmd->header.id) {
-				std::cerr << "ACK id mismatch: got " << hdr->id << ", expected " << cmd->header.id
-						  << std::endl;
-				return false;
-			}
-			if (hdr->command == UVCPConstants::COMMAND_PENDING_ACK) {
-				auto* p = reinterpret_cast<UVCPPendingAck*>(buffer.data());
-				const uint16_t waitMs = p->timeout_ms;
-				if (++pendingLoops > kMaxPendingLoops) {
-					std::cerr << "Too many PENDING_ACK responses" << std::endl;
+		using Clock = std::chrono::steady_clock;
+		struct Row {
+			std::string test;
+			uint32_t bytes = 0;
+			size_t count = 0;
+			std::vector<double> samplesUs; // per operation; empty for streamed tests
+			double seconds = 0;
+		};
+		std::vector<Row> rows;
+		auto timeEach = [&](const std::string& test, uint32_t bytes, size_t count,
+							const std::function<bool()>& op) {
+			Row row{test, bytes, count, {}, 0};
+			row.samplesUs.reserve(count);
+			const auto start = Clock::now();
+			for (size_t i = 0; i < count; ++i) {
+				const auto t0 = Clock::now();
+				if (!op()) {
+					*err_ << "bench: " << test << " failed" << std::endl;
 					return false;
 				}
-				std::this_thread::sleep_for(std::chrono::milliseconds(waitMs ? waitMs : 1));
-				continue;
+				row.samplesUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
 			}
-			if (hdr->command != UVCPConstants::COMMAND_WRITE_MEMORY_ACK) {
-				std::cerr << "Unexpected ACK command: 0x" << std::hex << hdr->command << std::dec
-						  << std::endl;
+			row.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			rows.push_back(std::move(row));
+			return true;
+		};
+		// Queue `count` transfers of `bytes` through the pipeline and time the lot.
+		auto timeStream = [&](const std::string& test, uint32_t bytes, size_t count,
+							  const std::function<void(size_t, UVCPWaitGroup&)>& submit) {
+			UVCPWaitGroup group;
+			const auto start = Clock::now();
+			for (size_t i = 0; i < count; ++i) {
+				submit(i, group);
+			}
+			const bool ok = group.wait();
+			if (!ok) {
+				*err_ << "bench: " << test << " failed" << std::endl;
 				return false;
 			}
+			rows.push_back(Row{test, bytes, count, {}, std::chrono::duration<double>(Clock::now() - start).count()});
+			return true;
+		};
 
-			auto* ack = reinterpret_cast<UVCPWriteMemoryAck*>(buffer.data());
-			if (ack->bytes_written != bytes) {
-				std::cerr << "Write bytes mismatch: got " << ack->bytes_written << ", expected "
-						  << bytes << std::endl;
+		uint32_t value = 0;
+		bool ok = timeEach("reg-read", 4, opts.iterations,
+						   [&] { return readRegister(kTerminalVersionAddr, value); }) &&
+				  timeEach("reg-write", 4, opts.iterations,
+						   [&] { return writeRegister(kTerminalFileCmdAddr, kFileCmdNone); });
+
+		// Shell round trip: send a marker and wait until it comes back.
+		const std::string marker = "u3vdb-bench";
+		ok = ok && timeEach("shell-rtt", static_cast<uint32_t>(marker.size()), std::min<size_t>(opts.iterations, 50), [&] {
+			if (!sendCommand("echo " + marker)) {
 				return false;
 			}
+			std::string output;
+			const auto deadline = Clock::now() + std::chrono::seconds(5);
+			while (output.find(marker) == std::string::npos) {
+				if (Clock::now() > deadline ||
+					!drainOutput(output, std::chrono::milliseconds(0), std::chrono::seconds(1))) {
+					return false;
+				}
+			}
 			return true;
-		}
-	}
+		});
 
-	void shutdown() {
-		if (handle_ && claimed_) {
-			libusb_release_interface(handle_, interfaceNumber_);
-			claimed_ = false;
-		}
-		if (handle_) {
-			libusb_close(handle_);
-			handle_ = nullptr;
-		}
-		if (ctx_) {
-			libusb_exit(ctx_);
-			ctx_ = nullptr;
+		// readMemory and u3vget-style streaming against an endless remote source.
+		if (ok && !openRemoteFile("/dev/zero", kFileCmdOpenRead, kFileStatusReading)) {
+			ok = false;
 		}
-	}
-
-  private:
-	bool bulkSend(const void* data, int length) {
-		int transferred = 0;
-		const int rc = libusb_bulk_transfer(handle_, bulkOut_,
-											reinterpret_cast<unsigned char*>(const_cast<void*>(data)),
-											length, &transferred, kTransferTimeoutMs);
-		if (rc != LIBUSB_SUCCESS || transferred != length) {
-			std::cerr << "Bulk OUT failed: " << libusb_error_name(rc)
-					  << ", bytes=" << transferred << '/' << length << std::endl;
-			return false;
+		if (ok) {
+			std::vector<uint32_t> sizes;
+			for (uint32_t size = 64; size < fileWindow_; size *= 4) {
+				sizes.push_back(size);
+			}
+			sizes.push_back(fileWindow_);
+			for (uint32_t size : sizes) {
+				const size_t count = static_cast<size_t>(
+					std::clamp<uint64_t>(opts.fileBytes / size, 16, opts.iterations));
+				ok = ok && timeEach("read-mem", size, count, [&] {
+					return device_.readMemory(fileDataAddr(), rxBuffer_.data(), static_cast<uint16_t>(size));
+				});
+			}
+			const size_t chunks = static_cast<size_t>((opts.fileBytes + fileWindow_ - 1) / fileWindow_);
+			ok = ok && timeStream("u3vget-zero", fileWindow_, chunks, [&](size_t, UVCPWaitGroup& group) {
+				device_.submitReadMemory(fileDataAddr(), rxBuffer_.data(),
+										 static_cast<uint16_t>(fileWindow_), group);
+			});
+			// Register latency while a second thread keeps the pipeline full of
+			// file reads on the same device.
+			if (ok) {
+				std::atomic<bool> stopStream{false};
+				std::thread streamer([&] {
+					std::vector<uint8_t> scratch(fileWindow_);
+					while (!stopStream) {
+						UVCPWaitGroup group;
+						for (size_t i = 0; i < kDefaultPipelineDepth; ++i) {
+							device_.submitReadMemory(fileDataAddr(), scratch.data(),
+													 static_cast<uint16_t>(fileWindow_), group);
+						}
+						group.wait();
+					}
+				});
+				ok = timeEach("reg-busy", 4, opts.iterations, [&] { return readRegister(kTerminalVersionAddr, value); });
+				stopStream = true;
+				streamer.join();
+			}
+			ok = closeFileChannel() && ok;
 		}
-		return true;
-	}
 
-	bool bulkReceive(void* data, int length) {
-		int transferred = 0;
-		const int rc = libusb_bulk_transfer(handle_, bulkIn_,
-											reinterpret_cast<unsigned char*>(data), length,
-											&transferred, kTransferTimeoutMs);
-		if (rc != LIBUSB_SUCCESS) {
-			std::cerr << "Bulk IN failed: " << libusb_error_name(rc) << std::endl;
-			return false;
+		// u3vput-style streaming into a remote sink, with the usual status checks.
+		if (ok && !openRemoteFile("/dev/null", kFileCmdOpenWrite, kFileStatusWriting)) {
+			ok = false;
 		}
-		if (transferred <= 0) {
-			std::cerr << "Bulk IN returned " << transferred << " bytes" << std::endl;
-			return false;
+		if (ok) {
+			std::vector<uint8_t> payload(fileWindow_, 0);
+			uint32_t status = 0;
+			const size_t chunks = static_cast<size_t>((opts.fileBytes + fileWindow_ - 1) / fileWindow_);
+			ok = timeStream("u3vput-null", fileWindow_, chunks, [&](size_t i, UVCPWaitGroup& group) {
+				device_.submitWriteMemory(fileDataAddr(), payload.data(),
+										  static_cast<uint16_t>(payload.size()), group);
+				if ((i + 1) % uploadStatusInterval_ == 0 || i + 1 == chunks) {
+					device_.submitReadMemory(kTerminalFileStatusAddr, reinterpret_cast<uint8_t*>(&status),
+											 sizeof(status), group);
+				}
+			});
+			if (ok && (status & kFileStatusError)) {
+				ok = checkFileError("bench");
+			}
+			ok = closeFileChannel() && ok;
 		}
 
-		return true;
+		auto percentile = [](std::vector<double> samples, double p) {
+			if (samples.empty()) {
+				return 0.0;
+			}
+			std::sort(samples.begin(), samples.end());
+			const size_t rank = static_cast<size_t>(std::ceil(p * static_cast<double>(samples.size())));
+			return samples[std::min(samples.size(), std::max<size_t>(rank, 1)) - 1];
+		};
+		std::ostream& out = *out_;
+		const auto flags = out.flags();
+		out << std::fixed << std::setprecision(1);
+		if (opts.csv) {
+			out << "test,bytes,count,p50_us,p99_us,mean_us,mb_per_s\n";
+		} else {
+			out << std::left << std::setw(12) << "test" << std::right << std::setw(8) << "bytes"
+				<< std::setw(8) << "count" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+				<< std::setw(10) << "mean us" << std::setw(10) << "MB/s" << '\n';
+		}
+		for (const Row& row : rows) {
+			const double meanUs = row.seconds * 1e6 / static_cast<double>(std::max<size_t>(row.count, 1));
+			const double mbps = static_cast<double>(row.bytes) * static_cast<double>(row.count) /
+								std::max(row.seconds, 1e-9) / 1e6;
+			const bool sampled = !row.samplesUs.empty();
+			if (opts.csv) {
+				out << row.test << ',' << row.bytes << ',' << row.count << ',';
+				if (sampled) {
+					out << percentile(row.samplesUs, 0.50) << ',' << percentile(row.samplesUs, 0.99);
+				} else {
+					out << ',';
+				}
+				out << ',' << meanUs << ',' << mbps << '\n';
+			} else {
+				out << std::left << std::setw(12) << row.test << std::right << std::setw(8) << row.bytes
+					<< std::setw(8) << row.count;
+				if (sampled) {
+					out << std::setw(10) << percentile(row.samplesUs, 0.50)
+						<< std::setw(10) << percentile(row.samplesUs, 0.99);
+				} else {
+					out << std::setw(10) << '-' << std::setw(10) << '-';
+				}
+				out << std::setw(10) << meanUs << std::setw(10) << mbps << '\n';
+			}
+		}
+		out.flags(flags);
+		out << std::flush;
+		return ok;
 	}
 
-	uint16_t nextRequestId() { return ++requestId_; }
-
-	libusb_context* ctx_ = nullptr;
-	libusb_device_handle* handle_ = nullptr;
-	uint8_t interfaceNumber_ = 0;
-	uint8_t bulkOut_ = 0;
-	uint8_t bulkIn_ = 0;
-	bool claimed_ = false;
-	uint16_t requestId_ = 0;
+	struct MonitorOptions {
+		std::vector<std::pair<uint32_t, uint16_t>> ranges; // first register address, register count
+		uint32_t rate = 100;   // samples per second
+		uint64_t samples = 0;  // stop after this many (0 = no limit)
+		uint32_t seconds = 0;  // stop after this long (0 = no limit)
+		std::string outPath;   // empty = the client's output
+		bool binary = false;
+		uint32_t mergeGap = 0; // unrequested bytes a block read may span
 	};
 
-	bool hasWildcard(const std::string& s) {
-		return s.find_first_of("*?[") != std::string::npos;
-	}
-
-	bool wildcardMatch(const char* pattern, const char* str) {
-		const char* p = pattern;
-		const char* s = str;
-		const char* star = nullptr;
-		const char* starMatch = nullptr;
-		while (*s) {
-			if (*p == '?' || *p == *s) {
-				++p;
-				++s;
-				continue;
+	// Sample the registers of opts.ranges at opts.rate until a limit is hit
+	// or `stop` is set. Adjacent registers are read as one block, and so are
+	// those up to opts.mergeGap bytes apart (opt-in: reading registers nobody
+	// asked for can have side effects). A sample queues all of its block
+	// reads at once. Samples go through a
+	// ring to a writer thread that streams CSV, or binary records of a
+	// uint64_t nanosecond timestamp and the uint32_t values in host byte
+	// order. The achieved rate is reported on err_ at the end.
+	bool monitor(const MonitorOptions& opts, const std::atomic<bool>& stop) {
+		using Clock = std::chrono::steady_clock;
+		std::vector<uint32_t> columns;
+		for (const auto& range : opts.ranges) {
+			for (uint32_t i = 0; i < range.second; ++i) {
+				columns.push_back(range.first + 4 * i);
 			}
-			if (*p == '*') {
-				star = p++;
-				starMatch = s;
-				continue;
+		}
+		std::vector<uint32_t> sorted = columns;
+		std::sort(sorted.begin(), sorted.end());
+		sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+		struct Block {
+			uint32_t address;
+			uint16_t bytes;
+			size_t offset; // into the sample scratch buffer
+		};
+		const uint32_t maxRead = std::max<uint32_t>(4, device_.transferLimits().maxRead & ~3u);
+		std::vector<Block> blocks;
+		size_t scratchBytes = 0;
+		for (uint32_t address : sorted) {
+			if (!blocks.empty()) {
+				Block& last = blocks.back();
+				const uint32_t end = last.address + last.bytes;
+				if (address - end <= opts.mergeGap && address + 4 - last.address <= maxRead) {
+					scratchBytes += address + 4 - end;
+					last.bytes = static_cast<uint16_t>(address + 4 - last.address);
+					continue;
+				}
 			}
-			if (star) {
-				p = star + 1;
-				s = ++starMatch;
-				continue;
+			blocks.push_back(Block{address, 4, scratchBytes});
+			scratchBytes += 4;
+		}
+		std::vector<size_t> columnOffsets;
+		for (uint32_t address : columns) {
+			const auto block = std::prev(std::upper_bound(blocks.begin(), blocks.end(), address,
+											[](uint32_t a, const Block& b) { return a < b.address; }));
+			columnOffsets.push_back(block->offset + (address - block->address));
+		}
+
+		std::ofstream file;
+		std::vector<char> fileBuffer;
+		if (!opts.outPath.empty()) {
+			fileBuffer.resize(kLocalFileBuffer);
+			file.rdbuf()->pubsetbuf(fileBuffer.data(), static_cast<std::streamsize>(fileBuffer.size()));
+			file.open(opts.outPath, opts.binary ? std::ios::binary | std::ios::trunc : std::ios::trunc);
+			if (!file) {
+				*err_ << "monitor: cannot write '" << opts.outPath << "'" << std::endl;
+				return false;
 			}
-			return false;
 		}
-		while (*p == '*') {
-			++p;
-		}
-		return *p == '\0';
+		std::ostream& out = opts.outPath.empty() ? *out_ : file;
+		if (!opts.binary) {
+			out << "time_s";
+			for (uint32_t address : columns) {
+				out << ",0x" << std::hex << std::setw(8) << std::setfill('0') << address << std::dec;
+			}
+			out << '\n';
+		}
+
+		const size_t recordSize = sizeof(uint64_t) + columns.size() * sizeof(uint32_t);
+		SpscByteRing ring(std::max(kMonitorRingBytes, 2 * recordSize));
+		Wakeup wakeup;
+		std::atomic<bool> sampling{true};
+		std::thread writer([&] {
+			std::vector<uint8_t> chunk(recordSize * std::max<size_t>(1, 65536 / recordSize));
+			for (;;) {
+				const bool last = !sampling.load();
+				const size_t got = ring.read(chunk.data(), chunk.size());
+				if (got == 0) {
+					if (last) {
+						break;
+					}
+					wakeup.waitUntil(Clock::now() + std::chrono::milliseconds(50));
+					continue;
+				}
+				if (opts.binary) {
+					out.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(got));
+					continue;
+				}
+				for (size_t at = 0; at < got; at += recordSize) {
+					uint64_t ns = 0;
+					std::memcpy(&ns, chunk.data() + at, sizeof(ns));
+					out << ns / 1000000000u << '.' << std::setw(9) << std::setfill('0') << ns % 1000000000u;
+					for (size_t c = 0; c < columns.size(); ++c) {
+						uint32_t value = 0;
+						std::memcpy(&value, chunk.data() + at + sizeof(ns) + c * sizeof(value), sizeof(value));
+						out << ",0x" << std::hex << std::setw(8) << value << std::dec;
+					}
+					out << '\n';
+				}
+			}
+			out << std::flush;
+		});
+
+		const auto period = std::chrono::nanoseconds(1000000000ull / opts.rate);
+		const auto start = Clock::now();
+		const auto end = opts.seconds ? start + std::chrono::seconds(opts.seconds) : Clock::time_point::max();
+		auto next = start;
+		std::vector<uint8_t> scratch(scratchBytes);
+		std::vector<uint8_t> record(recordSize);
+		uint64_t taken = 0;
+		uint64_t dropped = 0;
+		double readSeconds = 0;
+		bool ok = true;
+		while (!stop && (opts.samples == 0 || taken < opts.samples)) {
+			if (next > Clock::now()) {
+				std::this_thread::sleep_until(next);
+			}
+			const auto t0 = Clock::now();
+			if (t0 >= end) {
+				break;
+			}
+			UVCPWaitGroup group;
+			for (const Block& block : blocks) {
+				device_.submitReadMemory(block.address, scratch.data() + block.offset, block.bytes, group);
+			}
+			if (!group.wait()) {
+				*err_ << "monitor: register read failed" << std::endl;
+				ok = false;
+				break;
+			}
+			const auto t1 = Clock::now();
+			readSeconds += std::chrono::duration<double>(t1 - t0).count();
+			const uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t0 - start).count());
+			std::memcpy(record.data(), &ns, sizeof(ns));
+			for (size_t c = 0; c < columns.size(); ++c) {
+				std::memcpy(record.data() + sizeof(ns) + c * sizeof(uint32_t), scratch.data() + columnOffsets[c],
+							sizeof(uint32_t));
+			}
+			if (ring.freeSpace() >= recordSize) {
+				ring.write(record.data(), recordSize);
+				wakeup.notify();
+			} else {
+				++dropped;
+			}
+			++taken;
+			// Behind schedule: carry on from now rather than bursting to catch up.
+			next = std::max(next + period, t1);
+		}
+		const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		sampling = false;
+		wakeup.notify();
+		writer.join();
+		if (file.is_open() && !file) {
+			*err_ << "monitor: writing '" << opts.outPath << "' failed" << std::endl;
+			ok = false;
+		}
+
+		const double achieved = elapsed > 0 ? static_cast<double>(taken) / elapsed : 0.0;
+		const double meanReadUs = taken ? readSeconds * 1e6 / static_cast<double>(taken) : 0.0;
+		std::ostringstream report;
+		report << std::fixed << std::setprecision(1) << "monitor: " << taken << " samples of " << columns.size()
+			   << " registers (" << blocks.size() << (blocks.size() == 1 ? " block read" : " block reads")
+			   << " each) in " << std::setprecision(3) << elapsed
+			   << " s, " << std::setprecision(1) << achieved << " Hz of " << opts.rate << " Hz requested, "
+			   << meanReadUs << " us per sample";
+		if (dropped) {
+			report << ", " << dropped << " dropped by the writer";
+		}
+		*err_ << report.str() << std::endl;
+		if (taken > 1 && achieved < 0.95 * opts.rate) {
+			*err_ << "monitor: the link is saturated, about " << static_cast<uint64_t>(1e6 / std::max(meanReadUs, 1e-3))
+				  << " Hz is possible with these registers" << std::endl;
+		}
+		return ok;
 	}
 
-	std::vector<std::string> expandLocalPattern(const std::string& pattern) {
-		std::vector<std::string> results;
-		if (!hasWildcard(pattern)) {
-			results.push_back(pattern);
-			return results;
-		}
-		namespace fs = std::filesystem;
-		fs::path p(pattern);
-		fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
-		std::string namePattern = p.filename().string();
-		std::error_code ec;
-		fs::directory_iterator it(dir, ec);
-		if (ec) {
-			return results;
+	void setEchoEnabled(bool enable) { echoEnabled_ = enable; }
+	bool getEchoEnabled() {
+		uint32_t status = 0;
+		// If we cannot read the terminal status register, treat as error.
+		if (!const_cast<TerminalClient*>(this)->readRegister(kTerminalStatusAddr, status)) {
+			*err_ << "Failed to read terminal status register for echo state" << std::endl;
+			return echoEnabled_;
 		}
-		for (const auto& entry : it) {
-			std::string filename = entry.path().filename().string();
-			if (wildcardMatch(namePattern.c_str(), filename.c_str())) {
-				results.push_back(entry.path().string());
-			}
+		if ((status & kStatusEchoEnabled) != 0) {
+			echoEnabled_ = true;
+		} else {
+			echoEnabled_ = false;
 		}
-		return results;
+		return echoEnabled_;
 	}
 
-	std::vector<std::string> splitTokens(const std::string& line);
-
-	class TerminalClient {
-  public:
-	explicit TerminalClient(U3VDevice& dev) : device_(dev) {}
-	uint32_t getVersion() const { return version_; }
+  private:
+	struct StdinState {
+#ifdef _WIN32
+		DWORD origMode = 0;
+		bool hasMode = false;
+#else
+		termios orig{};
+#endif
+	};
 
-	bool initialize() {
-		if (initialized_) {
-			return true;
-		}
-		std::vector<uint32_t> regs;
-		if (!device_.readRegisters(kTerminalBaseAddr, 2, regs)) {
-			std::cerr << "Failed to read terminal header" << std::endl;
-			return false;
-		}
-		if (regs[0] != kTerminalMagic) {
-			std::cerr << "Unexpected terminal magic 0x" << std::hex << regs[0]
-					  << ", expected 0x" << kTerminalMagic << std::dec << std::endl;
+	static bool setStdinRaw(StdinState& state) {
+#ifdef _WIN32
+		HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
+		if (hIn == INVALID_HANDLE_VALUE || hIn == nullptr) {
 			return false;
 		}
-		version_ = regs[1];
-		// also read explicit version register if available
-		uint32_t verReg = 0;
-		if (device_.readRegisters(kTerminalVersionAddr, 1, regs)) {
-			verReg = regs[0];
-			if (verReg != 0) {
-				version_ = verReg;
-			}
-		}
-		chunkHint_ = readRegisterOr(kTerminalChunkHintAddr, chunkHint_);
-		if (chunkHint_ == 0) {
-			chunkHint_ = 512;
-		}
-		initialized_ = true;
-		return true;
-	}
-
-	bool ensureSession() {
-		if (!initialized_ && !initialize()) {
+		DWORD mode = 0;
+		if (!GetConsoleMode(hIn, &mode)) {
 			return false;
 		}
-		if (!ensureAuth()) {
+		state.origMode = mode;
+		state.hasMode = true;
+		mode &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT);
+		mode |= ENABLE_EXTENDED_FLAGS;
+		if (!SetConsoleMode(hIn, mode)) {
 			return false;
 		}
-		uint32_t status = 0;
-		if (!readRegister(kTerminalStatusAddr, status)) {
+		return true;
+#else
+		if (tcgetattr(STDIN_FILENO, &state.orig) != 0) {
+			std::perror("tcgetattr");
 			return false;
 		}
-		if (status & kStatusReady) {
-			return true;
-		}
-		uint32_t ctrl = kCtrlStart | kCtrlClearFlags;
-		if (echoEnabled_) {
-			ctrl |= kCtrlEchoEnable;
-		} else {
-			ctrl |= kCtrlEchoDisable;
-		}
-		if (!writeRegister(kTerminalStatusAddr, ctrl)) {
+		termios raw = state.orig;
+		raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+		raw.c_iflag &= ~(IXON | ICRNL);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) {
+			std::perror("tcsetattr");
 			return false;
 		}
-		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
-		while (std::chrono::steady_clock::now() < deadline) {
-			if (!readRegister(kTerminalStatusAddr, status)) {
-				return false;
-			}
-			if (status & kStatusReady) {
-				return true;
+		return true;
+#endif
+	}
+
+#ifdef _WIN32
+	// Longest byte sequence consoleKeyBytes() produces for one key.
+	static constexpr size_t kMaxConsoleKeyBytes = 8;
+
+	// The bytes a POSIX terminal sends for a console key event: characters as
+	// UTF-8 (with an ESC prefix for Alt, but not AltGr), cursor and editing
+	// keys as VT sequences, Backspace as DEL. Key releases and bare modifiers
+	// give nothing. `surrogate` holds a UTF-16 high surrogate until its pair
+	// arrives in the next event.
+	static size_t consoleKeyBytes(const KEY_EVENT_RECORD& key, wchar_t& surrogate, char* out) {
+		if (!key.bKeyDown) {
+			return 0;
+		}
+		const char* sequence = nullptr;
+		switch (key.wVirtualKeyCode) {
+		case VK_UP:     sequence = "\x1b[A"; break;
+		case VK_DOWN:   sequence = "\x1b[B"; break;
+		case VK_RIGHT:  sequence = "\x1b[C"; break;
+		case VK_LEFT:   sequence = "\x1b[D"; break;
+		case VK_HOME:   sequence = "\x1b[H"; break;
+		case VK_END:    sequence = "\x1b[F"; break;
+		case VK_INSERT: sequence = "\x1b[2~"; break;
+		case VK_DELETE: sequence = "\x1b[3~"; break;
+		case VK_PRIOR:  sequence = "\x1b[5~"; break;
+		case VK_NEXT:   sequence = "\x1b[6~"; break;
+		case VK_F1:     sequence = "\x1bOP"; break;
+		case VK_F2:     sequence = "\x1bOQ"; break;
+		case VK_F3:     sequence = "\x1bOR"; break;
+		case VK_F4:     sequence = "\x1bOS"; break;
+		case VK_BACK:   sequence = "\x7f"; break;
+		default: break;
+		}
+		if (sequence) {
+			const size_t length = std::strlen(sequence);
+			std::memcpy(out, sequence, length);
+			return length;
+		}
+		const wchar_t ch = key.uChar.UnicodeChar;
+		uint32_t cp = ch;
+		if (ch == 0) {
+			return 0;
+		}
+		if (ch >= 0xD800 && ch < 0xDC00) {
+			surrogate = ch;
+			return 0;
+		}
+		if (ch >= 0xDC00 && ch < 0xE000) {
+			if (surrogate == 0) {
+				return 0;
 			}
-			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			cp = 0x10000 + ((static_cast<uint32_t>(surrogate) - 0xD800) << 10) + (ch - 0xDC00);
+			surrogate = 0;
+		}
+		size_t n = 0;
+		const DWORD state = key.dwControlKeyState;
+		if ((state & (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED)) && !(state & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED))) {
+			out[n++] = '\x1b';
+		}
+		if (cp < 0x80) {
+			out[n++] = static_cast<char>(cp);
+		} else if (cp < 0x800) {
+			out[n++] = static_cast<char>(0xC0 | (cp >> 6));
+			out[n++] = static_cast<char>(0x80 | (cp & 0x3F));
+		} else if (cp < 0x10000) {
+			out[n++] = static_cast<char>(0xE0 | (cp >> 12));
+			out[n++] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out[n++] = static_cast<char>(0x80 | (cp & 0x3F));
+		} else {
+			out[n++] = static_cast<char>(0xF0 | (cp >> 18));
+			out[n++] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+			out[n++] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out[n++] = static_cast<char>(0x80 | (cp & 0x3F));
 		}
-		std::cerr << "Timed out waiting for terminal session" << std::endl;
-		return false;
+		return n;
 	}
+#endif
 
-	bool reset() {
-		if (!initialize()) {
-			return false;
+	static void restoreStdin(const StdinState& state) {
+#ifdef _WIN32
+		if (!state.hasMode) {
+			return;
 		}
-		if (!ensureAuth()) {
-			return false;
+		HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
+		if (hIn == INVALID_HANDLE_VALUE || hIn == nullptr) {
+			return;
 		}
-		// do not clear auth
-		uint32_t ctrl = kCtrlReset | kCtrlClearFlags;
-		if (echoEnabled_) {
-			ctrl |= kCtrlEchoEnable;
-		} else {
-			ctrl |= kCtrlEchoDisable;
+		SetConsoleMode(hIn, state.origMode);
+#else
+		if (tcsetattr(STDIN_FILENO, TCSANOW, &state.orig) != 0) {
+			std::perror("tcsetattr");
 		}
-		if (!writeRegister(kTerminalStatusAddr, ctrl)) {
-			return false;
+#endif
+	}
+
+	// Called on the libusb event thread.
+	void signalOutputEvent() {
+		outputEventPending_ = true;
+		ioWake_.notify();
+#ifndef _WIN32
+		const char wake = 1;
+		ssize_t wr = ::write(eventPipe_[1], &wake, 1);
+		(void)wr;
+#endif
+	}
+
+	bool consumeOutputEvent() {
+#ifndef _WIN32
+		char sink[64];
+		while (::read(eventPipe_[0], sink, sizeof(sink)) > 0) {
+		}
+#endif
+		return outputEventPending_.exchange(false);
+	}
+
+	uint32_t readRegisterOr(uint32_t addr, uint32_t fallback) {
+		uint32_t value = 0;
+		if (readRegister(addr, value)) {
+			return value;
 		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(200));
-		return ensureSession();
+		return fallback;
 	}
 
-	void setPassword(const std::string& pass) { password_ = pass; }
-
-	bool ensureAuth() {
-		uint32_t authed = 0;
-		if (!readRegister(kTerminalAuthStatusAddr, authed)) {
-			return false;
-		}
-		if (authed) return true;
-		std::string pw = password_;
-		if (pw.empty()) {
-			std::cerr << "Terminal locked: provide password via --password" << std::endl;
-			return false;
-		}
-		// write password to auth buffer (as C-string with NUL terminator recommended but not required)
-		if (!device_.writeMemory(kTerminalAuthBufAddr,
-								 reinterpret_cast<const uint8_t*>(pw.data()),
-								 static_cast<uint16_t>(pw.size()))) {
-			return false;
-		}
-		if (!device_.writeRegister(kTerminalAuthCmdAddr, 1)) {
-			return false;
-		}
-		// re-check
-		if (!readRegister(kTerminalAuthStatusAddr, authed)) {
-			return false;
-		}
-		if (!authed) {
-			std::cerr << "Authentication failed" << std::endl;
+	// Any failed register access may mean the device went away or reset, so
+	// session-scoped cache entries are dropped with it.
+	bool readRegister(uint32_t addr, uint32_t& value) {
+		if (!device_.readMemory(addr, reinterpret_cast<uint8_t*>(&value), sizeof(value))) {
+			cache_.invalidateSession();
 			return false;
 		}
+		noteTerminalStatus(addr, value);
 		return true;
 	}
 
-	bool lock(){
-		if (!device_.writeRegister(kTerminalAuthCmdAddr, 0)) {
+	bool writeRegister(uint32_t addr, uint32_t value) {
+		if (!device_.writeRegister(addr, value)) {
+			cache_.invalidateSession();
 			return false;
 		}
 		return true;
 	}
 
-	bool sendCommand(const std::string& command) {
-		if (!ensureSession()) {
-			return false;
+	// Read through the cache; the value read is kept according to `policy`.
+	bool readCachedRegister(uint32_t addr, uint32_t& value, RegisterPolicy policy) {
+		if (cache_.lookup(addr, value)) {
+			return true;
 		}
-		std::string payload = command;
-		if (payload.empty() || payload.back() != '\n') {
-			payload.push_back('\n');
+		if (!readRegister(addr, value)) {
+			return false;
 		}
-
-		size_t offset = 0;
-		while (offset < payload.size()) {
-			const size_t chunk = std::min<size_t>(chunkHint_, payload.size() - offset);
-			if (!device_.writeMemory(kTerminalDataAddr,
-									 reinterpret_cast<const uint8_t*>(payload.data() + offset),
-									 static_cast<uint16_t>(chunk))) {
-				return false;
-			}
-			offset += chunk;
+		if (addr != kTerminalStatusAddr || (value & kStatusReady)) {
+			cache_.store(addr, value, policy);
 		}
 		return true;
 	}
 
-	bool drainOutput(std::string& out,
-					 std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(200),
-					 std::chrono::milliseconds maxWait = std::chrono::seconds(5)) {
-		if (!ensureSession()) {
-			return false;
+	// Every status read doubles as a check of the cached session state: a
+	// session that is no longer ready (the shell exited, the device reset)
+	// must be started again by the next ensureSession().
+	void noteTerminalStatus(uint32_t addr, uint32_t status) {
+		if (addr == kTerminalStatusAddr && (status & kStatusReady) == 0) {
+			cache_.forget(kTerminalStatusAddr);
 		}
+	}
 
-		auto lastData = std::chrono::steady_clock::now();
-		auto deadline = std::chrono::steady_clock::now() + maxWait;
-		bool warnedOverflow = false;
-
-		while (std::chrono::steady_clock::now() < deadline) {
-			uint32_t status = 0;
-			if (!readRegister(kTerminalStatusAddr, status)) {
-				return false;
-			}
-			if ((status & kStatusOverflow) && !warnedOverflow) {
-				std::cerr << "Warning: terminal output overflowed, some bytes dropped" << std::endl;
-				warnedOverflow = true;
-			}
-			if (status & kStatusError) {
-				std::cerr << "Terminal reported error bit" << std::endl;
-			}
-
-			uint32_t available = 0;
-			if (!readRegister(kTerminalAvailAddr, available)) {
-				return false;
-			}
-			if (available == 0) {
-				if (std::chrono::steady_clock::now() - lastData > idleTimeout) {
-					break;
-				}
-				std::this_thread::sleep_for(std::chrono::milliseconds(50));
-				continue;
-			}
-
-			const uint32_t toRead = static_cast<uint32_t>(std::min<uint32_t>(available, chunkHint_));
-			std::vector<uint8_t> buffer;
-			if (!device_.readMemory(kTerminalDataAddr, static_cast<uint16_t>(toRead), buffer)) {
-				return false;
-			}
-			out.append(buffer.begin(), buffer.end());
-			lastData = std::chrono::steady_clock::now();
+	template <typename Block>
+	bool readSnapshot(uint32_t addr, Block& block) {
+		if (!device_.readMemory(addr, reinterpret_cast<uint8_t*>(&block), sizeof(Block))) {
+			cache_.invalidateSession();
+			return false;
 		}
+		uint32_t first = 0;
+		std::memcpy(&first, &block, sizeof(first));
+		noteTerminalStatus(addr, first);
 		return true;
 	}
 
-	bool runOnce(const std::string& command) {
-		bool handled = false;
-		if (!handleFileTransferCommand(command, handled)) {
-			return false;
+	// Older kTerminal builds only accept kTerminalFileDataWindow bytes per file
+	// data transaction. Newer ones advertise a larger window which the host
+	// selects by writing the size it wants back to kTerminalFileWindowAddr,
+	// and serve it at kTerminalFileWideDataAddr.
+	void negotiateFileWindow() {
+		fileWindow_ = kTerminalFileDataWindow;
+		if ((caps_ & kCapLargeFileWindow) == 0) {
+			return;
 		}
-		if (handled) {
-			return true;
+		uint32_t deviceMax = 0;
+		if (!readRegister(kTerminalFileWindowMaxAddr, deviceMax)) {
+			return;
 		}
-		if (!sendCommand(command)) {
-			return false;
+		// One file data transaction per window, cut to whole packets of the link.
+		const UVCPTransport::TransferLimits limits = device_.transferLimits();
+		uint32_t wanted = std::min<uint32_t>({deviceMax, kMaxFileDataWindow, limits.maxRead, limits.maxWrite});
+		if (fileWindowLimit_ != 0) {
+			wanted = std::min(wanted, fileWindowLimit_);
 		}
-		std::string output;
-		if (!drainOutput(output)) {
-			return false;
+		wanted &= ~3u;
+		if (wanted <= kTerminalFileDataWindow) {
+			return;
+		}
+		uint32_t accepted = 0;
+		if (!writeRegister(kTerminalFileWindowAddr, wanted) ||
+			!readRegister(kTerminalFileWindowAddr, accepted)) {
+			*err_ << "File window negotiation failed, using " << kTerminalFileDataWindow
+					  << " bytes" << std::endl;
+			return;
 		}
-		if (!output.empty()) {
-			std::cout << output << std::flush;
+		if (accepted > kTerminalFileDataWindow && accepted <= wanted) {
+			fileWindow_ = accepted;
 		}
-		return true;
 	}
 
-	bool interactiveLoopV1() {
-		if (!ensureSession()) {
-			return false;
-		}
-		std::cout << "Interactive shell ready (kTerminal version 0x" << std::hex << version_
-				  << std::dec << "). Type 'exit' to quit." << std::endl;
+	uint32_t fileDataAddr() const {
+		return fileWindow_ > kTerminalFileDataWindow ? kTerminalFileWideDataAddr : kTerminalFileDataAddr;
+	}
 
-		std::string warmup;
-		drainOutput(warmup, std::chrono::milliseconds(50), std::chrono::milliseconds(500));
-		if (!warmup.empty()) {
-			std::cout << warmup << std::flush;
-		}
-		
-		{
-			if (!sendCommand("cd /root")) {
-				return false;
-			}
-			std::string output;
-			if (!drainOutput(output)) {
-				return false;
-			}
-			if (!output.empty()) {
-				std::cout << output << std::flush;
-			}
+	bool sendFileCommand(uint32_t cmd) {
+		return writeRegister(kTerminalFileCmdAddr, cmd);
+	}
+
+	bool readFileStatus(uint32_t& status) {
+		return readRegister(kTerminalFileStatusAddr, status);
+	}
+
+	bool readFileResult(int& result) {
+		uint32_t value = 0;
+		if (!readRegister(kTerminalFileResultAddr, value)) {
+			return false;
 		}
+		result = static_cast<int>(value);
+		return true;
+	}
 
-		std::string line;
-		while (true) {
-			if (!std::getline(std::cin, line)) {
-				std::cout << std::endl;
-				break;
-			}
-			if (line == "exit" || line == "quit") {
-				break;
-			}
-			bool handled = false;
-			handleFileTransferCommand(line, handled);
-			if (handled) {
-				if (!sendCommand(" ")) {
-					return false;
-				}
-				std::string output;
-				if (!drainOutput(output)) {
-					return false;
-				}
-				if (!output.empty()) {
-					std::cout << output << std::flush;
-				}
-				continue;
-			}
-			if (!sendCommand(line)) {
+	bool waitForFileOpen(uint32_t modeBit, std::chrono::milliseconds timeout) {
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		PollBackoff backoff(pollPolicy_);
+		while (std::chrono::steady_clock::now() < deadline) {
+			uint32_t status = 0;
+			if (!readFileStatus(status)) {
 				return false;
 			}
-			std::string output;
-			if (!drainOutput(output)) {
-				return false;
+			if (status & modeBit) {
+				return true;
 			}
-			if (!output.empty()) {
-				std::cout << output << std::flush;
+			if (status & kFileStatusError) {
+				return checkFileError("open file");
 			}
+			backoff.wait(deadline);
 		}
-		return true;
+		*err_ << "Timed out waiting for file channel" << std::endl;
+		return false;
 	}
 
-	bool interactiveLoopV2() {
-		if (!ensureSession()) {
+	// The reset, path, codec and open command are queued back to back with a
+	// status read behind them (the device handles them in order), so a file
+	// that opens at once costs one round trip. `opened` receives the channel
+	// status of the open file.
+	bool openRemoteFile(const std::string& remotePath, uint32_t cmd, uint32_t modeBit,
+						uint32_t codec = kFileCodecRaw, FileStatusBlock* opened = nullptr) {
+		if (remotePath.empty()) {
+			*err_ << "Remote path must not be empty" << std::endl;
 			return false;
 		}
-		std::cout << "Interactive shell ready (kTerminal version 0x" << std::hex << version_
-				  << std::dec << "). Type 'exit' to quit." << std::endl;
-
-		// Drain any warmup output.
-		std::string warmup;
-		drainOutput(warmup, std::chrono::milliseconds(50), std::chrono::milliseconds(500));
-		if (!warmup.empty()) {
-			std::cout << warmup << std::flush;
-		}
-
-		// Send initial working directory.
-		if (!sendCommand("cd /root")) {
+		if (remotePath.size() >= kTerminalFilePathCapacity) {
+			*err_ << "Remote path exceeds " << kTerminalFilePathCapacity - 1
+				  << " bytes limit" << std::endl;
 			return false;
 		}
-		std::string initOutput;
-		if (!drainOutput(initOutput)) {
+		std::array<uint8_t, kTerminalFilePathCapacity> path{};
+		std::memcpy(path.data(), remotePath.data(), remotePath.size());
+		const uint32_t commands[] = {kFileCmdReset, codec, cmd};
+		FileStatusBlock snap;
+		UVCPTransaction batch[5];
+		size_t count = 0;
+		batch[count++] = UVCPTransaction::writeRegister(kTerminalFileCmdAddr, commands[0]);
+		batch[count++] = UVCPTransaction::write(kTerminalFilePathAddr, path.data(), static_cast<uint16_t>(path.size()));
+		if (codec != kFileCodecRaw) {
+			batch[count++] = UVCPTransaction::writeRegister(kTerminalFileCodecAddr, commands[1]);
+		}
+		batch[count++] = UVCPTransaction::writeRegister(kTerminalFileCmdAddr, commands[2]);
+		batch[count++] = UVCPTransaction::read(kTerminalFileStatusAddr, reinterpret_cast<uint8_t*>(&snap), sizeof(snap));
+		UVCPWaitGroup group;
+		device_.submitBatch(batch, count, group);
+		if (!group.wait()) {
+			cache_.invalidateSession();
 			return false;
 		}
-		if (!initOutput.empty()) {
-			std::cout << initOutput << std::flush;
+		if ((snap.status & modeBit) == 0) {
+			if (snap.status & kFileStatusError) {
+				checkFileError("open file", snap.status);
+				closeFileChannel();
+				return false;
+			}
+			if (!waitForFileOpen(modeBit, std::chrono::milliseconds(500)) ||
+				(opened && !readSnapshot(kTerminalFileStatusAddr, snap))) {
+				closeFileChannel();
+				return false;
+			}
 		}
-
-		// Configure local terminal to raw mode for byte-stream behaviour.
-		StdinState stdinState{};
-		if (!setStdinRaw(stdinState)) {
-			return false;
+		if (opened) {
+			*opened = snap;
 		}
-		auto restore = [&stdinState]() { restoreStdin(stdinState); };
-		// Ensure restoration even if we early-return below.
-		struct Guard {
-			std::function<void()> fn;
-			~Guard() { if (fn) fn(); }
-		} guard{restore};
+		return true;
+	}
 
-		constexpr char kExitKey = 0x1d; // Ctrl+]
-		std::array<char, 256> inBuf{};
-		auto lastPoll = std::chrono::steady_clock::now();
-		std::string currentLine;
+	// Move the open file's position; the device seeks when the high word lands.
+	bool seekFileCursor(uint64_t offset) {
+		return device_.writeRegisters(kTerminalFileCursorLowAddr,
+									  {static_cast<uint32_t>(offset), static_cast<uint32_t>(offset >> 32)});
+	}
 
-		while (true) {
-			// 1) Read from stdin (non-blocking-ish by using small timeout or polling).
-			ssize_t n = 0;
-#ifndef _WIN32
-			fd_set rfds;
-			FD_ZERO(&rfds);
-			FD_SET(STDIN_FILENO, &rfds);
-			timeval tv{};
-			// Short timeout to also poll device output regularly.
-			tv.tv_sec = 0;
-			tv.tv_usec = 20000; // 20 ms
-			int sel = select(STDIN_FILENO + 1, &rfds, nullptr, nullptr, &tv);
-			if (sel > 0 && FD_ISSET(STDIN_FILENO, &rfds)) {
-				n = ::read(STDIN_FILENO, inBuf.data(), inBuf.size());
-			}
-#else
-			if (_kbhit()) {
-				int idx = 0;
-				while (_kbhit() && idx < static_cast<int>(inBuf.size())) {
-					int ch = _getch();
-					inBuf[static_cast<size_t>(idx++)] = static_cast<char>(ch);
-				}
-				n = idx;
-			} else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	// Read exactly `bytes` from the file open for reading.
+	bool readFileData(uint8_t* out, size_t bytes) {
+		size_t got = 0;
+		PollBackoff backoff(pollPolicy_);
+		while (got < bytes) {
+			FileStatusBlock snap;
+			if (!readSnapshot(kTerminalFileStatusAddr, snap)) {
+				return false;
 			}
-#endif
-			if (n > 0) {
-				// Check for Ctrl+] to exit locally.
-				bool exitRequested = false;
-				std::vector<uint8_t> toSend;
-				toSend.reserve(static_cast<size_t>(n));
-				for (ssize_t i = 0; i < n; ++i) {
-					unsigned char ch = static_cast<unsigned char>(inBuf[static_cast<size_t>(i)]);
-
-#ifdef _WIN32
-					// On Windows, arrow keys and some others are reported by _getch()
-					// as a leading 0 or 0xE0 byte followed by a scan code. Translate the
-					// most common ones into ANSI escape sequences so the remote shell
-					// sees the same bytes as on a POSIX terminal.
-					if ((ch == 0x00 || ch == 0xE0) && i + 1 < n) {
-						unsigned char scan = static_cast<unsigned char>(inBuf[static_cast<size_t>(i + 1)]);
-						bool handledSpecial = true;
-						// Arrow keys
-						switch (scan) {
-							case 72: // Up
-								toSend.push_back(0x1b);
-								toSend.push_back('[');
-								toSend.push_back('A');
-								break;
-							case 80: // Down
-								toSend.push_back(0x1b);
-								toSend.push_back('[');
-								toSend.push_back('B');
-								break;
-							case 75: // Left
-								toSend.push_back(0x1b);
-								toSend.push_back('[');
-								toSend.push_back('D');
-								break;
-							case 77: // Right
-								toSend.push_back(0x1b);
-								toSend.push_back('[');
-								toSend.push_back('C');
-								break;
-							default:
-								// Unhandled special key: ignore.
-								handledSpecial = false;
-								break;
-						}
-						if (handledSpecial) {
-							// Skip the scan-code byte; we already consumed it.
-							++i;
-							continue;
-						}
-					}
-#endif
-					if (ch == static_cast<unsigned char>(kExitKey)) {
-						exitRequested = true;
-						continue;
-					}
-					// Maintain a simple local line buffer to intercept "exit".
-					if (ch == '\r' || ch == '\n') {
-						// End of line: check if the line is exactly "exit".
-						if (currentLine == "exit") {
-							// Do not send this line to remote, just exit locally.
-							toSend.push_back('\b');
-							toSend.push_back('\b');
-							toSend.push_back('\b');
-							toSend.push_back('\b');
-							device_.writeMemory(kTerminalDataAddr, toSend.data(),
-											static_cast<uint16_t>(toSend.size()));
-							toSend.clear();
-							exitRequested = true;
-							currentLine.clear();
-							continue;
-						} else {
-							if(tryHandleFileTransferCommand(currentLine)){
-								bool handle = false;
-								for(int i =0;i<currentLine.size();i++){
-									toSend.push_back('\b');
-								}
-								toSend.push_back('\n');
-								device_.writeMemory(kTerminalDataAddr, toSend.data(),
-											static_cast<uint16_t>(toSend.size()));
-								toSend.clear();
-								std::cout << std::endl;
-								handleFileTransferCommand(currentLine,handle);
-								currentLine.clear();
-								continue;	
-							}
-						}
-						currentLine.clear();
-					} else if (ch == 0x7f || ch == '\b') {
-						// Handle backspace locally for the line buffer.
-						if (!currentLine.empty()) {
-							currentLine.pop_back();
-						}
-					} else if (std::isprint(ch)) {
-						currentLine.push_back(static_cast<char>(ch));
-					}
-					toSend.push_back(ch);
-				}
-				if (!toSend.empty()) {
-					if (!device_.writeMemory(kTerminalDataAddr, toSend.data(),
-								   static_cast<uint16_t>(toSend.size()))) {
-						return false;
-					}
-				}
-				if (exitRequested) {
-					break;
+			if (snap.dataAvail == 0) {
+				if (snap.status & kFileStatusError) {
+					return checkFileError("u3vget");
 				}
-			}
-
-			// 2) Periodically poll device output.
-			auto now = std::chrono::steady_clock::now();
-			if (now - lastPoll >= std::chrono::milliseconds(10)) {
-				std::string out;
-				if (!drainOutput(out, std::chrono::milliseconds(10), std::chrono::milliseconds(10))) {
+				if (snap.status & kFileStatusEof) {
+					*err_ << "Unexpected end of remote file" << std::endl;
 					return false;
 				}
-				if (!out.empty()) {
-#ifndef _WIN32
-					int wr = ::write(STDOUT_FILENO, out.data(), out.size());
-					(void)wr;
-#else
-					std::cout.write(out.data(), out.size());
-					std::cout.flush();
-#endif
-				}
-				lastPoll = now;
+				backoff.wait();
+				continue;
+			}
+			backoff.reset();
+			const uint32_t toRead = static_cast<uint32_t>(
+				std::min<uint64_t>({snap.dataAvail, fileWindow_, bytes - got}));
+			if (!device_.readMemory(fileDataAddr(), out + got, static_cast<uint16_t>(toRead))) {
+				return false;
 			}
+			got += toRead;
 		}
-
 		return true;
 	}
 
-	bool tryHandleFileTransferCommand(const std::string& line) {
-		auto tokens = splitTokens(line);
-		if (tokens.empty()) {
+	// Check that the bytes of localPath just before `offset` match the remote
+	// file open for reading. Leaves the remote position at `offset`.
+	bool verifyResumePoint(const std::string& localPath, uint64_t offset) {
+		const uint64_t bytes = std::min(offset, kResumeVerifyBytes);
+		std::vector<char> local(static_cast<size_t>(bytes));
+		std::ifstream ifs(localPath, std::ios::binary);
+		ifs.seekg(static_cast<std::streamoff>(offset - bytes));
+		if (!ifs.read(local.data(), static_cast<std::streamsize>(bytes))) {
+			*err_ << "Unable to read '" << localPath << "'" << std::endl;
 			return false;
 		}
-		const std::string& op = tokens[0];
-		if (op != "u3vget" && op != "u3vput") {
+		std::vector<uint8_t> remote(static_cast<size_t>(bytes));
+		if (!seekFileCursor(offset - bytes) || !readFileData(remote.data(), remote.size())) {
+			return false;
+		}
+		if (std::memcmp(local.data(), remote.data(), remote.size()) != 0) {
+			*err_ << "'" << localPath << "' does not match the remote file before byte "
+					  << offset << "; not resuming" << std::endl;
 			return false;
 		}
 		return true;
 	}
 
-	bool expandRemotePattern(const std::string& pattern, std::vector<std::string>& outPaths) {
-		outPaths.clear();
-		// Use remote shell to expand wildcard: ls -1 -d pattern
-		std::string cmd = "ls -1 -d " + pattern + " 2>/dev/null";
-		if (!sendCommand(cmd)) {
-			std::cerr << "Failed to send remote pattern expansion command" << std::endl;
+	// Parse a memread/memwrite number: decimal, 0x hex or 0 octal.
+	static bool parseMemoryArgument(const std::string& text, uint64_t& value) {
+		// stoull skips leading blanks and takes "-1" as 2^64 - 1.
+		if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
 			return false;
 		}
-		std::string output;
-		if (!drainOutput(output, std::chrono::milliseconds(200), std::chrono::seconds(3))) {
-			std::cerr << "Failed to read remote pattern expansion output" << std::endl;
+		try {
+			size_t used = 0;
+			value = std::stoull(text, &used, 0);
+			return used == text.size();
+		} catch (...) {
 			return false;
 		}
-		std::istringstream iss(output);
-		std::string line;
-		while (std::getline(iss, line)) {
-			// Trim whitespace
-			size_t start = line.find_first_not_of(" \t\r\n");
-			if (start == std::string::npos) continue;
-			size_t end = line.find_last_not_of(" \t\r\n");
-			std::string candidate = line.substr(start, end - start + 1);
-			if (wildcardMatch(pattern.c_str(), candidate.c_str())) {
-				outPaths.push_back(candidate);
+	}
+
+	// memread: stream `length` bytes of device memory from `address` to a
+	// local file. Each block is split into the largest transactions the device
+	// takes, and the next block is on the wire while this one is written.
+	// `announce` adds a summary line once done.
+	bool performMemoryRead(uint32_t address, uint64_t length, const std::string& localPath, bool announce = true) {
+		std::ofstream ofs(localPath, std::ios::binary | std::ios::trunc);
+		if (!ofs) {
+			*err_ << "Unable to open local file '" << localPath << "' for writing" << std::endl;
+			return false;
+		}
+		std::vector<uint8_t> buffers[2];
+		UVCPWaitGroup groups[2];
+		size_t blockBytes[2] = {};
+		uint64_t submitted = 0;
+		uint64_t written = 0;
+		bool success = true;
+		auto submitNext = [&](int slot) {
+			blockBytes[slot] = static_cast<size_t>(std::min<uint64_t>(kMemoryBlockBytes, length - submitted));
+			buffers[slot].resize(blockBytes[slot]);
+			const bool queued = device_.submitReadBlock(address + static_cast<uint32_t>(submitted),
+														buffers[slot].data(), blockBytes[slot], groups[slot]);
+			submitted += blockBytes[slot];
+			return queued;
+		};
+		success = submitNext(0);
+		for (int slot = 0; written < length; slot ^= 1) {
+			if (success && submitted < length) {
+				success = submitNext(slot ^ 1);
+			}
+			if (!groups[slot].wait() || !success) {
+				*err_ << "memread: reading 0x" << std::hex << address + written << std::dec << " failed" << std::endl;
+				success = false;
+				break;
 			}
+			ofs.write(reinterpret_cast<const char*>(buffers[slot].data()),
+					  static_cast<std::streamsize>(blockBytes[slot]));
+			if (!ofs) {
+				*err_ << "Failed writing to local file '" << localPath << "'" << std::endl;
+				success = false;
+				break;
+			}
+			written += blockBytes[slot];
+			const double pct = 100.0 * static_cast<double>(written) / static_cast<double>(length);
+			*out_ << '\r' << "Reading: " << written << '/' << length << " (" << std::fixed << std::setprecision(1) << pct << "%)" << std::flush;
 		}
-		return true;
+		// Let reads still in flight finish before their buffers go away.
+		groups[0].wait();
+		groups[1].wait();
+		if (written != 0) {
+			*out_ << '\n';
+		}
+		if (success && announce) {
+			*out_ << "Read 0x" << std::hex << address << std::dec << " -> '" << localPath << "' ("
+				  << length << " bytes)" << std::endl;
+		}
+		return success;
 	}
 
-	bool handleFileTransferCommand(const std::string& line, bool& handled) {
-		handled = false;
-		auto tokens = splitTokens(line);
-		if (tokens.empty()) {
-			return true;
+	// memwrite: load a local file into device memory at `address`. Writes are
+	// copied when queued, so one block buffer keeps the pipeline full.
+	bool performMemoryWrite(uint32_t address, const std::string& localPath) {
+		std::ifstream ifs(localPath, std::ios::binary);
+		std::error_code ec;
+		const uint64_t length = std::filesystem::file_size(localPath, ec);
+		if (!ifs || ec) {
+			*err_ << "Unable to open local file '" << localPath << "'" << std::endl;
+			return false;
 		}
-		const std::string& op = tokens[0];
-		if (op != "u3vget" && op != "u3vput") {
-			return true;
+		if (address + length > 0x100000000ull) {
+			*err_ << "memwrite: '" << localPath << "' does not fit below 4 GiB at 0x" << std::hex << address
+				  << std::dec << std::endl;
+			return false;
 		}
-		handled = true;
-		if (op == "u3vget") {
-			if (tokens.size() != 3) {
-				std::cerr << "Usage: u3vget <remote-path> <local-path>" << std::endl;
-				return true;
-			}
-			const std::string& remoteSpec = tokens[1];
-			const std::string& localSpec = tokens[2];
-			if (!hasWildcard(remoteSpec)) {
-				return performFileDownload(remoteSpec, localSpec);
-			}
-			// Remote wildcard: download multiple remote files into local directory
-			namespace fs = std::filesystem;
-			fs::path localDir(localSpec);
-			if (!localSpec.empty() && localSpec.back() == '/') {
-				// Treat as directory path
-			} else if (fs::exists(localDir) && fs::is_directory(localDir)) {
-				// Existing directory
-			} else {
-				// Ensure directory exists when using wildcard remote path
-				std::error_code ec;
-				if (!fs::create_directories(localDir, ec) && ec) {
-					std::cerr << "u3vget: local path must be a directory when remote path contains wildcards" << std::endl;
-					return true;
-				}
+		std::vector<uint8_t> buffer(kMemoryBlockBytes);
+		UVCPWaitGroup groups[2];
+		uint64_t sent = 0;
+		bool success = true;
+		for (int slot = 0; success && sent < length; slot ^= 1) {
+			const size_t n = static_cast<size_t>(std::min<uint64_t>(kMemoryBlockBytes, length - sent));
+			if (!ifs.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(n))) {
+				*err_ << "Failed reading local file '" << localPath << "'" << std::endl;
+				success = false;
+				break;
 			}
-			std::vector<std::string> remotePaths;
-			if (!expandRemotePattern(remoteSpec, remotePaths)) {
-				return false;
+			success = device_.submitWriteBlock(address + static_cast<uint32_t>(sent), buffer.data(), n, groups[slot]);
+			// Check the block before this one; it has had a block's time to finish.
+			if (!groups[slot ^ 1].wait()) {
+				success = false;
 			}
-			if (remotePaths.empty()) {
-				std::cerr << "u3vget: no remote files match pattern '" << remoteSpec << "'" << std::endl;
-				return true;
+			if (!success) {
+				*err_ << "memwrite: writing near 0x" << std::hex << address + sent << std::dec << " failed" << std::endl;
+				break;
 			}
-			bool allOk = true;
-			for (const auto& rp : remotePaths) {
-				fs::path lp = localDir / fs::path(rp).filename();
-				if (!performFileDownload(rp, lp.string())) {
-					allOk = false;
-				}
+			sent += n;
+			const double pct = 100.0 * static_cast<double>(sent) / static_cast<double>(length);
+			*out_ << '\r' << "Writing: " << sent << '/' << length << " (" << std::fixed << std::setprecision(1) << pct << "%)" << std::flush;
+		}
+		if (!groups[0].wait() || !groups[1].wait()) {
+			if (success) {
+				*err_ << "\nmemwrite: the last block failed" << std::endl;
 			}
-			return allOk;
+			success = false;
 		}
-		// u3vput
-		if (tokens.size() != 3) {
-			std::cerr << "Usage: u3vput <local-path> <remote-path>" << std::endl;
+		if (sent != 0) {
+			*out_ << '\n';
+		}
+		if (success) {
+			*out_ << "Wrote '" << localPath << "' -> 0x" << std::hex << address << std::dec << " (" << length
+				  << " bytes)" << std::endl;
+		}
+		return success;
+	}
+
+	// memread <addr> <len> <local-path> / memwrite <addr> <local-path>
+	bool handleMemoryCommand(const std::vector<std::string>& tokens) {
+		const bool read = tokens[0] == "memread";
+		uint64_t address = 0;
+		uint64_t length = 0;
+		if (tokens.size() != (read ? 4u : 3u) || !parseMemoryArgument(tokens[1], address) ||
+			(read && (!parseMemoryArgument(tokens[2], length) || length == 0))) {
+			*err_ << (read ? "Usage: memread <address> <length> <local-path>"
+						   : "Usage: memwrite <address> <local-path>") << std::endl;
 			return true;
 		}
-		const std::string& localSpec = tokens[1];
-		const std::string& remoteDest = tokens[2];
-		std::vector<std::string> sources = expandLocalPattern(localSpec);
-		if (sources.empty()) {
-			std::cerr << "u3vput: no local files match '" << localSpec << "'" << std::endl;
+		if (address > 0xFFFFFFFFull || length > 0x100000000ull - address) {
+			*err_ << tokens[0] << ": the range must end below 4 GiB" << std::endl;
 			return true;
 		}
-		if (sources.size() > 1) {
-			if (remoteDest.empty() || remoteDest.back() != '/') {
-				std::cerr << "u3vput: multiple source files matched; remote path must end with '/'" << std::endl;
-				return true;
+		if (!ensureSession()) {
+			return false;
+		}
+		return read ? performMemoryRead(static_cast<uint32_t>(address), length, resolveLocalPath(tokens[3]))
+					: performMemoryWrite(static_cast<uint32_t>(address), resolveLocalPath(tokens[2]));
+	}
+
+	// u3vxml [--refresh] <local-path>: save the device's GenICam file (XML or
+	// zip, as the manifest says) to local-path. Files are cached per model,
+	// file version and SHA-1 (address and size without one), so a known device
+	// costs the ABRM and manifest reads only.
+	bool handleGenICamCommand(std::vector<std::string> tokens) {
+		bool refresh = false;
+		if (tokens.size() == 3 && tokens[1] == "--refresh") {
+			refresh = true;
+			tokens.erase(tokens.begin() + 1);
+		}
+		if (tokens.size() != 2) {
+			*err_ << "Usage: u3vxml [--refresh] <local-path>" << std::endl;
+			return true;
+		}
+		const std::string localPath = resolveLocalPath(tokens[1]);
+
+		char model[kAbrmStringLength + 1] = {};
+		uint64_t manifestAddr = 0;
+		uint64_t entryCount = 0;
+		UVCPWaitGroup group;
+		device_.submitReadMemory(kAbrmModelNameAddr, reinterpret_cast<uint8_t*>(model), kAbrmStringLength, group);
+		device_.submitReadMemory(kAbrmManifestTableAddr, reinterpret_cast<uint8_t*>(&manifestAddr),
+								 sizeof(manifestAddr), group);
+		if (!group.wait()) {
+			*err_ << "u3vxml: failed to read the ABRM" << std::endl;
+			return false;
+		}
+		if (manifestAddr == 0 || manifestAddr >= 0xFFFFFFFFull ||
+			!device_.readMemory(static_cast<uint32_t>(manifestAddr), reinterpret_cast<uint8_t*>(&entryCount),
+								sizeof(entryCount)) ||
+			entryCount == 0 || entryCount > kMaxManifestEntries ||
+			manifestAddr + sizeof(entryCount) + entryCount * sizeof(ManifestEntry) > 0x100000000ull) {
+			*err_ << "u3vxml: device has no usable manifest table" << std::endl;
+			return false;
+		}
+		std::vector<ManifestEntry> entries(static_cast<size_t>(entryCount));
+		UVCPWaitGroup entryGroup;
+		device_.submitReadBlock(static_cast<uint32_t>(manifestAddr + sizeof(entryCount)),
+								reinterpret_cast<uint8_t*>(entries.data()), entries.size() * sizeof(ManifestEntry),
+								entryGroup);
+		if (!entryGroup.wait()) {
+			*err_ << "u3vxml: failed to read the manifest table" << std::endl;
+			return false;
+		}
+
+		// Newest schema first, then newest file version; only types we can save.
+		auto rank = [](const ManifestEntry& e) {
+			return std::make_tuple(e.schema >> 16, e.file_version_major, e.file_version_minor,
+								   e.file_version_subminor);
+		};
+		const ManifestEntry* best = nullptr;
+		for (const ManifestEntry& e : entries) {
+			const uint32_t type = (e.schema >> 10) & 0x3F;
+			if ((type == kManifestFileXml || type == kManifestFileZip) && e.size != 0 &&
+				e.address + e.size <= 0x100000000ull && (!best || rank(e) > rank(*best))) {
+				best = &e;
 			}
 		}
-		bool allOk = true;
+		if (!best) {
+			*err_ << "u3vxml: no manifest entry holds an XML or zip file below 4 GiB" << std::endl;
+			return false;
+		}
+		const bool zip = ((best->schema >> 10) & 0x3F) == kManifestFileZip;
+
+		std::ostringstream key;
+		for (const char* p = model; *p; ++p) {
+			key << (std::isalnum(static_cast<unsigned char>(*p)) || *p == '-' || *p == '.' ? *p : '_');
+		}
+		key << '_' << static_cast<int>(best->file_version_major) << '.' << static_cast<int>(best->file_version_minor)
+			<< '.' << best->file_version_subminor << '_' << std::hex << std::setfill('0');
+		if (std::any_of(std::begin(best->sha1), std::end(best->sha1), [](uint8_t b) { return b != 0; })) {
+			for (uint8_t b : best->sha1) {
+				key << std::setw(2) << static_cast<int>(b);
+			}
+		} else {
+			key << best->address << '-' << best->size;
+		}
+		key << (zip ? ".zip" : ".xml");
+
 		namespace fs = std::filesystem;
-		for (const auto& src : sources) {
-			std::string remotePath = remoteDest;
-			if (sources.size() > 1 || (!remoteDest.empty() && remoteDest.back() == '/')) {
-				fs::path sp(src);
-				remotePath = remoteDest + sp.filename().string();
+		std::error_code ec;
+		const fs::path dir = cacheDirectory();
+		const fs::path cached = dir.empty() ? fs::path() : dir / "genicam" / key.str();
+		const bool hit = !refresh && !cached.empty() && fs::file_size(cached, ec) == best->size && !ec;
+		fs::path source = cached; // where the file is once fetched
+		if (!hit) {
+			// Without a cache directory the file goes straight to localPath.
+			if (!source.empty() && (fs::create_directories(source.parent_path(), ec), ec)) {
+				source.clear();
 			}
-			if (!performFileUpload(src, remotePath)) {
-				allOk = false;
+			const fs::path target = source.empty() ? fs::path(localPath) : fs::path(source.string() + ".tmp");
+			if (!performMemoryRead(static_cast<uint32_t>(best->address), best->size, target.string(), false)) {
+				fs::remove(target, ec);
+				return false;
+			}
+			ec.clear();
+			if (!source.empty()) {
+				fs::rename(target, source, ec);
 			}
 		}
-		return allOk;
-	}
-	void setEchoEnabled(bool enable) { echoEnabled_ = enable; }
-	bool getEchoEnabled() {
-		uint32_t status = 0;
-		// If we cannot read the terminal status register, treat as error.
-		if (!const_cast<TerminalClient*>(this)->readRegister(kTerminalStatusAddr, status)) {
-			std::cerr << "Failed to read terminal status register for echo state" << std::endl;
-			return echoEnabled_;
+		if (!ec && !source.empty()) {
+			fs::copy_file(source, localPath, fs::copy_options::overwrite_existing, ec);
 		}
-		if ((status & kStatusEchoEnabled) != 0) {
-			echoEnabled_ = true;
-		} else {
-			echoEnabled_ = false;
+		if (ec) {
+			*err_ << "u3vxml: cannot write '" << localPath << "': " << ec.message() << std::endl;
+			return false;
 		}
-		return echoEnabled_;
+		*out_ << "GenICam " << (zip ? "zip" : "XML") << " file " << static_cast<int>(best->file_version_major) << '.'
+			  << static_cast<int>(best->file_version_minor) << '.' << best->file_version_subminor << " -> '"
+			  << localPath << "' (" << best->size << " bytes" << (hit ? ", cached" : "") << ")" << std::endl;
+		return true;
 	}
 
-  private:
-	struct StdinState {
-#ifdef _WIN32
-		DWORD origMode = 0;
-		bool hasMode = false;
-#else
-		termios orig{};
-#endif
-	};
+	bool performFileDownload(const std::string& remotePath, const std::string& localPath,
+							 bool resume = false) {
+		if (!ensureSession()) {
+			return false;
+		}
+		uint64_t offset = 0;
+		if (resume) {
+			std::error_code ec;
+			const auto localSize = std::filesystem::file_size(localPath, ec);
+			offset = ec ? 0 : static_cast<uint64_t>(localSize);
+		}
+		// Resuming seeks in the raw file, so only fresh downloads are compressed.
+		const bool compressed = offset == 0 && fileCodecAvailable();
+		FileStatusBlock snap;
+		if (!openRemoteFile(remotePath, kFileCmdOpenRead, kFileStatusReading,
+							compressed ? kFileCodecLz4 : kFileCodecRaw, &snap)) {
+			return false;
+		}
+		const uint64_t remoteSize = snap.size();
+		if (offset > remoteSize) {
+			*err_ << "u3vget --resume: '" << localPath << "' is larger than '" << remotePath
+					  << "' (" << offset << " > " << remoteSize << " bytes)" << std::endl;
+			closeFileChannel();
+			return false;
+		}
+		if (offset != 0) {
+			// A seek restarts the device's digest; start it at the resume point.
+			if (!verifyResumePoint(localPath, offset) ||
+				((caps_ & kCapFileDigest) && !seekFileCursor(offset)) ||
+				!readSnapshot(kTerminalFileStatusAddr, snap)) {
+				closeFileChannel();
+				return false;
+			}
+			*out_ << "Resuming '" << remotePath << "' at byte " << offset << std::endl;
+		}
+		std::vector<char> writeBuffer(kLocalFileBuffer);
+		std::ofstream ofs;
+		ofs.rdbuf()->pubsetbuf(writeBuffer.data(), static_cast<std::streamsize>(writeBuffer.size()));
+		ofs.open(localPath, offset != 0 ? (std::ios::binary | std::ios::in | std::ios::out)
+										: (std::ios::binary | std::ios::trunc));
+		if (ofs && offset != 0) {
+			ofs.seekp(static_cast<std::streamoff>(offset));
+		}
+		if (!ofs) {
+			*err_ << "Unable to open local file '" << localPath << "' for writing"
+				  << std::endl;
+			closeFileChannel();
+			return false;
+		}
+		reserveFileSpace(localPath, remoteSize);
+		uint64_t bytesReceived = offset;
+		TransferTally tally;
+		bool success = receiveFileData(snap, ofs, localPath, remoteSize, bytesReceived, tally, compressed);
+		if (!closeFileChannel(success ? &tally.digest : nullptr)) {
+			success = false;
+		}
+		if (success) {
+			*out_ << "Downloaded '" << remotePath << "' -> '" << localPath << "'";
+			if (remoteSize != 0) {
+				*out_ << " (" << remoteSize << " bytes" << compressionNote(compressed, remoteSize, tally.wireBytes) << ")";
+			}
+			*out_ << std::endl;
+		}
+		return success;
+	}
 
-	static bool setStdinRaw(StdinState& state) {
-#ifdef _WIN32
-		HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
-		if (hIn == INVALID_HANDLE_VALUE || hIn == nullptr) {
+	bool performFileUpload(const std::string& localPath, const std::string& remotePath,
+						   bool resume = false) {
+		// Regular files are prefetched in large blocks; anything else is read
+		// through a large ifstream buffer.
+		PrefetchFileBuf prefetched;
+		std::vector<char> readBuffer;
+		std::ifstream ifs;
+		std::istream in(nullptr);
+		if (prefetched.open(localPath)) {
+			in.rdbuf(&prefetched);
+		} else {
+			readBuffer.resize(kLocalFileBuffer);
+			ifs.rdbuf()->pubsetbuf(readBuffer.data(), static_cast<std::streamsize>(readBuffer.size()));
+			ifs.open(localPath, std::ios::binary);
+			if (!ifs) {
+				*err_ << "Unable to open local file '" << localPath << "'" << std::endl;
+				return false;
+			}
+			in.rdbuf(ifs.rdbuf());
+		}
+		in.seekg(0, std::ios::end);
+		std::streampos end = in.tellg();
+		in.clear();
+		in.seekg(0, std::ios::beg);
+		uint64_t totalBytes = end >= 0 ? static_cast<uint64_t>(end) : 0;
+		if (!ensureSession()) {
 			return false;
 		}
-		DWORD mode = 0;
-		if (!GetConsoleMode(hIn, &mode)) {
+		if (resume && (caps_ & kCapFileOpenUpdate) == 0) {
+			*err_ << "u3vput --resume: device cannot reopen files for update; uploading from the start"
+					  << std::endl;
+			resume = false;
+		}
+		uint64_t offset = 0;
+		if (resume) {
+			// Opening for update keeps the partial file and reports its size.
+			if (!openRemoteFile(remotePath, kFileCmdOpenUpdate, kFileStatusWriting)) {
+				return false;
+			}
+			if (!readFileSize(offset)) {
+				closeFileChannel();
+				return false;
+			}
+			if (offset > totalBytes) {
+				*err_ << "u3vput --resume: '" << remotePath << "' is larger than '" << localPath
+						  << "' (" << offset << " > " << totalBytes << " bytes)" << std::endl;
+				closeFileChannel();
+				return false;
+			}
+			if (offset != 0) {
+				closeFileChannel();
+				if (!openRemoteFile(remotePath, kFileCmdOpenRead, kFileStatusReading)) {
+					return false;
+				}
+				const bool match = verifyResumePoint(localPath, offset);
+				closeFileChannel();
+				if (!match || !openRemoteFile(remotePath, kFileCmdOpenUpdate, kFileStatusWriting)) {
+					return false;
+				}
+				if (!seekFileCursor(offset)) {
+					closeFileChannel();
+					return false;
+				}
+				in.seekg(static_cast<std::streamoff>(offset));
+				*out_ << "Resuming '" << localPath << "' at byte " << offset << std::endl;
+			}
+		}
+		// Resumed uploads keep writing raw at the device's offset. A resume
+		// that found nothing to keep reopens to pick up the codec.
+		const bool compressed = offset == 0 && fileCodecAvailable();
+		if (offset == 0 && (!resume || compressed) &&
+			!openRemoteFile(remotePath, kFileCmdOpenWrite, kFileStatusWriting,
+							compressed ? kFileCodecLz4 : kFileCodecRaw)) {
 			return false;
 		}
-		state.origMode = mode;
-		state.hasMode = true;
-		mode &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT);
-		mode |= ENABLE_EXTENDED_FLAGS;
-		if (!SetConsoleMode(hIn, mode)) {
+		uint64_t bytesSent = offset;
+		TransferTally tally;
+		bool success = sendFileData(in, totalBytes, bytesSent, tally, compressed);
+		if (!closeFileChannel(success ? &tally.digest : nullptr)) {
+			success = false;
+		}
+		if (success) {
+			*out_ << "Uploaded '" << localPath << "' -> '" << remotePath << "'";
+			if (totalBytes != 0) {
+				*out_ << " (" << totalBytes << " bytes" << compressionNote(compressed, totalBytes, tally.wireBytes) << ")";
+			}
+			*out_ << std::endl;
+		}
+		return success;
+	}
+
+	// u3vput --delta: hash the local file in kFileCodecBlock blocks while the
+	// device hashes its copy, rewrite only the runs of blocks that differ, then
+	// compare every block again. Falls back to a full upload when the device
+	// cannot hash blocks, the local file is empty or not a regular file, or
+	// the remote file is empty or longer than ours.
+	bool performDeltaUpload(const std::string& localPath, const std::string& remotePath) {
+		PrefetchFileBuf prefetched;
+		if (!prefetched.open(localPath)) {
+			return performFileUpload(localPath, remotePath);
+		}
+		const uint64_t localSize = prefetched.size();
+		if (!ensureSession()) {
 			return false;
 		}
-		return true;
-#else
-		if (tcgetattr(STDIN_FILENO, &state.orig) != 0) {
-			std::perror("tcgetattr");
+		if ((caps_ & kCapFileBlockDigest) == 0 || (caps_ & kCapFileOpenUpdate) == 0) {
+			*err_ << "u3vput --delta: device cannot hash file blocks; uploading all of it" << std::endl;
+			return performFileUpload(localPath, remotePath);
+		}
+		std::vector<uint32_t> localDigests;
+		bool localOk = true;
+		std::thread hasher([&] { localOk = fileBlockDigests(prefetched, localSize, localDigests); });
+		// Opening for update reports the remote size and creates a missing file.
+		uint64_t remoteSize = 0;
+		bool remoteOk = openRemoteFile(remotePath, kFileCmdOpenUpdate, kFileStatusWriting);
+		if (remoteOk) {
+			remoteOk = readFileSize(remoteSize);
+			remoteOk = closeFileChannel() && remoteOk;
+		}
+		std::vector<uint32_t> remoteDigests;
+		const bool usable = remoteSize != 0 && remoteSize <= localSize;
+		if (remoteOk && usable) {
+			remoteOk = readRemoteBlockDigests(remotePath, remoteSize, remoteDigests);
+		}
+		hasher.join();
+		if (!localOk) {
+			*err_ << "u3vput --delta: '" << localPath << "' shrank while it was read" << std::endl;
 			return false;
 		}
-		termios raw = state.orig;
-		raw.c_lflag &= ~(ICANON | ECHO | ISIG);
-		raw.c_iflag &= ~(IXON | ICRNL);
-		raw.c_cc[VMIN] = 1;
-		raw.c_cc[VTIME] = 0;
-		if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) {
-			std::perror("tcsetattr");
+		if (!remoteOk) {
 			return false;
 		}
-		return true;
-#endif
-	}
-
-	static void restoreStdin(const StdinState& state) {
-#ifdef _WIN32
-		if (!state.hasMode) {
-			return;
+		if (!usable) {
+			if (remoteSize > localSize) {
+				*err_ << "u3vput --delta: '" << remotePath << "' is larger than '" << localPath
+						  << "'; uploading all of it" << std::endl;
+			}
+			return performFileUpload(localPath, remotePath);
+		}
+		// Runs of changed blocks as [begin, end) byte ranges. A block is kept
+		// only if it has the same length and CRC-32C on both sides.
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		uint64_t changedBytes = 0;
+		size_t changedBlocks = 0;
+		for (size_t i = 0; i < localDigests.size(); ++i) {
+			const uint64_t begin = i * kFileCodecBlock;
+			const uint64_t end = std::min<uint64_t>(begin + kFileCodecBlock, localSize);
+			if (i < remoteDigests.size() && remoteDigests[i] == localDigests[i] &&
+				std::min<uint64_t>(begin + kFileCodecBlock, remoteSize) == end) {
+				continue;
+			}
+			if (!ranges.empty() && ranges.back().second == begin) {
+				ranges.back().second = end;
+			} else {
+				ranges.emplace_back(begin, end);
+			}
+			changedBytes += end - begin;
+			++changedBlocks;
+		}
+		const bool compressed = fileCodecAvailable();
+		uint64_t bytesSent = 0;
+		TransferTally tally;
+		TransferProgress progress(*out_, "Uploading:   ", changedBytes, 0, progressVisible());
+		bool success = true;
+		if (!ranges.empty()) {
+			if (!openRemoteFile(remotePath, kFileCmdOpenUpdate, kFileStatusWriting,
+								compressed ? kFileCodecLz4 : kFileCodecRaw)) {
+				return false;
+			}
+			for (size_t r = 0; r < ranges.size() && success; ++r) {
+				if (!seekFileCursor(ranges[r].first)) {
+					success = false;
+					break;
+				}
+				prefetched.window(ranges[r].first, ranges[r].second);
+				std::istream range(&prefetched);
+				TransferTally rangeTally;
+				success = sendFileData(range, changedBytes, bytesSent, rangeTally, compressed, &progress);
+				tally.wireBytes += rangeTally.wireBytes;
+			}
+			progress.finish();
+			// The device digest restarts at every seek, so the blocks are
+			// compared below instead.
+			if (!closeFileChannel()) {
+				success = false;
+			}
+		}
+		std::vector<uint32_t> finalDigests;
+		if (success && !readRemoteBlockDigests(remotePath, localSize, finalDigests)) {
+			success = false;
 		}
-		HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
-		if (hIn == INVALID_HANDLE_VALUE || hIn == nullptr) {
-			return;
+		if (success && finalDigests != localDigests) {
+			*err_ << "u3vput --delta: '" << remotePath << "' does not match '" << localPath
+					  << "' after the update" << std::endl;
+			success = false;
 		}
-		SetConsoleMode(hIn, state.origMode);
-#else
-		if (tcsetattr(STDIN_FILENO, TCSANOW, &state.orig) != 0) {
-			std::perror("tcsetattr");
+		if (success) {
+			*out_ << "Uploaded '" << localPath << "' -> '" << remotePath << "' (" << changedBlocks << " of "
+				  << localDigests.size() << " blocks changed, " << changedBytes << " bytes"
+				  << compressionNote(compressed, changedBytes, tally.wireBytes) << ")" << std::endl;
 		}
-#endif
+		return success;
 	}
 
-	uint32_t readRegisterOr(uint32_t addr, uint32_t fallback) {
-		uint32_t value = 0;
-		if (readRegister(addr, value)) {
-			return value;
+	// The CRC-32C of each kFileCodecBlock bytes of the first `size` bytes of
+	// a remote file, read through kFileCodecBlockDigest.
+	bool readRemoteBlockDigests(const std::string& remotePath, uint64_t size, std::vector<uint32_t>& digests) {
+		digests.assign(static_cast<size_t>((size + kFileCodecBlock - 1) / kFileCodecBlock), 0);
+		if (!openRemoteFile(remotePath, kFileCmdOpenRead, kFileStatusReading, kFileCodecBlockDigest)) {
+			return false;
 		}
-		return fallback;
+		const bool ok = readFileData(reinterpret_cast<uint8_t*>(digests.data()), digests.size() * sizeof(uint32_t));
+		return closeFileChannel() && ok;
 	}
 
-	bool readRegister(uint32_t addr, uint32_t& value) {
-		std::vector<uint32_t> vals;
-		if (!device_.readRegisters(addr, 1, vals)) {
-			return false;
+	// What a file data loop moved, from receiveFileData() or sendFileData().
+	struct TransferTally {
+		uint64_t wireBytes = 0; // bytes that crossed the link
+		uint32_t digest = 0;    // CRC-32C of the uncompressed data
+	};
+
+	bool fileCodecAvailable() const { return compressTransfers_ && (caps_ & kCapFileCodec) != 0; }
+
+	// Progress lines go to a terminal, or to a job log that u3vjobs shows,
+	// never into other captured output.
+	bool progressVisible() const { return progressToOutput_ || (out_ == &std::cout && stdoutIsTerminal()); }
+
+	// ", 1234 on the link, 9.8x" after a compressed transfer's byte count.
+	static std::string compressionNote(bool compressed, uint64_t bytes, uint64_t wireBytes) {
+		if (!compressed || bytes == 0) {
+			return {};
 		}
-		value = vals[0];
-		return true;
+		std::ostringstream note;
+		note << ", " << wireBytes << " on the link, " << std::fixed << std::setprecision(1)
+			 << static_cast<double>(bytes) / static_cast<double>(std::max<uint64_t>(wireBytes, 1)) << "x";
+		return note.str();
 	}
 
-	bool writeRegister(uint32_t addr, uint32_t value) {
-		return device_.writeRegister(addr, value);
+	// Quote `text` as one word for the remote shell.
+	static std::string shellQuote(const std::string& text) {
+		std::string quoted = "'";
+		for (char ch : text) {
+			quoted += ch == '\'' ? std::string("'\\''") : std::string(1, ch);
+		}
+		return quoted + "'";
 	}
 
-	bool prepareFilePath(const std::string& remotePath) {
-		if (remotePath.empty()) {
-			std::cerr << "Remote path must not be empty" << std::endl;
-			return false;
-		}
-		if (!sendFileCommand(kFileCmdReset)) {
+	// Run a setup command for u3vget -r / u3vput -r; false unless it exited 0.
+	bool runArchiveStep(const std::string& context, const std::string& command,
+						const char* needs = "the directory, tar and mkfifo") {
+		std::string output;
+		if (!runFramed(command, [&output](const char* data, size_t size) { output.append(data, size); })) {
 			return false;
 		}
-		if (remotePath.size() >= kTerminalFilePathCapacity) {
-			std::cerr << "Remote path exceeds " << kTerminalFilePathCapacity - 1
-				  << " bytes limit" << std::endl;
+		if (lastExitStatus_ != 0) {
+			if (!echoEnabled_) {
+				*err_ << output;
+			}
+			*err_ << context << ": remote setup failed (status " << lastExitStatus_
+				  << "); the device needs " << needs << std::endl;
 			return false;
 		}
-		std::array<uint8_t, kTerminalFilePathCapacity> buffer{};
-		std::memcpy(buffer.data(), remotePath.data(), remotePath.size());
-		buffer[remotePath.size()] = 0;
-		return device_.writeMemory(kTerminalFilePathAddr, buffer.data(),
-						 static_cast<uint16_t>(buffer.size()));
+		return true;
 	}
 
-	bool sendFileCommand(uint32_t cmd) {
-		return writeRegister(kTerminalFileCmdAddr, cmd);
+	// Wait for the background tar started by u3vget -r / u3vput -r (or the
+	// u3vexec command, `what`), killing it first if the transfer failed, and
+	// remove its FIFO. True if it exited 0.
+	bool finishArchiveJob(const std::string& context, const std::string& fifo, bool transferred,
+						  const char* what = "tar") {
+		// tar's messages come back prefixed, which tells them from the echo.
+		const std::string prefix = "u3vdb-tar: ";
+		const std::string errors = shellQuote(fifo + ".err");
+		std::string output;
+		const bool ok = runFramed((transferred ? "" : "kill $u3vdb_job 2>/dev/null; ") +
+									  std::string("wait $u3vdb_job; s=$?; sed 's/^/") + prefix + "/' " + errors +
+									  " 2>/dev/null; rm -f " + shellQuote(fifo) + " " + errors + "; (exit $s)",
+								  [&output](const char* data, size_t size) { output.append(data, size); });
+		std::istringstream lines(output);
+		for (std::string line; std::getline(lines, line);) {
+			if (line.compare(0, prefix.size(), prefix) == 0) {
+				*err_ << line.substr(prefix.size()) << std::endl;
+			}
+		}
+		if (!ok) {
+			return false;
+		}
+		if (lastExitStatus_ != 0 && transferred) {
+			*err_ << context << ": remote " << what << " exited with status " << lastExitStatus_ << std::endl;
+		}
+		return lastExitStatus_ == 0;
 	}
 
-	bool readFileStatus(uint32_t& status) {
-		return readRegister(kTerminalFileStatusAddr, status);
+	std::string archiveFifoPath(const char* suffix = ".tar") {
+		std::random_device rd;
+		std::ostringstream path;
+		path << "/tmp/u3vdb-" << std::hex << rd() << suffix;
+		return path.str();
 	}
 
-	bool readFileResult(int& result) {
-		uint32_t value = 0;
-		if (!readRegister(kTerminalFileResultAddr, value)) {
+	// u3vget -r: the device shell runs tar on `remoteDir` into a FIFO, which
+	// streams through one file channel session and is unpacked below
+	// `localDir`. The shell holds the FIFO open read-write while the channel
+	// opens it, so the device never sees an early end, and tar inherits that
+	// descriptor instead of opening the FIFO (a long path stays in the shell).
+	bool performArchiveDownload(const std::string& remoteDir, const std::string& localDir) {
+		if (!ensureSession()) {
 			return false;
 		}
-		result = static_cast<int>(value);
-		return true;
-	}
-
-	bool waitForFileOpen(uint32_t modeBit, std::chrono::milliseconds timeout) {
-		auto deadline = std::chrono::steady_clock::now() + timeout;
-		while (std::chrono::steady_clock::now() < deadline) {
-			uint32_t status = 0;
-			if (!readFileStatus(status)) {
-				return false;
-			}
-			if (status & modeBit) {
-				return true;
-			}
-			if (status & kFileStatusError) {
-				return checkFileError("open file");
-			}
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		std::error_code ec;
+		std::filesystem::create_directories(localDir, ec);
+		if (ec) {
+			*err_ << "u3vget -r: cannot create '" << localDir << "': " << ec.message() << std::endl;
+			return false;
 		}
-		std::cerr << "Timed out waiting for file channel" << std::endl;
-		return false;
+		const std::string fifo = archiveFifoPath();
+		const std::string quotedFifo = shellQuote(fifo);
+		if (!runArchiveStep("u3vget -r", "test -d " + shellQuote(remoteDir) + " && command -v tar >/dev/null && rm -f " +
+											 quotedFifo + " && mkfifo " + quotedFifo + " && exec 9<>" + quotedFifo)) {
+			return false;
+		}
+		const bool compressed = fileCodecAvailable();
+		if (!openRemoteFile(fifo, kFileCmdOpenRead, kFileStatusReading, compressed ? kFileCodecLz4 : kFileCodecRaw)) {
+			runFramed("exec 9>&-; rm -f " + quotedFifo, [](const char*, size_t) {});
+			return false;
+		}
+		if (!runArchiveStep("u3vget -r", "tar -C " + shellQuote(remoteDir) + " -cf - . >&9 2>" +
+											 shellQuote(fifo + ".err") + " & u3vdb_job=$!; exec 9>&-")) {
+			closeFileChannel();
+			runFramed("exec 9>&-; rm -f " + quotedFifo, [](const char*, size_t) {});
+			return false;
+		}
+		FileStatusBlock snap;
+		TarExtractBuf extract(localDir, *err_);
+		std::ostream sink(&extract);
+		uint64_t bytesReceived = 0;
+		TransferTally tally;
+		bool success = readSnapshot(kTerminalFileStatusAddr, snap) &&
+					   receiveFileData(snap, sink, localDir, 0, bytesReceived, tally, compressed);
+		if (!closeFileChannel(success ? &tally.digest : nullptr)) {
+			success = false;
+		}
+		if (success && !extract.finished()) {
+			*err_ << "u3vget -r: archive ended early" << std::endl;
+			success = false;
+		}
+		if (!finishArchiveJob("u3vget -r", fifo, success)) {
+			success = false;
+		}
+		if (success) {
+			*out_ << "Downloaded '" << remoteDir << "' -> '" << localDir << "' (" << extract.entries()
+				  << " entries, " << bytesReceived << " bytes" << compressionNote(compressed, bytesReceived, tally.wireBytes)
+				  << ")" << std::endl;
+		}
+		return success;
 	}
 
-	bool performFileDownload(const std::string& remotePath, const std::string& localPath) {
+	// u3vexec: run `command` in the device shell with its stdout going into a
+	// FIFO that the file channel streams to `localPath`, so binary output
+	// arrives complete, without the terminal's overflow drops and idle
+	// timeout. stderr is shown afterwards, and the command's exit status is
+	// the result, as with -c.
+	bool performRemoteExec(const std::string& command, const std::string& localPath) {
 		if (!ensureSession()) {
 			return false;
 		}
-		if (!prepareFilePath(remotePath)) {
+		std::vector<char> writeBuffer(kLocalFileBuffer);
+		std::ofstream ofs;
+		ofs.rdbuf()->pubsetbuf(writeBuffer.data(), static_cast<std::streamsize>(writeBuffer.size()));
+		ofs.open(localPath, std::ios::binary | std::ios::trunc);
+		if (!ofs) {
+			*err_ << "Unable to open local file '" << localPath << "' for writing" << std::endl;
 			return false;
 		}
-		if (!sendFileCommand(kFileCmdOpenRead)) {
+		const std::string fifo = archiveFifoPath(".out");
+		const std::string quotedFifo = shellQuote(fifo);
+		if (!runArchiveStep("u3vexec", "rm -f " + quotedFifo + " && mkfifo " + quotedFifo + " && exec 9<>" + quotedFifo,
+							"mkfifo")) {
 			return false;
 		}
-		if (!waitForFileOpen(kFileStatusReading, std::chrono::milliseconds(500))) {
-			closeFileChannel();
+		const bool compressed = fileCodecAvailable();
+		FileStatusBlock snap;
+		if (!openRemoteFile(fifo, kFileCmdOpenRead, kFileStatusReading, compressed ? kFileCodecLz4 : kFileCodecRaw,
+							&snap)) {
+			runFramed("exec 9>&-; rm -f " + quotedFifo, [](const char*, size_t) {});
 			return false;
 		}
-		uint64_t remoteSize = 0;
-		readFileSize(remoteSize);
-		std::ofstream ofs(localPath, std::ios::binary | std::ios::trunc);
-		if (!ofs) {
-			std::cerr << "Unable to open local file '" << localPath << "' for writing"
-				  << std::endl;
+		if (!runArchiveStep("u3vexec", "(" + command + " ) >&9 2>" + shellQuote(fifo + ".err") +
+										   " & u3vdb_job=$!; exec 9>&-", "mkfifo")) {
 			closeFileChannel();
+			runFramed("exec 9>&-; rm -f " + quotedFifo, [](const char*, size_t) {});
 			return false;
 		}
 		uint64_t bytesReceived = 0;
-		bool progressPrinted = false;
+		TransferTally tally;
+		bool success = receiveFileData(snap, ofs, localPath, 0, bytesReceived, tally, compressed);
+		if (!closeFileChannel(success ? &tally.digest : nullptr)) {
+			success = false;
+		}
+		ofs.close();
+		if (success && !ofs) {
+			*err_ << "Failed writing to local file '" << localPath << "'" << std::endl;
+			success = false;
+		}
+		if (!finishArchiveJob("u3vexec", fifo, success, "command")) {
+			success = false;
+		}
+		if (success) {
+			*out_ << "Captured '" << command << "' -> '" << localPath << "' (" << bytesReceived << " bytes"
+				  << compressionNote(compressed, bytesReceived, tally.wireBytes) << ")" << std::endl;
+		}
+		return success;
+	}
+
+	// u3vput -r: archive `localDir` and stream it through one file channel
+	// session into a FIFO that tar in the device shell unpacks below
+	// `remoteDir`. tar's open of the FIFO pairs with the device's.
+	bool performArchiveUpload(const std::string& localDir, const std::string& remoteDir) {
+		if (!std::filesystem::is_directory(localDir)) {
+			*err_ << "u3vput -r: '" << localDir << "' is not a directory" << std::endl;
+			return false;
+		}
+		TarWriterBuf archive(localDir, *err_);
+		if (!archive.ok()) {
+			return false;
+		}
+		if (!ensureSession()) {
+			return false;
+		}
+		const std::string fifo = archiveFifoPath();
+		const std::string quotedFifo = shellQuote(fifo);
+		if (!runArchiveStep("u3vput -r", "command -v tar >/dev/null && mkdir -p " + shellQuote(remoteDir) +
+											 " && rm -f " + quotedFifo + " && mkfifo " + quotedFifo) ||
+			!runArchiveStep("u3vput -r", "tar -C " + shellQuote(remoteDir) + " -xf " + quotedFifo + " 2>" +
+											 shellQuote(fifo + ".err") + " & u3vdb_job=$!")) {
+			runFramed("rm -f " + quotedFifo, [](const char*, size_t) {});
+			return false;
+		}
+		const bool compressed = fileCodecAvailable();
+		bool success = openRemoteFile(fifo, kFileCmdOpenWrite, kFileStatusWriting,
+									  compressed ? kFileCodecLz4 : kFileCodecRaw);
+		uint64_t bytesSent = 0;
+		TransferTally tally;
+		if (success) {
+			std::istream in(&archive);
+			success = sendFileData(in, archive.size(), bytesSent, tally, compressed);
+			if (!closeFileChannel(success ? &tally.digest : nullptr)) {
+				success = false;
+			}
+		}
+		if (!finishArchiveJob("u3vput -r", fifo, success)) {
+			success = false;
+		}
+		if (success && !archive.ok()) {
+			*err_ << "u3vput -r: some files changed while they were sent" << std::endl;
+			success = false;
+		}
+		if (success) {
+			*out_ << "Uploaded '" << localDir << "' -> '" << remoteDir << "' (" << archive.entries()
+				  << " entries, " << bytesSent << " bytes" << compressionNote(compressed, bytesSent, tally.wireBytes)
+				  << ")" << std::endl;
+		}
+		return success;
+	}
+
+	// Copy the remote file open for reading to `sink` until its end. `snap` is
+	// the channel status read last; `bytesReceived` counts on from its value
+	// and `remoteSize` (0 if unknown) only shows in the progress line. With
+	// `compressed` the data port carries frames, decoded on a helper thread.
+	// The CRC-32C in `tally` covers what reached `sink`.
+	bool receiveFileData(FileStatusBlock& snap, std::ostream& sink, const std::string& sinkName,
+						 uint64_t remoteSize, uint64_t& bytesReceived, TransferTally& tally,
+						 bool compressed = false) {
+		Crc32cStreamBuf digestBuf(sink.rdbuf());
+		std::ostream digested(&digestBuf);
+		std::unique_ptr<FileDecodeBuf> decoder;
+		std::ostream decoded(nullptr);
+		if (compressed) {
+			decoder.reset(new FileDecodeBuf(digested));
+			decoded.rdbuf(decoder.get());
+		}
+		std::ostream& target = compressed ? decoded : digested;
+		const uint64_t start = bytesReceived;
+		uint64_t wire = 0;
+		TransferProgress progress(*out_, "Downloading: ", remoteSize, start, progressVisible());
 		bool success = true;
+		PollBackoff backoff(pollPolicy_);
 		while (success) {
-			uint32_t avail = 0;
-			if (!readFileDataAvail(avail)) {
+			if (cancelled()) {
 				success = false;
 				break;
 			}
-			if (avail == 0) {
-				uint32_t status = 0;
-				if (!readFileStatus(status)) {
-					success = false;
-					break;
-				}
-				if (status & kFileStatusError) {
+			printRequestedStats();
+			if (snap.dataAvail == 0) {
+				if (snap.status & kFileStatusError) {
 					success = checkFileError("u3vget");
 					break;
 				}
-				if (status & kFileStatusEof) {
+				if (snap.status & kFileStatusEof) {
 					break;
 				}
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				backoff.wait();
+				if (!readSnapshot(kTerminalFileStatusAddr, snap)) {
+					success = false;
+				}
 				continue;
 			}
-			std::vector<uint8_t> buffer;
-			if (!device_.readMemory(kTerminalFileDataAddr, static_cast<uint16_t>(avail), buffer)) {
+			backoff.reset();
+			yieldToForeground();
+			// Fetch this chunk and the next snapshot in a single round trip.
+			const uint32_t toRead = std::min(snap.dataAvail, fileWindow_);
+			UVCPWaitGroup group;
+			device_.submitReadMemory(fileDataAddr(), rxBuffer_.data(),
+									 static_cast<uint16_t>(toRead), group);
+			device_.submitReadMemory(kTerminalFileStatusAddr, reinterpret_cast<uint8_t*>(&snap),
+									 sizeof(snap), group);
+			if (!group.wait()) {
 				success = false;
 				break;
 			}
-			ofs.write(reinterpret_cast<const char*>(buffer.data()),
-					static_cast<std::streamsize>(avail));
-			if (!ofs) {
-				std::cerr << "Failed writing to local file '" << localPath << "'" << std::endl;
+			target.write(reinterpret_cast<const char*>(rxBuffer_.data()),
+					static_cast<std::streamsize>(toRead));
+			if (!target) {
+				if (decoder && !decoder->finish()) {
+					*err_ << "u3vget: " << decoder->error() << std::endl;
+				} else {
+					*err_ << "Failed writing to local file '" << sinkName << "'" << std::endl;
+				}
 				success = false;
 				break;
 			}
-			bytesReceived += avail;
-			if (remoteSize > 0) {
-				progressPrinted = true;
-				double pct = remoteSize ? (100.0 * static_cast<double>(bytesReceived) / static_cast<double>(remoteSize)) : 0.0;
-				std::cout << '\r' << "Downloading: " << bytesReceived << '/' << remoteSize << " (" << std::fixed << std::setprecision(1) << pct << "%)" << std::flush;
-			} else {
-				progressPrinted = true;
-				std::cout << '\r' << "Downloading: " << bytesReceived << " bytes" << std::flush;
-			}
-		}
-		if (!closeFileChannel()) {
-			success = false;
-		}
-		if (progressPrinted) {
-			std::cout << '\n';
+			wire += toRead;
+			bytesReceived = decoder ? start + decoder->rawBytes() : bytesReceived + toRead;
+			progress.update(bytesReceived);
 		}
-		if (success) {
-			std::cout << "Downloaded '" << remotePath << "' -> '" << localPath << "'";
-			if (remoteSize != 0) {
-				std::cout << " (" << remoteSize << " bytes)";
+		if (decoder) {
+			if (!decoder->finish() && success) {
+				*err_ << "u3vget: " << decoder->error() << std::endl;
+				success = false;
 			}
-			std::cout << std::endl;
+			// The decoder trails the link; show where it ended up.
+			bytesReceived = start + decoder->rawBytes();
+			progress.update(bytesReceived);
+		}
+		tally.wireBytes = wire;
+		tally.digest = digestBuf.digest();
+		progress.finish();
+		if (!success && cancelled()) {
+			*err_ << "u3vget: cancelled" << std::endl;
 		}
 		return success;
 	}
 
-	bool performFileUpload(const std::string& localPath, const std::string& remotePath) {
-		std::ifstream ifs(localPath, std::ios::binary);
-		if (!ifs) {
-			std::cerr << "Unable to open local file '" << localPath << "'" << std::endl;
-			return false;
-		}
-		ifs.seekg(0, std::ios::end);
-		std::streampos end = ifs.tellg();
-		ifs.clear();
-		ifs.seekg(0, std::ios::beg);
-		uint64_t totalBytes = end >= 0 ? static_cast<uint64_t>(end) : 0;
-		if (!ensureSession()) {
-			return false;
-		}
-		if (!prepareFilePath(remotePath)) {
-			return false;
-		}
-		if (!sendFileCommand(kFileCmdOpenWrite)) {
-			return false;
-		}
-		if (!waitForFileOpen(kFileStatusWriting, std::chrono::milliseconds(500))) {
-			closeFileChannel();
-			return false;
-		}
-		std::array<char, kTerminalFileDataWindow> buffer{};
-		uint64_t bytesSent = 0;
-		bool progressPrinted = false;
+	// Copy `in` to the remote file open for writing. `bytesSent` counts on
+	// from its value; `totalBytes` only shows in the progress line. With
+	// `compressed` a helper thread turns `in` into frames ahead of the
+	// transfer. The CRC-32C in `tally` covers what was taken from `in`.
+	// An upload sent in several calls passes one `sharedProgress` and finishes
+	// it itself.
+	bool sendFileData(std::istream& in, uint64_t totalBytes, uint64_t& bytesSent, TransferTally& tally,
+					  bool compressed = false, TransferProgress* sharedProgress = nullptr) {
+		Crc32cStreamBuf digestBuf(in.rdbuf());
+		std::istream digested(&digestBuf);
+		std::unique_ptr<FileEncodeBuf> encoder;
+		std::istream encoded(nullptr);
+		if (compressed) {
+			encoder.reset(new FileEncodeBuf(digested));
+			encoded.rdbuf(encoder.get());
+		}
+		std::istream& source = compressed ? encoded : digested;
+		// Raw data from a prefetched file goes to the USB transfers straight
+		// from its block buffers, hashed in place.
+		PrefetchFileBuf* const file = dynamic_cast<PrefetchFileBuf*>(in.rdbuf());
+		PrefetchFileBuf* const direct = compressed ? nullptr : file;
+		uint32_t directDigest = 0;
+		const uint64_t start = bytesSent;
+		uint64_t wire = 0;
+		// Each chunk is a data write, followed by a status read on every
+		// uploadStatusInterval_-th chunk, the last one, and whenever
+		// kUploadStatusMaxBytes went out unchecked. A short write ACK fails the
+		// chunk on its own. Several chunks are kept in flight in a fixed ring
+		// and retired in order.
+		struct PendingChunk {
+			UVCPWaitGroup group;
+			uint32_t status = 0;
+			uint16_t bytes = 0;
+		};
+		uint32_t chunksUnchecked = 0;
+		uint64_t bytesUnchecked = 0;
+		std::array<PendingChunk, kUploadChunksInFlight> ring;
+		size_t head = 0;
+		size_t queued = 0;
+		std::vector<char> buffer(fileWindow_);
+		TransferProgress ownProgress(*out_, "Uploading:   ", totalBytes, start, progressVisible());
+		TransferProgress& progress = sharedProgress ? *sharedProgress : ownProgress;
 		bool success = true;
-		while (ifs && success) {
-			ifs.read(buffer.data(), buffer.size());
-			std::streamsize got = ifs.gcount();
-			if (got <= 0) {
-				break;
+		auto retire = [&]() {
+			PendingChunk& chunk = ring[head];
+			head = (head + 1) % ring.size();
+			--queued;
+			const bool ok = chunk.group.wait();
+			if (!success) {
+				return;
 			}
-			if (!device_.writeMemory(kTerminalFileDataAddr,
-							reinterpret_cast<const uint8_t*>(buffer.data()),
-							static_cast<uint16_t>(got))) {
+			if (!ok) {
+				// Report the device's reason if a short write was caused by one.
+				checkFileError("u3vput");
 				success = false;
-				break;
+				return;
 			}
-			uint32_t status = 0;
-			if (!readFileStatus(status)) {
+			if (chunk.status & kFileStatusError) {
+				checkFileError("u3vput");
 				success = false;
-				break;
+				return;
 			}
-			if (status & kFileStatusError) {
-				success = checkFileError("u3vput");
+			wire += chunk.bytes;
+			// Frames run a little ahead of the acknowledged chunks.
+			bytesSent = encoder ? start + encoder->rawBytes() : bytesSent + chunk.bytes;
+			progress.update(bytesSent);
+		};
+		const size_t inFlight = yieldTo_ ? kBackgroundChunksInFlight : ring.size();
+		while (success && (direct || source)) {
+			if (cancelled()) {
+				success = false;
 				break;
 			}
-			bytesSent += static_cast<uint64_t>(got);
-			if (totalBytes > 0) {
-				progressPrinted = true;
-				double pct = totalBytes ? (100.0 * static_cast<double>(bytesSent) / static_cast<double>(totalBytes)) : 0.0;
-				std::cout << '\r' << "Uploading:   " << bytesSent << '/' << totalBytes << " (" << std::fixed << std::setprecision(1) << pct << "%)" << std::flush;
+			printRequestedStats();
+			const char* data = buffer.data();
+			std::streamsize got = 0;
+			if (direct) {
+				got = static_cast<std::streamsize>(direct->take(data, buffer.size()));
+				directDigest = crc32c(directDigest, data, static_cast<size_t>(got));
 			} else {
-				progressPrinted = true;
-				std::cout << '\r' << "Uploading:   " << bytesSent << " bytes" << std::flush;
+				source.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+				got = source.gcount();
 			}
+			if (got <= 0) {
+				break;
+			}
+			while (queued >= inFlight) {
+				retire();
+			}
+			yieldToForeground();
+			PendingChunk& chunk = ring[(head + queued) % ring.size()];
+			++queued;
+			chunk.bytes = static_cast<uint16_t>(got);
+			chunk.status = 0;
+			device_.submitWriteMemory(fileDataAddr(),
+									  reinterpret_cast<const uint8_t*>(data), chunk.bytes, chunk.group);
+			++chunksUnchecked;
+			bytesUnchecked += chunk.bytes;
+			const bool last = direct ? direct->remaining() == 0 : source.peek() == std::char_traits<char>::eof();
+			if (last || chunksUnchecked >= uploadStatusInterval_ || bytesUnchecked >= kUploadStatusMaxBytes) {
+				device_.submitReadMemory(kTerminalFileStatusAddr, reinterpret_cast<uint8_t*>(&chunk.status),
+										 sizeof(chunk.status), chunk.group);
+				chunksUnchecked = 0;
+				bytesUnchecked = 0;
+			}
+		}
+		while (queued != 0) {
+			retire();
 		}
-		if (!closeFileChannel()) {
+		if (!sharedProgress || !success) {
+			progress.finish();
+		}
+		if (success && ((encoder && !encoder->ok()) || (file && file->failed()))) {
+			*err_ << "u3vput: reading the local file failed" << (file && file->failed() ? " (it shrank)" : "")
+				  << std::endl;
 			success = false;
 		}
-		if (progressPrinted) {
-			std::cout << '\n';
+		tally.wireBytes = wire;
+		tally.digest = direct ? directDigest : digestBuf.digest();
+		if (!success && cancelled()) {
+			*err_ << "u3vput: cancelled" << std::endl;
 		}
-		if (success) {
-			std::cout << "Uploaded '" << localPath << "' -> '" << remotePath << "'";
-			if (totalBytes != 0) {
-				std::cout << " (" << totalBytes << " bytes)";
+		return success;
+	}
+
+	// Close the open file. With `digest` (a finished transfer's CRC-32C), the
+	// device's digest of the data is checked first if it keeps one.
+	bool closeFileChannel(const uint32_t* digest = nullptr) {
+		bool digestOk = true;
+		if (digest && (caps_ & kCapFileDigest)) {
+			uint32_t deviceDigest = 0;
+			if (!readRegister(kTerminalFileDigestAddr, deviceDigest)) {
+				digestOk = false;
+			} else if (deviceDigest != *digest) {
+				std::ostringstream message;
+				message << std::hex << std::setfill('0') << "file transfer failed: CRC-32C mismatch (device 0x"
+						<< std::setw(8) << deviceDigest << ", local 0x" << std::setw(8) << *digest << ")";
+				*err_ << message.str() << std::endl;
+				digestOk = false;
 			}
-			std::cout << std::endl;
 		}
-		return success;
+		// The close and the first status read go out together. Wait briefly
+		// for the close to land so its result is the one checked.
+		const uint32_t close = kFileCmdClose;
+		uint32_t status = 0;
+		if (!device_.runBatch({UVCPTransaction::writeRegister(kTerminalFileCmdAddr, close),
+							   UVCPTransaction::readRegister(kTerminalFileStatusAddr, status)})) {
+			cache_.invalidateSession();
+			return false;
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+		PollBackoff backoff(pollPolicy_);
+		while ((status & (kFileStatusBusy | kFileStatusOpen)) != 0 && std::chrono::steady_clock::now() < deadline) {
+			backoff.wait(deadline);
+			if (!readFileStatus(status)) {
+				return false;
+			}
+		}
+		return checkFileError("file transfer", status) && digestOk;
+	}
+
+	bool checkFileError(const std::string& context) {
+		uint32_t status = 0;
+		if (!readFileStatus(status)) {
+			return false;
+		}
+		return checkFileError(context, status);
+	}
+
+	// As above with the file status just read.
+	bool checkFileError(const std::string& context, uint32_t status) {
+		if ((status & kFileStatusError) == 0) {
+			return true;
+		}
+		int err = 0;
+		if (!readFileResult(err)) {
+			return false;
+		}
+		*err_ << context << " failed";
+		if (err != 0) {
+			*err_ << ": errno=" << err << " (" << std::strerror(err) << ")";
+		}
+		*err_ << std::endl;
+		return false;
+	}
+
+	bool readFileSize(uint64_t& size) {
+		FileStatusBlock snap;
+		if (!readSnapshot(kTerminalFileStatusAddr, snap)) {
+			return false;
+		}
+		size = snap.size();
+		return true;
+	}
+
+	UVCPTransport& device_;
+	bool initialized_ = false;
+	uint32_t version_ = 0;
+	uint32_t caps_ = 0;
+	uint32_t chunkHint_ = 4096;
+	uint32_t fileWindow_ = kTerminalFileDataWindow;
+	uint32_t fileWindowLimit_ = 0;
+	PollPolicy pollPolicy_;
+	std::filesystem::path localDirectory_;
+	uint32_t uploadStatusInterval_ = kDefaultUploadStatusInterval;
+	bool compressTransfers_ = true;
+	bool resumeTransfers_ = false;
+	bool progressToOutput_ = false;
+	bool framedCommands_ = true;
+	RegisterCache cache_;
+	int lastExitStatus_ = -1;
+	unsigned frameSeq_ = 0;
+	std::string frameNonce_;
+	std::string framePending_; // shell output read past the last end marker
+	bool promptsQuiet_ = false; // see quietPrompts()
+	std::ostream* out_ = &std::cout;
+	std::ostream* err_ = &std::cerr;
+	SessionLogWriter* log_ = nullptr;
+	// Receive scratch for drainOutput and downloads, sized for the largest ACK.
+	std::vector<uint8_t> rxBuffer_ = std::vector<uint8_t>(TY_UVCP_MAX_MSG_LEN);
+	bool outputEvents_ = false;
+	std::atomic<bool> outputEventPending_{false};
+	Wakeup ioWake_; // the shell I/O worker: input queued or an output event
+	ForegroundGate foreground_;              // held by the shell I/O worker
+	ForegroundGate* yieldTo_ = nullptr;      // background clients: the owner's gate...
+	const std::atomic<bool>* cancel_ = nullptr; // ...and its request to give up
+	// Background transfer jobs; guarded by jobsMutex_.
+	std::mutex jobsMutex_;
+	std::condition_variable jobsCv_;
+	std::vector<std::shared_ptr<TransferJob>> jobs_;
+	unsigned nextJobId_ = 1;
+	bool jobsStop_ = false;
+	std::string jobNotices_;
+	std::atomic<bool> jobNoticesPending_{false};
+	std::atomic<bool> cancelJobs_{false};
+	std::thread jobThread_;
+#ifndef _WIN32
+	int eventPipe_[2] = {-1, -1};
+#endif
+	std::string password_;
+	bool echoEnabled_ = true;
+};
+
+std::string joinArguments(int argc, char** argv, int startIndex) {
+	std::ostringstream oss;
+	for (int i = startIndex; i < argc; ++i) {
+		if (i > startIndex) {
+			oss << ' ';
+		}
+		oss << argv[i];
+	}
+	return oss.str();
+}
+
+#ifndef _WIN32
+// --daemon keeps one authenticated session open and runs commands for thin
+// clients on a Unix socket. Frames in both directions are a tag byte, a
+// uint32 length and the payload. A client sends kDaemonCwd and kDaemonCommand
+// (or kDaemonStop); the daemon answers with kDaemonOut/kDaemonErr output and
+// a final kDaemonExit carrying the exit status.
+enum DaemonTag : uint8_t {
+	kDaemonCwd     = 'd',
+	kDaemonCommand = 'c',
+	kDaemonStop    = 'q',
+	kDaemonOut     = 'o',
+	kDaemonErr     = 'e',
+	kDaemonExit    = 'x',
+};
+
+std::atomic<bool> gDaemonStop{false};
+
+std::string defaultDaemonSocket() {
+	const char* env = std::getenv("U3VDB_SOCKET");
+	if (env && *env) {
+		return env;
 	}
+	return "/tmp/u3vdb-" + std::to_string(::getuid()) + ".sock";
+}
 
-	bool closeFileChannel() {
-		if (!sendFileCommand(kFileCmdClose)) {
+bool writeAll(int fd, const char* data, size_t size) {
+	while (size > 0) {
+		const ssize_t n = ::write(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
 			return false;
 		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(5));
-		return checkFileError("file transfer");
+		data += n;
+		size -= static_cast<size_t>(n);
 	}
+	return true;
+}
 
-	bool checkFileError(const std::string& context) {
-		uint32_t status = 0;
-		if (!readFileStatus(status)) {
-			return false;
-		}
-		if ((status & kFileStatusError) == 0) {
-			return true;
+bool readAll(int fd, char* data, size_t size) {
+	while (size > 0) {
+		const ssize_t n = ::read(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
-		int err = 0;
-		if (!readFileResult(err)) {
+		if (n <= 0) {
 			return false;
 		}
-		std::cerr << context << " failed";
-		if (err != 0) {
-			std::cerr << ": errno=" << err << " (" << std::strerror(err) << ")";
-		}
-		std::cerr << std::endl;
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+bool writeFrame(int fd, uint8_t tag, const char* data, size_t size) {
+	char header[5];
+	const uint32_t length = static_cast<uint32_t>(size);
+	header[0] = static_cast<char>(tag);
+	std::memcpy(header + 1, &length, sizeof(length));
+	return writeAll(fd, header, sizeof(header)) && writeAll(fd, data, size);
+}
+
+bool readFrame(int fd, uint8_t& tag, std::string& payload) {
+	char header[5];
+	uint32_t length = 0;
+	if (!readAll(fd, header, sizeof(header))) {
 		return false;
 	}
+	tag = static_cast<uint8_t>(header[0]);
+	std::memcpy(&length, header + 1, sizeof(length));
+	if (length > (1u << 20)) {
+		return false;
+	}
+	payload.resize(length);
+	return readAll(fd, &payload[0], length);
+}
 
-	bool readFileDataAvail(uint32_t& avail) {
-		return readRegister(kTerminalFileDataAvailAddr, avail);
+// Stream buffer that sends everything written to it to a daemon client as
+// frames with one tag. Write errors are dropped: a client that went away
+// must not fail the command that is still running on the device.
+class FrameStreamBuf : public std::streambuf {
+  public:
+	FrameStreamBuf(int fd, uint8_t tag) : fd_(fd), tag_(tag) {}
+	~FrameStreamBuf() override { sync(); }
+
+  protected:
+	int_type overflow(int_type ch) override {
+		if (ch != traits_type::eof()) {
+			pending_ += traits_type::to_char_type(ch);
+			if (pending_.size() >= 4096) {
+				sync();
+			}
+		}
+		return traits_type::not_eof(ch);
 	}
 
-	bool readFileSize(uint64_t& size) {
-		uint32_t low = 0;
-		uint32_t high = 0;
-		if (!readRegister(kTerminalFileSizeLowAddr, low)) {
-			return false;
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		pending_.append(s, static_cast<size_t>(n));
+		if (pending_.size() >= 4096) {
+			sync();
 		}
-		if (!readRegister(kTerminalFileSizeHighAddr, high)) {
-			return false;
+		return n;
+	}
+
+	int sync() override {
+		if (!pending_.empty()) {
+			writeFrame(fd_, tag_, pending_.data(), pending_.size());
+			pending_.clear();
 		}
-		size = (static_cast<uint64_t>(high) << 32) | low;
-		return true;
+		return 0;
 	}
 
-	U3VDevice& device_;
-	bool initialized_ = false;
-	uint32_t version_ = 0;
-	uint32_t chunkHint_ = 4096;
-	std::string password_;
-	bool echoEnabled_ = true;
+  private:
+	int fd_;
+	uint8_t tag_;
+	std::string pending_;
 };
 
-std::string joinArguments(int argc, char** argv, int startIndex) {
-	std::ostringstream oss;
-	for (int i = startIndex; i < argc; ++i) {
-		if (i > startIndex) {
-			oss << ' ';
+// Hand `command` to the daemon at `socketPath`, relay its output and return
+// the command's exit status.
+int runDaemonClient(const std::string& socketPath, const std::string& command, bool stop) {
+	sockaddr_un addr{};
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path too long: " << socketPath << std::endl;
+		return EXIT_FAILURE;
+	}
+	addr.sun_family = AF_UNIX;
+	std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+	const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		std::cerr << "Cannot reach u3vdb daemon at " << socketPath << ": " << std::strerror(errno)
+				  << std::endl;
+		if (fd >= 0) {
+			::close(fd);
 		}
-		oss << argv[i];
+		return EXIT_FAILURE;
 	}
-	return oss.str();
+	bool sent = false;
+	if (stop) {
+		sent = writeFrame(fd, kDaemonStop, nullptr, 0);
+	} else {
+		std::error_code ec;
+		const std::string cwd = std::filesystem::current_path(ec).string();
+		sent = writeFrame(fd, kDaemonCwd, cwd.data(), cwd.size()) &&
+			   writeFrame(fd, kDaemonCommand, command.data(), command.size());
+	}
+	int status = EXIT_FAILURE;
+	uint8_t tag = 0;
+	std::string payload;
+	while (sent && readFrame(fd, tag, payload)) {
+		if (tag == kDaemonOut) {
+			std::cout << payload << std::flush;
+		} else if (tag == kDaemonErr) {
+			std::cerr << payload << std::flush;
+		} else if (tag == kDaemonExit) {
+			status = payload.empty() ? EXIT_FAILURE : static_cast<unsigned char>(payload[0]);
+			break;
+		}
+	}
+	if (tag != kDaemonExit) {
+		std::cerr << "u3vdb daemon closed the connection" << std::endl;
+	}
+	::close(fd);
+	return status;
 }
 
-std::vector<std::string> splitTokens(const std::string& line) {
-	std::istringstream iss(line);
-	std::vector<std::string> tokens;
-	std::string token;
-	while (iss >> token) {
-		tokens.push_back(token);
+// Accept clients one at a time until SIGINT/SIGTERM or a stop request; each
+// command runs through `run` with the client's working directory, returns
+// the exit status for the client, and has its output routed back to it.
+// Refuses a socket path another daemon answers on or that is not a socket.
+bool serveDaemon(const std::string& socketPath,
+				 const std::function<int(const std::string&, const std::string&, std::ostream&, std::ostream&)>& run) {
+	sockaddr_un addr{};
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path too long: " << socketPath << std::endl;
+		return false;
+	}
+	addr.sun_family = AF_UNIX;
+	std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+	const int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		std::cerr << "socket: " << std::strerror(errno) << std::endl;
+		return false;
+	}
+	// Replace only a stale socket: never another daemon's, never a file.
+	struct stat existing{};
+	if (::lstat(socketPath.c_str(), &existing) == 0) {
+		if (!S_ISSOCK(existing.st_mode)) {
+			std::cerr << socketPath << " exists and is not a socket" << std::endl;
+			::close(listenFd);
+			return false;
+		}
+		const int probeFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		const bool answered =
+			probeFd >= 0 && ::connect(probeFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+		if (probeFd >= 0) {
+			::close(probeFd);
+		}
+		if (answered) {
+			std::cerr << "A u3vdb daemon is already listening on " << socketPath << std::endl;
+			::close(listenFd);
+			return false;
+		}
+		::unlink(socketPath.c_str());
+	}
+	const mode_t oldMask = ::umask(077);
+	const bool bound = ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+	::umask(oldMask);
+	if (!bound || ::listen(listenFd, 8) != 0) {
+		std::cerr << "Cannot listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+		::close(listenFd);
+		return false;
+	}
+
+	struct sigaction sa{};
+	sa.sa_handler = [](int) { gDaemonStop = true; };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	signal(SIGPIPE, SIG_IGN);
+
+	std::cout << "u3vdb daemon listening on " << socketPath << std::endl;
+	while (!gDaemonStop) {
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(listenFd, &readable);
+		timeval tv{0, 200000};
+		if (::select(listenFd + 1, &readable, nullptr, nullptr, &tv) <= 0) {
+			continue;
+		}
+		const int fd = ::accept(listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			continue;
+		}
+		uint8_t tag = 0;
+		std::string payload;
+		std::string cwd;
+		int exitStatus = EXIT_FAILURE;
+		while (readFrame(fd, tag, payload)) {
+			if (tag == kDaemonCwd) {
+				cwd = payload;
+				continue;
+			}
+			if (tag == kDaemonStop) {
+				gDaemonStop = true;
+				exitStatus = EXIT_SUCCESS;
+			} else if (tag == kDaemonCommand) {
+				// Relative local paths in u3vget/u3vput are the client's.
+				FrameStreamBuf outBuf(fd, kDaemonOut);
+				FrameStreamBuf errBuf(fd, kDaemonErr);
+				std::ostream out(&outBuf);
+				std::ostream err(&errBuf);
+				exitStatus = run(payload, cwd, out, err);
+				out.flush();
+				err.flush();
+			}
+			break;
+		}
+		const char status = static_cast<char>(exitStatus);
+		writeFrame(fd, kDaemonExit, &status, 1);
+		::close(fd);
 	}
-	return tokens;
+	::close(listenFd);
+	::unlink(socketPath.c_str());
+	std::cout << "u3vdb daemon stopped" << std::endl;
+	return true;
 }
+#endif
 
-std::vector<std::string> splitTokens(const std::string& line);
+// Set by Ctrl-C to end a monitor run; the samples taken so far are written.
+std::atomic<bool> gMonitorStop{false};
 
 void printUsage(const char* exe) {
 	std::cout << "Usage: " << exe << " [options] [command]\n"
@@ -1818,13 +8538,56 @@ void printUsage(const char* exe) {
 			  << "  -i,  --interactive               Force interactive mode (default if no command)\n"
 			  << "  -get <remote-path> <local-path>  Execute get file command then exit\n"
 			  << "  -put <local-path> <remote-path>  Execute put file command then exit\n"
+			  << "       --resume                    Continue partial -get/-put transfers\n"
+			  << "       --delta                     Send only the blocks -put finds changed\n"
+			  << "       --reconnect                 Wait for the device to come back when it drops out, then\n"
+			  << "                                   resume the interactive session or -get/-put transfer\n"
 			  << "  -r,  --reset                     Reset terminal session before use\n"
 			  << "  -p,  --password <pwd>            Password for unlocking terminal (or use TY_TERM_PASS)\n"
 		  	  << "  -id, --id <serial>               Match device by USB serial number (iSerial)\n"
-		      << "                                   (omit to be prompted when multiple devices exist)\n"
+		      << "                                   (omit to be prompted when multiple devices exist;\n"
+		      << "                                   a comma-separated list runs on each in parallel)\n"
+		      << "       --all                       Run the command or transfer on every matching device\n"
+		      << "                                   ({serial} in the command is replaced per device)\n"
+			  << "       --path <bus-port.port>      Open only the device on this USB port (e.g. 2-1.4)\n"
+			  << "  -q,  --quiet                     Skip the descriptor report when opening the device\n"
 			  << "       --vid <id>                  USB vendor ID (e.g., 0x04b4)\n"
 			  << "       --pid <id>                  USB product ID (e.g., 0x1004)\n"
-			  << "  -h,  --help                      Show this message\n";
+			  << "       --pipeline-depth <n>        UVCP commands kept in flight (default 8)\n"
+			  << "       --file-window <bytes>       Cap the negotiated u3vget/u3vput chunk size\n"
+			  << "       --no-events                 Poll for shell output even if the device can signal it\n"
+			  << "       --no-sentinel               End -c output after 200 ms of silence instead of at an\n"
+			  << "                                   end marker (for shells without printf)\n"
+			  << "       --script <file>             Run one command per line (- for stdin, the default when\n"
+			  << "                                   stdin is not a terminal) and print JSON Lines results\n"
+			  << "       --status-every <n>          Check file status every n u3vput chunks (default 16)\n"
+			  << "       --no-compress               Send file data raw even if the device can compress it\n"
+			  << "       --poll-min <us>             First sleep when waiting on the device (default 100)\n"
+			  << "       --poll-max <us>             Longest sleep between polls (default 20000)\n"
+			  << "       --stats                     Print UVCP counters and latencies at exit\n"
+			  << "                                   (SIGUSR1 prints them while u3vdb runs)\n"
+			  << "       --trace <file>              Record every UVCP transfer to file ({serial} allowed)\n"
+			  << "       --log <file>                Append shell input and output, timestamped, to file\n"
+			  << "                                   ({serial} allowed)\n"
+			  << "       --replay <file>             Answer from a --trace recording instead of a device\n"
+			  << "       --mock                      Use an in-memory kTerminal device (password U3V)\n"
+			  << "       --mock-latency <us>         Per-transfer latency of the mock (default 100)\n"
+			  << "       --mock-bandwidth <MB/s>     Link bandwidth of the mock, 0 = unlimited (default 350)\n"
+			  << "       --mock-fail-out <n>         Fail every nth bulk OUT transfer of register reads to the\n"
+			  << "                                   mock, which are sent again\n"
+			  << "       --daemon                    Keep the session open and serve commands on a socket\n"
+			  << "       --socket <path>             Daemon socket; without --daemon, run -c/-get/-put\n"
+			  << "                                   through it (default $U3VDB_SOCKET or /tmp/u3vdb-<uid>.sock)\n"
+			  << "       --stop-daemon               Ask the daemon on --socket to exit\n"
+			  << "  -h,  --help                      Show this message\n"
+			  << "Benchmark:\n"
+			  << "  " << exe << " [options] bench [--csv] [--iterations <n>] [--bytes <n>]\n"
+			  << "       Measure register latency, readMemory and file channel throughput\n"
+			  << "Monitor:\n"
+			  << "  " << exe << " [options] monitor [--rate <hz>] [--samples <n>] [--seconds <n>]\n"
+			  << "                 [--merge-gap <bytes>] [--out <file>] [--binary] <addr>[:<count>]...\n"
+			  << "       Sample 32-bit registers to CSV (or binary records) until Ctrl-C or a limit;\n"
+			  << "       --merge-gap also reads unrequested registers to join blocks that close\n";
 }
 
 }  // namespace
@@ -1838,6 +8601,34 @@ int main(int argc, char** argv) {
 	std::string serialFilter;
 	uint16_t vendorId = kVendorId;
 	uint16_t productId = kProductId;
+	size_t pipelineDepth = kDefaultPipelineDepth;
+	uint32_t fileWindowLimit = 0;
+	bool useEvents = true;
+	PollPolicy pollPolicy;
+	uint32_t uploadStatusInterval = kDefaultUploadStatusInterval;
+	bool resumeTransfers = false;
+	bool deltaUploads = false;
+	bool compressTransfers = true;
+	bool allDevices = false;
+	bool benchMode = false;
+	bool printStats = false;
+	std::string tracePath;
+	std::string replayPath;
+	std::string logPath;
+	bool useMock = false;
+	bool daemonMode = false;
+	bool framedCommands = true;
+	bool quiet = false;
+	std::string portFilter;
+	bool stopDaemon = false;
+	std::string socketPath;
+	bool forceInteractive = false;
+	std::string scriptPath;
+	MockTerminalDevice::Options mockOptions;
+	TerminalClient::BenchOptions benchOptions;
+	bool monitorMode = false;
+	TerminalClient::MonitorOptions monitorOptions;
+	bool reconnect = false;
 
 	auto parseU16 = [](const std::string& s, uint16_t& out) -> bool {
 		try {
@@ -1849,6 +8640,16 @@ int main(int argc, char** argv) {
 			return false;
 		}
 	};
+	auto parseU32 = [](const std::string& s, uint32_t& out) -> bool {
+		try {
+			unsigned long v = std::stoul(s, nullptr, 0);
+			if (v > 0xFFFFFFFFul) return false;
+			out = static_cast<uint32_t>(v);
+			return true;
+		} catch (...) {
+			return false;
+		}
+	};
 
 	for (int i = 1; i < argc; ++i) {
 		std::string arg = argv[i];
@@ -1861,6 +8662,7 @@ int main(int argc, char** argv) {
 				return EXIT_FAILURE;
 			}
 			interactive = true;
+			forceInteractive = true;
 			uint16_t v = 0;
 			if (!parseU16(argv[++i], v)) {
 				std::cerr << "Invalid interactive mode value" << std::endl;
@@ -1905,6 +8707,66 @@ int main(int argc, char** argv) {
 				return EXIT_FAILURE;
 			}
 			serialFilter = argv[++i];
+		} else if (arg == "--stats") {
+			printStats = true;
+		} else if (arg == "--trace" || arg == "--replay") {
+			if (i + 1 >= argc) {
+				std::cerr << arg << " requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			(arg == "--trace" ? tracePath : replayPath) = argv[++i];
+		} else if (arg == "--log") {
+			if (i + 1 >= argc) {
+				std::cerr << "--log requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			logPath = argv[++i];
+		} else if (arg == "--mock") {
+			useMock = true;
+		} else if (arg == "-q" || arg == "--quiet") {
+			quiet = true;
+		} else if (arg == "--path") {
+			if (i + 1 >= argc) {
+				std::cerr << "--path requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			portFilter = argv[++i];
+		} else if (arg == "--no-sentinel") {
+			framedCommands = false;
+		} else if (arg == "--script") {
+			if (i + 1 >= argc) {
+				std::cerr << "--script requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			scriptPath = argv[++i];
+			interactive = false;
+		} else if (arg == "--daemon") {
+			daemonMode = true;
+			interactive = false;
+		} else if (arg == "--stop-daemon") {
+			stopDaemon = true;
+		} else if (arg == "--socket") {
+			if (i + 1 >= argc) {
+				std::cerr << "--socket requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			socketPath = argv[++i];
+		} else if (arg == "--mock-latency" || arg == "--mock-bandwidth" || arg == "--mock-fail-out") {
+			uint32_t value = 0;
+			if (i + 1 >= argc || !parseU32(argv[++i], value)) {
+				std::cerr << arg << " requires a numeric argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			if (arg == "--mock-latency") {
+				mockOptions.latency = std::chrono::microseconds(value);
+			} else if (arg == "--mock-fail-out") {
+				mockOptions.failTransferEvery = value;
+			} else {
+				mockOptions.bandwidthMBps = value;
+			}
+			useMock = true;
+		} else if (arg == "--all") {
+			allDevices = true;
 		} else if (arg == "--vid") {
 			if (i + 1 >= argc) {
 				std::cerr << "--vid requires an argument" << std::endl;
@@ -1927,6 +8789,121 @@ int main(int argc, char** argv) {
 				return EXIT_FAILURE;
 			}
 			productId = v;
+		} else if (arg == "--pipeline-depth") {
+			if (i + 1 >= argc) {
+				std::cerr << "--pipeline-depth requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			uint16_t v = 0;
+			if (!parseU16(argv[++i], v) || v == 0) {
+				std::cerr << "Invalid pipeline depth value" << std::endl;
+				return EXIT_FAILURE;
+			}
+			pipelineDepth = v;
+		} else if (arg == "--file-window") {
+			if (i + 1 >= argc) {
+				std::cerr << "--file-window requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			uint16_t v = 0;
+			if (!parseU16(argv[++i], v) || v == 0) {
+				std::cerr << "Invalid file window value" << std::endl;
+				return EXIT_FAILURE;
+			}
+			fileWindowLimit = v;
+		} else if (arg == "--no-events") {
+			useEvents = false;
+		} else if (arg == "--resume") {
+			resumeTransfers = true;
+		} else if (arg == "--delta") {
+			deltaUploads = true;
+		} else if (arg == "--reconnect") {
+			reconnect = true;
+		} else if (arg == "--no-compress") {
+			compressTransfers = false;
+		} else if (arg == "--status-every") {
+			if (i + 1 >= argc) {
+				std::cerr << "--status-every requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			if (!parseU32(argv[++i], uploadStatusInterval) || uploadStatusInterval == 0) {
+				std::cerr << "Invalid --status-every value" << std::endl;
+				return EXIT_FAILURE;
+			}
+		} else if (arg == "--poll-min" || arg == "--poll-max") {
+			if (i + 1 >= argc) {
+				std::cerr << arg << " requires an argument" << std::endl;
+				return EXIT_FAILURE;
+			}
+			uint32_t v = 0;
+			if (!parseU32(argv[++i], v) || v == 0) {
+				std::cerr << "Invalid " << arg << " value" << std::endl;
+				return EXIT_FAILURE;
+			}
+			(arg == "--poll-min" ? pollPolicy.minDelay : pollPolicy.maxDelay) = std::chrono::microseconds(v);
+		} else if (arg == "bench" && singleCommand.empty()) {
+			benchMode = true;
+			interactive = false;
+			for (++i; i < argc; ++i) {
+				std::string opt = argv[i];
+				uint32_t v = 0;
+				if (opt == "--csv") {
+					benchOptions.csv = true;
+				} else if ((opt == "--iterations" || opt == "--bytes") && i + 1 < argc &&
+						   parseU32(argv[i + 1], v) && v != 0) {
+					++i;
+					if (opt == "--iterations") {
+						benchOptions.iterations = v;
+					} else {
+						benchOptions.fileBytes = v;
+					}
+				} else {
+					std::cerr << "Unknown bench option '" << opt << "'" << std::endl;
+					return EXIT_FAILURE;
+				}
+			}
+		} else if (arg == "monitor" && singleCommand.empty()) {
+			monitorMode = true;
+			interactive = false;
+			for (++i; i < argc; ++i) {
+				std::string opt = argv[i];
+				uint32_t v = 0;
+				if (opt == "--binary") {
+					monitorOptions.binary = true;
+				} else if (opt == "--out" && i + 1 < argc) {
+					monitorOptions.outPath = argv[++i];
+				} else if (opt == "--merge-gap" && i + 1 < argc && parseU32(argv[i + 1], v)) {
+					++i;
+					monitorOptions.mergeGap = v;
+				} else if ((opt == "--rate" || opt == "--samples" || opt == "--seconds") && i + 1 < argc &&
+						   parseU32(argv[i + 1], v) && v != 0) {
+					++i;
+					if (opt == "--rate") {
+						monitorOptions.rate = std::min<uint32_t>(v, 1000000);
+					} else if (opt == "--samples") {
+						monitorOptions.samples = v;
+					} else {
+						monitorOptions.seconds = v;
+					}
+				} else {
+					// <addr>[:<count>] of 32-bit registers
+					const size_t colon = opt.find(':');
+					uint32_t address = 0;
+					uint32_t count = 1;
+					if (opt.empty() || opt[0] == '-' || !parseU32(opt.substr(0, colon), address) || address % 4 != 0 ||
+						(colon != std::string::npos && (!parseU32(opt.substr(colon + 1), count) || count == 0 ||
+														count > 4096 || address + 4ull * count > 0x100000000ull))) {
+						std::cerr << "Unknown monitor option or register '" << opt
+								  << "' (registers are 4-byte aligned <addr>[:<count>])" << std::endl;
+						return EXIT_FAILURE;
+					}
+					monitorOptions.ranges.emplace_back(address, static_cast<uint16_t>(count));
+				}
+			}
+			if (monitorOptions.ranges.empty()) {
+				std::cerr << "monitor needs at least one register <addr>[:<count>]" << std::endl;
+				return EXIT_FAILURE;
+			}
 		} else {
 			singleCommand = joinArguments(argc, argv, i);
 			interactive = false;
@@ -1934,70 +8911,436 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	U3VDevice device;
-	if (!device.open(vendorId, productId, serialFilter)) {
+	pollPolicy.maxDelay = std::max(pollPolicy.maxDelay, pollPolicy.minDelay);
+	// Commands piped in without -c or -i run as a script.
+#ifdef _WIN32
+	const bool stdinIsTerminal = _isatty(_fileno(stdin)) != 0;
+#else
+	const bool stdinIsTerminal = ::isatty(STDIN_FILENO) != 0;
+#endif
+	// Daemon and socket runs never take commands from stdin unasked, so ssh,
+	// CI and open pipes do not block them.
+	if (interactive && !forceInteractive && !stdinIsTerminal && !daemonMode && !stopDaemon && socketPath.empty() &&
+		!benchMode && !monitorMode) {
+		scriptPath = "-";
+		interactive = false;
+	}
+	if (!scriptPath.empty() && (benchMode || monitorMode || !singleCommand.empty())) {
+		std::cerr << "--script cannot be combined with -c, -get, -put, bench or monitor" << std::endl;
 		return EXIT_FAILURE;
 	}
-
-	uint8_t controlInterface = 0, epOut = 0, epIn = 0;
-	if (!device.findU3VControlInterface(controlInterface, epOut, epIn)) {
+	const bool fanOut = allDevices || serialFilter.find(',') != std::string::npos;
+	if (fanOut && !portFilter.empty()) {
+		std::cerr << "--path selects a single device; drop --all or the --id list" << std::endl;
 		return EXIT_FAILURE;
 	}
-	if (!device.claimInterface(controlInterface, epOut, epIn)) {
+	if (fanOut && monitorMode) {
+		std::cerr << "monitor watches one device; drop --all or the --id list" << std::endl;
 		return EXIT_FAILURE;
 	}
-
-	TerminalClient terminal(device);
-	if (!terminal.initialize()) {
+	if (fanOut && !replayPath.empty()) {
+		std::cerr << "--replay plays back a single device; drop --all or the --id list" << std::endl;
 		return EXIT_FAILURE;
 	}
-	if (!password.empty()) {
-		terminal.setPassword(password);
+	if (fanOut && !logPath.empty() && logPath.find("{serial}") == std::string::npos) {
+		std::cerr << "--log with --all or an --id list needs a {serial} in the file name" << std::endl;
+		return EXIT_FAILURE;
 	}
-
-	// kTerminal version must be >= 0x00010002 to allow V2 mode
-	const uint32_t kMinV2Version = 0x00010002u;
-	uint32_t kVersion = terminal.getVersion();
-	if (interactiveMode >= 2 && kVersion < kMinV2Version) {
-		std::cerr << "kTerminal version 0x" << std::hex << kVersion
-			  << " is below 0x" << kMinV2Version
-			  << ", falling back to V1 mode" << std::dec << std::endl;
-		interactiveMode = 1;
+	if (reconnect && (fanOut || useMock || !replayPath.empty() || !tracePath.empty() || daemonMode || benchMode ||
+					  monitorMode || !scriptPath.empty())) {
+		std::cerr << "--reconnect follows one device through an interactive session, -c, -get or -put; drop --all, "
+					 "the --id list, --mock, --trace, --replay, --daemon, --script, bench and monitor" << std::endl;
+		return EXIT_FAILURE;
 	}
-	bool currentEcho = terminal.getEchoEnabled();
-	if (interactive) {
-		terminal.setEchoEnabled(interactiveMode == 2);
-		if (currentEcho != (interactiveMode == 2)) {
-			resetSession = true;
+	if (deltaUploads && singleCommand.rfind("u3vput ", 0) == 0) {
+		singleCommand += " --delta";
+	}
+	// U3VDB_SOCKET routes one-shot commands through a running daemon.
+	const bool viaEnvironment = !interactive && !benchMode && !monitorMode && !fanOut && scriptPath.empty() &&
+								std::getenv("U3VDB_SOCKET");
+	if (daemonMode || stopDaemon || !socketPath.empty() || viaEnvironment) {
+#ifdef _WIN32
+		std::cerr << "--daemon and --socket are not supported on Windows" << std::endl;
+		return EXIT_FAILURE;
+#else
+		if (socketPath.empty()) {
+			socketPath = defaultDaemonSocket();
 		}
-	} else {
-		terminal.setEchoEnabled(false);
-		if (currentEcho != false) {
-			resetSession = true;
+		if (daemonMode && (fanOut || benchMode || monitorMode || stopDaemon || !scriptPath.empty())) {
+			std::cerr << "--daemon serves a single device; drop --all, the --id list, bench, monitor, --script and "
+						 "--stop-daemon" << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (stopDaemon) {
+			return runDaemonClient(socketPath, std::string(), true);
+		}
+		if (!daemonMode) {
+			if (interactive || benchMode || monitorMode || !scriptPath.empty()) {
+				std::cerr << "--socket runs -c, -get and -put through a daemon; interactive sessions, "
+							 "scripts, bench and monitor need a direct connection" << std::endl;
+				return EXIT_FAILURE;
+			}
+			if (!logPath.empty()) {
+				std::cerr << "--log records the daemon's session; pass it to --daemon instead" << std::endl;
+				return EXIT_FAILURE;
+			}
+			std::string command = singleCommand;
+			if (resumeTransfers && (command.rfind("u3vget ", 0) == 0 || command.rfind("u3vput ", 0) == 0)) {
+				command += " --resume";
+			}
+			return runDaemonClient(socketPath, command, false);
 		}
+#endif
 	}
-
-	if (resetSession && !terminal.reset()) {
+	if (useMock && (fanOut || !replayPath.empty() || !tracePath.empty())) {
+		std::cerr << "--mock cannot be combined with --all, an --id list, --trace or --replay" << std::endl;
 		return EXIT_FAILURE;
 	}
+	std::vector<std::string> scriptLines;
+	if (!scriptPath.empty()) {
+		std::ifstream scriptFile;
+		if (scriptPath != "-") {
+			scriptFile.open(scriptPath);
+			if (!scriptFile) {
+				std::cerr << "Cannot open script " << scriptPath << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		std::istream& script = scriptPath == "-" ? std::cin : scriptFile;
+		for (std::string line; std::getline(script, line);) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			const size_t first = line.find_first_not_of(" \t");
+			if (first != std::string::npos && line[first] != '#') {
+				scriptLines.push_back(line);
+			}
+		}
+	}
+	const int requestedMode = interactiveMode;
+	// The remote command's $? for single-device -c runs.
+	int exitStatus = EXIT_FAILURE;
+	const bool requestReset = resetSession;
+
+	// What a --reconnect session learned about its device.
+	struct SessionLink {
+		std::ostream* startupErr = nullptr;          // errors until the terminal answers
+		std::chrono::steady_clock::time_point lostAt; // set when this is a reconnect
+		std::string serial;                          // of the device opened...
+		std::string port;                            // ...and where it was
+		bool connected = false;                      // the terminal answered
+		bool lost = false;                           // the device went away
+	};
 
-	bool ok = false;
-	if (interactive) {
-		if(interactiveMode == 1){
-			ok = terminal.interactiveLoopV1();
-		} else if(interactiveMode == 2){
-			ok = terminal.interactiveLoopV2();
+	// One complete session against the device with the given serial (empty:
+	// pick or prompt as usual). Safe to run concurrently for different devices.
+	auto runSession = [&](const std::string& serial, const std::string& port, std::ostream& out, std::ostream& err,
+						  SessionLink* link = nullptr) -> bool {
+		int interactiveMode = requestedMode;
+		bool resetSession = requestReset;
+		U3VDevice device;
+		// "{serial}" lets fan-out sessions use a distinct local path per device;
+		// the serial is the open device's.
+		auto perDevice = [&device](std::string text) {
+			const std::string& serial = device.serialNumber();
+			for (size_t pos; !serial.empty() && (pos = text.find("{serial}")) != std::string::npos;) {
+				text.replace(pos, 8, serial);
+			}
+			return text;
+		};
+		struct LinkGuard {
+			SessionLink* link;
+			const U3VDevice& device;
+			~LinkGuard() {
+				if (link) {
+					link->lost = device.disconnected();
+				}
+			}
+		} linkGuard{link, device};
+		std::ostream& startupErr = link && link->startupErr ? *link->startupErr : err;
+		std::unique_ptr<MockTerminalDevice> mock;
+		device.setOutput(out, startupErr);
+		device.setQuiet(quiet);
+		if (useMock) {
+			mock = std::make_unique<MockTerminalDevice>(mockOptions);
+			device.openEmulated(*mock);
+		} else if (!replayPath.empty()) {
+			if (!device.openReplay(replayPath)) {
+				return false;
+			}
+		} else if (!device.open(vendorId, productId, serial, port)) {
+			return false;
+		}
+		if (link) {
+			link->serial = device.serialNumber();
+			link->port = device.port();
+		}
+		if (!tracePath.empty() && !device.startTrace(perDevice(tracePath))) {
+			return false;
+		}
+
+		uint8_t controlInterface = 0, epOut = 0, epIn = 0;
+		if (!device.findU3VControlInterface(controlInterface, epOut, epIn)) {
+			return false;
+		}
+		if (!device.claimInterface(controlInterface, epOut, epIn)) {
+			return false;
+		}
+		device.setPipelineDepth(pipelineDepth);
+		uint8_t eventInterface = 0, epEvent = 0;
+		if (useEvents && device.findU3VEventInterface(eventInterface, epEvent)) {
+			device.claimEventInterface(eventInterface, epEvent);
+		}
+
+		SessionLogWriter log;
+		if (!logPath.empty()) {
+			if (!log.open(perDevice(logPath), startupErr)) {
+				return false;
+			}
+			const std::string source = useMock ? std::string("mock") : device.serialNumber();
+			log.record(kLogSession, reinterpret_cast<const uint8_t*>(source.data()), source.size());
+		}
+
+		TerminalClient terminal(device);
+		terminal.setOutput(out, startupErr);
+		terminal.setSessionLog(logPath.empty() ? nullptr : &log);
+		terminal.setFileWindowLimit(fileWindowLimit);
+		terminal.setPollPolicy(pollPolicy);
+		terminal.setUploadStatusInterval(uploadStatusInterval);
+		terminal.setResumeTransfers(resumeTransfers);
+		terminal.setCompressTransfers(compressTransfers);
+		terminal.setFramedCommands(framedCommands);
+		if (!terminal.initialize()) {
+			return false;
+		}
+		if (link) {
+			link->connected = true;
+			device.setOutput(out, err);
+			terminal.setOutput(out, err);
+			if (link->lostAt != std::chrono::steady_clock::time_point{}) {
+				const std::chrono::duration<double> away = std::chrono::steady_clock::now() - link->lostAt;
+				err << "Reconnected after " << std::fixed << std::setprecision(1) << away.count() << " s"
+					<< std::defaultfloat << std::endl;
+			}
+		}
+		if (!password.empty()) {
+			terminal.setPassword(password);
+		}
+
+		// kTerminal version must be >= 0x00010002 to allow V2 mode
+		const uint32_t kMinV2Version = 0x00010002u;
+		uint32_t kVersion = terminal.getVersion();
+		if (interactiveMode >= 2 && kVersion < kMinV2Version) {
+			err << "kTerminal version 0x" << std::hex << kVersion
+				  << " is below 0x" << kMinV2Version
+				  << ", falling back to V1 mode" << std::dec << std::endl;
+			interactiveMode = 1;
+		}
+		bool currentEcho = terminal.getEchoEnabled();
+		if (interactive) {
+			terminal.setEchoEnabled(interactiveMode == 2);
+			if (currentEcho != (interactiveMode == 2)) {
+				resetSession = true;
+			}
+		} else {
+			terminal.setEchoEnabled(false);
+			if (currentEcho != false) {
+				resetSession = true;
+			}
+		}
+
+		if (resetSession && !terminal.reset()) {
+			return false;
+		}
+
+		bool ok = false;
+		if (interactive) {
+			if (useEvents && interactiveMode != 1) {
+				terminal.enableOutputEvents();
+			}
+			if(interactiveMode == 1){
+				ok = terminal.interactiveLoopV1();
+			} else if(interactiveMode == 2){
+				ok = terminal.interactiveLoopV2();
+			} else {
+				ok = terminal.interactiveLoopV2();
+			}
+		} else if (benchMode) {
+			ok = terminal.benchmark(benchOptions);
+		} else if (monitorMode) {
+			std::signal(SIGINT, [](int) { gMonitorStop = true; });
+			ok = terminal.monitor(monitorOptions, gMonitorStop);
+#ifndef _WIN32
+		} else if (daemonMode) {
+			ok = serveDaemon(socketPath, [&](const std::string& command, const std::string& cwd,
+											 std::ostream& clientOut, std::ostream& clientErr) {
+				device.setOutput(clientOut, clientErr);
+				terminal.setOutput(clientOut, clientErr);
+				terminal.setLocalDirectory(cwd);
+				const bool done = terminal.runOnce(command);
+				terminal.setLocalDirectory(std::string());
+				device.setOutput(out, err);
+				terminal.setOutput(out, err);
+				return done ? EXIT_SUCCESS : terminal.lastExitStatus() > 0 ? terminal.lastExitStatus() : EXIT_FAILURE;
+			});
+#endif
+		} else if (!scriptPath.empty()) {
+			std::vector<std::string> commands;
+			for (const auto& line : scriptLines) {
+				commands.push_back(perDevice(line));
+			}
+			ok = terminal.runScript(commands);
 		} else {
-			ok = terminal.interactiveLoopV2();
+			ok = terminal.runOnce(perDevice(singleCommand));
+			if (!ok && !fanOut && terminal.lastExitStatus() > 0) {
+				exitStatus = terminal.lastExitStatus();
+			}
+		}
+
+		terminal.disableOutputEvents();
+		if (!terminal.lock()) {
+			return false;
+		}
+		if (printStats) {
+			device.stats().print(err);
+		}
+
+		device.shutdown();
+		if (!log.close()) {
+			err << "Writing the session log failed" << std::endl;
+			ok = false;
+		}
+		return ok;
+	};
+
+#ifndef _WIN32
+	// SA_RESTART keeps a signal from ending the session's getline; the
+	// client polls the flag while it waits on the device instead.
+	{
+		struct sigaction sa{};
+		sa.sa_handler = [](int) { gStatsRequested = true; };
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, nullptr);
+	}
+#endif
+	if (!fanOut && !reconnect) {
+		return runSession(serialFilter, portFilter, std::cout, std::cerr) ? EXIT_SUCCESS : exitStatus;
+	}
+	if (reconnect) {
+		// Run the session again whenever the device drops out, pinned to the
+		// serial (or port) it had. Transfers continue with --resume; an
+		// interactive session gets a fresh shell. Attempts while the device
+		// is away or still booting keep their errors until the deadline.
+		const bool transfer = singleCommand.rfind("u3vget ", 0) == 0 || singleCommand.rfind("u3vput ", 0) == 0;
+		std::string serial = serialFilter;
+		std::ostringstream attemptErr;
+		std::chrono::steady_clock::time_point lostAt;
+		for (;;) {
+			const bool waiting = lostAt != std::chrono::steady_clock::time_point{};
+			SessionLink link;
+			link.startupErr = waiting ? &attemptErr : nullptr;
+			link.lostAt = lostAt;
+			attemptErr.str(std::string());
+			const bool ok = runSession(serial, portFilter, std::cout, std::cerr, &link);
+			if (!link.serial.empty()) {
+				serial = link.serial;
+			} else if (!link.port.empty() && serial.empty()) {
+				portFilter = link.port;
+			}
+			if (!link.lost && (link.connected || !waiting)) {
+				return ok ? EXIT_SUCCESS : exitStatus;
+			}
+			if (link.connected || !waiting) {
+				if (!interactive && !transfer) {
+					std::cerr << "Device disconnected; '" << singleCommand
+							  << "' is not re-run (--reconnect resumes transfers and interactive sessions)"
+							  << std::endl;
+					return EXIT_FAILURE;
+				}
+				if (transfer && singleCommand.find(" --resume") == std::string::npos) {
+					singleCommand += " --resume";
+				}
+				std::cerr << "Device " << (serial.empty() ? portFilter : serial) << " disconnected; waiting up to "
+						  << kReconnectTimeout.count() << " s for it to return" << std::endl;
+				lostAt = std::chrono::steady_clock::now();
+			} else {
+				std::this_thread::sleep_for(kReconnectRetry); // there, but not answering yet
+			}
+			const auto deadline = lostAt + kReconnectTimeout;
+			if (!U3VDevice::waitForDevice(vendorId, productId, serial.empty() ? portFilter : std::string(), deadline) ||
+				std::chrono::steady_clock::now() >= deadline) {
+				std::cerr << attemptErr.str() << "Device did not come back within " << kReconnectTimeout.count()
+						  << " s" << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	if (interactive) {
+		std::cerr << "--all and --id with several serials need a command, -get, -put or bench" << std::endl;
+		return EXIT_FAILURE;
+	}
+	// Enumerate once here: workers open their camera by port path only.
+	std::vector<U3VDevice::DeviceEntry> devices;
+	if (!U3VDevice::listDevices(vendorId, productId, devices)) {
+		return EXIT_FAILURE;
+	}
+	std::vector<std::string> serials;
+	if (allDevices) {
+		for (const auto& device : devices) {
+			serials.push_back(device.serial);
 		}
 	} else {
-		ok = terminal.runOnce(singleCommand);
+		std::istringstream list(serialFilter);
+		std::string serial;
+		while (std::getline(list, serial, ',')) {
+			if (!serial.empty()) {
+				serials.push_back(serial);
+			}
+		}
 	}
-
-	if (!terminal.lock()) {
+	if (serials.empty()) {
+		std::cerr << "No devices " << std::hex << vendorId << ':' << productId << std::dec
+				  << " with a serial number found" << std::endl;
 		return EXIT_FAILURE;
 	}
-
-	device.shutdown();
-	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	// A serial missing from the enumeration gets no port, so its worker
+	// searches and reports it as usual.
+	std::vector<std::string> ports(serials.size());
+	for (size_t i = 0; i < serials.size(); ++i) {
+		for (const auto& device : devices) {
+			if (device.serial == serials[i]) {
+				ports[i] = device.port;
+			}
+		}
+	}
+	// One worker and one libusb context per device.
+	std::vector<std::thread> workers;
+	std::unique_ptr<bool[]> results(new bool[serials.size()]());
+	for (size_t i = 0; i < serials.size(); ++i) {
+		workers.emplace_back([&, i] {
+			PrefixedLineBuf outBuf(std::cout, serials[i]);
+			PrefixedLineBuf errBuf(std::cerr, serials[i]);
+			std::ostream out(&outBuf);
+			std::ostream err(&errBuf);
+			results[i] = runSession(serials[i], ports[i], out, err);
+		});
+	}
+	size_t failed = 0;
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+		if (!results[i]) {
+			++failed;
+		}
+	}
+	if (failed != 0) {
+		std::cerr << failed << " of " << serials.size() << " device(s) failed:";
+		for (size_t i = 0; i < serials.size(); ++i) {
+			if (!results[i]) {
+				std::cerr << ' ' << serials[i];
+			}
+		}
+		std::cerr << std::endl;
+	}
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,561 @@
+// Tar archive writing and extraction for u3vget -r and u3vput -r. Nothing
+// here touches a device, so u3vdb_check can feed it hostile archives.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace u3vdb {
+
+// Tar archives for u3vget -r and u3vput -r, in the GNU layout both GNU tar
+// and busybox read: ustar headers, with 'L'/'K' records for names that do
+// not fit. Regular files, directories and symbolic links are kept.
+constexpr size_t kTarBlock = 512;
+
+struct TarHeader {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char type;
+	char linkName[100];
+	char magic[6];
+	char version[2];
+	char userName[32];
+	char groupName[32];
+	char devMajor[8];
+	char devMinor[8];
+	char prefix[155];
+	char pad[12];
+};
+static_assert(sizeof(TarHeader) == kTarBlock, "a tar header is one block");
+
+inline uint64_t tarPadding(uint64_t bytes) {
+	return (kTarBlock - bytes % kTarBlock) % kTarBlock;
+}
+
+inline std::time_t toTimeT(std::filesystem::file_time_type time) {
+	using namespace std::chrono;
+	return system_clock::to_time_t(time_point_cast<system_clock::duration>(
+		time - std::filesystem::file_time_type::clock::now() + system_clock::now()));
+}
+
+inline std::filesystem::file_time_type fromTimeT(std::time_t time) {
+	using namespace std::chrono;
+	return std::filesystem::file_time_type::clock::now() +
+		   duration_cast<std::filesystem::file_time_type::duration>(system_clock::from_time_t(time) -
+																	 system_clock::now());
+}
+
+// Produces the archive of a local directory tree as a byte stream; names are
+// relative to the root. The tree is listed up front, so size() is known
+// before the first byte is read.
+class TarWriterBuf : public std::streambuf {
+  public:
+	TarWriterBuf(const std::filesystem::path& root, std::ostream& err) : err_(err) {
+		namespace fs = std::filesystem;
+		fs::path base = root.lexically_normal();
+		if (!base.has_filename() && base.has_relative_path()) {
+			base = base.parent_path();
+		}
+		std::error_code ec;
+		for (fs::recursive_directory_iterator it(base, ec), end; !ec && it != end; it.increment(ec)) {
+			const fs::file_status st = it->symlink_status(ec);
+			if (ec) {
+				break;
+			}
+			Entry entry;
+			entry.path = it->path();
+			entry.name = it->path().lexically_relative(base).generic_string();
+			entry.mode = static_cast<unsigned>(st.permissions()) & 07777;
+			if (fs::is_symlink(st)) {
+				entry.type = '2';
+				entry.link = fs::read_symlink(it->path(), ec).generic_string();
+			} else if (fs::is_directory(st)) {
+				entry.type = '5';
+				entry.name += '/';
+			} else if (fs::is_regular_file(st)) {
+				entry.type = '0';
+				entry.size = it->file_size(ec);
+			} else {
+				err_ << "Skipping '" << it->path().string() << "': not a file, directory or link" << std::endl;
+				continue;
+			}
+			if (!ec) {
+				entry.mtime = entry.type == '2' ? std::time(nullptr) : toTimeT(it->last_write_time(ec));
+			}
+			if (ec) {
+				break;
+			}
+			size_ += headerBytes(entry) + entry.size + tarPadding(entry.size);
+			entries_.push_back(std::move(entry));
+		}
+		if (ec) {
+			err_ << "Cannot list '" << root.string() << "': " << ec.message() << std::endl;
+			ok_ = false;
+		}
+		size_ += 2 * kTarBlock;
+	}
+
+	// False if the tree could not be listed or a file could not be read in full.
+	bool ok() const { return ok_; }
+	// Bytes in the whole archive.
+	uint64_t size() const { return size_; }
+	size_t entries() const { return entries_.size(); }
+
+  protected:
+	int_type underflow() override {
+		if (gptr() < egptr()) {
+			return traits_type::to_int_type(*gptr());
+		}
+		piece_.clear();
+		if (file_.is_open()) {
+			readFileData();
+		} else if (next_ < entries_.size()) {
+			const Entry& entry = entries_[next_++];
+			appendHeaders(entry);
+			if (entry.type == '0' && entry.size != 0) {
+				file_.open(entry.path, std::ios::binary);
+				fileLeft_ = entry.size;
+				filePadding_ = tarPadding(entry.size);
+				if (!file_) {
+					err_ << "Cannot read '" << entry.path.string() << "'" << std::endl;
+					ok_ = false;
+				}
+			}
+		} else if (!trailerDone_) {
+			piece_.assign(2 * kTarBlock, '\0');
+			trailerDone_ = true;
+		}
+		if (piece_.empty()) {
+			return traits_type::eof();
+		}
+		setg(piece_.data(), piece_.data(), piece_.data() + piece_.size());
+		return traits_type::to_int_type(*gptr());
+	}
+
+  private:
+	static constexpr size_t kPieceBytes = 256 * 1024;
+
+	struct Entry {
+		std::filesystem::path path;
+		std::string name;
+		std::string link;
+		char type = '0';
+		uint64_t size = 0;
+		unsigned mode = 0;
+		std::time_t mtime = 0;
+	};
+
+	static uint64_t headerBytes(const Entry& entry) {
+		uint64_t bytes = kTarBlock;
+		for (const std::string* text : {&entry.name, &entry.link}) {
+			if (text->size() > sizeof(TarHeader::name)) {
+				bytes += kTarBlock + text->size() + 1 + tarPadding(text->size() + 1);
+			}
+		}
+		return bytes;
+	}
+
+	// Octal while it fits the field, else the GNU base-256 form.
+	static void setNumber(char* field, size_t length, uint64_t value) {
+		if (value < (1ull << (3 * (length - 1)))) {
+			std::snprintf(field, length, "%0*llo", static_cast<int>(length - 1),
+						  static_cast<unsigned long long>(value));
+			return;
+		}
+		std::memset(field, 0, length);
+		field[0] = static_cast<char>(0x80);
+		for (size_t i = length - 1; i > 0 && value != 0; --i, value >>= 8) {
+			field[i] = static_cast<char>(value & 0xFF);
+		}
+	}
+
+	void appendHeader(const std::string& name, const std::string& link, char type, uint64_t size,
+					  unsigned mode, std::time_t mtime) {
+		TarHeader h{};
+		std::memcpy(h.name, name.data(), std::min(name.size(), sizeof(h.name)));
+		std::memcpy(h.linkName, link.data(), std::min(link.size(), sizeof(h.linkName)));
+		setNumber(h.mode, sizeof(h.mode), mode);
+		setNumber(h.uid, sizeof(h.uid), 0);
+		setNumber(h.gid, sizeof(h.gid), 0);
+		setNumber(h.size, sizeof(h.size), size);
+		setNumber(h.mtime, sizeof(h.mtime), static_cast<uint64_t>(std::max<std::time_t>(mtime, 0)));
+		h.type = type;
+		std::memcpy(h.magic, "ustar ", sizeof(h.magic));
+		std::memcpy(h.version, " ", sizeof(h.version));
+		std::memset(h.checksum, ' ', sizeof(h.checksum));
+		unsigned sum = 0;
+		for (unsigned char ch : std::string(reinterpret_cast<const char*>(&h), sizeof(h))) {
+			sum += ch;
+		}
+		std::snprintf(h.checksum, sizeof(h.checksum), "%06o", sum);
+		piece_.append(reinterpret_cast<const char*>(&h), sizeof(h));
+	}
+
+	void appendHeaders(const Entry& entry) {
+		auto longRecord = [this](const std::string& text, char type) {
+			if (text.size() > sizeof(TarHeader::name)) {
+				appendHeader("././@LongLink", {}, type, text.size() + 1, 0, 0);
+				piece_ += text;
+				piece_.append(1 + tarPadding(text.size() + 1), '\0');
+			}
+		};
+		longRecord(entry.name, 'L');
+		longRecord(entry.link, 'K');
+		appendHeader(entry.name, entry.link, entry.type, entry.size, entry.mode, entry.mtime);
+	}
+
+	// The next piece of the open file, then its padding. A file that shrank
+	// is padded out to its listed size so the archive stays well formed.
+	void readFileData() {
+		const size_t want = static_cast<size_t>(std::min<uint64_t>(fileLeft_, kPieceBytes));
+		piece_.resize(want);
+		size_t got = 0;
+		if (file_) {
+			file_.read(&piece_[0], static_cast<std::streamsize>(want));
+			got = static_cast<size_t>(file_.gcount());
+		}
+		if (got < want) {
+			if (ok_) {
+				err_ << "'" << entries_[next_ - 1].path.string() << "' changed while it was archived" << std::endl;
+			}
+			ok_ = false;
+			std::fill(piece_.begin() + static_cast<std::ptrdiff_t>(got), piece_.end(), '\0');
+		}
+		fileLeft_ -= want;
+		if (fileLeft_ == 0) {
+			piece_.append(static_cast<size_t>(filePadding_), '\0');
+			file_.close();
+		}
+	}
+
+	std::ostream& err_;
+	std::vector<Entry> entries_;
+	size_t next_ = 0;
+	uint64_t size_ = 0;
+	bool ok_ = true;
+	bool trailerDone_ = false;
+	std::ifstream file_;
+	uint64_t fileLeft_ = 0;
+	uint64_t filePadding_ = 0;
+	std::string piece_;
+};
+
+// Unpacks an archive written to it below a local directory. Names and link
+// targets that are absolute or climb out with "..", and entries below a
+// symbolic link, are refused. Writes fail after an error.
+class TarExtractBuf : public std::streambuf {
+  public:
+	TarExtractBuf(const std::filesystem::path& root, std::ostream& err) : root_(root), err_(err) {}
+
+	// The end-of-archive blocks arrived.
+	bool finished() const { return finished_; }
+	bool ok() const { return ok_; }
+	size_t entries() const { return entries_; }
+
+  protected:
+	int_type overflow(int_type ch) override {
+		if (ch == traits_type::eof()) {
+			return traits_type::not_eof(ch);
+		}
+		const char c = traits_type::to_char_type(ch);
+		return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		size_t left = static_cast<size_t>(n);
+		while (left > 0 && ok_) {
+			if (finished_) {
+				return n; // anything past the end-of-archive blocks is padding
+			}
+			size_t used = 0;
+			if (dataLeft_ > 0) {
+				used = static_cast<size_t>(std::min<uint64_t>(dataLeft_, left));
+				if (record_) {
+					record_->append(s, used);
+				} else if (file_.is_open()) {
+					file_.write(s, static_cast<std::streamsize>(used));
+					if (!file_) {
+						fail("cannot write '" + current_.string() + "'");
+					}
+				}
+				dataLeft_ -= used;
+				if (dataLeft_ == 0) {
+					endEntry();
+				}
+			} else if (paddingLeft_ > 0) {
+				used = static_cast<size_t>(std::min<uint64_t>(paddingLeft_, left));
+				paddingLeft_ -= used;
+			} else {
+				used = std::min(kTarBlock - header_.size(), left);
+				header_.append(s, used);
+				if (header_.size() == kTarBlock) {
+					parseHeader();
+					header_.clear();
+				}
+			}
+			s += used;
+			left -= used;
+		}
+		return ok_ ? n : 0;
+	}
+
+  private:
+	void fail(const std::string& message) {
+		err_ << "u3vget -r: " << message << std::endl;
+		ok_ = false;
+	}
+
+	static std::string field(const char* data, size_t length) {
+		return std::string(data, strnlen(data, length));
+	}
+
+	static uint64_t number(const char* data, size_t length) {
+		uint64_t value = 0;
+		if (static_cast<unsigned char>(data[0]) & 0x80) {
+			for (size_t i = 1; i < length; ++i) {
+				value = (value << 8) | static_cast<unsigned char>(data[i]);
+			}
+			return value;
+		}
+		for (size_t i = 0; i < length && data[i]; ++i) {
+			if (data[i] >= '0' && data[i] <= '7') {
+				value = (value << 3) | static_cast<uint64_t>(data[i] - '0');
+			}
+		}
+		return value;
+	}
+
+	// Joins the components of an archive path; false if it is absolute or
+	// climbs with "..".
+	static bool relativePath(const std::string& name, std::filesystem::path& relative) {
+		relative.clear();
+		for (const std::filesystem::path& part : std::filesystem::path(name)) {
+			if (part == ".." || part.has_root_name() || part.has_root_directory()) {
+				return false;
+			}
+			if (!part.empty() && part != ".") {
+				relative /= part;
+			}
+		}
+		return true;
+	}
+
+	// True if a component of `relative` below the target directory is a
+	// symbolic link, which could be one an earlier entry made.
+	bool throughSymlink(const std::filesystem::path& relative) const {
+		std::filesystem::path at = root_;
+		for (const std::filesystem::path& part : relative) {
+			at /= part;
+			std::error_code ec;
+			if (std::filesystem::is_symlink(std::filesystem::symlink_status(at, ec))) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Pax records are "<length> <key>=<value>\n".
+	void parsePax(const std::string& records) {
+		size_t at = 0;
+		while (at < records.size()) {
+			const size_t space = records.find(' ', at);
+			const size_t length = std::strtoul(records.c_str() + at, nullptr, 10);
+			if (space == std::string::npos || length == 0 || at + length > records.size()) {
+				return;
+			}
+			const std::string record = records.substr(space + 1, at + length - space - 2);
+			const size_t eq = record.find('=');
+			if (eq != std::string::npos) {
+				const std::string key = record.substr(0, eq);
+				if (key == "path") {
+					longName_ = record.substr(eq + 1);
+				} else if (key == "linkpath") {
+					longLink_ = record.substr(eq + 1);
+				}
+			}
+			at += length;
+		}
+	}
+
+	void parseHeader() {
+		if (std::all_of(header_.begin(), header_.end(), [](char ch) { return ch == '\0'; })) {
+			finished_ = ++zeroBlocks_ == 2;
+			return;
+		}
+		zeroBlocks_ = 0;
+		const auto& h = *reinterpret_cast<const TarHeader*>(header_.data());
+		unsigned sum = 0;
+		for (size_t i = 0; i < kTarBlock; ++i) {
+			const bool inChecksum = i >= offsetof(TarHeader, checksum) &&
+									i < offsetof(TarHeader, checksum) + sizeof(h.checksum);
+			sum += inChecksum ? ' ' : static_cast<unsigned char>(header_[i]);
+		}
+		if (sum != number(h.checksum, sizeof(h.checksum))) {
+			fail("bad archive header checksum");
+			return;
+		}
+		const uint64_t size = number(h.size, sizeof(h.size));
+		dataLeft_ = size;
+		paddingLeft_ = tarPadding(size);
+		record_ = nullptr;
+		if (h.type == 'L' || h.type == 'K' || h.type == 'x') {
+			recordType_ = h.type;
+			recordText_.clear();
+			record_ = &recordText_;
+			if (size == 0) {
+				endEntry();
+			}
+			return;
+		}
+		if (h.type == 'g') {
+			return; // global pax header: nothing we use
+		}
+
+		std::string name = longName_;
+		if (name.empty()) {
+			name = field(h.name, sizeof(h.name));
+			if (std::memcmp(h.magic, "ustar", 6) == 0 && h.prefix[0]) {
+				name = field(h.prefix, sizeof(h.prefix)) + "/" + name;
+			}
+		}
+		std::string link = longLink_.empty() ? field(h.linkName, sizeof(h.linkName)) : longLink_;
+		longName_.clear();
+		longLink_.clear();
+
+		namespace fs = std::filesystem;
+		fs::path relative;
+		if (!relativePath(name, relative)) {
+			fail("refusing '" + name + "': outside the target directory");
+			return;
+		}
+		if (relative.empty()) {
+			return; // the archive's "./"
+		}
+		if (throughSymlink(relative.parent_path())) {
+			fail("refusing '" + name + "': its directory is a symbolic link");
+			return;
+		}
+		fs::path linkRelative;
+		if ((h.type == '1' || h.type == '2') && (!relativePath(link, linkRelative) || linkRelative.empty())) {
+			fail("refusing '" + name + "': link target '" + link + "' is outside the target directory");
+			return;
+		}
+		current_ = root_ / relative;
+		// Permission bits only: setuid, setgid and sticky bits from the device
+		// are dropped, as tar does for users other than the owner.
+		mode_ = static_cast<unsigned>(number(h.mode, sizeof(h.mode))) & 0777;
+		mtime_ = static_cast<std::time_t>(number(h.mtime, sizeof(h.mtime)));
+		std::error_code ec;
+		fs::create_directories(current_.parent_path(), ec);
+		++entries_;
+		switch (h.type) {
+		case '0':
+		case '\0':
+		case '7':
+			if (fs::is_symlink(fs::symlink_status(current_, ec))) {
+				fs::remove(current_, ec); // replace the link, never write through it
+			}
+			file_.open(current_, std::ios::binary | std::ios::trunc);
+			if (!file_) {
+				fail("cannot create '" + current_.string() + "'");
+			} else if (size == 0) {
+				endEntry();
+			}
+			break;
+		case '5':
+			fs::create_directories(current_, ec);
+			if (ec) {
+				fail("cannot create '" + current_.string() + "': " + ec.message());
+			}
+			break;
+		case '2':
+			fs::remove(current_, ec);
+			fs::create_symlink(link, current_, ec);
+			if (ec) {
+				fail("cannot link '" + current_.string() + "': " + ec.message());
+			}
+			break;
+		case '1':
+			if (throughSymlink(linkRelative)) {
+				fail("refusing '" + name + "': link target '" + link + "' is a symbolic link");
+				break;
+			}
+			fs::remove(current_, ec);
+			fs::create_hard_link(root_ / linkRelative, current_, ec);
+			if (ec) {
+				ec.clear();
+				fs::copy_file(root_ / linkRelative, current_, ec);
+			}
+			if (ec) {
+				fail("cannot link '" + current_.string() + "': " + ec.message());
+			}
+			break;
+		default:
+			err_ << "Skipping '" << name << "': unsupported entry type '" << h.type << "'" << std::endl;
+			--entries_;
+			break;
+		}
+	}
+
+	void endEntry() {
+		if (record_) {
+			std::string text = std::move(recordText_);
+			record_ = nullptr;
+			if (recordType_ == 'x') {
+				parsePax(text);
+			} else {
+				text.erase(std::find(text.begin(), text.end(), '\0'), text.end());
+				(recordType_ == 'L' ? longName_ : longLink_) = text;
+			}
+			return;
+		}
+		if (!file_.is_open()) {
+			return;
+		}
+		file_.close();
+		if (!file_) {
+			fail("cannot write '" + current_.string() + "'");
+			return;
+		}
+		std::error_code ec;
+		std::filesystem::permissions(current_, static_cast<std::filesystem::perms>(mode_), ec);
+		std::filesystem::last_write_time(current_, fromTimeT(mtime_), ec);
+	}
+
+	const std::filesystem::path root_;
+	std::ostream& err_;
+	std::string header_;
+	uint64_t dataLeft_ = 0;
+	uint64_t paddingLeft_ = 0;
+	std::ofstream file_;
+	std::filesystem::path current_;
+	unsigned mode_ = 0;
+	std::time_t mtime_ = 0;
+	std::string* record_ = nullptr; // collects an 'L', 'K' or 'x' record
+	std::string recordText_;
+	char recordType_ = 0;
+	std::string longName_;
+	std::string longLink_;
+	unsigned zeroBlocks_ = 0;
+	bool finished_ = false;
+	bool ok_ = true;
+	size_t entries_ = 0;
+};
+
+}  // namespace u3vdb
@@ -0,0 +1,372 @@
+// Correctness cases for the host-side code that parses what a device sends:
+// round trips and malformed input for the LZ4 file codec, and tar archives
+// that try to write outside the target directory. Each case prints "ok" or
+// "FAIL" with the reason; the exit status is non-zero if any failed. Run by
+// ctest, no device needed.
+#include "filecodec.h"
+#include "tar.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace u3vdb;
+
+struct CheckCase {
+	std::string name;
+	// Returns an empty string on success, else what went wrong.
+	std::function<std::string()> run;
+};
+
+std::string randomBytes(size_t size, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::string data(size, '\0');
+	for (char& ch : data) {
+		ch = static_cast<char>(rng() & 0xFF);
+	}
+	return data;
+}
+
+// Inputs the codec must round-trip: empty, shorter than the end-of-block
+// rules, runs, text and incompressible data, up to a whole block.
+std::vector<std::string> sampleBlocks() {
+	std::vector<std::string> blocks = {"", "a", "abcde", "abcdefghijkl", "abcdefghijklm", std::string(13, 'x'),
+									   std::string(kFileCodecBlock, '\0')};
+	std::string text;
+	while (text.size() < kFileCodecBlock) {
+		text += "u3vdb streams files over the kTerminal data port; ";
+	}
+	text.resize(kFileCodecBlock);
+	blocks.push_back(text);
+	blocks.push_back(randomBytes(kFileCodecBlock, 1));
+	blocks.push_back(randomBytes(1000, 2) + std::string(3000, 'z') + randomBytes(1000, 3));
+	return blocks;
+}
+
+std::string decode(const std::string& compressed, size_t capacity, bool& ok) {
+	std::string out(capacity, '\0');
+	size_t produced = 0;
+	ok = lz4DecompressBlock(reinterpret_cast<const uint8_t*>(compressed.data()), compressed.size(),
+							reinterpret_cast<uint8_t*>(&out[0]), capacity, produced);
+	out.resize(ok ? produced : 0);
+	return out;
+}
+
+// A decoder that accepts `block` is a bug; `what` names the defect.
+std::string expectRejected(const std::string& block, size_t capacity, const char* what) {
+	bool ok = false;
+	decode(block, capacity, ok);
+	return ok ? std::string("accepted ") + what : std::string();
+}
+
+namespace fs = std::filesystem;
+
+// A directory of its own under the system temp directory, removed again.
+class ScratchDir {
+  public:
+	ScratchDir() {
+		std::random_device rd;
+		path_ = fs::temp_directory_path() / ("u3vdb_check_" + std::to_string(rd()) + std::to_string(rd()));
+		fs::create_directories(path_);
+	}
+	~ScratchDir() {
+		std::error_code ec;
+		fs::remove_all(path_, ec);
+	}
+	const fs::path& path() const { return path_; }
+
+  private:
+	fs::path path_;
+};
+
+std::string readFile(const fs::path& path) {
+	std::ifstream in(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const fs::path& path, const std::string& data) {
+	std::ofstream(path, std::ios::binary) << data;
+}
+
+// One archive member, written the way a hostile device could.
+std::string tarEntry(const std::string& name, char type, const std::string& link = {}, const std::string& data = {},
+					 unsigned mode = 0644) {
+	TarHeader h{};
+	std::memcpy(h.name, name.data(), std::min(name.size(), sizeof(h.name)));
+	std::memcpy(h.linkName, link.data(), std::min(link.size(), sizeof(h.linkName)));
+	std::snprintf(h.mode, sizeof(h.mode), "%07o", mode);
+	std::snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+	std::snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+	std::snprintf(h.size, sizeof(h.size), "%011llo", static_cast<unsigned long long>(data.size()));
+	std::snprintf(h.mtime, sizeof(h.mtime), "%011o", 0);
+	h.type = type;
+	std::memcpy(h.magic, "ustar ", sizeof(h.magic));
+	std::memcpy(h.version, " ", sizeof(h.version));
+	std::memset(h.checksum, ' ', sizeof(h.checksum));
+	unsigned sum = 0;
+	for (size_t i = 0; i < sizeof(h); ++i) {
+		sum += reinterpret_cast<const unsigned char*>(&h)[i];
+	}
+	std::snprintf(h.checksum, sizeof(h.checksum), "%06o", sum);
+	std::string entry(reinterpret_cast<const char*>(&h), sizeof(h));
+	entry += data;
+	entry.append(static_cast<size_t>(tarPadding(data.size())), '\0');
+	return entry;
+}
+
+// Unpack `archive` below `root`; true if every entry was accepted.
+bool extract(const fs::path& root, const std::string& archive) {
+	std::ostringstream err;
+	TarExtractBuf buf(root, err);
+	std::ostream out(&buf);
+	out.write(archive.data(), static_cast<std::streamsize>(archive.size()));
+	out.write(std::string(2 * kTarBlock, '\0').data(), 2 * kTarBlock);
+	return buf.ok() && buf.finished();
+}
+
+// `archive` must be refused, and `outside` (next to the target directory)
+// must not exist afterwards.
+std::string expectRefused(const std::string& archive, const char* what) {
+	ScratchDir scratch;
+	const fs::path root = scratch.path() / "root";
+	fs::create_directories(root);
+	if (extract(root, archive)) {
+		return std::string("accepted ") + what;
+	}
+	std::error_code ec;
+	if (fs::exists(fs::symlink_status(scratch.path() / "outside", ec))) {
+		return std::string("wrote outside the target for ") + what;
+	}
+	return std::string();
+}
+
+std::vector<CheckCase> makeCases() {
+	std::vector<CheckCase> cases;
+
+	cases.push_back({"lz4_round_trip", [] {
+		for (const std::string& block : sampleBlocks()) {
+			std::string compressed;
+			lz4CompressBlock(reinterpret_cast<const uint8_t*>(block.data()), block.size(), compressed);
+			bool ok = false;
+			if (decode(compressed, block.size(), ok) != block || !ok) {
+				return "block of " + std::to_string(block.size()) + " bytes did not round-trip";
+			}
+		}
+		return std::string();
+	}});
+
+	cases.push_back({"lz4_overlapping_match", [] {
+		// Literal 'a', then a match at offset 1 of 4 + 6 bytes: a run of 11.
+		const std::string block = {'\x16', 'a', '\x01', '\x00', '\x10', 'b'};
+		bool ok = false;
+		const std::string out = decode(block, 64, ok);
+		return ok && out == std::string(11, 'a') + "b" ? std::string() : "run decoded as '" + out + "'";
+	}});
+
+	cases.push_back({"lz4_malformed", [] {
+		const std::pair<std::string, const char*> blocks[] = {
+			{{'\x10', 'a', '\x00', '\x00'}, "a zero offset"},
+			{{'\x10', 'a', '\x02', '\x00'}, "an offset before the output"},
+			{{'\xF0'}, "a literal length cut off"},
+			{{'\xF0', '\xFF'}, "a literal length extension cut off"},
+			{{'\x50', 'a', 'b'}, "literals past the end of the input"},
+			{{'\x10', 'a', '\x01'}, "an offset cut off"},
+			{{'\x1F', 'a', '\x01', '\x00'}, "a match length cut off"},
+		};
+		for (const auto& block : blocks) {
+			std::string error = expectRejected(block.first, 64, block.second);
+			if (!error.empty()) {
+				return error;
+			}
+		}
+		// Within the format, but past the output capacity.
+		std::string error = expectRejected({'\x1F', 'a', '\x01', '\x00', '\x40'}, 64, "a match past the capacity");
+		return error.empty() ? expectRejected({'\x50', 'a', 'b', 'c', 'd', 'e'}, 4, "literals past the capacity")
+							 : error;
+	}});
+
+	cases.push_back({"lz4_truncated", [] {
+		// Every prefix of a valid block either fails or decodes to a prefix
+		// of the original; none may write past the capacity.
+		std::string block = randomBytes(200, 4) + std::string(500, 'q') + randomBytes(200, 5);
+		std::string compressed;
+		lz4CompressBlock(reinterpret_cast<const uint8_t*>(block.data()), block.size(), compressed);
+		for (size_t length = 0; length < compressed.size(); ++length) {
+			bool ok = false;
+			const std::string out = decode(compressed.substr(0, length), block.size(), ok);
+			if (ok && block.compare(0, out.size(), out) != 0) {
+				return "prefix of " + std::to_string(length) + " bytes decoded to other data";
+			}
+		}
+		return std::string();
+	}});
+
+	cases.push_back({"file_frames", [] {
+		std::string frames;
+		const std::vector<std::string> blocks = sampleBlocks();
+		for (const std::string& block : blocks) {
+			encodeFileFrame(block.data(), block.size(), frames);
+		}
+		for (const std::string& expected : blocks) {
+			const size_t length = fileFrameLength(frames);
+			if (length == 0 || length == std::string::npos) {
+				return std::string("frame not found");
+			}
+			if (fileFrameLength(frames.substr(0, length - 1)) != 0) {
+				return std::string("incomplete frame taken as complete");
+			}
+			std::string block;
+			if (!decodeFileFrame(frames.data(), length, block) || block != expected) {
+				return "frame of " + std::to_string(expected.size()) + " bytes did not round-trip";
+			}
+			frames.erase(0, length);
+		}
+		return frames.empty() ? std::string() : std::string("bytes left over");
+	}});
+
+	cases.push_back({"file_frames_malformed", [] {
+		auto header = [](uint32_t value) { return std::string(reinterpret_cast<const char*>(&value), 4); };
+		if (fileFrameLength(header(static_cast<uint32_t>(kFileCodecBlock + 1) | kFileFrameStored)) !=
+			std::string::npos) {
+			return std::string("accepted a stored frame longer than a block");
+		}
+		if (fileFrameLength(header(static_cast<uint32_t>(kFileFrameMaxPayload + 1))) != std::string::npos) {
+			return std::string("accepted a compressed frame longer than the limit");
+		}
+		// A valid LZ4 block that expands past kFileCodecBlock: literal 'a',
+		// then one match of 4 + 15 + 260 * 255 bytes.
+		std::string block = {'\x1F', 'a', '\x01', '\x00'};
+		block.append(260, '\xFF');
+		block += '\x00';
+		const std::string frame = header(static_cast<uint32_t>(block.size())) + block;
+		std::string out;
+		if (fileFrameLength(frame) == frame.size() && decodeFileFrame(frame.data(), frame.size(), out)) {
+			return std::string("accepted a frame that decodes past a block");
+		}
+		return std::string();
+	}});
+
+	cases.push_back({"tar_round_trip", [] {
+		ScratchDir scratch;
+		const fs::path src = scratch.path() / "src";
+		const std::string longName(120, 'n');
+		fs::create_directories(src / "sub" / "empty");
+		writeFile(src / "a.txt", "hello\n");
+		writeFile(src / "sub" / "b.bin", randomBytes(70000, 6));
+		writeFile(src / "sub" / longName, "long name\n");
+#ifndef _WIN32
+		fs::create_symlink("a.txt", src / "link");
+#endif
+		std::ostringstream err;
+		TarWriterBuf writer(src, err);
+		std::istream in(&writer);
+		const std::string archive((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		if (!writer.ok() || archive.size() != writer.size()) {
+			return "archiving failed: " + err.str();
+		}
+		const fs::path dst = scratch.path() / "dst";
+		fs::create_directories(dst);
+		if (!extract(dst, archive)) {
+			return std::string("extracting a valid archive failed");
+		}
+		for (const fs::path& file : {fs::path("a.txt"), fs::path("sub") / "b.bin", fs::path("sub") / longName}) {
+			if (readFile(dst / file) != readFile(src / file)) {
+				return "'" + file.generic_string() + "' differs";
+			}
+		}
+		if (!fs::is_directory(dst / "sub" / "empty")) {
+			return std::string("empty directory missing");
+		}
+#ifndef _WIN32
+		if (!fs::is_symlink(dst / "link") || fs::read_symlink(dst / "link") != "a.txt") {
+			return std::string("symbolic link not restored");
+		}
+#endif
+		return std::string();
+	}});
+
+	cases.push_back({"tar_refuses_escaping_names", [] {
+		std::string error = expectRefused(tarEntry("../outside", '0', {}, "x"), "a name with ..");
+		if (error.empty()) {
+			error = expectRefused(tarEntry("a/../../outside", '0', {}, "x"), "a name climbing out");
+		}
+		if (error.empty()) {
+			ScratchDir scratch;
+			const std::string absolute = (scratch.path() / "outside").string();
+			fs::create_directories(scratch.path() / "root");
+			if (extract(scratch.path() / "root", tarEntry(absolute, '0', {}, "x")) ||
+				fs::exists(scratch.path() / "outside")) {
+				error = "accepted an absolute name";
+			}
+		}
+		return error;
+	}});
+
+	cases.push_back({"tar_refuses_escaping_links", [] {
+		std::string error = expectRefused(tarEntry("up", '2', "../outside"), "a symlink to ..");
+		if (error.empty()) {
+			error = expectRefused(tarEntry("abs", '2', "/etc"), "a symlink to an absolute path");
+		}
+		if (error.empty()) {
+			error = expectRefused(tarEntry("hard", '1', "../outside"), "a hard link to ..");
+		}
+		return error;
+	}});
+
+#ifndef _WIN32
+	cases.push_back({"tar_refuses_writing_through_symlinks", [] {
+		ScratchDir scratch;
+		const fs::path root = scratch.path() / "root";
+		fs::create_directories(root / "real");
+		// "d" is a link within the target, but an entry below it could be
+		// redirected by a later, different link; it is refused either way.
+		const std::string archive = tarEntry("d", '2', "real") + tarEntry("d/x", '0', {}, "x");
+		if (extract(root, archive) || fs::exists(root / "real" / "x")) {
+			return std::string("wrote below a symbolic link");
+		}
+		return std::string();
+	}});
+
+	cases.push_back({"tar_drops_special_mode_bits", [] {
+		ScratchDir scratch;
+		if (!extract(scratch.path(), tarEntry("tool", '0', {}, "#!/bin/sh\n", 06755 | 01000))) {
+			return std::string("extracting failed");
+		}
+		const fs::perms perms = fs::status(scratch.path() / "tool").permissions();
+		if ((perms & (fs::perms::set_uid | fs::perms::set_gid | fs::perms::sticky_bit)) != fs::perms::none) {
+			return std::string("setuid, setgid or sticky bit kept");
+		}
+		return (perms & fs::perms::all) == static_cast<fs::perms>(0755) ? std::string()
+																		 : std::string("permission bits changed");
+	}});
+#endif
+
+	return cases;
+}
+
+}  // namespace
+
+int main() {
+	int failures = 0;
+	for (const CheckCase& c : makeCases()) {
+		const std::string error = c.run();
+		if (error.empty()) {
+			std::cout << "ok    " << c.name << std::endl;
+		} else {
+			std::cout << "FAIL  " << c.name << ": " << error << std::endl;
+			++failures;
+		}
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include "uvcp.h"
+
+#include <sstream>
+
+namespace u3vdb {
+
+UVCPReadMemoryCmd makeReadMemoryCmd(uint64_t address, uint16_t bytes, uint16_t id) {
+	UVCPReadMemoryCmd cmd{};
+	cmd.header.magic = UVCPConstants::MAGIC;
+	cmd.header.flags = UVCPConstants::FLAGS_REQUEST_ACK;
+	cmd.header.command = UVCPConstants::COMMAND_READ_MEMORY_CMD;
+	cmd.header.size = sizeof(cmd.address) + sizeof(cmd.unknown) + sizeof(cmd.size);
+	cmd.header.id = id;
+	cmd.address = address;
+	cmd.unknown = 0;
+	cmd.size = bytes;
+	return cmd;
+}
+
+UVCPWriteMemoryCmd makeWriteMemoryCmd(uint64_t address, uint16_t bytes, uint16_t id) {
+	UVCPWriteMemoryCmd cmd{};
+	cmd.header.magic = UVCPConstants::MAGIC;
+	cmd.header.flags = UVCPConstants::FLAGS_REQUEST_ACK;
+	cmd.header.command = UVCPConstants::COMMAND_WRITE_MEMORY_CMD;
+	cmd.header.size = static_cast<uint16_t>(sizeof(cmd.address) + bytes);
+	cmd.header.id = id;
+	cmd.address = address;
+	return cmd;
+}
+
+UVCPCheck checkPacket(const uint8_t* data, size_t length) {
+	if (length < sizeof(UVCPHeader)) {
+		return UVCPCheck::Short;
+	}
+	if (reinterpret_cast<const UVCPHeader*>(data)->magic != UVCPConstants::MAGIC) {
+		return UVCPCheck::BadMagic;
+	}
+	return UVCPCheck::Ok;
+}
+
+UVCPCheck checkAck(const uint8_t* data, size_t length, uint16_t expectedAck, uint16_t expectedBytes) {
+	const auto* hdr = reinterpret_cast<const UVCPHeader*>(data);
+	if (hdr->command != expectedAck) {
+		return UVCPCheck::WrongCommand;
+	}
+	if (expectedAck == UVCPConstants::COMMAND_READ_MEMORY_ACK) {
+		if (hdr->size != expectedBytes || length < sizeof(UVCPHeader) + hdr->size) {
+			return UVCPCheck::SizeMismatch;
+		}
+	} else if (length < sizeof(UVCPWriteMemoryAck)) {
+		return UVCPCheck::ShortWriteAck;
+	}
+	return UVCPCheck::Ok;
+}
+
+UVCPAck parseAck(const uint8_t* ack) {
+	const auto* hdr = reinterpret_cast<const UVCPHeader*>(ack);
+	UVCPAck result;
+	result.command = hdr->command;
+	if (hdr->command == UVCPConstants::COMMAND_READ_MEMORY_ACK) {
+		result.payload = reinterpret_cast<const UVCPReadMemoryAck*>(ack)->data;
+		result.payloadSize = hdr->size;
+	} else {
+		result.bytesWritten = reinterpret_cast<const UVCPWriteMemoryAck*>(ack)->bytes_written;
+	}
+	return result;
+}
+
+bool hasWildcard(const std::string& s) {
+	return s.find_first_of("*?[") != std::string::npos;
+}
+
+bool wildcardMatch(const char* pattern, const char* str) {
+	const char* p = pattern;
+	const char* s = str;
+	const char* star = nullptr;
+	const char* starMatch = nullptr;
+	while (*s) {
+		if (*p == '?' || *p == *s) {
+			++p;
+			++s;
+			continue;
+		}
+		if (*p == '*') {
+			star = p++;
+			starMatch = s;
+			continue;
+		}
+		if (star) {
+			p = star + 1;
+			s = ++starMatch;
+			continue;
+		}
+		return false;
+	}
+	while (*p == '*') {
+		++p;
+	}
+	return *p == '\0';
+}
+
+std::vector<std::string> splitTokens(const std::string& line) {
+	std::istringstream iss(line);
+	std::vector<std::string> tokens;
+	std::string token;
+	while (iss >> token) {
+		tokens.push_back(token);
+	}
+	return tokens;
+}
+
+}  // namespace u3vdb
@@ -0,0 +1,181 @@
+// UVCP (USB3 Vision Control Protocol) wire format and the host-side code
+// u3vdb runs for every transaction or command line: building commands,
+// checking ACKs, the TerminalClient poll backoff, tokenizing and wildcard
+// matching. None of it touches libusb, so u3vdb_bench can time it alone.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TY_UVCP_MAX_MSG_LEN 65536
+
+namespace u3vdb {
+
+namespace UVCPConstants {
+    const uint32_t MAGIC = 0x43563355; // "U3VC"
+    const uint16_t FLAGS_REQUEST_ACK = 0x0001<<14;
+
+    enum Command {
+        COMMAND_READ_MEMORY_CMD                 = 0x0800,
+        COMMAND_READ_MEMORY_ACK                 = 0x0801,
+        COMMAND_WRITE_MEMORY_CMD                = 0x0802,
+        COMMAND_WRITE_MEMORY_ACK                = 0x0803,
+        COMMAND_PENDING_ACK                     = 0x0805,
+        COMMAND_EVENT_CMD                       = 0x0c00,
+	    COMMAND_EVENT_ACK                       = 0x0c01
+    };
+}
+
+#pragma pack(push, 1)
+struct UVCPHeader { //ArvUvcpHeader
+    uint32_t magic  = 0;
+    uint16_t flags  = 0;
+    uint16_t command= 0;
+    uint16_t size   = 0;
+    uint16_t id     = 0;
+};
+
+struct UVCPReadMemoryCmd {  //ArvUvcpReadMemoryCmd
+    UVCPHeader header{};
+    uint64_t address = 0;
+    uint16_t unknown = 0;
+    uint16_t size    = 0;
+};
+
+struct UVCPReadMemoryAck {      //ArvUvcpReadMemoryCmd
+    UVCPHeader header{};
+    uint8_t data[1];
+};
+
+struct UVCPWriteMemoryCmd {      //ArvUvcpWriteMemoryCmd
+    UVCPHeader header{};
+    uint64_t address = 0;
+    uint8_t data[1];
+};
+
+struct UVCPWriteMemoryAck {     //ArvUvcpWriteMemoryAck
+    UVCPHeader header{};
+    uint16_t unknown       = 0;
+    uint16_t bytes_written = 0;
+};
+
+struct UVCPPendingAck {
+    UVCPHeader header{};
+    uint16_t unknown    = 0;
+    uint16_t timeout_ms = 0;
+};
+
+struct UVCPEventCmd {
+    UVCPHeader header{};
+    uint16_t event_size = 0;
+    uint16_t event_id   = 0;
+    uint64_t timestamp  = 0;
+    uint8_t data[1];
+};
+#pragma pack(pop)
+
+// Bytes of a WRITE_MEMORY command ahead of its payload.
+constexpr size_t kWriteMemoryCmdHeaderSize = sizeof(UVCPHeader) + sizeof(uint64_t);
+
+// Commands asking for an ACK. The id is normally filled in when the command
+// is queued.
+UVCPReadMemoryCmd makeReadMemoryCmd(uint64_t address, uint16_t bytes, uint16_t id = 0);
+// Only the first kWriteMemoryCmdHeaderSize bytes are sent; the payload follows.
+UVCPWriteMemoryCmd makeWriteMemoryCmd(uint64_t address, uint16_t bytes, uint16_t id = 0);
+
+// Outcome of checking a packet from the device.
+enum class UVCPCheck {
+	Ok,
+	Short,         // shorter than a UVCP header
+	BadMagic,
+	WrongCommand,  // not the ACK the request waits for
+	SizeMismatch,  // READ_MEMORY_ACK payload not the requested size, or cut off
+	ShortWriteAck,
+};
+
+// Framing every packet from the control channel must pass.
+UVCPCheck checkPacket(const uint8_t* data, size_t length);
+
+// Whether a framed packet is a complete `expectedAck`, carrying exactly
+// `expectedBytes` when that is a READ_MEMORY_ACK.
+UVCPCheck checkAck(const uint8_t* data, size_t length, uint16_t expectedAck, uint16_t expectedBytes);
+
+// Fields of an ACK that passed checkAck(), pointing into its buffer.
+struct UVCPAck {
+	uint16_t command = 0;
+	const uint8_t* payload = nullptr; // READ_MEMORY_ACK only
+	uint16_t payloadSize = 0;
+	uint16_t bytesWritten = 0;        // WRITE_MEMORY_ACK only
+};
+
+UVCPAck parseAck(const uint8_t* ack);
+
+// How TerminalClient waits for the device: re-poll immediately a few times,
+// then sleep, doubling from minDelay up to maxDelay.
+struct PollPolicy {
+	unsigned spins = 2;
+	std::chrono::microseconds minDelay{100};
+	std::chrono::microseconds maxDelay{20000};
+};
+
+// One wait loop's position within a PollPolicy.
+class PollBackoff {
+  public:
+	using Clock = std::chrono::steady_clock;
+
+	explicit PollBackoff(const PollPolicy& policy) : policy_(policy) { reset(); }
+
+	// Call when the loop made progress so the next wait is short again.
+	void reset() {
+		spins_ = 0;
+		delay_ = policy_.minDelay;
+	}
+
+	// Wait before the next poll, without sleeping past deadline.
+	void wait(Clock::time_point deadline = Clock::time_point::max()) {
+		auto sleep = nextDelay();
+		if (sleep.count() == 0) {
+			return;
+		}
+		const auto now = Clock::now();
+		if (deadline != Clock::time_point::max()) {
+			if (deadline <= now) {
+				return;
+			}
+			sleep = std::min(sleep, std::chrono::duration_cast<std::chrono::microseconds>(deadline - now));
+		}
+		std::this_thread::sleep_for(sleep);
+	}
+
+	// Advance as wait() would and return how long to sleep, for callers that
+	// sleep on something else (zero while still spinning).
+	std::chrono::microseconds nextDelay() {
+		if (spins_ < policy_.spins) {
+			++spins_;
+			return std::chrono::microseconds(0);
+		}
+		const auto sleep = delay_;
+		delay_ = std::min(delay_ * 2, policy_.maxDelay);
+		return sleep;
+	}
+
+  private:
+	const PollPolicy& policy_;
+	unsigned spins_ = 0;
+	std::chrono::microseconds delay_{0};
+};
+
+bool hasWildcard(const std::string& s);
+
+// '*' and '?' glob match of a whole string.
+bool wildcardMatch(const char* pattern, const char* str);
+
+// Whitespace-separated words of a command line.
+std::vector<std::string> splitTokens(const std::string& line);
+
+}  // namespace u3vdb